@@ -32,6 +32,9 @@ if grep -q '^config LEGION_LAPTOP$' "${DRIVER_DIR}/Kconfig"; then
 fi
 
 cp "${REPODIR}/kernel_module/legion-laptop.c" "${DRIVER_DIR}/legion-laptop.c"
+cp "${REPODIR}/kernel_module/legion-laptop-test.c" "${DRIVER_DIR}/legion-laptop-test.c"
+cp "${REPODIR}/kernel_module/legion-laptop-trace.h" "${DRIVER_DIR}/legion-laptop-trace.h"
+cp "${REPODIR}/kernel_module/legion-laptop.kunitconfig" "${DRIVER_DIR}/legion-laptop.kunitconfig"
 cat >> "${DRIVER_DIR}/Kconfig" <<'EOF'
 
 config LEGION_LAPTOP
@@ -39,12 +42,24 @@ config LEGION_LAPTOP
 	depends on ACPI
 	depends on ACPI_WMI || ACPI_WMI = n
 	depends on HWMON || HWMON = n
+	depends on NET
 	select ACPI_PLATFORM_PROFILE
 	help
 	  This is a driver for Lenovo Legion laptops and contains drivers for
 	  hotkey, fan control, and power mode.
+
+config LEGION_LAPTOP_KUNIT_TEST
+	bool "KUnit tests for Lenovo Legion Laptop Extras" if !KUNIT_ALL_TESTS
+	depends on LEGION_LAPTOP && KUNIT=y
+	default KUNIT_ALL_TESTS
+	help
+	  Builds unit tests for the fan curve encoding and decoding of the
+	  Lenovo Legion Laptop driver. The tests use a simulated EC and do
+	  not access hardware.
+
+	  If unsure, say N.
 EOF
-printf '\nobj-$(CONFIG_LEGION_LAPTOP) += legion-laptop.o\n' >> "${DRIVER_DIR}/Makefile"
+printf '\nobj-$(CONFIG_LEGION_LAPTOP) += legion-laptop.o\nCFLAGS_legion-laptop.o := -I$(src)\n' >> "${DRIVER_DIR}/Makefile"
 
 cd ${BUILD_DIR}/linux
 git config user.name "John Martens"
@@ -3,15 +3,18 @@
 #include "modules/setapply.h"
 #include "modules/powerstate.h"
 #include "modules/output.h"
+#include "modules/fancurve.h"
+#include "modules/drift.h"
 
 #define BUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+#define MAX_EVENTS 8
 
-LEGIOND_CONFIG config;
-
+// Everything runs in the epoll loop of main(), so no locking is needed
+// for delayed and triggered.
 int delayed = 0;
 bool triggered = false;
-int fd, client_fd, inotify_fd, maxfd;
-fd_set readfds;
+int fd, epoll_fd, timer_fd, drift_fd, signal_fd, inotify_fd, preset_wd,
+	uevent_fd, profile_fd;
 char buffer[BUF_LEN], ret[20];
 struct inotify_event *event = NULL;
 
@@ -22,20 +25,12 @@ void clear_socket()
 	}
 }
 
-void term_handler(int signum)
+void timer_handler()
 {
-	close(fd);
-	clear_socket();
-	exit(0);
-}
-
-void timer_handler(union sigval sigev_value)
-{
-	pretty("config reload start");
-	parseconf(&config);
-	pretty("config reload end");
+	trace_stage("legiond-timer", NULL);
 	pretty("set_all start");
-	set_all(get_powerstate(), &config);
+	set_all(get_powerstate(), get_config());
+	drift_snapshot();
 
 	if (delayed)
 		delayed = 0;
@@ -44,14 +39,159 @@ void timer_handler(union sigval sigev_value)
 	pretty("set_all end");
 }
 
-void set_timer(struct itimerspec *its, long delay_s, long delay_ns,
-	       timer_t timerid)
+// cpu_control settings were changed by someone else
+void drift_handler()
+{
+	trace_stage("legiond-drift", NULL);
+	pretty("set_cpu start");
+	set_cpu(get_powerstate(), get_config());
+	drift_snapshot();
+	pretty("set_cpu end");
+}
+
+void set_timerfd(int tfd, long delay_s, long delay_ns)
+{
+	struct itimerspec its;
+
+	its.it_value.tv_sec = delay_s;
+	its.it_value.tv_nsec = delay_ns;
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 0;
+	timerfd_settime(tfd, 0, &its, NULL);
+}
+
+void set_timer(long delay_s, long delay_ns)
+{
+	set_timerfd(timer_fd, delay_s, delay_ns);
+}
+
+int watch_fd_events(int watched_fd, uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = watched_fd;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watched_fd, &ev);
+}
+
+int watch_fd(int watched_fd)
+{
+	return watch_fd_events(watched_fd, EPOLLIN);
+}
+
+void powerstate_changed(const char *source)
+{
+	trace_stage("legiond-powerstate", source);
+	pretty("power-state/power-profile change");
+	// as we used to use A3 in acpid cfg
+	set_timer(3, 0);
+}
+
+void handle_cmd(long delay_s, long delay_ns)
+{
+	printf("cmd: \"%s\" received\n", ret);
+
+	if (ret[0] == 'A') {
+		// delayed means user use legiond-ctl fanset with a parameter
+		triggered = false;
+		if (delayed) {
+			printf("extend delay\n");
+			set_timer(delayed, 0);
+		} else if (ret[1] == '0') {
+			printf("reset timer\n");
+			set_timer(delay_s, delay_ns);
+		} else {
+			printf("reset timer with delay\n");
+			int delay;
+			sscanf(ret, "A%d", &delay);
+			set_timer(delay, 0);
+			delayed = delay;
+		}
+	} else if (ret[0] == 'B' && triggered == true) {
+		pretty("set_cpu start");
+		set_cpu(get_powerstate(), get_config());
+		drift_snapshot();
+		pretty("set_cpu end");
+	} else if (ret[0] == 'R') {
+		pretty("config reload start");
+		reload_config();
+		load_fancurve_presets();
+		set_all(get_powerstate(), get_config());
+		drift_snapshot();
+		pretty("config reload end");
+	} else {
+		printf("do nothing\n");
+	}
+}
+
+// legiond-ctl sends one command per connection and closes it
+void handle_client(int client_fd, long delay_s, long delay_ns)
+{
+	memset(ret, 0, sizeof(ret));
+	ssize_t len = recv(client_fd, ret, sizeof(ret) - 1, 0);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+	close(client_fd);
+	if (len > 0)
+		handle_cmd(delay_s, delay_ns);
+}
+
+void handle_inotify()
+{
+	int lengh = read(inotify_fd, buffer, BUF_LEN);
+	char *p = buffer;
+	while (p < buffer + lengh) {
+		event = (struct inotify_event *)p;
+		if (event->wd == preset_wd) {
+			// only the changed config or preset is parsed again
+			if (event->len && strcmp(event->name, config_name) == 0) {
+				pretty("config reload start");
+				reload_config();
+				pretty("config reload end");
+			} else if (event->len) {
+				reload_fancurve_preset(event->name);
+			}
+		} else if (drift_detected(event->wd) &&
+			   get_config()->cpu_control && triggered) {
+			// other tools may write several knobs in a row
+			set_timerfd(drift_fd, 1, 0);
+		}
+		p += sizeof(struct inotify_event) + event->len;
+	}
+}
+
+void handle_uevent_fd()
 {
-	its->it_value.tv_sec = delay_s;
-	its->it_value.tv_nsec = delay_ns;
-	its->it_interval.tv_sec = 0;
-	its->it_interval.tv_nsec = 0;
-	timer_settime(timerid, 0, its, NULL);
+	ssize_t len;
+
+	while ((len = recv(uevent_fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+		buffer[len] = '\0';
+		if (handle_uevent(buffer, len))
+			powerstate_changed("ac");
+	}
+}
+
+// returns false if legiond should exit
+bool handle_signal()
+{
+	struct signalfd_siginfo info;
+
+	if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
+		return true;
+
+	if (info.ssi_signo == SIGHUP) {
+		pretty("config reload start");
+		reload_config();
+		load_fancurve_presets();
+		set_all(get_powerstate(), get_config());
+		drift_snapshot();
+		pretty("config reload end");
+		return true;
+	}
+	return false;
 }
 
 int main()
@@ -59,7 +199,8 @@ int main()
 	// remove socket before create it
 	clear_socket();
 
-	parseconf(&config);
+	reload_config();
+	load_fancurve_presets();
 
 	// calculate delay
 	long delay_s = (int)delay;
@@ -68,20 +209,24 @@ int main()
 	// not blocking output
 	setbuf(stdout, NULL);
 
-	// init timer
-	timer_t timerid;
-	struct itimerspec its;
+	// let legion_cli log its timing for trace-profile-switch
+	setenv("LEGION_CLI_TRACE", "1", 1);
 
-	struct sigevent sev;
-	sev.sigev_notify = SIGEV_THREAD;
-	sev.sigev_notify_function = timer_handler;
-	sev.sigev_value.sival_ptr = &timerid;
-	sev.sigev_notify_attributes = NULL;
+	// SIGTERM/SIGINT stop legiond, SIGHUP reloads the config
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
 
-	timer_create(CLOCK_REALTIME, &sev, &timerid);
+	// debounce timers
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	drift_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
 
 	// init socket
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	struct sockaddr_un addr;
 	addr.sun_family = AF_UNIX;
 	strcpy(addr.sun_path, socket_path);
@@ -92,80 +237,96 @@ int main()
 
 	listen(fd, 5);
 
-	// run fancurve-set on startup
-	set_timer(&its, delay, 0, timerid);
+	// power_supply changes arrive as uevents
+	uevent_fd = socket(AF_NETLINK,
+			   SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			   NETLINK_KOBJECT_UEVENT);
+	struct sockaddr_nl nl_addr;
+	memset(&nl_addr, 0, sizeof(nl_addr));
+	nl_addr.nl_family = AF_NETLINK;
+	nl_addr.nl_groups = 1;
+	if (uevent_fd != -1 &&
+	    bind(uevent_fd, (struct sockaddr *)&nl_addr, sizeof(nl_addr))) {
+		close(uevent_fd);
+		uevent_fd = -1;
+	}
+
+	// sysfs signals POLLPRI on platform_profile when it changes
+	profile_fd = powerstate_init(uevent_fd != -1);
 
-	// setup SIGTERM handler
-	struct sigaction action;
-	memset(&action, 0, sizeof(action));
-	action.sa_handler = term_handler;
-	sigaction(SIGTERM, &action, NULL);
+	// config and fancurve presets; editors often replace files instead
+	// of writing
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	preset_wd = inotify_add_watch(inotify_fd, preset_dir,
+				      IN_CLOSE_WRITE | IN_MOVED_TO |
+					      IN_MOVED_FROM | IN_DELETE);
+	// sysfs knobs of cpu_control, re-applied if changed by someone else
+	printf("watching %d cpu knobs\n", drift_init(inotify_fd));
 
-	// inotify power-state/power-profile watcher
-	inotify_fd = inotify_init();
-	inotify_add_watch(inotify_fd, profile_path, IN_MODIFY);
-	inotify_add_watch(inotify_fd, ac_path, IN_MODIFY);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (signal_fd == -1 || timer_fd == -1 || drift_fd == -1 ||
+	    inotify_fd == -1 || epoll_fd == -1 || watch_fd(fd) ||
+	    watch_fd(signal_fd) || watch_fd(timer_fd) || watch_fd(drift_fd) ||
+	    watch_fd(inotify_fd) ||
+	    (uevent_fd != -1 && watch_fd(uevent_fd)) ||
+	    (profile_fd != -1 && watch_fd_events(profile_fd, EPOLLPRI))) {
+		perror("failed to set up event loop");
+		close(fd);
+		clear_socket();
+		exit(1);
+	}
+
+	// run fancurve-set on startup
+	set_timer(delay_s, delay_ns);
 
 	// listen
-	while (1) {
-		FD_ZERO(&readfds);
-		FD_SET(fd, &readfds);
-		FD_SET(inotify_fd, &readfds);
-
-		maxfd = (fd > inotify_fd) ? fd : inotify_fd;
-
-		select(maxfd + 1, &readfds, NULL, NULL, NULL);
-
-		if (FD_ISSET(fd, &readfds)) {
-			client_fd = accept(fd, NULL, NULL);
-			memset(ret, 0, sizeof(ret));
-			recv(client_fd, ret, sizeof(ret), 0);
-			printf("cmd: \"%s\" received\n", ret);
-			close(client_fd);
-
-			if (ret[0] == 'A') {
-				// delayed means user use legiond-ctl fanset with a parameter
-				triggered = false;
-				if (delayed) {
-					printf("extend delay\n");
-					set_timer(&its, delayed, 0, timerid);
-				} else if (ret[1] == '0') {
-					printf("reset timer\n");
-					set_timer(&its, delay_s, delay_ns,
-						  timerid);
-				} else {
-					printf("reset timer with delay\n");
-					int delay;
-					sscanf(ret, "A%d", &delay);
-					set_timer(&its, delay, 0, timerid);
-					delayed = delay;
-				}
-			} else if (ret[0] == 'B' && triggered == true) {
-				pretty("set_cpu start");
-				set_cpu(get_powerstate(), &config);
-				pretty("set_cpu end");
-			} else if (ret[0] == 'R') {
-				pretty("config reload start");
-				parseconf(&config);
-				set_all(get_powerstate(), &config);
-				pretty("config reload end");
-			} else {
-				printf("do nothing\n");
-			}
-		}
+	bool running = true;
+	struct epoll_event events[MAX_EVENTS];
+	while (running) {
+		int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (n == -1 && errno == EINTR)
+			continue;
+
+		for (int i = 0; i < n; i++) {
+			int event_fd = events[i].data.fd;
 
-		if (FD_ISSET(inotify_fd, &readfds)) {
-			int lengh = read(inotify_fd, buffer, BUF_LEN);
-			char *p = buffer;
-			while (p < buffer + lengh) {
-				event = (struct inotify_event *)p;
-				if (event->mask & IN_MODIFY) {
-					pretty("power-state/power-profile change");
-					// as we used to use A3 in acpid cfg
-					set_timer(&its, 3, 0, timerid);
+			if (event_fd == fd) {
+				int client_fd;
+				while ((client_fd = accept4(
+						fd, NULL, NULL,
+						SOCK_NONBLOCK | SOCK_CLOEXEC)) !=
+				       -1) {
+					if (watch_fd(client_fd))
+						close(client_fd);
 				}
-				p += sizeof(struct inotify_event) + event->len;
+			} else if (event_fd == timer_fd) {
+				uint64_t expirations;
+				if (read(timer_fd, &expirations,
+					 sizeof(expirations)) ==
+				    sizeof(expirations))
+					timer_handler();
+			} else if (event_fd == drift_fd) {
+				uint64_t expirations;
+				if (read(drift_fd, &expirations,
+					 sizeof(expirations)) ==
+				    sizeof(expirations))
+					drift_handler();
+			} else if (event_fd == inotify_fd) {
+				handle_inotify();
+			} else if (event_fd == uevent_fd) {
+				handle_uevent_fd();
+			} else if (event_fd == profile_fd) {
+				if (refresh_profile())
+					powerstate_changed("profile");
+			} else if (event_fd == signal_fd) {
+				running = handle_signal();
+			} else {
+				handle_client(event_fd, delay_s, delay_ns);
 			}
 		}
 	}
+
+	close(fd);
+	clear_socket();
+	return 0;
 }
@@ -0,0 +1,103 @@
+#include "drift.h"
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// sysfs knobs that the commands of cpu_control usually set and that
+// other tools (power-profiles-daemon, tlp, ...) like to change back
+static const char *knob_globs[] = {
+	"/sys/devices/system/cpu/cpufreq/policy*/scaling_governor",
+	"/sys/devices/system/cpu/cpufreq/policy*/energy_performance_preference",
+	"/sys/devices/system/cpu/cpufreq/policy*/scaling_min_freq",
+	"/sys/devices/system/cpu/cpufreq/policy*/scaling_max_freq",
+	"/sys/devices/system/cpu/cpufreq/boost",
+	"/sys/devices/system/cpu/intel_pstate/status",
+	"/sys/devices/system/cpu/intel_pstate/no_turbo",
+	"/sys/devices/system/cpu/intel_pstate/min_perf_pct",
+	"/sys/devices/system/cpu/intel_pstate/max_perf_pct",
+	"/sys/devices/system/cpu/amd_pstate/status",
+};
+
+#define MAX_KNOBS 256
+#define KNOB_VALUE_LEN 64
+
+// Watched knobs and their values after cpu_control was applied last.
+// Writes by userspace, unlike changes by the kernel itself, generate
+// IN_MODIFY on sysfs files, which is exactly what is needed here.
+static struct {
+	char *path;
+	int wd;
+	char value[KNOB_VALUE_LEN];
+} knobs[MAX_KNOBS];
+static int knob_count = 0;
+
+static void read_knob(const char *path, char *value)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	ssize_t len = fd == -1 ? -1 : read(fd, value, KNOB_VALUE_LEN - 1);
+
+	if (fd != -1)
+		close(fd);
+	if (len < 0)
+		len = 0;
+	value[len] = '\0';
+	value[strcspn(value, "\n")] = '\0';
+}
+
+// Watches all existing knobs. Returns the number of watched knobs.
+int drift_init(int inotify_fd)
+{
+	for (size_t i = 0; i < sizeof(knob_globs) / sizeof(knob_globs[0]);
+	     i++) {
+		glob_t matches;
+
+		if (glob(knob_globs[i], 0, NULL, &matches) != 0)
+			continue;
+		for (size_t j = 0;
+		     j < matches.gl_pathc && knob_count < MAX_KNOBS; j++) {
+			int wd = inotify_add_watch(inotify_fd,
+						   matches.gl_pathv[j],
+						   IN_MODIFY);
+			if (wd == -1)
+				continue;
+			knobs[knob_count].path = strdup(matches.gl_pathv[j]);
+			knobs[knob_count].wd = wd;
+			knob_count++;
+		}
+		globfree(&matches);
+	}
+	drift_snapshot();
+	return knob_count;
+}
+
+// Remembers the current values as the wanted ones; call after
+// cpu_control was applied.
+void drift_snapshot()
+{
+	for (int i = 0; i < knob_count; i++)
+		read_knob(knobs[i].path, knobs[i].value);
+}
+
+// Returns true if the knob watched by wd no longer has the value of the
+// last snapshot. Writes of the same value, e.g. by cpu_control itself,
+// are no drift.
+bool drift_detected(int wd)
+{
+	char value[KNOB_VALUE_LEN];
+
+	for (int i = 0; i < knob_count; i++) {
+		if (knobs[i].wd != wd)
+			continue;
+		read_knob(knobs[i].path, value);
+		if (strcmp(value, knobs[i].value) == 0)
+			return false;
+		printf("%s changed from %s to %s\n", knobs[i].path,
+		       knobs[i].value, value);
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,9 @@
+#ifndef DRIFT_H_
+#define DRIFT_H_
+#include <stdbool.h>
+
+int drift_init(int inotify_fd);
+void drift_snapshot();
+bool drift_detected(int wd);
+
+#endif // DRIFT_H_
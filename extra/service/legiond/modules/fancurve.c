@@ -0,0 +1,452 @@
+#include "fancurve.h"
+#include "output.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MATCH(a, b) strcmp(a, b) == 0
+
+static const struct {
+	const char *name;
+	size_t offset;
+} entry_fields[] = {
+	{ "fan1_speed", offsetof(FANCURVE_ENTRY, fan1_speed) },
+	{ "fan2_speed", offsetof(FANCURVE_ENTRY, fan2_speed) },
+	{ "cpu_lower_temp", offsetof(FANCURVE_ENTRY, cpu_lower_temp) },
+	{ "cpu_upper_temp", offsetof(FANCURVE_ENTRY, cpu_upper_temp) },
+	{ "gpu_lower_temp", offsetof(FANCURVE_ENTRY, gpu_lower_temp) },
+	{ "gpu_upper_temp", offsetof(FANCURVE_ENTRY, gpu_upper_temp) },
+	{ "ic_lower_temp", offsetof(FANCURVE_ENTRY, ic_lower_temp) },
+	{ "ic_upper_temp", offsetof(FANCURVE_ENTRY, ic_upper_temp) },
+	{ "acceleration", offsetof(FANCURVE_ENTRY, acceleration) },
+	{ "deceleration", offsetof(FANCURVE_ENTRY, deceleration) },
+};
+
+static char *strip(char *s)
+{
+	while (isspace((unsigned char)*s))
+		s++;
+	char *end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return s;
+}
+
+static int parse_int(const char *value, int *result)
+{
+	char *end;
+	long number = strtol(value, &end, 10);
+	if (end == value || *end != '\0')
+		return 1;
+	*result = (int)number;
+	return 0;
+}
+
+static int parse_bool(const char *value, bool *result)
+{
+	if (MATCH(value, "true") || MATCH(value, "True") ||
+	    MATCH(value, "yes") || MATCH(value, "on")) {
+		*result = true;
+	} else if (MATCH(value, "false") || MATCH(value, "False") ||
+		   MATCH(value, "no") || MATCH(value, "off")) {
+		*result = false;
+	} else {
+		return 1;
+	}
+	return 0;
+}
+
+static int set_entry_field(FANCURVE_ENTRY *entry, const char *key,
+			   const char *value)
+{
+	for (size_t i = 0; i < sizeof(entry_fields) / sizeof(entry_fields[0]);
+	     i++) {
+		if (MATCH(key, entry_fields[i].name))
+			return parse_int(value,
+					 (int *)((char *)entry +
+						 entry_fields[i].offset));
+	}
+	return 1;
+}
+
+// Parses the block style YAML written by legion_cli, e.g.
+// name: balanced-ac
+// entries:
+// - fan1_speed: 0
+//   fan2_speed: 0
+//   ...
+// enable_minifancurve: false
+// Anything else is rejected, so the caller can fall back to legion_cli.
+int load_fancurve(const char *path, FANCURVE *fancurve)
+{
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		printf("failed to open fancurve preset %s\n", path);
+		return 1;
+	}
+
+	memset(fancurve, 0, sizeof(FANCURVE));
+	// presets without the key keep the minifancurve, as in legion_cli
+	fancurve->enable_minifancurve = true;
+
+	char line[256];
+	int lineno = 0;
+	int err = 0;
+	bool in_entries = false;
+	while (!err && fgets(line, sizeof(line), fp)) {
+		lineno++;
+		char *key = strip(line);
+		if (*key == '\0' || *key == '#' || MATCH(key, "---"))
+			continue;
+
+		bool new_entry = false;
+		if (key[0] == '-' && (key[1] == ' ' || key[1] == '\0')) {
+			new_entry = true;
+			key = strip(key + 1);
+		}
+
+		char *value = strchr(key, ':');
+		if (value == NULL) {
+			err = 1;
+			break;
+		}
+		*value = '\0';
+		key = strip(key);
+		value = strip(value + 1);
+
+		if (new_entry) {
+			if (!in_entries || fancurve->size >= MAXFANCURVESIZE) {
+				err = 1;
+				break;
+			}
+			fancurve->size++;
+		}
+
+		if (MATCH(key, "name")) {
+			in_entries = false;
+		} else if (MATCH(key, "entries")) {
+			in_entries = true;
+			err = *value != '\0' && !MATCH(value, "[]");
+		} else if (MATCH(key, "enable_minifancurve")) {
+			in_entries = false;
+			err = parse_bool(value, &fancurve->enable_minifancurve);
+		} else if (in_entries && fancurve->size > 0) {
+			err = set_entry_field(
+				&fancurve->entries[fancurve->size - 1], key,
+				value);
+		} else {
+			err = 1;
+		}
+	}
+	fclose(fp);
+
+	if (err)
+		printf("failed to parse fancurve preset %s in line %d\n", path,
+		       lineno);
+	return err;
+}
+
+static bool entry_is_empty(const FANCURVE_ENTRY *entry)
+{
+	static const FANCURVE_ENTRY empty;
+	return memcmp(entry, &empty, sizeof(empty)) == 0;
+}
+
+static int find_hwmon_dir(char *path, size_t size)
+{
+	glob_t matches;
+	int err = 1;
+
+	if (glob(hwmon_glob, 0, NULL, &matches) == 0 &&
+	    matches.gl_pathc > 0) {
+		snprintf(path, size, "%s", matches.gl_pathv[0]);
+		err = 0;
+	}
+	globfree(&matches);
+	return err;
+}
+
+static bool hwmon_has(const char *hwmon, const char *attr)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", hwmon, attr);
+	return access(path, F_OK) == 0;
+}
+
+static int hwmon_read(const char *hwmon, const char *attr, int *value)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", hwmon, attr);
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		return 1;
+	int err = fscanf(fp, "%d", value) != 1;
+	fclose(fp);
+	return err;
+}
+
+static int hwmon_write(const char *hwmon, const char *attr, int value)
+{
+	char path[512];
+	char buf[16];
+	snprintf(path, sizeof(path), "%s/%s", hwmon, attr);
+	int len = snprintf(buf, sizeof(buf), "%d", value);
+
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		printf("failed to open %s\n", path);
+		return 1;
+	}
+	int err = write(fd, buf, len) != len;
+	close(fd);
+	if (err)
+		printf("failed to write %d to %s\n", value, path);
+	return err;
+}
+
+static int hwmon_write_point(const char *hwmon, const char *format,
+			     int point_id, int value)
+{
+	char attr[64];
+	snprintf(attr, sizeof(attr), format, point_id);
+	return hwmon_write(hwmon, attr, value);
+}
+
+// same rounding as legion_cli: full hundreds of rpm scaled to 0..255
+static int rpm_to_pwm(int rpm, int max_rpm)
+{
+	return rpm / 100 * (100 * 255) / max_rpm;
+}
+
+// Layout of the hwmon attributes, detected on the first write and
+// again after a write failed, e.g. because legion_laptop was reloaded
+static struct {
+	bool valid;
+	char dir[256];
+	bool has_fan_2_speed;
+	bool has_temperature_curve;
+	bool has_acceleration_curve;
+	bool has_minifancurve;
+	int fan1_max;
+	int fan2_max;
+} layout;
+
+static int detect_hwmon_layout()
+{
+	layout.valid = false;
+	if (find_hwmon_dir(layout.dir, sizeof(layout.dir))) {
+		printf("hwmon dir of legion_laptop not found\n");
+		return 1;
+	}
+
+	const char *hwmon = layout.dir;
+	layout.has_fan_2_speed = hwmon_has(hwmon, "pwm2_auto_point1_pwm");
+	layout.has_temperature_curve =
+		hwmon_has(hwmon, "pwm1_auto_point1_temp_hyst") &&
+		hwmon_has(hwmon, "pwm1_auto_point1_temp") &&
+		hwmon_has(hwmon, "pwm2_auto_point1_temp_hyst") &&
+		hwmon_has(hwmon, "pwm2_auto_point1_temp") &&
+		hwmon_has(hwmon, "pwm3_auto_point1_temp_hyst") &&
+		hwmon_has(hwmon, "pwm3_auto_point1_temp");
+	layout.has_acceleration_curve =
+		hwmon_has(hwmon, "pwm1_auto_point1_accel") &&
+		hwmon_has(hwmon, "pwm1_auto_point1_decel");
+	layout.has_minifancurve = hwmon_has(hwmon, "minifancurve");
+
+	if (hwmon_read(hwmon, "fan1_max", &layout.fan1_max) ||
+	    layout.fan1_max <= 0 ||
+	    (layout.has_fan_2_speed &&
+	     (hwmon_read(hwmon, "fan2_max", &layout.fan2_max) ||
+	      layout.fan2_max <= 0))) {
+		printf("failed to read maximum fan speed\n");
+		return 1;
+	}
+	layout.valid = true;
+	return 0;
+}
+
+// Writes the fan curve to the hwmon attributes of legion_laptop
+// like legion_cli fancurve-write-preset-to-hw
+int write_fancurve(const FANCURVE *fancurve)
+{
+	int size = fancurve->size;
+	int err = 0;
+
+	while (size > 0 && entry_is_empty(&fancurve->entries[size - 1]))
+		size--;
+	if (size == 0) {
+		printf("fancurve has no writable points, skipping\n");
+		return 0;
+	}
+
+	if (!layout.valid && detect_hwmon_layout())
+		return 1;
+
+	const char *hwmon = layout.dir;
+	bool has_fan_2_speed = layout.has_fan_2_speed;
+	bool has_temperature_curve = layout.has_temperature_curve;
+	bool has_acceleration_curve = layout.has_acceleration_curve;
+	int fan1_max = layout.fan1_max;
+	int fan2_max = layout.fan2_max;
+
+	if (layout.has_minifancurve)
+		err |= hwmon_write(hwmon, "minifancurve",
+				   fancurve->enable_minifancurve ? 1 : 0);
+
+	for (int i = 0; i < size; i++) {
+		const FANCURVE_ENTRY *entry = &fancurve->entries[i];
+		int point_id = i + 1;
+
+		err |= hwmon_write_point(hwmon, "pwm1_auto_point%d_pwm",
+					 point_id,
+					 rpm_to_pwm(entry->fan1_speed,
+						    fan1_max));
+		if (has_fan_2_speed)
+			err |= hwmon_write_point(
+				hwmon, "pwm2_auto_point%d_pwm", point_id,
+				rpm_to_pwm(entry->fan2_speed, fan2_max));
+		if (has_temperature_curve) {
+			err |= hwmon_write_point(hwmon,
+						 "pwm1_auto_point%d_temp_hyst",
+						 point_id,
+						 entry->cpu_lower_temp);
+			err |= hwmon_write_point(hwmon,
+						 "pwm1_auto_point%d_temp",
+						 point_id,
+						 entry->cpu_upper_temp);
+			err |= hwmon_write_point(hwmon,
+						 "pwm2_auto_point%d_temp_hyst",
+						 point_id,
+						 entry->gpu_lower_temp);
+			err |= hwmon_write_point(hwmon,
+						 "pwm2_auto_point%d_temp",
+						 point_id,
+						 entry->gpu_upper_temp);
+			err |= hwmon_write_point(hwmon,
+						 "pwm3_auto_point%d_temp_hyst",
+						 point_id, entry->ic_lower_temp);
+			err |= hwmon_write_point(hwmon,
+						 "pwm3_auto_point%d_temp",
+						 point_id, entry->ic_upper_temp);
+		}
+		if (has_acceleration_curve) {
+			err |= hwmon_write_point(hwmon,
+						 "pwm1_auto_point%d_accel",
+						 point_id, entry->acceleration);
+			err |= hwmon_write_point(hwmon,
+						 "pwm1_auto_point%d_decel",
+						 point_id, entry->deceleration);
+		}
+	}
+
+	if (err)
+		layout.valid = false;
+	return err;
+}
+
+static const char *preset_names[] = {
+	[P_AC_Q] = "quiet-ac",
+	[P_BAT_Q] = "quiet-battery",
+	[P_AC_B] = "balanced-ac",
+	[P_BAT_B] = "balanced-battery",
+	[P_AC_BP] = "balanced-performance-ac",
+	[P_BAT_BP] = "balanced-performance-battery",
+	[P_AC_P] = "performance-ac",
+	[P_AC_E] = "extreme-ac",
+};
+
+#define PRESET_COUNT (sizeof(preset_names) / sizeof(preset_names[0]))
+
+typedef enum _PRESET_STATUS {
+	PRESET_MISSING = 0,
+	PRESET_LOADED,
+	// not understood by load_fancurve(), written with legion_cli
+	PRESET_FOREIGN,
+} PRESET_STATUS;
+
+// Presets of all power states, parsed once and refreshed when their
+// file changes, so applying a power state needs no file access besides
+// the hwmon writes.
+static struct {
+	PRESET_STATUS status;
+	FANCURVE fancurve;
+} presets[PRESET_COUNT];
+
+const char *get_preset_name(POWER_STATE power_state)
+{
+	if (power_state < 0 || power_state >= (int)PRESET_COUNT)
+		return NULL;
+	return preset_names[power_state];
+}
+
+static void load_preset(int index)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%s/%s.yaml", preset_dir,
+		 preset_names[index]);
+	if (access(path, F_OK) != 0) {
+		presets[index].status = PRESET_MISSING;
+	} else if (load_fancurve(path, &presets[index].fancurve) == 0) {
+		presets[index].status = PRESET_LOADED;
+	} else {
+		presets[index].status = PRESET_FOREIGN;
+	}
+}
+
+void load_fancurve_presets()
+{
+	for (size_t i = 0; i < PRESET_COUNT; i++)
+		load_preset(i);
+}
+
+// Reloads the preset stored in filename (without directory) if it is
+// one of the presets. Returns true if it was.
+bool reload_fancurve_preset(const char *filename)
+{
+	size_t len = strlen(filename);
+
+	if (len < 5 || strcmp(filename + len - 5, ".yaml") != 0)
+		return false;
+	for (size_t i = 0; i < PRESET_COUNT; i++) {
+		if (strlen(preset_names[i]) == len - 5 &&
+		    strncmp(filename, preset_names[i], len - 5) == 0) {
+			load_preset(i);
+			printf("fancurve preset %s reloaded\n",
+			       preset_names[i]);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Writes the preset of the power state to hardware. Presets that could
+// not be parsed are written with legion_cli instead.
+int apply_fancurve_preset(POWER_STATE power_state)
+{
+	const char *name = get_preset_name(power_state);
+
+	if (name == NULL)
+		return 0;
+
+	switch (presets[power_state].status) {
+	case PRESET_LOADED:
+		return write_fancurve(&presets[power_state].fancurve);
+	case PRESET_FOREIGN: {
+		char cmd[100];
+		snprintf(cmd, sizeof(cmd),
+			 "legion_cli fancurve-write-preset-to-hw %s", name);
+		printf("fall back to %s\n", cmd);
+		return system(cmd);
+	}
+	default:
+		printf("fancurve preset %s/%s.yaml not found\n", preset_dir,
+		       name);
+		return 1;
+	}
+}
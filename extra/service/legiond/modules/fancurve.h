@@ -0,0 +1,36 @@
+#ifndef FANCURVE_H_
+#define FANCURVE_H_
+#include "powerstate.h"
+#include <stdbool.h>
+
+#define preset_dir "/etc/legion_linux"
+#define hwmon_glob "/sys/module/legion_laptop/drivers/platform:legion/*/hwmon/hwmon*"
+#define MAXFANCURVESIZE 10
+
+typedef struct _FANCURVE_ENTRY {
+	int fan1_speed;
+	int fan2_speed;
+	int cpu_lower_temp;
+	int cpu_upper_temp;
+	int gpu_lower_temp;
+	int gpu_upper_temp;
+	int ic_lower_temp;
+	int ic_upper_temp;
+	int acceleration;
+	int deceleration;
+} FANCURVE_ENTRY;
+
+typedef struct _FANCURVE {
+	int size;
+	FANCURVE_ENTRY entries[MAXFANCURVESIZE];
+	bool enable_minifancurve;
+} FANCURVE;
+
+int load_fancurve(const char *path, FANCURVE *fancurve);
+int write_fancurve(const FANCURVE *fancurve);
+const char *get_preset_name(POWER_STATE power_state);
+void load_fancurve_presets();
+bool reload_fancurve_preset(const char *filename);
+int apply_fancurve_preset(POWER_STATE power_state);
+
+#endif // FANCURVE_H_
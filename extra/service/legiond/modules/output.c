@@ -1,6 +1,7 @@
 #include "output.h"
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 
 void pretty(char *msg)
 {
@@ -18,3 +19,13 @@ void pretty(char *msg)
 
 	putchar('\n');
 }
+
+// Log record with CLOCK_MONOTONIC timestamp for legion_cli trace-profile-switch
+void trace_stage(const char *stage, const char *detail)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	printf("trace: %ld.%06ld %s %s\n", (long)ts.tv_sec, ts.tv_nsec / 1000,
+	       stage, detail ? detail : "");
+}
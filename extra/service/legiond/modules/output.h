@@ -2,5 +2,6 @@
 #define OUTPUT_H_
 
 void pretty(char *msg);
+void trace_stage(const char *stage, const char *detail);
 
 #endif // OUTPUT_H_
@@ -1,5 +1,6 @@
 #include "parseconf.h"
 #include <ini.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -37,6 +38,8 @@ static int handler(void *user, const char *section, const char *name,
 		ptr_cmd = &pconfig->gpu_tdp_bat_bp;
 	} else if (MATCH("gpu_control", "tdp_ac_p")) {
 		ptr_cmd = &pconfig->gpu_tdp_ac_p;
+	} else if (MATCH("gpu_control", "tdp_ac_e")) {
+		ptr_cmd = &pconfig->gpu_tdp_ac_e;
 	} else if (MATCH("cpu_control", "bat_q")) {
 		ptr_cmd = &pconfig->cpu_bat_q;
 	} else if (MATCH("cpu_control", "ac_q")) {
@@ -51,13 +54,15 @@ static int handler(void *user, const char *section, const char *name,
 		ptr_cmd = &pconfig->cpu_ac_bp;
 	} else if (MATCH("cpu_control", "ac_p")) {
 		ptr_cmd = &pconfig->cpu_ac_p;
+	} else if (MATCH("cpu_control", "ac_e")) {
+		ptr_cmd = &pconfig->cpu_ac_e;
 	} else {
 		// unknown section
 		return 0;
 	}
 
 	if (ptr_cmd) {
-		strcpy((char *)ptr_cmd, value);
+		snprintf((char *)ptr_cmd, sizeof(command), "%s", value);
 	}
 	return 1;
 }
@@ -70,12 +75,65 @@ static void init_config(LEGIOND_CONFIG *config)
 	config->cpu_control = false;
 }
 
+static int validate_config(LEGIOND_CONFIG *config)
+{
+	// not set means no gpu_control
+	if (config->gpu_control[0] == '\0')
+		strcpy(config->gpu_control, "false");
+
+	if (strcmp(config->gpu_control, "false") != 0 &&
+	    strcmp(config->gpu_control, "nvidia") != 0 &&
+	    strcmp(config->gpu_control, "radeon") != 0) {
+		printf("invalid gpu_control %s\n", config->gpu_control);
+		return 1;
+	}
+	return 0;
+}
+
 int parseconf(LEGIOND_CONFIG *config)
 {
+	int err;
+
 	init_config(config);
-	if (ini_parse(config_path, handler, config)) {
+	err = ini_parse(config_path, handler, config);
+	if (err < 0) {
 		printf("Unable to parse config\n");
 		return 1;
 	}
+	// err is the first line that was not understood; it is skipped like
+	// unknown lines always were, so the rest of the config is still used
+	if (err > 0)
+		printf("Ignoring unknown config line %d\n", err);
+	return validate_config(config);
+}
+
+// The config in use and the one the next reload parses into. The
+// active config is only replaced by a completely parsed and valid one,
+// so it is never seen empty or half parsed.
+static LEGIOND_CONFIG configs[2];
+static int active_config = -1;
+
+int reload_config()
+{
+	int next = active_config == 0 ? 1 : 0;
+
+	if (parseconf(&configs[next])) {
+		if (active_config == -1) {
+			// nothing to keep yet, start with everything disabled
+			init_config(&configs[next]);
+			validate_config(&configs[next]);
+			active_config = next;
+		}
+		printf("keep previous config\n");
+		return 1;
+	}
+	active_config = next;
 	return 0;
 }
+
+const LEGIOND_CONFIG *get_config()
+{
+	if (active_config == -1)
+		reload_config();
+	return &configs[active_config];
+}
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 
 #define config_path "/etc/legion_linux/legiond.ini"
+#define config_name "legiond.ini"
 typedef char command[100];
 
 typedef struct _LEGIOND_CONFIG {
@@ -29,5 +30,7 @@ typedef struct _LEGIOND_CONFIG {
 } LEGIOND_CONFIG;
 
 int parseconf(LEGIOND_CONFIG *config);
+int reload_config();
+const LEGIOND_CONFIG *get_config();
 
 #endif // PARSECONF_H_
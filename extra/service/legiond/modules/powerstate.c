@@ -3,44 +3,134 @@
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #define MATCH(a, b) strcmp(a, b) == 0
 
-POWER_STATE get_powerstate()
+// Current AC and profile state, kept up to date from uevents and
+// POLLPRI on platform_profile, see powerstate_init()
+static int ac_state = -1;
+static bool ac_from_uevents = false;
+static char profile[30] = "";
+static int profile_fd = -1;
+
+static int read_ac_file()
 {
-	POWER_STATE power_state = -1;
 	FILE *fp;
 
 	fp = fopen(ac_path, "r");
 	if (fp == NULL)
 		fp = fopen(ac_path_alt, "r");
-	
+
 	if (fp == NULL) {
 		printf("failed to open AC power status file\n");
 		return P_ERROR_AC;
 	}
 
-	int ac_state;
-	if (fscanf(fp, "%d", &ac_state) != 1) {
+	int state;
+	if (fscanf(fp, "%d", &state) != 1) {
 		printf("failed to get AC status\n");
 		fclose(fp);
 		return P_ERROR_AC;
 	}
 	fclose(fp);
+	return state;
+}
 
-	fp = fopen(profile_path, "r");
-	if (fp == NULL) {
+// Reads platform_profile again from the open file. Returns true if
+// it changed.
+bool refresh_profile()
+{
+	char buf[sizeof(profile)];
+
+	ssize_t len = pread(profile_fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0) {
+		printf("failed to get power_profile\n");
+		return false;
+	}
+	buf[len] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+
+	if (MATCH(buf, profile))
+		return false;
+	strcpy(profile, buf);
+	return true;
+}
+
+// Opens platform_profile and reads the initial state. Returns the file
+// descriptor to poll for POLLPRI, which sysfs signals when the profile
+// changes, or -1. Without uevents, the AC state is read on every
+// get_powerstate().
+int powerstate_init(bool uevents)
+{
+	ac_from_uevents = uevents;
+	ac_state = read_ac_file();
+	profile_fd = open(profile_path, O_RDONLY | O_CLOEXEC);
+	if (profile_fd == -1) {
 		printf("failed to open power profile file\n");
-		return P_ERROR_PROFILE;
+		return -1;
 	}
-	
-	char profile[30];
-	if (fscanf(fp, "%s", profile) != 1) {
-		printf("failed to get power_profile\n");
+	refresh_profile();
+	return profile_fd;
+}
+
+// Handles a message of NETLINK_KOBJECT_UEVENT, a header followed by
+// KEY=value strings separated by '\0'. Returns true if the AC state
+// changed.
+bool handle_uevent(const char *buf, size_t len)
+{
+	bool power_supply = false;
+	bool mains = false;
+	int online = -1;
+
+	for (size_t pos = 0; pos < len; pos += strlen(buf + pos) + 1) {
+		const char *var = buf + pos;
+
+		if (MATCH(var, "SUBSYSTEM=power_supply"))
+			power_supply = true;
+		else if (MATCH(var, "POWER_SUPPLY_TYPE=Mains") ||
+			 MATCH(var, "POWER_SUPPLY_NAME=ADP0") ||
+			 MATCH(var, "POWER_SUPPLY_NAME=ACAD"))
+			mains = true;
+		else if (strncmp(var, "POWER_SUPPLY_ONLINE=", 20) == 0)
+			online = var[20] == '1';
+	}
+
+	if (!power_supply || !mains)
+		return false;
+	// no state in the event, e.g. on add
+	if (online == -1)
+		online = read_ac_file();
+	if (online == ac_state)
+		return false;
+	ac_state = online;
+	return true;
+}
+
+POWER_STATE get_powerstate()
+{
+	POWER_STATE power_state = -1;
+
+	// files are only read if powerstate_init() was not called or failed
+	// or there are no uevents for AC changes
+	if (ac_state < 0 || !ac_from_uevents)
+		ac_state = read_ac_file();
+	if (ac_state < 0)
+		return P_ERROR_AC;
+
+	if (profile_fd == -1) {
+		FILE *fp = fopen(profile_path, "r");
+		if (fp == NULL) {
+			printf("failed to open power profile file\n");
+			return P_ERROR_PROFILE;
+		}
+		if (fscanf(fp, "%29s", profile) != 1) {
+			printf("failed to get power_profile\n");
+			fclose(fp);
+			return P_ERROR_PROFILE;
+		}
 		fclose(fp);
-		return P_ERROR_PROFILE;
 	}
-	fclose(fp);
 	
 	if (MATCH(profile, "quiet") || MATCH(profile, "low-power")) {
 		power_state = P_AC_Q;
@@ -1,5 +1,7 @@
 #ifndef POWERSTATE_H_
 #define POWERSTATE_H_
+#include <stdbool.h>
+#include <stddef.h>
 
 typedef enum _POWER_STATE {
 	P_AC_Q = 0,
@@ -19,6 +21,9 @@ typedef enum _POWER_STATE {
 #define ac_path_alt "/sys/class/power_supply/ACAD/online"
 #define profile_path "/sys/firmware/acpi/platform_profile"
 
+int powerstate_init(bool uevents);
+bool refresh_profile();
+bool handle_uevent(const char *buf, size_t len);
 POWER_STATE get_powerstate();
 
 #endif // POWERSTATE_H_
@@ -1,9 +1,12 @@
 #include "setapply.h"
 #include "powerstate.h"
+#include "output.h"
+#include "fancurve.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-int set_cpu(POWER_STATE power_state, LEGIOND_CONFIG *config)
+int set_cpu(POWER_STATE power_state, const LEGIOND_CONFIG *config)
 {
 	if (config->cpu_control == 0) {
 		printf("cpu_control is set to false\n");
@@ -57,7 +60,7 @@ int set_cpu(POWER_STATE power_state, LEGIOND_CONFIG *config)
 	return result;
 }
 
-int set_fancurve(POWER_STATE power_state, LEGIOND_CONFIG *config)
+int set_fancurve(POWER_STATE power_state, const LEGIOND_CONFIG *config)
 {
 	if (config->fan_control == 0) {
 		printf("fan_control is set to false\n");
@@ -65,53 +68,26 @@ int set_fancurve(POWER_STATE power_state, LEGIOND_CONFIG *config)
 		return 0;
 	}
 
-	char cmd[100] = "legion_cli fancurve-write-preset-to-hw ";
-	switch (power_state) {
-	case P_AC_Q:
-		strcat(cmd, "quiet-ac");
-		break;
-	case P_BAT_Q:
-		strcat(cmd, "quiet-battery");
-		break;
-	case P_AC_B:
-		strcat(cmd, "balanced-ac");
-		break;
-	case P_BAT_B:
-		strcat(cmd, "balanced-battery");
-		break;
-	case P_AC_BP:
-		strcat(cmd, "balanced-performance-ac");
-		break;
-	case P_BAT_BP:
-		strcat(cmd, "balanced-performance-battery");
-		break;
-	case P_AC_P:
-		strcat(cmd, "performance-ac");
-		break;
-	case P_AC_E:
-		strcat(cmd, "extreme-ac");
-		break;
-    default:
-		cmd[0] = '\0';
-		break;
-	}
+	const char *preset = get_preset_name(power_state);
 
 	int result = 0;
 
-	if (cmd[0] != '\0') {
-		result = system(cmd);
+	if (preset != NULL) {
+		trace_stage("legiond-fancurve-start", preset);
+		result = apply_fancurve_preset(power_state);
+		trace_stage("legiond-fancurve-done", result ? "failed" : "ok");
 	}
 
 	if (result != 0) {
-		printf("fancurve_control cmd failed\n");
+		printf("fancurve_control failed\n");
 	} else {
-		printf("fancurve_control cmd started\n");
+		printf("fancurve_control applied\n");
 	}
 
 	return result;
 }
 
-int set_gpu(POWER_STATE power_state, LEGIOND_CONFIG *config)
+int set_gpu(POWER_STATE power_state, const LEGIOND_CONFIG *config)
 {
 	if (strcmp(config->gpu_control, "false") == 0) {
 		printf("gpu_control is set to false\n");
@@ -170,7 +146,7 @@ int set_gpu(POWER_STATE power_state, LEGIOND_CONFIG *config)
 	return result;
 }
 
-int set_all(POWER_STATE power_state, LEGIOND_CONFIG *config)
+int set_all(POWER_STATE power_state, const LEGIOND_CONFIG *config)
 {
 	set_fancurve(power_state, config);
 	set_cpu(power_state, config);
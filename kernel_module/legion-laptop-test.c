@@ -0,0 +1,599 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * KUnit tests for the fan curve encoding and decoding of legion-laptop.c.
+ *
+ * This file is included at the end of legion-laptop.c if
+ * CONFIG_LEGION_LAPTOP_KUNIT_TEST is enabled, so it can test its static
+ * functions. Each test gets its own zeroed EC RAM (see mock_ec in
+ * struct ecram_portio), so neither hardware nor the simulated EC of a
+ * bound device is accessed.
+ *
+ * Run in a kernel tree patched with deploy/build_kernelpatch.sh with
+ * (the driver depends on ACPI, so UML is not possible):
+ *   ./tools/testing/kunit/kunit.py run --arch=x86_64 \
+ *	--kunitconfig=drivers/platform/x86/legion-laptop.kunitconfig
+ * or out of tree with "make kunit" and by loading the resulting module.
+ */
+
+#include <kunit/test.h>
+
+#define LEGION_TEST_BENCH_ITERATIONS 1000
+
+static const enum fan_speed_unit legion_test_units[] = {
+	FAN_SPEED_UNIT_PERCENT,
+	FAN_SPEED_UNIT_PERCENT_NEAREST,
+	FAN_SPEED_UNIT_PWM,
+	FAN_SPEED_UNIT_RPM_HUNDRED,
+};
+
+// Only the registers are used by the EC encoders
+static const struct model_config legion_test_model_ec = {
+	.registers = &ec_register_offsets_v0,
+};
+
+static const struct model_config legion_test_model_ec2 = {
+	.registers = &ec_register_offsets_ideapad_v0,
+};
+
+static const struct model_config legion_test_model_ec3 = {
+	.registers = &ec_register_offsets_loq_v0,
+};
+
+struct legion_test_ctx {
+	struct ecram ecram;
+	u8 *ec;
+};
+
+static void legion_test_fancurve_init(struct fancurve *fancurve,
+				      enum fan_speed_unit unit, size_t size)
+{
+	int i;
+
+	memset(fancurve, 0, sizeof(*fancurve));
+	fancurve->fan_speed_unit = unit;
+	fancurve->size = size;
+	for (i = 0; i < size; ++i) {
+		struct fancurve_point *point = &fancurve->points[i];
+
+		point->speed1 = 10 + 3 * i;
+		point->speed2 = 11 + 3 * i;
+		point->accel = 2 + i % 4;
+		point->decel = 5 - i % 4;
+		point->cpu_max_temp_celsius = 50 + 5 * i;
+		point->cpu_min_temp_celsius = 45 + 5 * i;
+		point->gpu_max_temp_celsius = 52 + 5 * i;
+		point->gpu_min_temp_celsius = 47 + 5 * i;
+		point->ic_max_temp_celsius = 54 + 5 * i;
+		point->ic_min_temp_celsius = 49 + 5 * i;
+	}
+	fancurve->points[size - 1].cpu_max_temp_celsius = 127;
+	fancurve->points[size - 1].gpu_max_temp_celsius = 127;
+	fancurve->points[size - 1].ic_max_temp_celsius = 127;
+}
+
+static int legion_test_init(struct kunit *test)
+{
+	struct legion_test_ctx *ctx;
+	int err;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	ctx->ec = vzalloc(LEGION_SIM_EC_SIZE);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->ec);
+	ctx->ecram.portio.mock_ec = ctx->ec;
+	err = ecram_init(&ctx->ecram, 0, 0);
+	if (err)
+		vfree(ctx->ec);
+	KUNIT_ASSERT_EQ(test, err, 0);
+	// the mock EC is writable even if the module is loaded with
+	// ec_readonly
+	ctx->ecram.readonly = false;
+	test->priv = ctx;
+	return 0;
+}
+
+static void legion_test_exit(struct kunit *test)
+{
+	struct legion_test_ctx *ctx = test->priv;
+
+	if (!ctx)
+		return;
+	ecram_exit(&ctx->ecram);
+	vfree(ctx->ec);
+}
+
+/* ================================= */
+/* Unit conversions                  */
+/* ================================= */
+
+static void legion_test_speed_pwm_roundtrip(struct kunit *test)
+{
+	struct fancurve fancurve;
+	size_t u;
+	int pwm;
+
+	for (u = 0; u < ARRAY_SIZE(legion_test_units); ++u) {
+		enum fan_speed_unit unit = legion_test_units[u];
+
+		legion_test_fancurve_init(&fancurve, unit, MAXFANCURVESIZE);
+		for (pwm = 0; pwm <= 255; ++pwm) {
+			int readback;
+
+			KUNIT_ASSERT_TRUE(test, fancurve_set_speed_pwm(
+							&fancurve, 3, 1, pwm));
+			KUNIT_ASSERT_TRUE(test, fancurve_get_speed_pwm(
+							&fancurve, 3, 1,
+							&readback));
+			if (unit == FAN_SPEED_UNIT_PWM)
+				KUNIT_EXPECT_EQ_MSG(test, readback, pwm,
+						    "unit %d", unit);
+			else
+				KUNIT_EXPECT_LE_MSG(test, abs(readback - pwm),
+						    3, "unit %d pwm %d", unit,
+						    pwm);
+			// other fan and point are untouched
+			KUNIT_EXPECT_EQ(test, fancurve.points[3].speed1,
+					10 + 3 * 3);
+			KUNIT_EXPECT_EQ(test, fancurve.points[2].speed2,
+					11 + 3 * 2);
+		}
+	}
+}
+
+// Writing back the value that was read must not change the stored speed,
+// e.g. when a tool reads and rewrites the whole curve
+static void legion_test_speed_pwm_stable(struct kunit *test)
+{
+	static const enum fan_speed_unit stable_units[] = {
+		FAN_SPEED_UNIT_PERCENT_NEAREST,
+		FAN_SPEED_UNIT_PWM,
+		FAN_SPEED_UNIT_RPM_HUNDRED,
+	};
+	struct fancurve fancurve;
+	size_t u;
+	int speed;
+
+	for (u = 0; u < ARRAY_SIZE(stable_units); ++u) {
+		enum fan_speed_unit unit = stable_units[u];
+		int max_speed = unit == FAN_SPEED_UNIT_PWM ? 255 :
+				unit == FAN_SPEED_UNIT_PERCENT_NEAREST ?
+							      100 :
+							      MAX_RPM / 100;
+
+		legion_test_fancurve_init(&fancurve, unit, MAXFANCURVESIZE);
+		for (speed = 0; speed <= max_speed; ++speed) {
+			int pwm;
+
+			fancurve.points[0].speed1 = speed;
+			KUNIT_ASSERT_TRUE(test, fancurve_get_speed_pwm(
+							&fancurve, 0, 0, &pwm));
+			KUNIT_ASSERT_TRUE(test, fancurve_set_speed_pwm(
+							&fancurve, 0, 0, pwm));
+			KUNIT_EXPECT_EQ_MSG(test, fancurve.points[0].speed1,
+					    speed, "unit %d", unit);
+		}
+	}
+}
+
+static void legion_test_speed_pwm_limits(struct kunit *test)
+{
+	struct fancurve fancurve;
+	int value;
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_PERCENT_NEAREST,
+				  MAXFANCURVESIZE);
+	KUNIT_EXPECT_TRUE(test, fancurve_set_speed_pwm(&fancurve, 0, 0, 255));
+	KUNIT_EXPECT_EQ(test, fancurve.points[0].speed1, 100);
+	KUNIT_EXPECT_TRUE(test, fancurve_set_speed_pwm(&fancurve, 0, 0, 0));
+	KUNIT_EXPECT_EQ(test, fancurve.points[0].speed1, 0);
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_RPM_HUNDRED,
+				  MAXFANCURVESIZE);
+	KUNIT_EXPECT_TRUE(test, fancurve_set_speed_pwm(&fancurve, 0, 0, 255));
+	KUNIT_EXPECT_EQ(test, fancurve.points[0].speed1, MAX_RPM / 100);
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_PWM, 4);
+	KUNIT_EXPECT_FALSE(test, fancurve_set_speed_pwm(&fancurve, 0, 0, -1));
+	KUNIT_EXPECT_FALSE(test, fancurve_set_speed_pwm(&fancurve, 0, 0, 256));
+	KUNIT_EXPECT_FALSE(test, fancurve_set_speed_pwm(&fancurve, 4, 0, 10));
+	KUNIT_EXPECT_FALSE(test, fancurve_set_speed_pwm(&fancurve, 0, 2, 10));
+	KUNIT_EXPECT_FALSE(test, fancurve_get_speed_pwm(&fancurve, 4, 0,
+							&value));
+	KUNIT_EXPECT_FALSE(test, fancurve_get_speed_pwm(&fancurve, 0, -1,
+							&value));
+	KUNIT_EXPECT_EQ(test, fancurve.points[0].speed1, 10);
+
+	fancurve.fan_speed_unit = 0;
+	KUNIT_EXPECT_FALSE(test, fancurve_set_speed_pwm(&fancurve, 0, 0, 10));
+	KUNIT_EXPECT_FALSE(test, fancurve_get_speed_pwm(&fancurve, 0, 0,
+							&value));
+}
+
+/* ================================= */
+/* Validators                        */
+/* ================================= */
+
+typedef bool (*legion_test_setter)(struct fancurve *fancurve, int point_id,
+				   int value);
+
+static void legion_test_expect_range(struct kunit *test,
+				     legion_test_setter setter, int min,
+				     int max)
+{
+	struct fancurve fancurve;
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_PWM,
+				  MAXFANCURVESIZE);
+	KUNIT_EXPECT_FALSE(test, setter(&fancurve, 1, min - 1));
+	KUNIT_EXPECT_FALSE(test, setter(&fancurve, 1, max + 1));
+	KUNIT_EXPECT_TRUE(test, setter(&fancurve, 1, min));
+	KUNIT_EXPECT_TRUE(test, setter(&fancurve, 1, max));
+}
+
+static void legion_test_setters(struct kunit *test)
+{
+	static const legion_test_setter temp_setters[] = {
+		fancurve_set_cpu_temp_max, fancurve_set_gpu_temp_max,
+		fancurve_set_ic_temp_max,  fancurve_set_cpu_temp_min,
+		fancurve_set_gpu_temp_min, fancurve_set_ic_temp_min,
+	};
+	struct fancurve fancurve;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(temp_setters); ++i)
+		legion_test_expect_range(test, temp_setters[i], 0, 127);
+	legion_test_expect_range(test, fancurve_set_accel, 2, 5);
+	legion_test_expect_range(test, fancurve_set_decel, 2, 5);
+
+	// rejected values leave the point untouched
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_PWM,
+				  MAXFANCURVESIZE);
+	KUNIT_EXPECT_FALSE(test, fancurve_set_cpu_temp_max(&fancurve, 2, 128));
+	KUNIT_EXPECT_EQ(test, fancurve.points[2].cpu_max_temp_celsius, 60);
+	KUNIT_EXPECT_FALSE(test, fancurve_set_accel(&fancurve, 2, 6));
+	KUNIT_EXPECT_EQ(test, fancurve.points[2].accel, 4);
+	KUNIT_EXPECT_TRUE(test, fancurve_set_gpu_temp_min(&fancurve, 2, 33));
+	KUNIT_EXPECT_EQ(test, fancurve.points[2].gpu_min_temp_celsius, 33);
+}
+
+static void legion_test_set_size(struct kunit *test)
+{
+	struct fancurve fancurve;
+	int i;
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_PWM, 5);
+	KUNIT_EXPECT_FALSE(test, fancurve_set_size(&fancurve, 0, true));
+	KUNIT_EXPECT_FALSE(test,
+			   fancurve_set_size(&fancurve, MAXFANCURVESIZE + 1,
+					     true));
+
+	// increasing copies the last point
+	KUNIT_EXPECT_TRUE(test, fancurve_set_size(&fancurve, 8, true));
+	for (i = 5; i < 8; ++i)
+		KUNIT_EXPECT_MEMEQ(test, &fancurve.points[i],
+				   &fancurve.points[4],
+				   sizeof(struct fancurve_point));
+	fancurve.size = 8;
+
+	// decreasing makes the new last point cover all temperatures
+	KUNIT_EXPECT_TRUE(test, fancurve_set_size(&fancurve, 3, true));
+	KUNIT_EXPECT_EQ(test, fancurve.points[2].cpu_max_temp_celsius, 127);
+	KUNIT_EXPECT_EQ(test, fancurve.points[2].gpu_max_temp_celsius, 127);
+	KUNIT_EXPECT_EQ(test, fancurve.points[2].ic_max_temp_celsius, 127);
+	KUNIT_EXPECT_EQ(test, fancurve.points[1].cpu_max_temp_celsius, 55);
+
+	// without init_values only the size is validated
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_PWM, 5);
+	KUNIT_EXPECT_TRUE(test, fancurve_set_size(&fancurve, 2, false));
+	KUNIT_EXPECT_EQ(test, fancurve.points[1].cpu_max_temp_celsius, 55);
+}
+
+/* ================================= */
+/* Layout encoding                   */
+/* ================================= */
+
+static void legion_test_ec_legion(struct kunit *test)
+{
+	struct legion_test_ctx *ctx = test->priv;
+	const struct ec_register_offsets *regs = legion_test_model_ec.registers;
+	struct fancurve fancurve;
+	struct fancurve readback;
+	int i;
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_RPM_HUNDRED, 6);
+	memset(&ctx->ec[regs->EXT_FAN1_BASE], 0xFF, MAXFANCURVESIZE);
+	ctx->ec[regs->EXT_FAN_CUR_POINT] = 4;
+
+	KUNIT_ASSERT_EQ(test,
+			ec_write_fancurve_legion(&ctx->ecram,
+						 &legion_test_model_ec,
+						 &fancurve, true),
+			0);
+	for (i = 0; i < MAXFANCURVESIZE; ++i) {
+		const struct fancurve_point *point = &fancurve.points[i];
+
+		KUNIT_EXPECT_EQ(test, ctx->ec[regs->EXT_FAN1_BASE + i],
+				point->speed1);
+		KUNIT_EXPECT_EQ(test, ctx->ec[regs->EXT_FAN2_BASE + i],
+				point->speed2);
+		KUNIT_EXPECT_EQ(test, ctx->ec[regs->EXT_VRM_TEMP_HYST + i],
+				point->ic_min_temp_celsius);
+	}
+	KUNIT_EXPECT_EQ(test, ctx->ec[regs->EXT_FAN_POINTS_SIZE], 6);
+	KUNIT_EXPECT_EQ(test, ctx->ec[regs->EXT_FAN_CUR_POINT], 0);
+
+	KUNIT_ASSERT_EQ(test,
+			ec_read_fancurve_legion(&ctx->ecram,
+						&legion_test_model_ec,
+						&readback),
+			0);
+	KUNIT_EXPECT_EQ(test, readback.size, 6);
+	KUNIT_EXPECT_EQ(test, readback.fan_speed_unit,
+			FAN_SPEED_UNIT_RPM_HUNDRED);
+	KUNIT_EXPECT_MEMEQ(test, readback.points, fancurve.points,
+			   sizeof(fancurve.points));
+}
+
+static void legion_test_ec_ideapad(struct kunit *test)
+{
+	struct legion_test_ctx *ctx = test->priv;
+	const struct ec_register_offsets *regs =
+		legion_test_model_ec2.registers;
+	struct fancurve fancurve;
+	struct fancurve readback;
+	int i;
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_RPM_HUNDRED,
+				  FANCURVESIZE_IDEAPDAD);
+	KUNIT_ASSERT_EQ(test,
+			ec_write_fancurve_ideapad(&ctx->ecram,
+						  &legion_test_model_ec2,
+						  &fancurve),
+			0);
+	for (i = 0; i < FANCURVESIZE_IDEAPDAD; ++i) {
+		const struct fancurve_point *point = &fancurve.points[i];
+
+		// temperatures are stored twice, 8 bytes apart
+		KUNIT_EXPECT_EQ(test, ctx->ec[regs->EXT_CPU_TEMP + 8 + i],
+				point->cpu_max_temp_celsius);
+		KUNIT_EXPECT_EQ(test,
+				ctx->ec[regs->EXT_GPU_TEMP_HYST + 8 + i],
+				point->gpu_min_temp_celsius);
+	}
+
+	KUNIT_ASSERT_EQ(test,
+			ec_read_fancurve_ideapad(&ctx->ecram,
+						 &legion_test_model_ec2,
+						 &readback),
+			0);
+	KUNIT_EXPECT_EQ(test, readback.size, FANCURVESIZE_IDEAPDAD);
+	for (i = 0; i < FANCURVESIZE_IDEAPDAD; ++i) {
+		KUNIT_EXPECT_EQ(test, readback.points[i].speed1,
+				fancurve.points[i].speed1);
+		KUNIT_EXPECT_EQ(test, readback.points[i].speed2,
+				fancurve.points[i].speed2);
+		KUNIT_EXPECT_EQ(test, readback.points[i].cpu_min_temp_celsius,
+				fancurve.points[i].cpu_min_temp_celsius);
+		KUNIT_EXPECT_EQ(test, readback.points[i].gpu_max_temp_celsius,
+				fancurve.points[i].gpu_max_temp_celsius);
+	}
+}
+
+// The LOQ layout is written with a different stride than it is read, so
+// only check the written bytes.
+static void legion_test_ec_loq(struct kunit *test)
+{
+	struct legion_test_ctx *ctx = test->priv;
+	const struct ec_register_offsets *regs =
+		legion_test_model_ec3.registers;
+	struct fancurve fancurve;
+	int i;
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_RPM_HUNDRED,
+				  FANCURVESIZE_LOQ);
+	ctx->ec[LOQ_CMDR_ADDR] = 0x01;
+	KUNIT_ASSERT_EQ(test,
+			ec_write_fancurve_loq(&ctx->ecram,
+					      &legion_test_model_ec3,
+					      &fancurve),
+			0);
+	for (i = 0; i < FANCURVESIZE_LOQ; ++i) {
+		const struct fancurve_point *point = &fancurve.points[i];
+		size_t off = i * 6;
+
+		KUNIT_EXPECT_EQ(test, ctx->ec[regs->EXT_FAN1_BASE + off],
+				point->speed1);
+		KUNIT_EXPECT_EQ(test, ctx->ec[regs->EXT_FAN2_BASE + off],
+				point->speed2);
+		KUNIT_EXPECT_EQ(test, ctx->ec[regs->EXT_CPU_TEMP + off],
+				point->cpu_max_temp_celsius);
+		KUNIT_EXPECT_EQ(test,
+				ctx->ec[regs->EXT_VRM_TEMP_HYST + off],
+				point->ic_min_temp_celsius);
+	}
+	// execute bit is set without clearing other bits
+	KUNIT_EXPECT_EQ(test, ctx->ec[LOQ_CMDR_ADDR], 0x11);
+}
+
+static void legion_test_ec_legion2024(struct kunit *test)
+{
+	struct legion_test_ctx *ctx = test->priv;
+	struct fancurve fancurve;
+	struct fancurve readback;
+	int i;
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_RPM_HUNDRED,
+				  EC4_FANCURVE_SIZE);
+	KUNIT_ASSERT_EQ(test,
+			ec_write_fancurve_legion2024(&ctx->ecram, NULL,
+						     &fancurve),
+			0);
+	KUNIT_ASSERT_EQ(test,
+			ec_read_fancurve_legion2024(&ctx->ecram, NULL,
+						    &readback),
+			0);
+	KUNIT_EXPECT_EQ(test, readback.size, EC4_FANCURVE_SIZE);
+	for (i = 0; i < EC4_FANCURVE_SIZE; ++i) {
+		int off = EC4_POINT_STRIDE * i;
+
+		KUNIT_EXPECT_EQ(test, readback.points[i].speed1,
+				fancurve.points[i].speed1);
+		KUNIT_EXPECT_EQ(test, readback.points[i].speed2,
+				fancurve.points[i].speed2);
+		KUNIT_EXPECT_EQ(test, readback.points[i].cpu_max_temp_celsius,
+				fancurve.points[i].cpu_max_temp_celsius);
+		KUNIT_EXPECT_EQ(test, readback.points[i].gpu_max_temp_celsius,
+				fancurve.points[i].gpu_max_temp_celsius);
+		// second fan uses the same temperatures
+		KUNIT_EXPECT_EQ(test, ctx->ec[EC4_FAN2_BASE + off],
+				fancurve.points[i].cpu_max_temp_celsius);
+	}
+}
+
+static void legion_test_ec_readonly(struct kunit *test)
+{
+	struct legion_test_ctx *ctx = test->priv;
+	const struct ec_register_offsets *regs = legion_test_model_ec.registers;
+	struct fancurve fancurve;
+	int err;
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_RPM_HUNDRED,
+				  MAXFANCURVESIZE);
+	ctx->ec[regs->EXT_FAN1_BASE] = 0x42;
+	ctx->ecram.readonly = true;
+	err = ec_write_fancurve_legion(&ctx->ecram, &legion_test_model_ec,
+				       &fancurve, true);
+	KUNIT_EXPECT_EQ(test, err, -EROFS);
+	KUNIT_EXPECT_EQ(test, ctx->ec[regs->EXT_FAN1_BASE], 0x42);
+}
+
+static void legion_test_wmi_encode(struct kunit *test)
+{
+	u8 buffer[WMI_FAN_TABLE_WRITE_SIZE];
+	struct fancurve fancurve;
+	int i;
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_PERCENT,
+				  MAXFANCURVESIZE);
+	memset(buffer, 0xFF, sizeof(buffer));
+	wmi_fancurve_custom_encode(&fancurve, buffer);
+	for (i = 0; i < MAXFANCURVESIZE; ++i) {
+		KUNIT_EXPECT_EQ(test, buffer[0x06 + 2 * i],
+				fancurve.points[i].speed1);
+		KUNIT_EXPECT_EQ(test, buffer[0x07 + 2 * i], 0);
+	}
+	for (i = 0; i < 0x06; ++i)
+		KUNIT_EXPECT_EQ(test, buffer[i], 0);
+	for (i = 0x1A; i < WMI_FAN_TABLE_WRITE_SIZE; ++i)
+		KUNIT_EXPECT_EQ(test, buffer[i], 0);
+}
+
+/* ================================= */
+/* Microbenchmarks                   */
+/* ================================= */
+// Report the time per operation so regressions in the encode paths show up
+// in the test log; no limits are enforced because timings depend on the host.
+
+static void legion_test_bench_report(struct kunit *test, const char *name,
+				     u64 start_ns, unsigned int ops)
+{
+	u64 elapsed = ktime_get_ns() - start_ns;
+
+	kunit_info(test, "%s: %llu ns/op (%u ops)\n", name,
+		   div_u64(elapsed, ops), ops);
+}
+
+static void legion_test_bench_speed_pwm(struct kunit *test)
+{
+	struct fancurve fancurve;
+	unsigned int ops = 0;
+	size_t u;
+	u64 start;
+	int i;
+	int pwm;
+	int value;
+
+	for (u = 0; u < ARRAY_SIZE(legion_test_units); ++u) {
+		legion_test_fancurve_init(&fancurve, legion_test_units[u],
+					  MAXFANCURVESIZE);
+		start = ktime_get_ns();
+		for (i = 0; i < LEGION_TEST_BENCH_ITERATIONS; ++i) {
+			pwm = i & 0xFF;
+			fancurve_set_speed_pwm(&fancurve, i % MAXFANCURVESIZE,
+					       i & 1, pwm);
+			fancurve_get_speed_pwm(&fancurve, i % MAXFANCURVESIZE,
+					       i & 1, &value);
+			ops++;
+		}
+		legion_test_bench_report(test, "speed_pwm set+get", start,
+					 ops);
+		ops = 0;
+	}
+}
+
+static void legion_test_bench_ec_write(struct kunit *test)
+{
+	struct legion_test_ctx *ctx = test->priv;
+	struct fancurve fancurve;
+	u64 start;
+	int i;
+
+	legion_test_fancurve_init(&fancurve, FAN_SPEED_UNIT_RPM_HUNDRED,
+				  MAXFANCURVESIZE);
+
+	start = ktime_get_ns();
+	for (i = 0; i < LEGION_TEST_BENCH_ITERATIONS / 10; ++i)
+		KUNIT_ASSERT_EQ(test,
+				ec_write_fancurve_legion(&ctx->ecram,
+							 &legion_test_model_ec,
+							 &fancurve, true),
+				0);
+	legion_test_bench_report(test, "ec_write_fancurve_legion", start,
+				 LEGION_TEST_BENCH_ITERATIONS / 10);
+
+	start = ktime_get_ns();
+	for (i = 0; i < LEGION_TEST_BENCH_ITERATIONS / 10; ++i)
+		KUNIT_ASSERT_EQ(test,
+				ec_write_fancurve_loq(&ctx->ecram,
+						      &legion_test_model_ec3,
+						      &fancurve),
+				0);
+	legion_test_bench_report(test, "ec_write_fancurve_loq", start,
+				 LEGION_TEST_BENCH_ITERATIONS / 10);
+
+	start = ktime_get_ns();
+	for (i = 0; i < LEGION_TEST_BENCH_ITERATIONS / 10; ++i)
+		KUNIT_ASSERT_EQ(test,
+				ec_read_fancurve_legion(&ctx->ecram,
+							&legion_test_model_ec,
+							&fancurve),
+				0);
+	legion_test_bench_report(test, "ec_read_fancurve_legion", start,
+				 LEGION_TEST_BENCH_ITERATIONS / 10);
+}
+
+static struct kunit_case legion_fancurve_test_cases[] = {
+	KUNIT_CASE(legion_test_speed_pwm_roundtrip),
+	KUNIT_CASE(legion_test_speed_pwm_stable),
+	KUNIT_CASE(legion_test_speed_pwm_limits),
+	KUNIT_CASE(legion_test_setters),
+	KUNIT_CASE(legion_test_set_size),
+	KUNIT_CASE(legion_test_ec_legion),
+	KUNIT_CASE(legion_test_ec_ideapad),
+	KUNIT_CASE(legion_test_ec_loq),
+	KUNIT_CASE(legion_test_ec_legion2024),
+	KUNIT_CASE(legion_test_ec_readonly),
+	KUNIT_CASE(legion_test_wmi_encode),
+	KUNIT_CASE(legion_test_bench_speed_pwm),
+	KUNIT_CASE(legion_test_bench_ec_write),
+	{}
+};
+
+static struct kunit_suite legion_fancurve_test_suite = {
+	.name = "legion-laptop-fancurve",
+	.init = legion_test_init,
+	.exit = legion_test_exit,
+	.test_cases = legion_fancurve_test_cases,
+};
+
+kunit_test_suite(legion_fancurve_test_suite);
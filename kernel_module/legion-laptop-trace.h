@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Tracepoints of legion-laptop.c to measure the latency of power mode
+ * switches, e.g. from pressing Fn+Q to the applied fan curve.
+ *
+ * Enable with
+ *   echo mono > /sys/kernel/tracing/trace_clock
+ *   echo 1 > /sys/kernel/tracing/events/legion_laptop/enable
+ * so timestamps are comparable to CLOCK_MONOTONIC of legiond and legion_cli.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM legion_laptop
+
+#if !defined(_LEGION_LAPTOP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LEGION_LAPTOP_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// WMI event received; the platform profile is notified after a delay
+TRACE_EVENT(legion_wmi_event,
+	TP_PROTO(int event, unsigned int delay_ms),
+	TP_ARGS(event, delay_ms),
+	TP_STRUCT__entry(
+		__field(int, event)
+		__field(unsigned int, delay_ms)
+	),
+	TP_fast_assign(
+		__entry->event = event;
+		__entry->delay_ms = delay_ms;
+	),
+	TP_printk("event=%d delay_ms=%u", __entry->event, __entry->delay_ms)
+);
+
+// Userspace is notified of a possibly changed platform profile
+TRACE_EVENT(legion_profile_notify,
+	TP_PROTO(int powermode),
+	TP_ARGS(powermode),
+	TP_STRUCT__entry(
+		__field(int, powermode)
+	),
+	TP_fast_assign(
+		__entry->powermode = powermode;
+	),
+	TP_printk("powermode=%d", __entry->powermode)
+);
+
+// Fan curve written to EC or firmware
+TRACE_EVENT(legion_fancurve_write,
+	TP_PROTO(int access_method, size_t size, int err),
+	TP_ARGS(access_method, size, err),
+	TP_STRUCT__entry(
+		__field(int, access_method)
+		__field(size_t, size)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->access_method = access_method;
+		__entry->size = size;
+		__entry->err = err;
+	),
+	TP_printk("access_method=%d size=%zu err=%d", __entry->access_method,
+		  __entry->size, __entry->err)
+);
+
+#endif /* _LEGION_LAPTOP_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE legion-laptop-trace
+#include <trace/define_trace.h>
@@ -49,6 +49,16 @@
  *          hysteris (CPU, GPU, or IC) at the Y-level in the fan curve. The lower
  *          temperatue of the level is the upper temperature minus the hysteris
  *
+ *  It registers a thermal cooling device "legion_fan" whose states raise the
+ *  lower levels of the fan curve (and at the highest state enable fan full speed).
+ *
+ *    - /sys/class/thermal/cooling_deviceX/cur_state (rw)
+ *
+ *  The power limits of CPU and GPU are also available as powercap control
+ *  type "legion" with the zones "cpu" and "gpu".
+ *
+ *    - /sys/class/powercap/legion:Z/constraint_Y_power_limit_uw (rw)
+ *
  *
  *  Credits for reverse engineering the firmware to:
  *      - David Woodhouse: heavily inspired by lenovo_laptop.c
@@ -70,12 +80,23 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/pci.h>
 #include <linux/platform_device.h>
 #include <linux/platform_profile.h>
+#include <linux/pm_runtime.h>
+#include <linux/powercap.h>
+#include <linux/rcupdate.h>
+#include <linux/thermal.h>
 #include <linux/types.h>
+#include <linux/vmalloc.h>
 #include <linux/wmi.h>
+#include <net/genetlink.h>
+#include <linux/workqueue.h>
 #include <linux/version.h>
 
+#define CREATE_TRACE_POINTS
+#include "legion-laptop-trace.h"
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("johnfan");
 MODULE_DESCRIPTION("Lenovo Legion laptop extras");
@@ -92,12 +113,42 @@ MODULE_PARM_DESC(
 	ec_readonly,
 	"Only read from embedded controller but do not write or change settings.");
 
+static char *simulate;
+module_param(simulate, charp, 0440);
+MODULE_PARM_DESC(
+	simulate,
+	"Do not access hardware but simulate embedded controller, WMI and ACPI of the given model (ident in allowlist, e.g. GKCN) to test in a VM.");
+
+static bool ec_acpi_global_lock = true;
+module_param(ec_acpi_global_lock, bool, 0440);
+MODULE_PARM_DESC(
+	ec_acpi_global_lock,
+	"Take the ACPI global lock while accessing the embedded controller via IO ports, so accesses do not interleave with ACPI firmware. Accesses fail if it cannot be taken in time.");
+
 static bool enable_platformprofile = true;
 module_param(enable_platformprofile, bool, 0440);
 MODULE_PARM_DESC(
 	enable_platformprofile,
 	"Enable the platform profile sysfs API to read and write the power mode.");
 
+static bool gpu_temp_skip_suspended_dgpu;
+module_param(gpu_temp_skip_suspended_dgpu, bool, 0644);
+MODULE_PARM_DESC(
+	gpu_temp_skip_suspended_dgpu,
+	"Do not read the GPU temperature from firmware while the NVIDIA dGPU is runtime suspended, because this might wake it up. The last value read is reported instead.");
+
+static uint throttle_sample_ms;
+module_param(throttle_sample_ms, uint, 0440);
+MODULE_PARM_DESC(
+	throttle_sample_ms,
+	"Sample fan and temperature state every this many milliseconds to collect throttling statistics per power mode and fan health statistics. 0 disables it.");
+
+static uint powerlimit_writeback_ms;
+module_param(powerlimit_writeback_ms, uint, 0644);
+MODULE_PARM_DESC(
+	powerlimit_writeback_ms,
+	"Delay writes of power limits until no new value was written for this many milliseconds and only write the last value. 0 writes immediately.");
+
 // TODO: remove this?
 #define LEGIONFEATURES \
 	"fancurve powermode platformprofile platformprofilenotify minifancurve fancurve_pmw_speed fancurve_rpm_speed"
@@ -2021,12 +2072,42 @@ static const char *get_model_acpi_path(const struct model_config *model, enum ac
 	return default_acpi_paths[id];
 }
 
+// Simulated firmware, see section Simulation
+static bool legion_sim_active(void);
+static int legion_sim_eval_int(const char *name, unsigned long *res);
+static int legion_sim_exec_simple_method(const char *name, unsigned long arg);
+static acpi_status legion_sim_wmi_evaluate_method(const char *guid,
+						  u32 method_id,
+						  const struct acpi_buffer *in,
+						  struct acpi_buffer *out);
+static bool legion_sim_wmi_has_guid(const char *guid);
+
+static bool legion_wmi_has_guid(const char *guid)
+{
+	if (legion_sim_active())
+		return legion_sim_wmi_has_guid(guid);
+	return wmi_has_guid(guid);
+}
+
+static acpi_status legion_wmi_evaluate_method(const char *guid, u8 instance,
+					      u32 method_id,
+					      const struct acpi_buffer *in,
+					      struct acpi_buffer *out)
+{
+	if (legion_sim_active())
+		return legion_sim_wmi_evaluate_method(guid, method_id, in, out);
+	return wmi_evaluate_method(guid, instance, method_id, in, out);
+}
+
 // function from ideapad-laptop.c
 static int eval_int(struct acpi_device *adev, const char *name, unsigned long *res)
 {
 	unsigned long long result;
 	acpi_status status;
 	acpi_handle handle;
+
+	if (legion_sim_active())
+		return legion_sim_eval_int(name, res);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(7, 0, 0)
 	status = acpi_get_handle(NULL, (char *)name, &handle);
 	if (ACPI_FAILURE(status))
@@ -2051,6 +2132,9 @@ static int exec_simple_method(struct acpi_device *adev, const char *name,
 {
 	acpi_handle handle;
 	acpi_status status;
+
+	if (legion_sim_active())
+		return legion_sim_exec_simple_method(name, arg);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(7, 0, 0)
 	status = acpi_get_handle(NULL, (char *)name, &handle);
 	if (ACPI_FAILURE(status))
@@ -2176,10 +2260,10 @@ static int wmi_exec_ints(const char *guid, u8 instance, u32 method_id,
 	acpi_status status;
 	struct acpi_buffer out_buffer = { ACPI_ALLOCATE_BUFFER, NULL };
 
-	if (!wmi_has_guid(guid))
+	if (!legion_wmi_has_guid(guid))
 		return -ENODEV;
 
-	status = wmi_evaluate_method(guid, instance, method_id, params,
+	status = legion_wmi_evaluate_method(guid, instance, method_id, params,
 				     &out_buffer);
 	return acpi_process_buffer_to_ints(guid, method_id, status, &out_buffer,
 					   res, ressize);
@@ -2194,10 +2278,10 @@ static int wmi_exec_int(const char *guid, u8 instance, u32 method_id,
 	union acpi_object *out = NULL;
 	int error = 0;
 
-	if (!wmi_has_guid(guid))
+	if (!legion_wmi_has_guid(guid))
 		return -ENODEV;
 
-	status = wmi_evaluate_method(guid, instance, method_id, params,
+	status = legion_wmi_evaluate_method(guid, instance, method_id, params,
 				     &out_buffer);
 
 	if (ACPI_FAILURE(status)) {
@@ -2250,10 +2334,10 @@ static int wmi_exec_noarg_int_or_buffer(const char *guid, u8 instance,
 
 	params.length = 0;
 	params.pointer = NULL;
-	if (!wmi_has_guid(guid))
+	if (!legion_wmi_has_guid(guid))
 		return -ENODEV;
 
-	status = wmi_evaluate_method(guid, instance, method_id, &params,
+	status = legion_wmi_evaluate_method(guid, instance, method_id, &params,
 				     &out_buffer);
 	if (ACPI_FAILURE(status)) {
 		pr_info("WMI evaluation error for: %s:%d\n", guid, method_id);
@@ -2317,10 +2401,10 @@ static int wmi_exec_arg(const char *guid, u8 instance, u32 method_id, void *arg,
 
 	params.length = arg_size;
 	params.pointer = arg;
-	if (!wmi_has_guid(guid))
+	if (!legion_wmi_has_guid(guid))
 		return -ENODEV;
 
-	status = wmi_evaluate_method(guid, instance, method_id, &params, NULL);
+	status = legion_wmi_evaluate_method(guid, instance, method_id, &params, NULL);
 
 	if (ACPI_FAILURE(status))
 		return -EIO;
@@ -2556,6 +2640,336 @@ static ssize_t wmi_other_method_set_value(enum OtherMethodFeature feature_id,
 	return error;
 }
 
+/* =================================== */
+/* Simulation                          */
+/* =================================== */
+// With the module parameter simulate, EC RAM, WMI methods and ACPI methods
+// are not accessed but simulated: EC RAM is an in-memory image that is
+// initialized for the selected model, WMI and ACPI methods answer from
+// tables below. Allows testing and profiling the whole sysfs/hwmon
+// interface without a Legion laptop, e.g. in a VM.
+
+#define LEGION_SIM_EC_SIZE 0x10000
+
+// EC RAM image; not NULL iff simulation is active
+static u8 *legion_sim_ec;
+// protects the simulated WMI and ACPI values
+static DEFINE_SPINLOCK(legion_sim_lock);
+
+struct legion_sim_wmi_method {
+	const char *guid;
+	u32 get_method_id;
+	// method that sets the value returned by get_method_id; 0 if none
+	u32 set_method_id;
+	unsigned long value;
+};
+
+static struct legion_sim_wmi_method legion_sim_wmi_methods[] = {
+	// balanced
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETSMARTFANMODE,
+	  WMI_METHOD_ID_SETSMARTFANMODE, 2 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETTHERMALMODE, 0, 2 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETFAN1SPEED, 0, 2000 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETFAN2SPEED, 0, 2100 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETCPUTEMP, 0, 55 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETGPUTEMP, 0, 48 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETVERSION, 0, 1 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETWINKEYSTATUS,
+	  WMI_METHOD_ID_SETWINKEYSTATUS, 1 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETTPSTATUS,
+	  WMI_METHOD_ID_SETTPSTATUS, 1 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETGSYNCSTATUS,
+	  WMI_METHOD_ID_SETGSYNCSTATUS, 0 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETODSTATUS,
+	  WMI_METHOD_ID_SETODSTATUS, 0 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETIGPUMODESTATUS,
+	  WMI_METHOD_ID_SETIGPUMODESTATUS, 0 },
+	{ LEGION_WMI_GAMEZONE_GUID, WMI_METHOD_ID_GETKEYBOARDLIGHT,
+	  WMI_METHOD_ID_SETKEYBOARDLIGHT, 0 },
+	{ WMI_GUID_LENOVO_CPU_METHOD, WMI_METHOD_ID_CPU_GET_OC_STATUS,
+	  WMI_METHOD_ID_CPU_SET_OC_STATUS, 0 },
+	{ WMI_GUID_LENOVO_CPU_METHOD, WMI_METHOD_ID_CPU_GET_SHORTTERM_POWERLIMIT,
+	  WMI_METHOD_ID_CPU_SET_SHORTTERM_POWERLIMIT, 80 },
+	{ WMI_GUID_LENOVO_CPU_METHOD, WMI_METHOD_ID_CPU_GET_LONGTERM_POWERLIMIT,
+	  WMI_METHOD_ID_CPU_SET_LONGTERM_POWERLIMIT, 65 },
+	{ WMI_GUID_LENOVO_CPU_METHOD, WMI_METHOD_ID_CPU_GET_DEFAULT_POWERLIMIT,
+	  0, 65 },
+	{ WMI_GUID_LENOVO_CPU_METHOD, WMI_METHOD_ID_CPU_GET_PEAK_POWERLIMIT,
+	  WMI_METHOD_ID_CPU_SET_PEAK_POWERLIMIT, 100 },
+	{ WMI_GUID_LENOVO_CPU_METHOD, WMI_METHOD_ID_CPU_GET_APU_SPPT_POWERLIMIT,
+	  WMI_METHOD_ID_CPU_SET_APU_SPPT_POWERLIMIT, 0 },
+	{ WMI_GUID_LENOVO_CPU_METHOD,
+	  WMI_METHOD_ID_CPU_GET_CROSS_LOADING_POWERLIMIT,
+	  WMI_METHOD_ID_CPU_SET_CROSS_LOADING_POWERLIMIT, 0 },
+	{ WMI_GUID_LENOVO_GPU_METHOD, WMI_METHOD_ID_GPU_GET_OC_STATUS,
+	  WMI_METHOD_ID_GPU_SET_OC_STATUS, 0 },
+	{ WMI_GUID_LENOVO_GPU_METHOD, WMI_METHOD_ID_GPU_GET_PPAB_POWERLIMIT,
+	  WMI_METHOD_ID_GPU_SET_PPAB_POWERLIMIT, 15 },
+	{ WMI_GUID_LENOVO_GPU_METHOD, WMI_METHOD_ID_GPU_GET_CTGP_POWERLIMIT,
+	  WMI_METHOD_ID_GPU_SET_CTGP_POWERLIMIT, 115 },
+	{ WMI_GUID_LENOVO_GPU_METHOD,
+	  WMI_METHOD_ID_GPU_GET_DEFAULT_PPAB_CTGP_POWERLIMIT, 0, 115 },
+	{ WMI_GUID_LENOVO_GPU_METHOD, WMI_METHOD_ID_GPU_GET_TEMPERATURE_LIMIT,
+	  WMI_METHOD_ID_GPU_SET_TEMPERATURE_LIMIT, 87 },
+	{ WMI_GUID_LENOVO_GPU_METHOD, WMI_METHOD_ID_GPU_GET_BOOST_CLOCK, 0, 0 },
+	{ WMI_GUID_LENOVO_FAN_METHOD, WMI_METHOD_ID_FAN_GET_FULLSPEED,
+	  WMI_METHOD_ID_FAN_SET_FULLSPEED, 0 },
+	{ WMI_GUID_LENOVO_FAN_METHOD, WMI_METHOD_ID_FAN_GET_MAXSPEED,
+	  WMI_METHOD_ID_FAN_SET_MAXSPEED, 0 },
+	{ WMI_GUID_LENOVO_FAN_METHOD, WMI_METHOD_ID_FAN_GETCURRENTFANSPEED, 0,
+	  2000 },
+	{ WMI_GUID_LENOVO_FAN_METHOD,
+	  WMI_METHOD_ID_FAN_GETCURRENTSENSORTEMPERATURE, 0, 55 },
+};
+
+struct legion_sim_feature {
+	enum OtherMethodFeature feature_id;
+	int value;
+};
+
+// Values of the Other Method features; features not listed are unsupported
+static struct legion_sim_feature legion_sim_features[] = {
+	{ OtherMethodFeature_CPU_SHORT_TERM_POWER_LIMIT, 80 },
+	{ OtherMethodFeature_CPU_LONG_TERM_POWER_LIMIT, 65 },
+	{ OtherMethodFeature_CPU_PEAK_POWER_LIMIT, 100 },
+	{ OtherMethodFeature_CPU_TEMPERATURE_LIMIT, 95 },
+	{ OtherMethodFeature_APU_PPT_POWER_LIMIT, 0 },
+	{ OtherMethodFeature_CPU_CROSS_LOAD_POWER_LIMIT, 0 },
+	{ OtherMethodFeature_CPU_L1_TAU, 28 },
+	{ OtherMethodFeature_GPU_POWER_BOOST, 15 },
+	{ OtherMethodFeature_GPU_TEMPERATURE_LIMIT, 87 },
+	{ OtherMethodFeature_FAN_SPEED_1, 2000 },
+	{ OtherMethodFeature_FAN_SPEED_2, 2100 },
+	{ OtherMethodFeature_FAN_FULLSPEED, 0 },
+	{ OtherMethodFeature_TEMP_CPU, 55 },
+	{ OtherMethodFeature_TEMP_GPU, 48 },
+};
+
+struct legion_sim_acpi_value {
+	const char *name;
+	unsigned long value;
+};
+
+// Values returned and set by ACPI methods by name; unknown names are 0
+#define LEGION_SIM_ACPI_VALUES 16
+static struct legion_sim_acpi_value legion_sim_acpi_values[LEGION_SIM_ACPI_VALUES];
+
+static bool legion_sim_active(void)
+{
+	return legion_sim_ec != NULL;
+}
+
+static u8 legion_sim_ec_read(u16 offset)
+{
+	return legion_sim_ec[offset];
+}
+
+static void legion_sim_ec_write(u16 offset, u8 value)
+{
+	legion_sim_ec[offset] = value;
+}
+
+static bool legion_sim_wmi_has_guid(const char *guid)
+{
+	size_t i;
+
+	if (!strcasecmp(guid, LEGION_WMI_LENOVO_OTHER_METHOD_GUID))
+		return true;
+	for (i = 0; i < ARRAY_SIZE(legion_sim_wmi_methods); ++i) {
+		if (!strcasecmp(guid, legion_sim_wmi_methods[i].guid))
+			return true;
+	}
+	return false;
+}
+
+// First up to 4 bytes of the input as little endian integer
+static u32 legion_sim_wmi_arg(const struct acpi_buffer *in, size_t offset)
+{
+	u32 value = 0;
+	size_t i;
+
+	if (!in || !in->pointer)
+		return 0;
+	for (i = 0; i < 4 && offset + i < in->length; ++i)
+		value |= ((u32)((u8 *)in->pointer)[offset + i]) << (8 * i);
+	return value;
+}
+
+static acpi_status legion_sim_wmi_evaluate_method(const char *guid,
+						  u32 method_id,
+						  const struct acpi_buffer *in,
+						  struct acpi_buffer *out)
+{
+	union acpi_object *obj;
+	unsigned long value = 0;
+	bool found = false;
+	unsigned long flags;
+	size_t i;
+
+	spin_lock_irqsave(&legion_sim_lock, flags);
+	if (!strcasecmp(guid, LEGION_WMI_LENOVO_OTHER_METHOD_GUID)) {
+		u32 feature_id = legion_sim_wmi_arg(in, 0);
+
+		for (i = 0; i < ARRAY_SIZE(legion_sim_features); ++i) {
+			if (legion_sim_features[i].feature_id != feature_id)
+				continue;
+			if (method_id == WMI_METHOD_ID_SET_FEATURE_VALUE)
+				legion_sim_features[i].value =
+					legion_sim_wmi_arg(in, 4);
+			value = legion_sim_features[i].value;
+			found = method_id == WMI_METHOD_ID_GET_FEATURE_VALUE ||
+				method_id == WMI_METHOD_ID_SET_FEATURE_VALUE;
+			break;
+		}
+	} else {
+		for (i = 0; i < ARRAY_SIZE(legion_sim_wmi_methods); ++i) {
+			struct legion_sim_wmi_method *m =
+				&legion_sim_wmi_methods[i];
+
+			if (strcasecmp(guid, m->guid))
+				continue;
+			if (m->get_method_id == method_id) {
+				value = m->value;
+				found = true;
+				break;
+			}
+			if (m->set_method_id && m->set_method_id == method_id) {
+				m->value = legion_sim_wmi_arg(in, 0);
+				value = 0;
+				found = true;
+				break;
+			}
+		}
+	}
+	spin_unlock_irqrestore(&legion_sim_lock, flags);
+
+	if (!found)
+		return AE_NOT_FOUND;
+	if (!out)
+		return AE_OK;
+
+	obj = kzalloc(sizeof(*obj), GFP_KERNEL);
+	if (!obj)
+		return AE_NO_MEMORY;
+	obj->type = ACPI_TYPE_INTEGER;
+	obj->integer.value = value;
+	out->length = sizeof(*obj);
+	out->pointer = obj;
+	return AE_OK;
+}
+
+static struct legion_sim_acpi_value *legion_sim_acpi_find(const char *name,
+							  bool create)
+{
+	size_t i;
+
+	for (i = 0; i < LEGION_SIM_ACPI_VALUES; ++i) {
+		if (legion_sim_acpi_values[i].name &&
+		    !strcmp(legion_sim_acpi_values[i].name, name))
+			return &legion_sim_acpi_values[i];
+	}
+	if (!create)
+		return NULL;
+	for (i = 0; i < LEGION_SIM_ACPI_VALUES; ++i) {
+		if (!legion_sim_acpi_values[i].name) {
+			// names are ACPI paths of the model config
+			legion_sim_acpi_values[i].name = name;
+			return &legion_sim_acpi_values[i];
+		}
+	}
+	return NULL;
+}
+
+static int legion_sim_eval_int(const char *name, unsigned long *res)
+{
+	struct legion_sim_acpi_value *entry;
+	unsigned long flags;
+
+	if (!name)
+		return -ENODEV;
+	spin_lock_irqsave(&legion_sim_lock, flags);
+	entry = legion_sim_acpi_find(name, false);
+	*res = entry ? entry->value : 0;
+	spin_unlock_irqrestore(&legion_sim_lock, flags);
+	return 0;
+}
+
+static int legion_sim_exec_simple_method(const char *name, unsigned long arg)
+{
+	struct legion_sim_acpi_value *entry;
+	unsigned long flags;
+
+	if (!name)
+		return -ENODEV;
+	spin_lock_irqsave(&legion_sim_lock, flags);
+	entry = legion_sim_acpi_find(name, true);
+	if (entry)
+		entry->value = arg;
+	spin_unlock_irqrestore(&legion_sim_lock, flags);
+	return entry ? 0 : -ENOSPC;
+}
+
+// Fill EC RAM image with plausible values for the model
+static void legion_sim_ec_setup(const struct model_config *model)
+{
+	const struct ec_register_offsets *regs = model->registers;
+	u16 rpm1 = 2000;
+	u16 rpm2 = 2100;
+	int i;
+
+	legion_sim_ec[regs->ECHIPID1] = model->embedded_controller_id >> 8;
+	legion_sim_ec[regs->ECHIPID2] = model->embedded_controller_id & 0xFF;
+
+	// temperatures as read by ec_read_sensor_values
+	legion_sim_ec[0xC5E6] = 55;
+	legion_sim_ec[0xC5E7] = 48;
+	legion_sim_ec[0xC5E8] = 40;
+	legion_sim_ec[regs->EXT_CPU_TEMP_INPUT] = 55;
+	legion_sim_ec[regs->EXT_GPU_TEMP_INPUT] = 48;
+	legion_sim_ec[regs->EXT_IC_TEMP_INPUT] = 40;
+	legion_sim_ec[regs->EXT_FAN1_RPM_LSB] = rpm1 & 0xFF;
+	legion_sim_ec[regs->EXT_FAN1_RPM_MSB] = rpm1 >> 8;
+	legion_sim_ec[regs->EXT_FAN2_RPM_LSB] = rpm2 & 0xFF;
+	legion_sim_ec[regs->EXT_FAN2_RPM_MSB] = rpm2 >> 8;
+	legion_sim_ec[regs->EXT_FAN1_TARGET_RPM] = rpm1 / 100;
+	legion_sim_ec[regs->EXT_FAN2_TARGET_RPM] = rpm2 / 100;
+
+	// fan curve in the layout of ec_read_fancurve_legion
+	if (model->access_method_fancurve == ACCESS_METHOD_EC) {
+		legion_sim_ec[regs->EXT_FAN_POINTS_SIZE] = MAXFANCURVESIZE;
+		for (i = 0; i < MAXFANCURVESIZE; ++i) {
+			legion_sim_ec[regs->EXT_FAN1_BASE + i] = 15 + 3 * i;
+			legion_sim_ec[regs->EXT_FAN2_BASE + i] = 15 + 3 * i;
+			legion_sim_ec[regs->EXT_FAN_ACC_BASE + i] = 2;
+			legion_sim_ec[regs->EXT_FAN_DEC_BASE + i] = 2;
+			legion_sim_ec[regs->EXT_CPU_TEMP + i] = 45 + 5 * i;
+			legion_sim_ec[regs->EXT_CPU_TEMP_HYST + i] = 40 + 5 * i;
+			legion_sim_ec[regs->EXT_GPU_TEMP + i] = 45 + 5 * i;
+			legion_sim_ec[regs->EXT_GPU_TEMP_HYST + i] = 40 + 5 * i;
+			legion_sim_ec[regs->EXT_VRM_TEMP + i] = 45 + 5 * i;
+			legion_sim_ec[regs->EXT_VRM_TEMP_HYST + i] = 40 + 5 * i;
+		}
+	}
+}
+
+static int legion_sim_init(void)
+{
+	if (!simulate)
+		return 0;
+
+	legion_sim_ec = vzalloc(LEGION_SIM_EC_SIZE);
+	if (!legion_sim_ec)
+		return -ENOMEM;
+	pr_info("Simulating model %s; no hardware is accessed\n", simulate);
+	return 0;
+}
+
+static void legion_sim_exit(void)
+{
+	vfree(legion_sim_ec);
+	legion_sim_ec = NULL;
+}
+
 /* =================================== */
 /* EC RAM Access with memory mapped IO */
 /* =================================== */
@@ -2623,6 +3037,8 @@ static void ecram_memoryio_exit(struct ecram_memoryio *ec_memoryio)
 static ssize_t ecram_memoryio_read(const struct ecram_memoryio *ec_memoryio,
 				   u16 ec_offset, u8 *value)
 {
+	if (!ec_memoryio->virtual_start)
+		return -ENODEV;
 	if (ec_offset < ec_memoryio->physical_ec_start) {
 		pr_info("Unexpected read at offset %d into EC RAM\n",
 			ec_offset);
@@ -2687,6 +3103,9 @@ static __maybe_unused ssize_t ecram_memoryio_write(const struct ecram_memoryio *
 // Name used to request ports
 #define ECRAM_PORTIO_NAME "legion"
 
+// Timeout to get the ACPI global lock
+#define ECRAM_PORTIO_GLOBAL_LOCK_TIMEOUT_MS 100
+
 struct ecram_portio {
 	/* protects read/write to EC RAM performed
 	 * as a certain sequence of outb, inb
@@ -2694,11 +3113,38 @@ struct ecram_portio {
 	 * be at most one.
 	 */
 	struct mutex io_port_mutex;
+	// The ACPI global lock additionally protects against
+	// the ACPI firmware using the same ports.
+	bool global_lock_available;
+	bool global_lock_held;
+	u32 global_lock_handle;
+	// task that holds the lock for several accesses, see ecram_hold
+	struct task_struct *holder;
+
+	// statistics; protected by io_port_mutex
+	u64 lock_count;
+	// number of times io_port_mutex was held by another caller
+	u64 lock_contended;
+	u64 lock_wait_ns_total;
+	u64 lock_wait_ns_max;
+	u64 global_lock_wait_ns_total;
+	u64 global_lock_failures;
+
+	// EC RAM of a KUnit test; used instead of the IO ports and the
+	// simulated EC if set before ecram_portio_init
+	u8 *mock_ec;
 };
 
+// No IO ports are used for a mock or the simulated EC
+static bool ecram_portio_uses_ports(struct ecram_portio *ec_portio)
+{
+	return !ec_portio->mock_ec && !legion_sim_active();
+}
+
 static ssize_t ecram_portio_init(struct ecram_portio *ec_portio)
 {
-	if (!request_region(ECRAM_PORTIO_START_PORT, ECRAM_PORTIO_PORTS_SIZE,
+	if (ecram_portio_uses_ports(ec_portio) &&
+	    !request_region(ECRAM_PORTIO_START_PORT, ECRAM_PORTIO_PORTS_SIZE,
 			    ECRAM_PORTIO_NAME)) {
 		pr_info("Cannot init ecram_portio the %x ports starting at %x\n",
 			ECRAM_PORTIO_PORTS_SIZE, ECRAM_PORTIO_START_PORT);
@@ -2706,24 +3152,77 @@ static ssize_t ecram_portio_init(struct ecram_portio *ec_portio)
 	}
 	//pr_info("Reserved %x ports starting at %x\n", ECRAM_PORTIO_PORTS_SIZE, ECRAM_PORTIO_START_PORT);
 	mutex_init(&ec_portio->io_port_mutex);
+	ec_portio->global_lock_available =
+		ec_acpi_global_lock && ecram_portio_uses_ports(ec_portio);
 	return 0;
 }
 
 static void ecram_portio_exit(struct ecram_portio *ec_portio)
 {
-	release_region(ECRAM_PORTIO_START_PORT, ECRAM_PORTIO_PORTS_SIZE);
+	if (ecram_portio_uses_ports(ec_portio))
+		release_region(ECRAM_PORTIO_START_PORT,
+			       ECRAM_PORTIO_PORTS_SIZE);
 }
 
-/* Read a byte from the EC RAM.
+/* Get exclusive access to the IO ports for a sequence of EC RAM accesses.
  *
- * Return status because of commong signature for alle
- * methods to access EC RAM.
+ * Returns -EBUSY if the ACPI global lock cannot be taken in time, since
+ * the firmware might then use the ports at the same time.
  */
-static ssize_t ecram_portio_read(struct ecram_portio *ec_portio, u16 offset,
-				 u8 *value)
+static int ecram_portio_lock(struct ecram_portio *ec_portio)
 {
-	mutex_lock(&ec_portio->io_port_mutex);
+	ktime_t start = ktime_get();
+	ktime_t global_lock_start;
+	bool contended;
+	acpi_status status;
+	u64 wait_ns;
+
+	contended = !mutex_trylock(&ec_portio->io_port_mutex);
+	if (contended)
+		mutex_lock(&ec_portio->io_port_mutex);
+
+	ec_portio->global_lock_held = false;
+	if (ec_portio->global_lock_available) {
+		global_lock_start = ktime_get();
+		status = acpi_acquire_global_lock(
+			ECRAM_PORTIO_GLOBAL_LOCK_TIMEOUT_MS,
+			&ec_portio->global_lock_handle);
+		ec_portio->global_lock_wait_ns_total +=
+			ktime_to_ns(ktime_sub(ktime_get(), global_lock_start));
+		// also succeeds if the firmware has no global lock, so then
+		// this only costs the call
+		if (ACPI_SUCCESS(status)) {
+			ec_portio->global_lock_held = true;
+		} else {
+			ec_portio->global_lock_failures++;
+			mutex_unlock(&ec_portio->io_port_mutex);
+			pr_info_ratelimited("Failed to get ACPI global lock: %s\n",
+					    acpi_format_exception(status));
+			return -EBUSY;
+		}
+	}
+
+	wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	ec_portio->lock_count++;
+	if (contended)
+		ec_portio->lock_contended++;
+	ec_portio->lock_wait_ns_total += wait_ns;
+	ec_portio->lock_wait_ns_max = max(ec_portio->lock_wait_ns_max, wait_ns);
+	return 0;
+}
+
+static void ecram_portio_unlock(struct ecram_portio *ec_portio)
+{
+	if (ec_portio->global_lock_held) {
+		acpi_release_global_lock(ec_portio->global_lock_handle);
+		ec_portio->global_lock_held = false;
+	}
+	mutex_unlock(&ec_portio->io_port_mutex);
+}
 
+// Select the address in EC RAM; ecram_portio_lock must be held
+static void ecram_portio_set_addr_locked(u16 offset)
+{
 	outb(0x2E, ECRAM_PORTIO_ADDR_PORT);
 	outb(0x11, ECRAM_PORTIO_DATA_PORT);
 	outb(0x2F, ECRAM_PORTIO_ADDR_PORT);
@@ -2739,9 +3238,54 @@ static ssize_t ecram_portio_read(struct ecram_portio *ec_portio, u16 offset,
 	outb(0x2E, ECRAM_PORTIO_ADDR_PORT);
 	outb(0x12, ECRAM_PORTIO_DATA_PORT);
 	outb(0x2F, ECRAM_PORTIO_ADDR_PORT);
-	*value = inb(ECRAM_PORTIO_DATA_PORT);
+}
 
-	mutex_unlock(&ec_portio->io_port_mutex);
+static u8 ecram_portio_read_locked(struct ecram_portio *ec_portio, u16 offset)
+{
+	if (ec_portio->mock_ec)
+		return ec_portio->mock_ec[offset];
+	if (legion_sim_active())
+		return legion_sim_ec_read(offset);
+	ecram_portio_set_addr_locked(offset);
+	return inb(ECRAM_PORTIO_DATA_PORT);
+}
+
+static void ecram_portio_write_locked(struct ecram_portio *ec_portio,
+				      u16 offset, u8 value)
+{
+	if (ec_portio->mock_ec) {
+		ec_portio->mock_ec[offset] = value;
+		return;
+	}
+	if (legion_sim_active()) {
+		legion_sim_ec_write(offset, value);
+		return;
+	}
+	ecram_portio_set_addr_locked(offset);
+	outb(value, ECRAM_PORTIO_DATA_PORT);
+}
+
+/* Read a byte from the EC RAM.
+ *
+ * Return status because of commong signature for alle
+ * methods to access EC RAM.
+ */
+static ssize_t ecram_portio_read(struct ecram_portio *ec_portio, u16 offset,
+				 u8 *value)
+{
+	bool held = READ_ONCE(ec_portio->holder) == current;
+	int err;
+
+	if (!held) {
+		err = ecram_portio_lock(ec_portio);
+		if (err) {
+			*value = 0;
+			return err;
+		}
+	}
+	*value = ecram_portio_read_locked(ec_portio, offset);
+	if (!held)
+		ecram_portio_unlock(ec_portio);
 	return 0;
 }
 
@@ -2753,26 +3297,17 @@ static ssize_t ecram_portio_read(struct ecram_portio *ec_portio, u16 offset,
 static ssize_t ecram_portio_write(struct ecram_portio *ec_portio, u16 offset,
 				  u8 value)
 {
-	mutex_lock(&ec_portio->io_port_mutex);
-
-	outb(0x2E, ECRAM_PORTIO_ADDR_PORT);
-	outb(0x11, ECRAM_PORTIO_DATA_PORT);
-	outb(0x2F, ECRAM_PORTIO_ADDR_PORT);
-	// TODO: no explicit cast between types seems to be sometimes
-	// done and sometimes not
-	outb((u8)((offset >> 8) & 0xFF), ECRAM_PORTIO_DATA_PORT);
-
-	outb(0x2E, ECRAM_PORTIO_ADDR_PORT);
-	outb(0x10, ECRAM_PORTIO_DATA_PORT);
-	outb(0x2F, ECRAM_PORTIO_ADDR_PORT);
-	outb((u8)(offset & 0xFF), ECRAM_PORTIO_DATA_PORT);
-
-	outb(0x2E, ECRAM_PORTIO_ADDR_PORT);
-	outb(0x12, ECRAM_PORTIO_DATA_PORT);
-	outb(0x2F, ECRAM_PORTIO_ADDR_PORT);
-	outb(value, ECRAM_PORTIO_DATA_PORT);
+	bool held = READ_ONCE(ec_portio->holder) == current;
+	int err;
 
-	mutex_unlock(&ec_portio->io_port_mutex);
+	if (!held) {
+		err = ecram_portio_lock(ec_portio);
+		if (err)
+			return err;
+	}
+	ecram_portio_write_locked(ec_portio, offset, value);
+	if (!held)
+		ecram_portio_unlock(ec_portio);
 	// TODO: remove this
 	//pr_info("Writing %d to addr %x\n", value, offset);
 	return 0;
@@ -2784,6 +3319,8 @@ static ssize_t ecram_portio_write(struct ecram_portio *ec_portio, u16 offset,
 
 struct ecram {
 	struct ecram_portio portio;
+	// skip all writes; initialized from ec_readonly
+	bool readonly;
 };
 
 static ssize_t ecram_init(struct ecram *ecram,
@@ -2792,6 +3329,7 @@ static ssize_t ecram_init(struct ecram *ecram,
 {
 	ssize_t err;
 
+	ecram->readonly = ec_readonly;
 	err = ecram_portio_init(&ecram->portio);
 	if (err) {
 		pr_info("Failed ecram_portio_init\n");
@@ -2829,89 +3367,301 @@ static void ecram_write(struct ecram *ecram, u16 ecram_offset, u8 value)
 {
 	int err;
 
-	if (ec_readonly) {
+	if (ecram->readonly) {
 		pr_info("Skipping writing EC RAM to 0x%x: Read-Only.\n",
 			ecram_offset);
 		return;
 	}
 	err = ecram_portio_write(&ecram->portio, ecram_offset, value);
 	if (err)
-		pr_info("Error writing EC RAM to 0x%x: Read-Only.\n",
-			ecram_offset);
+		pr_info("Error writing EC RAM to 0x%x: %d\n", ecram_offset,
+			err);
 }
 
-/* =============================== */
-/* Reads from EC  */
-/* ===============================  */
-
-static u16 read_ec_id(struct ecram *ecram, const struct model_config *model)
+/* Keep EC RAM locked for the following ecram_read and ecram_write calls
+ * of the current task until ecram_release, so the ACPI global lock is
+ * taken only once for e.g. reading a whole fan curve.
+ */
+static int ecram_hold(struct ecram *ecram)
 {
-	u8 id1 = ecram_read(ecram, model->registers->ECHIPID1);
-	u8 id2 = ecram_read(ecram, model->registers->ECHIPID2);
+	int err;
 
-	return (id1 << 8) + id2;
+	err = ecram_portio_lock(&ecram->portio);
+	if (err)
+		return err;
+	WRITE_ONCE(ecram->portio.holder, current);
+	return 0;
 }
 
-static u16 read_ec_version(struct ecram *ecram,
-			   const struct model_config *model)
+static void ecram_release(struct ecram *ecram)
 {
-	u8 vers = ecram_read(ecram, model->registers->ECHIPVER);
-	u8 debug = ecram_read(ecram, model->registers->ECDEBUG);
-
-	return (vers << 8) + debug;
+	WRITE_ONCE(ecram->portio.holder, NULL);
+	ecram_portio_unlock(&ecram->portio);
 }
 
-/* ============================= */
-/* Data model for sensor values  */
-/* ============================= */
+/* =================================== */
+/* EC RAM transactions                 */
+/* =================================== */
 
-struct sensor_values {
-	u16 fan1_rpm; // current speed in rpm of fan 1
-	u16 fan2_rpm; // current speed in rpm of fan2
-	u16 fan1_target_rpm; // target speed in rpm of fan 1
-	u16 fan2_target_rpm; // target speed in rpm of fan 2
-	u8 cpu_temp_celsius; // cpu temperature in celcius
-	u8 gpu_temp_celsius; // gpu temperature in celcius
-	u8 ic_temp_celsius; // ic temperature in celcius
+// Writes to EC RAM that are queued and then applied while holding the
+// port lock once. Data writes are verified by reading all of them back
+// afterwards. If any does not match, all data writes are rolled back to
+// the previous values and the commit writes are skipped. Prepare writes
+// are never rolled back. For EC layouts whose registers do not always read
+// back the written value, mismatches can be only logged instead.
+#define ECRAM_TRANSACTION_MAX_WRITES 128
+
+enum ecram_transaction_op {
+	// written before the data, e.g. reset update counters; not verified
+	// and not rolled back
+	ECRAM_TRANSACTION_PREPARE,
+	// verified and rolled back on mismatch
+	ECRAM_TRANSACTION_DATA,
+	// written after successful verification, e.g. to make EC use the data
+	ECRAM_TRANSACTION_COMMIT,
+	// like ECRAM_TRANSACTION_COMMIT but sets bits (read-modify-write)
+	ECRAM_TRANSACTION_COMMIT_SET_BITS
 };
 
-enum SENSOR_ATTR {
-	SENSOR_CPU_TEMP_ID = 1,
-	SENSOR_GPU_TEMP_ID = 2,
-	SENSOR_IC_TEMP_ID = 3,
-	SENSOR_FAN1_RPM_ID = 4,
-	SENSOR_FAN2_RPM_ID = 5,
-	SENSOR_FAN1_TARGET_RPM_ID = 6,
-	SENSOR_FAN2_TARGET_RPM_ID = 7,
-	SENSOR_FAN3_RPM_ID = 8,
-	SENSOR_FAN4_RPM_ID = 9
+struct ecram_transaction_entry {
+	u16 offset;
+	u8 value;
+	u8 old_value;
+	u8 op;
 };
 
-/* ============================= */
-/* Data model for fan curve      */
-/* ============================= */
-
-#define MAX_RPM 10000
-
-enum fan_speed_unit {
-	FAN_SPEED_UNIT_PERCENT = 1,
-	FAN_SPEED_UNIT_PWM = 2,
-	FAN_SPEED_UNIT_RPM_HUNDRED = 3,
-	FAN_SPEED_UNIT_PERCENT_NEAREST = 4,
+struct ecram_transaction {
+	struct ecram *ecram;
+	size_t count;
+	bool overflow;
+	// only log mismatches, then continue as if verified
+	bool log_mismatches_only;
+	struct ecram_transaction_entry entries[ECRAM_TRANSACTION_MAX_WRITES];
 };
 
-struct fancurve_point {
-	// rpm1 devided by 100
-	u8 speed1;
-	// rpm2 devided by 100
-	u8 speed2;
-	// >=2 , <=5 (lower is faster); must increase by level
-	u8 accel;
-	// >=2 , <=5 (lower is faster); must increase by level
-	u8 decel;
+static struct ecram_transaction *ecram_transaction_begin(struct ecram *ecram)
+{
+	struct ecram_transaction *tx = kzalloc(sizeof(*tx), GFP_KERNEL);
 
-	// min must be lower than or equal to max
-	// last level max must be 127
+	if (tx)
+		tx->ecram = ecram;
+	return tx;
+}
+
+static void ecram_transaction_free(struct ecram_transaction *tx)
+{
+	kfree(tx);
+}
+
+static void ecram_transaction_add(struct ecram_transaction *tx,
+				  enum ecram_transaction_op op, u16 offset,
+				  u8 value)
+{
+	struct ecram_transaction_entry *entry;
+
+	if (tx->count >= ECRAM_TRANSACTION_MAX_WRITES) {
+		tx->overflow = true;
+		return;
+	}
+	entry = &tx->entries[tx->count++];
+	entry->offset = offset;
+	entry->value = value;
+	entry->op = op;
+}
+
+static void ecram_transaction_write(struct ecram_transaction *tx, u16 offset,
+				    u8 value)
+{
+	ecram_transaction_add(tx, ECRAM_TRANSACTION_DATA, offset, value);
+}
+
+static void ecram_transaction_prepare(struct ecram_transaction *tx, u16 offset,
+				      u8 value)
+{
+	ecram_transaction_add(tx, ECRAM_TRANSACTION_PREPARE, offset, value);
+}
+
+static void ecram_transaction_commit(struct ecram_transaction *tx, u16 offset,
+				     u8 value)
+{
+	ecram_transaction_add(tx, ECRAM_TRANSACTION_COMMIT, offset, value);
+}
+
+static void ecram_transaction_commit_set_bits(struct ecram_transaction *tx,
+					      u16 offset, u8 bits)
+{
+	ecram_transaction_add(tx, ECRAM_TRANSACTION_COMMIT_SET_BITS, offset,
+			      bits);
+}
+
+/* Apply all queued writes.
+ *
+ * Returns 0 on success, -EIO if verification failed and the data was
+ * rolled back (unless log_mismatches_only is set), -EROFS if EC RAM is
+ * read-only, -E2BIG if too many writes were queued and -EBUSY if the
+ * ACPI global lock could not be taken. Nothing is written in the latter
+ * three cases.
+ */
+static int ecram_transaction_apply(struct ecram_transaction *tx)
+{
+	struct ecram_portio *ec_portio = &tx->ecram->portio;
+	struct ecram_transaction_entry *entry;
+	size_t mismatches = 0;
+	size_t i;
+	u8 value;
+	int err = 0;
+
+	if (tx->overflow) {
+		pr_info("Too many writes in EC transaction\n");
+		return -E2BIG;
+	}
+	if (tx->ecram->readonly) {
+		pr_info("Skipping EC transaction: Read-Only.\n");
+		return -EROFS;
+	}
+
+	// the global lock is taken once for all writes
+	err = ecram_portio_lock(ec_portio);
+	if (err)
+		return err;
+
+	for (i = 0; i < tx->count; ++i) {
+		entry = &tx->entries[i];
+		if (entry->op == ECRAM_TRANSACTION_DATA)
+			entry->old_value = ecram_portio_read_locked(
+				ec_portio, entry->offset);
+	}
+
+	for (i = 0; i < tx->count; ++i) {
+		entry = &tx->entries[i];
+		if (entry->op == ECRAM_TRANSACTION_PREPARE)
+			ecram_portio_write_locked(ec_portio, entry->offset,
+						  entry->value);
+	}
+	for (i = 0; i < tx->count; ++i) {
+		entry = &tx->entries[i];
+		if (entry->op == ECRAM_TRANSACTION_DATA)
+			ecram_portio_write_locked(ec_portio, entry->offset,
+						  entry->value);
+	}
+
+	// single verification pass after all data is written
+	for (i = 0; i < tx->count; ++i) {
+		entry = &tx->entries[i];
+		if (entry->op == ECRAM_TRANSACTION_DATA &&
+		    ecram_portio_read_locked(ec_portio, entry->offset) !=
+			    entry->value)
+			mismatches++;
+	}
+
+	if (mismatches && !tx->log_mismatches_only) {
+		// in reverse order, so the oldest value wins for addresses
+		// written multiple times
+		for (i = tx->count; i-- > 0;) {
+			entry = &tx->entries[i];
+			if (entry->op == ECRAM_TRANSACTION_DATA)
+				ecram_portio_write_locked(ec_portio,
+							  entry->offset,
+							  entry->old_value);
+		}
+		err = -EIO;
+		goto unlock;
+	}
+
+	for (i = 0; i < tx->count; ++i) {
+		entry = &tx->entries[i];
+		if (entry->op == ECRAM_TRANSACTION_COMMIT) {
+			ecram_portio_write_locked(ec_portio, entry->offset,
+						  entry->value);
+		} else if (entry->op == ECRAM_TRANSACTION_COMMIT_SET_BITS) {
+			value = ecram_portio_read_locked(ec_portio,
+							 entry->offset);
+			ecram_portio_write_locked(ec_portio, entry->offset,
+						  value | entry->value);
+		}
+	}
+
+unlock:
+	ecram_portio_unlock(ec_portio);
+	if (mismatches)
+		pr_info("EC transaction: %zu of %zu writes not verified%s\n",
+			mismatches, tx->count,
+			tx->log_mismatches_only ? "" : "; rolled back");
+	return err;
+}
+
+/* =============================== */
+/* Reads from EC  */
+/* ===============================  */
+
+static u16 read_ec_id(struct ecram *ecram, const struct model_config *model)
+{
+	u8 id1 = ecram_read(ecram, model->registers->ECHIPID1);
+	u8 id2 = ecram_read(ecram, model->registers->ECHIPID2);
+
+	return (id1 << 8) + id2;
+}
+
+static u16 read_ec_version(struct ecram *ecram,
+			   const struct model_config *model)
+{
+	u8 vers = ecram_read(ecram, model->registers->ECHIPVER);
+	u8 debug = ecram_read(ecram, model->registers->ECDEBUG);
+
+	return (vers << 8) + debug;
+}
+
+/* ============================= */
+/* Data model for sensor values  */
+/* ============================= */
+
+struct sensor_values {
+	u16 fan1_rpm; // current speed in rpm of fan 1
+	u16 fan2_rpm; // current speed in rpm of fan2
+	u16 fan1_target_rpm; // target speed in rpm of fan 1
+	u16 fan2_target_rpm; // target speed in rpm of fan 2
+	u8 cpu_temp_celsius; // cpu temperature in celcius
+	u8 gpu_temp_celsius; // gpu temperature in celcius
+	u8 ic_temp_celsius; // ic temperature in celcius
+};
+
+enum SENSOR_ATTR {
+	SENSOR_CPU_TEMP_ID = 1,
+	SENSOR_GPU_TEMP_ID = 2,
+	SENSOR_IC_TEMP_ID = 3,
+	SENSOR_FAN1_RPM_ID = 4,
+	SENSOR_FAN2_RPM_ID = 5,
+	SENSOR_FAN1_TARGET_RPM_ID = 6,
+	SENSOR_FAN2_TARGET_RPM_ID = 7,
+	SENSOR_FAN3_RPM_ID = 8,
+	SENSOR_FAN4_RPM_ID = 9
+};
+
+/* ============================= */
+/* Data model for fan curve      */
+/* ============================= */
+
+#define MAX_RPM 10000
+
+enum fan_speed_unit {
+	FAN_SPEED_UNIT_PERCENT = 1,
+	FAN_SPEED_UNIT_PWM = 2,
+	FAN_SPEED_UNIT_RPM_HUNDRED = 3,
+	FAN_SPEED_UNIT_PERCENT_NEAREST = 4,
+};
+
+struct fancurve_point {
+	// rpm1 devided by 100
+	u8 speed1;
+	// rpm2 devided by 100
+	u8 speed2;
+	// >=2 , <=5 (lower is faster); must increase by level
+	u8 accel;
+	// >=2 , <=5 (lower is faster); must increase by level
+	u8 decel;
+
+	// min must be lower than or equal to max
+	// last level max must be 127
 	// <=127 cpu max temp for this level; must increase by level
 	u8 cpu_max_temp_celsius;
 	// <=127 cpu min temp for this level; must increase by level
@@ -3188,18 +3938,140 @@ static ssize_t fancurve_print_seqfile(const struct fancurve *fancurve,
 struct light {
 	bool initialized;
 	struct led_classdev led;
+	struct legion_private *priv;
+	// cached brightness; updated on writes and on WMI events
 	unsigned int last_brightness;
+	// serializes writes with the refresh after WMI events so that
+	// last_brightness matches the hardware
+	struct mutex mutex;
+	// light is accessed via EC register and not via WMI
+	bool ec_access;
 	u8 light_id;
 	unsigned int lower_limit;
 	unsigned int upper_limit;
 };
 
+// States counted by the throttling statistics
+enum legion_throttle_state {
+	// fan at highest point of fan curve
+	LEGION_THROTTLE_FAN_SATURATED,
+	LEGION_THROTTLE_CPU_TEMP_LIMIT,
+	LEGION_THROTTLE_GPU_TEMP_LIMIT,
+	LEGION_THROTTLE_FULLSPEED,
+	// fan more than 10 % below its target speed, e.g. while spinning up
+	LEGION_THROTTLE_FAN_LAGGING,
+	LEGION_THROTTLE_STATE_MAX
+};
+
+// Power modes the throttling statistics are kept for
+enum legion_throttle_profile {
+	LEGION_THROTTLE_PROFILE_QUIET,
+	LEGION_THROTTLE_PROFILE_BALANCED,
+	LEGION_THROTTLE_PROFILE_PERFORMANCE,
+	LEGION_THROTTLE_PROFILE_EXTREME,
+	LEGION_THROTTLE_PROFILE_CUSTOM,
+	LEGION_THROTTLE_PROFILE_UNKNOWN,
+	LEGION_THROTTLE_PROFILE_MAX
+};
+
+struct legion_throttle_counters {
+	u64 samples;
+	u64 time_ms;
+	// number of times a state was entered
+	u64 entered[LEGION_THROTTLE_STATE_MAX];
+	u64 state_ms[LEGION_THROTTLE_STATE_MAX];
+	// changes of thermalmode reported by firmware
+	u64 thermalmode_changes;
+};
+
+struct legion_throttle_stats {
+	// protects all members
+	struct mutex mutex;
+	struct legion_throttle_counters counters[LEGION_THROTTLE_PROFILE_MAX];
+	ktime_t reset_time;
+	ktime_t last_sample;
+	unsigned long last_states;
+	unsigned long last_thermalmode;
+	bool last_valid;
+	// temperature limits of CPU and GPU (0 if unknown) in power mode
+	// temp_limits_powermode; they only change with the power mode, so
+	// they are only read again when it changes or a limit is written
+	int temp_limits[2];
+	int temp_limits_powermode;
+	bool temp_limits_valid;
+};
+
+#define LEGION_FAN_HEALTH_FANS 2
+// fans are within this many percent of the target when settled
+#define LEGION_FAN_HEALTH_SETTLED_PERCENT 5
+// target not reached within this time is counted as timeout
+#define LEGION_FAN_HEALTH_SETTLE_TIMEOUT_MS 60000
+#define LEGION_FAN_HEALTH_RPM_STEP 500
+#define LEGION_FAN_HEALTH_RPM_BUCKETS 12
+
+// Statistics of one fan at one fan curve level
+struct legion_fan_level_stats {
+	u64 samples;
+	u64 rpm_sum;
+	u64 target_sum;
+	// number of times the target speed of this level was reached and
+	// the time it took in total
+	u64 settle_count;
+	u64 settle_ms;
+	u64 settle_timeouts;
+};
+
+// Temperature reached at a fan speed of one RPM bucket
+struct legion_fan_rpm_stats {
+	u64 samples;
+	u64 temp_sum;
+};
+
+struct legion_fan_health {
+	// protects all members
+	struct mutex mutex;
+	struct legion_fan_level_stats levels[LEGION_FAN_HEALTH_FANS]
+					    [MAXFANCURVESIZE];
+	struct legion_fan_rpm_stats rpm[LEGION_FAN_HEALTH_FANS]
+				       [LEGION_FAN_HEALTH_RPM_BUCKETS];
+	// tracking of the time to reach a new target speed
+	int last_target[LEGION_FAN_HEALTH_FANS];
+	int settle_level[LEGION_FAN_HEALTH_FANS];
+	ktime_t settle_start[LEGION_FAN_HEALTH_FANS];
+	bool settling[LEGION_FAN_HEALTH_FANS];
+};
+
+// Power limits of CPU and GPU that can be set by the firmware
+enum legion_powerlimit_id {
+	LEGION_POWERLIMIT_CPU_SHORTTERM = 0,
+	LEGION_POWERLIMIT_CPU_LONGTERM,
+	LEGION_POWERLIMIT_CPU_PEAK,
+	LEGION_POWERLIMIT_CPU_APU_SPPT,
+	LEGION_POWERLIMIT_CPU_CROSS_LOADING,
+	LEGION_POWERLIMIT_GPU_CTGP,
+	LEGION_POWERLIMIT_GPU_PPAB,
+	LEGION_POWERLIMIT_MAX
+};
+
+struct legion_capabilities {
+	// bits of enum legion_capability
+	unsigned long flags;
+	// bits of indices in legion_other_method_features
+	unsigned long other_method;
+	unsigned int fan_count;
+	// number of points of fan curve; 0 if it cannot be read
+	size_t fancurve_size;
+	// true when the slow, deferred part (fan curve and Other Method
+	// features) is done
+	bool probed;
+};
+
 /* =============================  */
 /* Global and shared data between */
 /* all calls to this module       */
 /* =============================  */
-// Implemented like ideapad-laptop.c but currently still
-// without dynamic memory allocation (instead global _priv)
+// Implemented like ideapad-laptop.c: allocated per platform device
+// with devm_kzalloc
 struct legion_private {
 	struct platform_device *platform_device;
 	// TODO: remove or keep? init?
@@ -3209,6 +4081,12 @@ struct legion_private {
 	struct ecram ecram;
 	// Configuration with registers and ECRAM access method
 	const struct model_config *conf;
+	// Capabilities determined when loading
+	struct legion_capabilities caps;
+
+	// last GPU temperature read from firmware; see read_gpu_temperature
+	int gpu_temp_cached;
+	bool gpu_temp_cached_valid;
 
 	// TODO: maybe refactor and keep only local to each function
 	// last known fan curve
@@ -3234,38 +4112,91 @@ struct legion_private {
 	struct light ylogo_light;
 	struct light iport_light;
 
-	// TODO: remove?
-	bool loaded;
+	// powercap control type and zones for power limits
+	struct legion_powercap *powercap;
+
+	// power limits written by user space but not yet written to firmware
+	// (see powerlimit_writeback_ms)
+	unsigned long powerlimit_pending;
+	int powerlimit_pending_value[LEGION_POWERLIMIT_MAX];
+	bool powerlimit_writeback_stopped;
+	struct delayed_work powerlimit_work;
+
+	// deferred part of probing, see legion_deferred_probe
+	struct work_struct probe_work;
+
+	// sampling for throttle_stats and fan_health
+	struct delayed_work throttle_work;
+	// sampler was started and is restarted on resume
+	bool throttle_started;
+	struct legion_throttle_stats throttle;
+	struct legion_fan_health fan_health;
+
+	// generated pwmX_auto_pointY_* attributes of hwmon_dev
+	struct attribute_group hwmon_autopoint_group;
+	// groups hwmon_dev is registered with
+	const struct attribute_group *hwmon_groups[4];
+	// limits and results of last write to powerlimits or writeback
+	unsigned long powerlimits_written;
+	int powerlimits_results[LEGION_POWERLIMIT_MAX];
+
+	// thermal cooling device on top of the fan curve
+	struct thermal_cooling_device *cooling_dev;
+	// current state of the cooling device; 0 means untouched fan curve
+	unsigned long cooling_state;
+	// number of fan curve points when the cooling device was registered
+	size_t cooling_curve_size;
+	// fan curve before it was changed by the cooling device
+	struct fancurve cooling_base;
+	bool cooling_base_valid;
+
+	// delayed notification of userspace after a WMI event
+	struct delayed_work notify_work;
+	// delayed refresh of the cached light states after a WMI event
+	struct delayed_work light_work;
 
 	// TODO: remove, only for reverse enginnering
 	struct ecram_memoryio ec_memoryio;
 };
 
+static void powerlimit_writeback_work(struct work_struct *work);
+static void legion_wmi_notify_work(struct work_struct *work);
+static void legion_light_refresh_work(struct work_struct *work);
+static void legion_throttle_init(struct legion_private *priv);
+
 // keep state of fancurve defaults powermode
 static int fancurve_defaults_powermode;
 
-// shared between different drivers: WMI, platform and protected by mutex
-static struct legion_private *legion_shared;
-static struct legion_private _priv;
+// Shared between different drivers: WMI, platform. Readers (WMI events,
+// netlink) only take rcu_read_lock; the mutex only serializes publishing
+// and unpublishing.
+static struct legion_private __rcu *legion_shared;
 static DEFINE_MUTEX(legion_shared_mutex);
 
 static int legion_shared_init(struct legion_private *priv)
 {
 	int ret;
 
-	mutex_lock(&legion_shared_mutex);
+	mutex_init(&priv->fancurve_mutex);
+	priv->fancurve_valid = false;
+	priv->powerlimit_pending = 0;
+	priv->powerlimit_writeback_stopped = false;
+	INIT_DELAYED_WORK(&priv->powerlimit_work, powerlimit_writeback_work);
+	INIT_DELAYED_WORK(&priv->notify_work, legion_wmi_notify_work);
+	INIT_DELAYED_WORK(&priv->light_work, legion_light_refresh_work);
+	mutex_init(&priv->kbd_bl.mutex);
+	mutex_init(&priv->ylogo_light.mutex);
+	mutex_init(&priv->iport_light.mutex);
+	legion_throttle_init(priv);
 
-	if (!legion_shared) {
-		legion_shared = priv;
-		mutex_init(&legion_shared->fancurve_mutex);
-		priv->fancurve_valid = false;
+	mutex_lock(&legion_shared_mutex);
+	if (!rcu_access_pointer(legion_shared)) {
+		rcu_assign_pointer(legion_shared, priv);
 		ret = 0;
 	} else {
 		pr_warn("Found multiple platform devices\n");
 		ret = -EINVAL;
 	}
-
-	priv->loaded = true;
 	mutex_unlock(&legion_shared_mutex);
 
 	return ret;
@@ -3275,11 +4206,15 @@ static void legion_shared_exit(struct legion_private *priv)
 {
 	pr_info("Unloading legion shared\n");
 	mutex_lock(&legion_shared_mutex);
-
-	if (legion_shared == priv)
-		legion_shared = NULL;
-
+	if (rcu_access_pointer(legion_shared) == priv)
+		RCU_INIT_POINTER(legion_shared, NULL);
 	mutex_unlock(&legion_shared_mutex);
+
+	// wait for WMI events that still see priv; afterwards they cannot
+	// schedule the notification anymore
+	synchronize_rcu();
+	cancel_delayed_work_sync(&priv->notify_work);
+	cancel_delayed_work_sync(&priv->light_work);
 	pr_info("Unloading legion shared done\n");
 }
 
@@ -3345,6 +4280,289 @@ static int set_simple_wmi_attribute(struct legion_private *priv,
 	return err;
 }
 
+/* ============================= */
+/* Power limits reading/writing  */
+/* ============================= */
+
+struct legion_powerlimit_desc {
+	const char *name;
+	// feature id if access method is ACCESS_METHOD_WMI3
+	enum OtherMethodFeature feature_id;
+	// WMI method otherwise
+	const char *guid;
+	u32 method_id_get;
+	u32 method_id_set;
+	// result of get method is a buffer instead of an int
+	bool get_from_buffer;
+	// range in watt; same as used by the python tools. The firmware does
+	// not report it, so it is only a guess that is enforced for the
+	// powerlimits attribute, powercap and netlink, but not for the older
+	// *_powerlimit attributes.
+	unsigned int min_watts;
+	unsigned int max_watts;
+};
+
+static const struct legion_powerlimit_desc
+	legion_powerlimits[LEGION_POWERLIMIT_MAX] = {
+	[LEGION_POWERLIMIT_CPU_SHORTTERM] = {
+		.name = "cpu_shortterm",
+		.feature_id = OtherMethodFeature_CPU_SHORT_TERM_POWER_LIMIT,
+		.guid = WMI_GUID_LENOVO_CPU_METHOD,
+		.method_id_get = WMI_METHOD_ID_CPU_GET_SHORTTERM_POWERLIMIT,
+		.method_id_set = WMI_METHOD_ID_CPU_SET_SHORTTERM_POWERLIMIT,
+		.get_from_buffer = true,
+		.min_watts = 5,
+		.max_watts = 200,
+	},
+	[LEGION_POWERLIMIT_CPU_LONGTERM] = {
+		.name = "cpu_longterm",
+		.feature_id = OtherMethodFeature_CPU_LONG_TERM_POWER_LIMIT,
+		.guid = WMI_GUID_LENOVO_CPU_METHOD,
+		.method_id_get = WMI_METHOD_ID_CPU_GET_LONGTERM_POWERLIMIT,
+		.method_id_set = WMI_METHOD_ID_CPU_SET_LONGTERM_POWERLIMIT,
+		.get_from_buffer = true,
+		.min_watts = 5,
+		.max_watts = 200,
+	},
+	[LEGION_POWERLIMIT_CPU_PEAK] = {
+		.name = "cpu_peak",
+		.feature_id = OtherMethodFeature_CPU_PEAK_POWER_LIMIT,
+		.guid = WMI_GUID_LENOVO_GPU_METHOD,
+		.method_id_get = WMI_METHOD_ID_CPU_GET_PEAK_POWERLIMIT,
+		.method_id_set = WMI_METHOD_ID_CPU_SET_PEAK_POWERLIMIT,
+		.get_from_buffer = false,
+		.min_watts = 0,
+		.max_watts = 200,
+	},
+	[LEGION_POWERLIMIT_CPU_APU_SPPT] = {
+		.name = "cpu_apu_sppt",
+		.feature_id = OtherMethodFeature_APU_PPT_POWER_LIMIT,
+		.guid = WMI_GUID_LENOVO_GPU_METHOD,
+		.method_id_get = WMI_METHOD_ID_CPU_GET_APU_SPPT_POWERLIMIT,
+		.method_id_set = WMI_METHOD_ID_CPU_SET_APU_SPPT_POWERLIMIT,
+		.get_from_buffer = false,
+		.min_watts = 0,
+		.max_watts = 100,
+	},
+	[LEGION_POWERLIMIT_CPU_CROSS_LOADING] = {
+		.name = "cpu_cross_loading",
+		.feature_id = OtherMethodFeature_CPU_CROSS_LOAD_POWER_LIMIT,
+		.guid = WMI_GUID_LENOVO_GPU_METHOD,
+		.method_id_get = WMI_METHOD_ID_CPU_GET_CROSS_LOADING_POWERLIMIT,
+		.method_id_set = WMI_METHOD_ID_CPU_SET_CROSS_LOADING_POWERLIMIT,
+		.get_from_buffer = false,
+		.min_watts = 0,
+		.max_watts = 100,
+	},
+	[LEGION_POWERLIMIT_GPU_CTGP] = {
+		.name = "gpu_ctgp",
+		.feature_id = OtherMethodFeature_GPU_cTGP,
+		.guid = WMI_GUID_LENOVO_GPU_METHOD,
+		.method_id_get = WMI_METHOD_ID_GPU_GET_CTGP_POWERLIMIT,
+		.method_id_set = WMI_METHOD_ID_GPU_SET_CTGP_POWERLIMIT,
+		.get_from_buffer = true,
+		.min_watts = 0,
+		.max_watts = 200,
+	},
+	[LEGION_POWERLIMIT_GPU_PPAB] = {
+		.name = "gpu_ppab",
+		.feature_id = OtherMethodFeature_GPU_POWER_BOOST,
+		.guid = WMI_GUID_LENOVO_GPU_METHOD,
+		.method_id_get = WMI_METHOD_ID_GPU_GET_PPAB_POWERLIMIT,
+		.method_id_set = WMI_METHOD_ID_GPU_SET_PPAB_POWERLIMIT,
+		.get_from_buffer = true,
+		.min_watts = 0,
+		.max_watts = 200,
+	},
+};
+
+// Firmware clamps limits if long term <= short term <= peak does not hold,
+// so power limits are written along this order (see write_powerlimits)
+static const enum legion_powerlimit_id legion_powerlimit_order[] = {
+	LEGION_POWERLIMIT_CPU_LONGTERM,	    LEGION_POWERLIMIT_CPU_SHORTTERM,
+	LEGION_POWERLIMIT_CPU_PEAK,	    LEGION_POWERLIMIT_CPU_APU_SPPT,
+	LEGION_POWERLIMIT_CPU_CROSS_LOADING, LEGION_POWERLIMIT_GPU_CTGP,
+	LEGION_POWERLIMIT_GPU_PPAB,
+};
+
+// Only call with fancurve_mutex held
+static int read_powerlimit(struct legion_private *priv,
+			   enum legion_powerlimit_id id, int *value)
+{
+	const struct legion_powerlimit_desc *desc = &legion_powerlimits[id];
+	unsigned long res;
+	int err;
+
+	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
+		return wmi_other_method_get_value(desc->feature_id, value);
+
+	if (desc->get_from_buffer)
+		err = wmi_exec_noarg_int_or_buffer(desc->guid, 0,
+						   desc->method_id_get, 16, 0,
+						   &res);
+	else
+		err = get_simple_wmi_attribute(priv, desc->guid, 0,
+					       desc->method_id_get, false, 1,
+					       &res);
+	if (!err)
+		*value = res;
+	return err;
+}
+
+static int check_powerlimit(enum legion_powerlimit_id id, int value)
+{
+	const struct legion_powerlimit_desc *desc = &legion_powerlimits[id];
+
+	if (value < (int)desc->min_watts || value > (int)desc->max_watts)
+		return -EINVAL;
+	return 0;
+}
+
+// Only call with fancurve_mutex held
+static int write_powerlimit(struct legion_private *priv,
+			    enum legion_powerlimit_id id, int value)
+{
+	const struct legion_powerlimit_desc *desc = &legion_powerlimits[id];
+	int output;
+
+	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
+		return wmi_other_method_set_value(desc->feature_id, value,
+						  &output);
+
+	return set_simple_wmi_attribute(priv, desc->guid, 0,
+					desc->method_id_set, false, 1, value);
+}
+
+// Write several power limits at once. To avoid clamping by the firmware,
+// first all lowered limits are written from the lowest to the highest limit
+// and then all raised limits from the highest to the lowest limit. Limits
+// that do not change are not written. The result for each limit in mask is
+// stored in results. Returns first error.
+// Only call with fancurve_mutex held
+static int write_powerlimits(struct legion_private *priv, unsigned long mask,
+			     const int *values, int *results)
+{
+	unsigned long raised = 0;
+	unsigned long id;
+	int current_value;
+	int i;
+	int err;
+	int ret = 0;
+
+	for (i = 0; i < ARRAY_SIZE(legion_powerlimit_order); ++i) {
+		id = legion_powerlimit_order[i];
+		if (!test_bit(id, &mask))
+			continue;
+		err = read_powerlimit(priv, id, &current_value);
+		if (err || values[id] > current_value) {
+			set_bit(id, &raised);
+			continue;
+		}
+		results[id] = values[id] == current_value ?
+				      0 :
+				      write_powerlimit(priv, id, values[id]);
+	}
+
+	for (i = ARRAY_SIZE(legion_powerlimit_order) - 1; i >= 0; --i) {
+		id = legion_powerlimit_order[i];
+		if (test_bit(id, &raised))
+			results[id] = write_powerlimit(priv, id, values[id]);
+	}
+
+	for_each_set_bit(id, &mask, LEGION_POWERLIMIT_MAX) {
+		if (results[id] && !ret)
+			ret = results[id];
+	}
+	return ret;
+}
+
+// Power limits are slow firmware calls. With powerlimit_writeback_ms
+// set, writes are only recorded and written by powerlimit_writeback_work
+// when no new value was written during this time. Reads return the recorded
+// value until then.
+
+// The results are shown by powerlimits_status, since the writes that
+// recorded the values already returned.
+// Only call with fancurve_mutex held
+static int flush_powerlimits(struct legion_private *priv)
+{
+	unsigned long pending = priv->powerlimit_pending;
+	unsigned long id;
+	int ret;
+
+	if (!pending)
+		return 0;
+
+	priv->powerlimit_pending = 0;
+	ret = write_powerlimits(priv, pending, priv->powerlimit_pending_value,
+				priv->powerlimits_results);
+	priv->powerlimits_written = pending;
+	for_each_set_bit(id, &pending, LEGION_POWERLIMIT_MAX) {
+		if (priv->powerlimits_results[id])
+			pr_info("Could not write power limit %s: %d\n",
+				legion_powerlimits[id].name,
+				priv->powerlimits_results[id]);
+	}
+	return ret;
+}
+
+// Only call with fancurve_mutex held
+static int get_powerlimit(struct legion_private *priv,
+			  enum legion_powerlimit_id id, int *value)
+{
+	if (test_bit(id, &priv->powerlimit_pending)) {
+		*value = priv->powerlimit_pending_value[id];
+		return 0;
+	}
+	return read_powerlimit(priv, id, value);
+}
+
+// Only call with fancurve_mutex held
+static int set_powerlimit(struct legion_private *priv,
+			  enum legion_powerlimit_id id, int value)
+{
+	unsigned int delay_ms = powerlimit_writeback_ms;
+
+	if (!delay_ms || priv->powerlimit_writeback_stopped) {
+		clear_bit(id, &priv->powerlimit_pending);
+		return write_powerlimit(priv, id, value);
+	}
+
+	priv->powerlimit_pending_value[id] = value;
+	set_bit(id, &priv->powerlimit_pending);
+	mod_delayed_work(system_wq, &priv->powerlimit_work,
+			 msecs_to_jiffies(delay_ms));
+	return 0;
+}
+
+static void powerlimit_writeback_work(struct work_struct *work)
+{
+	struct legion_private *priv = container_of(
+		to_delayed_work(work), struct legion_private, powerlimit_work);
+
+	mutex_lock(&priv->fancurve_mutex);
+	flush_powerlimits(priv);
+	mutex_unlock(&priv->fancurve_mutex);
+}
+
+// Write pending power limits now, e.g. before suspend
+static void powerlimit_writeback_sync(struct legion_private *priv)
+{
+	cancel_delayed_work_sync(&priv->powerlimit_work);
+	mutex_lock(&priv->fancurve_mutex);
+	flush_powerlimits(priv);
+	mutex_unlock(&priv->fancurve_mutex);
+}
+
+// Write pending power limits and write all further values immediately
+static void powerlimit_writeback_stop(struct legion_private *priv)
+{
+	mutex_lock(&priv->fancurve_mutex);
+	priv->powerlimit_writeback_stopped = true;
+	mutex_unlock(&priv->fancurve_mutex);
+	powerlimit_writeback_sync(priv);
+}
+
 /* ============================= */
 /* Sensor value reading/writing */
 /* ============================= */
@@ -3671,20 +4889,115 @@ static ssize_t read_temperature(struct legion_private *priv, int sensor_id,
 	}
 }
 
-/* ============================= */
-/* Fancurve reading/writing      */
-/* ============================= */
+// Discrete NVIDIA GPU is in runtime suspend or powered off
+static bool legion_dgpu_is_suspended(void)
+{
+	struct pci_dev *pdev = NULL;
+	bool suspended = false;
 
-/* Fancurve from WMI
- * This allows changing fewer parameters.
- * It is only available on newer models.
+	while ((pdev = pci_get_device(PCI_VENDOR_ID_NVIDIA, PCI_ANY_ID, pdev))) {
+		if ((pdev->class >> 16) != PCI_BASE_CLASS_DISPLAY)
+			continue;
+		suspended = pm_runtime_status_suspended(&pdev->dev) ||
+			    pdev->current_state == PCI_D3cold;
+		pci_dev_put(pdev);
+		break;
+	}
+	return suspended;
+}
+
+/* Read GPU temperature without waking up the dGPU if requested.
+ *
+ * Reading it via ACPI or WMI can resume a runtime suspended dGPU.
+ * With gpu_temp_skip_suspended_dgpu the last value is returned in this
+ * case or -ENODATA if there is none. The EC is always read.
  */
+static ssize_t read_gpu_temperature(struct legion_private *priv,
+				    int *temperature)
+{
+	ssize_t err;
 
-struct wmi_fan_table_read {
-	__le32 fan_table_length;
-	__le32 fan_speed[MAXFANCURVESIZE];
-	__le32 sensor_table_length;
-	__le32 sensor_value[MAXFANCURVESIZE];
+	if (gpu_temp_skip_suspended_dgpu &&
+	    priv->conf->access_method_temperature != ACCESS_METHOD_EC &&
+	    legion_dgpu_is_suspended()) {
+		if (!READ_ONCE(priv->gpu_temp_cached_valid))
+			return -ENODATA;
+		*temperature = READ_ONCE(priv->gpu_temp_cached);
+		return 0;
+	}
+
+	err = read_temperature(priv, 1, temperature);
+	if (!err) {
+		WRITE_ONCE(priv->gpu_temp_cached, *temperature);
+		WRITE_ONCE(priv->gpu_temp_cached_valid, true);
+	}
+	return err;
+}
+
+// All sensor values read in one pass
+struct sensor_record {
+	// CLOCK_MONOTONIC when reading started
+	u64 timestamp_ns;
+	// indexed by enum SENSOR_ATTR; temperatures in celsius, fans in rpm
+	int values[SENSOR_FAN4_RPM_ID + 1];
+	// bits of enum SENSOR_ATTR that could be read
+	unsigned long valid;
+};
+
+static void sensor_record_set(struct sensor_record *record,
+			      enum SENSOR_ATTR id, int value)
+{
+	record->values[id] = value;
+	set_bit(id, &record->valid);
+}
+
+// Only call with fancurve_mutex held
+static void read_sensor_record(struct legion_private *priv,
+			       struct sensor_record *record)
+{
+	static const enum SENSOR_ATTR fan_ids[] = {
+		SENSOR_FAN1_RPM_ID, SENSOR_FAN2_RPM_ID, SENSOR_FAN3_RPM_ID,
+		SENSOR_FAN4_RPM_ID
+	};
+	struct sensor_values values;
+	int value;
+	int i;
+
+	record->timestamp_ns = ktime_get_ns();
+	record->valid = 0;
+
+	if (!read_temperature(priv, 0, &value))
+		sensor_record_set(record, SENSOR_CPU_TEMP_ID, value);
+	if (!read_gpu_temperature(priv, &value))
+		sensor_record_set(record, SENSOR_GPU_TEMP_ID, value);
+
+	ec_read_sensor_values(&priv->ecram, priv->conf, &values);
+	sensor_record_set(record, SENSOR_IC_TEMP_ID, values.ic_temp_celsius);
+	sensor_record_set(record, SENSOR_FAN1_TARGET_RPM_ID,
+			  values.fan1_target_rpm);
+	sensor_record_set(record, SENSOR_FAN2_TARGET_RPM_ID,
+			  values.fan2_target_rpm);
+
+	for (i = 0; i < priv->caps.fan_count && i < ARRAY_SIZE(fan_ids); ++i) {
+		if (!read_fanspeed(priv, i, &value))
+			sensor_record_set(record, fan_ids[i], value);
+	}
+}
+
+/* ============================= */
+/* Fancurve reading/writing      */
+/* ============================= */
+
+/* Fancurve from WMI
+ * This allows changing fewer parameters.
+ * It is only available on newer models.
+ */
+
+struct wmi_fan_table_read {
+	__le32 fan_table_length;
+	__le32 fan_speed[MAXFANCURVESIZE];
+	__le32 sensor_table_length;
+	__le32 sensor_value[MAXFANCURVESIZE];
 } __packed;
 
 static ssize_t wmi_read_fancurve_custom(const struct model_config *model,
@@ -3734,12 +5047,11 @@ static ssize_t wmi_read_fancurve_custom(const struct model_config *model,
 	return 0;
 }
 
-static ssize_t wmi_write_fancurve_custom(const struct model_config *model,
-					 const struct fancurve *fancurve)
-{
-	u8 buffer[0x20];
-	int err;
+#define WMI_FAN_TABLE_WRITE_SIZE 0x20
 
+static void wmi_fancurve_custom_encode(const struct fancurve *fancurve,
+				       u8 buffer[WMI_FAN_TABLE_WRITE_SIZE])
+{
 	// The buffer is read like this in ACPI firmware
 	//
 	// CreateByteField (Arg2, Zero, FSTM)
@@ -3756,7 +5068,7 @@ static ssize_t wmi_write_fancurve_custom(const struct model_config *model,
 	// CreateByteField (Arg2, 0x16, FSS8)
 	// CreateByteField (Arg2, 0x18, FSS9)
 
-	memset(buffer, 0, sizeof(buffer));
+	memset(buffer, 0, WMI_FAN_TABLE_WRITE_SIZE);
 	buffer[0x06] = fancurve->points[0].speed1;
 	buffer[0x08] = fancurve->points[1].speed1;
 	buffer[0x0A] = fancurve->points[2].speed1;
@@ -3767,7 +5079,15 @@ static ssize_t wmi_write_fancurve_custom(const struct model_config *model,
 	buffer[0x14] = fancurve->points[7].speed1;
 	buffer[0x16] = fancurve->points[8].speed1;
 	buffer[0x18] = fancurve->points[9].speed1;
+}
+
+static ssize_t wmi_write_fancurve_custom(const struct model_config *model,
+					 const struct fancurve *fancurve)
+{
+	u8 buffer[WMI_FAN_TABLE_WRITE_SIZE];
+	int err;
 
+	wmi_fancurve_custom_encode(fancurve, buffer);
 	print_hex_dump(KERN_DEBUG, "legion_laptop fan table wmi write buffer",
 		       DUMP_PREFIX_ADDRESS, 16, 1, buffer, sizeof(buffer),
 		       true);
@@ -3846,6 +5166,11 @@ static int ec_read_fancurve_legion(struct ecram *ecram,
 				   struct fancurve *fancurve)
 {
 	size_t i = 0;
+	int err;
+
+	err = ecram_hold(ecram);
+	if (err)
+		return err;
 
 	fancurve->fan_speed_unit = FAN_SPEED_UNIT_RPM_HUNDRED;
 	for (i = 0; i < MAXFANCURVESIZE; ++i) {
@@ -3884,6 +5209,7 @@ static int ec_read_fancurve_legion(struct ecram *ecram,
 		ecram_read(ecram, model->registers->EXT_FAN_CUR_POINT);
 	fancurve->current_point_i =
 		min(fancurve->current_point_i, fancurve->size);
+	ecram_release(ecram);
 	return 0;
 }
 
@@ -3892,11 +5218,17 @@ static int ec_write_fancurve_legion(struct ecram *ecram,
 				    const struct fancurve *fancurve,
 				    bool write_size)
 {
+	struct ecram_transaction *tx;
 	size_t i;
+	int err;
+
+	tx = ecram_transaction_begin(ecram);
+	if (!tx)
+		return -ENOMEM;
 
 	// Reset fan update counters (try to avoid any race conditions)
-	ecram_write(ecram, 0xC5FE, 0);
-	ecram_write(ecram, 0xC5FF, 0);
+	ecram_transaction_prepare(tx, 0xC5FE, 0);
+	ecram_transaction_prepare(tx, 0xC5FF, 0);
 	for (i = 0; i < MAXFANCURVESIZE; ++i) {
 		// Entries for points larger than fancurve size should be cleared
 		// to 0
@@ -3904,46 +5236,54 @@ static int ec_write_fancurve_legion(struct ecram *ecram,
 			i < fancurve->size ? &fancurve->points[i] :
 					     &fancurve_point_zero;
 
-		ecram_write(ecram, model->registers->EXT_FAN1_BASE + i,
-			    point->speed1);
-		ecram_write(ecram, model->registers->EXT_FAN2_BASE + i,
-			    point->speed2);
-
-		ecram_write(ecram, model->registers->EXT_FAN_ACC_BASE + i,
-			    point->accel);
-		ecram_write(ecram, model->registers->EXT_FAN_DEC_BASE + i,
-			    point->decel);
-
-		ecram_write(ecram, model->registers->EXT_CPU_TEMP + i,
-			    point->cpu_max_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_CPU_TEMP_HYST + i,
-			    point->cpu_min_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_GPU_TEMP + i,
-			    point->gpu_max_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_GPU_TEMP_HYST + i,
-			    point->gpu_min_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_VRM_TEMP + i,
-			    point->ic_max_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_VRM_TEMP_HYST + i,
-			    point->ic_min_temp_celsius);
+		ecram_transaction_write(tx, model->registers->EXT_FAN1_BASE + i,
+					point->speed1);
+		ecram_transaction_write(tx, model->registers->EXT_FAN2_BASE + i,
+					point->speed2);
+
+		ecram_transaction_write(tx,
+					model->registers->EXT_FAN_ACC_BASE + i,
+					point->accel);
+		ecram_transaction_write(tx,
+					model->registers->EXT_FAN_DEC_BASE + i,
+					point->decel);
+
+		ecram_transaction_write(tx, model->registers->EXT_CPU_TEMP + i,
+					point->cpu_max_temp_celsius);
+		ecram_transaction_write(tx,
+					model->registers->EXT_CPU_TEMP_HYST + i,
+					point->cpu_min_temp_celsius);
+		ecram_transaction_write(tx, model->registers->EXT_GPU_TEMP + i,
+					point->gpu_max_temp_celsius);
+		ecram_transaction_write(tx,
+					model->registers->EXT_GPU_TEMP_HYST + i,
+					point->gpu_min_temp_celsius);
+		ecram_transaction_write(tx, model->registers->EXT_VRM_TEMP + i,
+					point->ic_max_temp_celsius);
+		ecram_transaction_write(tx,
+					model->registers->EXT_VRM_TEMP_HYST + i,
+					point->ic_min_temp_celsius);
 	}
 
 	if (write_size) {
-		ecram_write(ecram, model->registers->EXT_FAN_POINTS_SIZE,
-			    fancurve->size);
+		ecram_transaction_write(tx,
+					model->registers->EXT_FAN_POINTS_SIZE,
+					fancurve->size);
 	}
 
 	// Reset current fan level to 0, so algorithm in EC
 	// selects fan curve point again and resetting hysterisis
 	// effects
-	ecram_write(ecram, model->registers->EXT_FAN_CUR_POINT, 0);
+	ecram_transaction_commit(tx, model->registers->EXT_FAN_CUR_POINT, 0);
 
 	// Reset internal fan levels
-	ecram_write(ecram, 0xC634, 0); // CPU
-	ecram_write(ecram, 0xC635, 0); // GPU
-	ecram_write(ecram, 0xC636, 0); // SENSOR
+	ecram_transaction_commit(tx, 0xC634, 0); // CPU
+	ecram_transaction_commit(tx, 0xC635, 0); // GPU
+	ecram_transaction_commit(tx, 0xC636, 0); // SENSOR
 
-	return 0;
+	err = ecram_transaction_apply(tx);
+	ecram_transaction_free(tx);
+	return err;
 }
 
 #define FANCURVESIZE_IDEAPDAD 8
@@ -3953,6 +5293,11 @@ static int ec_read_fancurve_ideapad(struct ecram *ecram,
 				    struct fancurve *fancurve)
 {
 	size_t i = 0;
+	int err;
+
+	err = ecram_hold(ecram);
+	if (err)
+		return err;
 
 	fancurve->fan_speed_unit = FAN_SPEED_UNIT_RPM_HUNDRED;
 	for (i = 0; i < FANCURVESIZE_IDEAPDAD; ++i) {
@@ -3984,6 +5329,7 @@ static int ec_read_fancurve_ideapad(struct ecram *ecram,
 		ecram_read(ecram, model->registers->EXT_FAN_CUR_POINT);
 	fancurve->current_point_i =
 		min(fancurve->current_point_i, fancurve->size);
+	ecram_release(ecram);
 	return 0;
 }
 
@@ -3991,50 +5337,57 @@ static int ec_write_fancurve_ideapad(struct ecram *ecram,
 				     const struct model_config *model,
 				     const struct fancurve *fancurve)
 {
+	struct ecram_transaction *tx;
 	size_t i;
-	int valr1;
-	int valr2;
+	int err;
+
+	tx = ecram_transaction_begin(ecram);
+	if (!tx)
+		return -ENOMEM;
+	// fan speeds read back can differ from the written values, which was
+	// only logged before
+	tx->log_mismatches_only = true;
 
 	// add this later: maybe other addresses needed
 	// therefore, fan curve might not be effective immediately but
 	// only after temp change
 	// Reset fan update counters (try to avoid any race conditions)
-	ecram_write(ecram, 0xC5FE, 0);
-	ecram_write(ecram, 0xC5FF, 0);
+	ecram_transaction_prepare(tx, 0xC5FE, 0);
+	ecram_transaction_prepare(tx, 0xC5FF, 0);
 	for (i = 0; i < FANCURVESIZE_IDEAPDAD; ++i) {
 		const struct fancurve_point *point = &fancurve->points[i];
 
-		ecram_write(ecram, model->registers->EXT_FAN1_BASE + i,
-			    point->speed1);
-		valr1 = ecram_read(ecram, model->registers->EXT_FAN1_BASE + i);
-		ecram_write(ecram, model->registers->EXT_FAN2_BASE + i,
-			    point->speed2);
-		valr2 = ecram_read(ecram, model->registers->EXT_FAN2_BASE + i);
-		pr_info("Writing fan1: %d; reading fan1: %d\n", point->speed1,
-			valr1);
-		pr_info("Writing fan2: %d; reading fan2: %d\n", point->speed2,
-			valr2);
+		ecram_transaction_write(tx, model->registers->EXT_FAN1_BASE + i,
+					point->speed1);
+		ecram_transaction_write(tx, model->registers->EXT_FAN2_BASE + i,
+					point->speed2);
 
 		// write to memory and repeat 8 bytes later again
-		ecram_write(ecram, model->registers->EXT_CPU_TEMP + i,
-			    point->cpu_max_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_CPU_TEMP + 8 + i,
-			    point->cpu_max_temp_celsius);
+		ecram_transaction_write(tx, model->registers->EXT_CPU_TEMP + i,
+					point->cpu_max_temp_celsius);
+		ecram_transaction_write(tx,
+					model->registers->EXT_CPU_TEMP + 8 + i,
+					point->cpu_max_temp_celsius);
 		// write to memory and repeat 8 bytes later again
-		ecram_write(ecram, model->registers->EXT_CPU_TEMP_HYST + i,
-			    point->cpu_min_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_CPU_TEMP_HYST + 8 + i,
-			    point->cpu_min_temp_celsius);
+		ecram_transaction_write(tx,
+					model->registers->EXT_CPU_TEMP_HYST + i,
+					point->cpu_min_temp_celsius);
+		ecram_transaction_write(
+			tx, model->registers->EXT_CPU_TEMP_HYST + 8 + i,
+			point->cpu_min_temp_celsius);
 		// write to memory and repeat 8 bytes later again
-		ecram_write(ecram, model->registers->EXT_GPU_TEMP + i,
-			    point->gpu_max_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_GPU_TEMP + 8 + i,
-			    point->gpu_max_temp_celsius);
+		ecram_transaction_write(tx, model->registers->EXT_GPU_TEMP + i,
+					point->gpu_max_temp_celsius);
+		ecram_transaction_write(tx,
+					model->registers->EXT_GPU_TEMP + 8 + i,
+					point->gpu_max_temp_celsius);
 		// write to memory and repeat 8 bytes later again
-		ecram_write(ecram, model->registers->EXT_GPU_TEMP_HYST + i,
-			    point->gpu_min_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_GPU_TEMP_HYST + 8 + i,
-			    point->gpu_min_temp_celsius);
+		ecram_transaction_write(tx,
+					model->registers->EXT_GPU_TEMP_HYST + i,
+					point->gpu_min_temp_celsius);
+		ecram_transaction_write(
+			tx, model->registers->EXT_GPU_TEMP_HYST + 8 + i,
+			point->gpu_min_temp_celsius);
 	}
 
 	// add this later: maybe other addresses needed
@@ -4043,14 +5396,16 @@ static int ec_write_fancurve_ideapad(struct ecram *ecram,
 	// // Reset current fan level to 0, so algorithm in EC
 	// // selects fan curve point again and resetting hysterisis
 	// // effects
-	// ecram_write(ecram, model->registers->EXT_FAN_CUR_POINT, 0);
+	// ecram_transaction_commit(tx, model->registers->EXT_FAN_CUR_POINT, 0);
 
 	// // Reset internal fan levels
-	// ecram_write(ecram, 0xC634, 0); // CPU
-	// ecram_write(ecram, 0xC635, 0); // GPU
-	// ecram_write(ecram, 0xC636, 0); // SENSOR
+	// ecram_transaction_commit(tx, 0xC634, 0); // CPU
+	// ecram_transaction_commit(tx, 0xC635, 0); // GPU
+	// ecram_transaction_commit(tx, 0xC636, 0); // SENSOR
 
-	return 0;
+	err = ecram_transaction_apply(tx);
+	ecram_transaction_free(tx);
+	return err;
 }
 
 #define FANCURVESIZE_LOQ 10
@@ -4062,6 +5417,11 @@ static int ec_read_fancurve_loq(struct ecram *ecram,
 	size_t i = 0;
 	size_t struct_offset_ecram = 3;
 	size_t struct_offset_ecramsys = 6;
+	int err;
+
+	err = ecram_hold(ecram);
+	if (err)
+		return err;
 
 	fancurve->fan_speed_unit = FAN_SPEED_UNIT_RPM_HUNDRED;
 	for (i = 0; i < FANCURVESIZE_LOQ; ++i) {
@@ -4101,6 +5461,7 @@ static int ec_read_fancurve_loq(struct ecram *ecram,
 		ecram_read(ecram, model->registers->EXT_FAN_CUR_POINT);
 	fancurve->current_point_i =
 		min(fancurve->current_point_i, fancurve->size);
+	ecram_release(ecram);
 	return 0;
 }
 
@@ -4110,53 +5471,49 @@ static int ec_write_fancurve_loq(struct ecram *ecram,
 				 const struct model_config *model,
 				 const struct fancurve *fancurve)
 {
+	struct ecram_transaction *tx;
 	size_t i;
-	int valr1;
-	int valr2;
-	u8 cmrd;
 	size_t struct_offset_ecramsys = 6;
+	int err;
+
+	tx = ecram_transaction_begin(ecram);
+	if (!tx)
+		return -ENOMEM;
+	// same as for ideapad
+	tx->log_mismatches_only = true;
 
 	for (i = 0; i < FANCURVESIZE_LOQ; ++i) {
 		const struct fancurve_point *point = &fancurve->points[i];
-
-		ecram_write(ecram, model->registers->EXT_FAN1_BASE
-							+ (i * struct_offset_ecramsys), point->speed1);
-		valr1 = ecram_read(ecram, model->registers->EXT_FAN1_BASE
-							+ (i * struct_offset_ecramsys));
-
-		ecram_write(ecram, model->registers->EXT_FAN2_BASE
-							+ (i * struct_offset_ecramsys), point->speed2);
-		valr2 = ecram_read(ecram, model->registers->EXT_FAN2_BASE +
-						  (i * struct_offset_ecramsys));
-
-		pr_info("Writing fan1: %d; reading fan1: %d\n", point->speed1,
-			valr1);
-		pr_info("Writing fan2: %d; reading fan2: %d\n", point->speed2,
-			valr2);
-
-		ecram_write(ecram, model->registers->EXT_CPU_TEMP
-							+ (i * struct_offset_ecramsys), point->cpu_max_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_CPU_TEMP_HYST
-							+ (i * struct_offset_ecramsys), point->cpu_min_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_GPU_TEMP
-							+ (i * struct_offset_ecramsys), point->gpu_max_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_GPU_TEMP_HYST
-							+ (i * struct_offset_ecramsys), point->gpu_min_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_VRM_TEMP
-							+ (i * struct_offset_ecramsys), point->ic_max_temp_celsius);
-		ecram_write(ecram, model->registers->EXT_VRM_TEMP_HYST
-							+ (i * struct_offset_ecramsys), point->ic_min_temp_celsius);
-
+		size_t off = i * struct_offset_ecramsys;
+
+		ecram_transaction_write(tx, model->registers->EXT_FAN1_BASE + off,
+					point->speed1);
+		ecram_transaction_write(tx, model->registers->EXT_FAN2_BASE + off,
+					point->speed2);
+		ecram_transaction_write(tx, model->registers->EXT_CPU_TEMP + off,
+					point->cpu_max_temp_celsius);
+		ecram_transaction_write(tx,
+					model->registers->EXT_CPU_TEMP_HYST + off,
+					point->cpu_min_temp_celsius);
+		ecram_transaction_write(tx, model->registers->EXT_GPU_TEMP + off,
+					point->gpu_max_temp_celsius);
+		ecram_transaction_write(tx,
+					model->registers->EXT_GPU_TEMP_HYST + off,
+					point->gpu_min_temp_celsius);
+		ecram_transaction_write(tx, model->registers->EXT_VRM_TEMP + off,
+					point->ic_max_temp_celsius);
+		ecram_transaction_write(tx,
+					model->registers->EXT_VRM_TEMP_HYST + off,
+					point->ic_min_temp_celsius);
 	}
 	// execute
-	cmrd = ecram_read(ecram, LOQ_CMDR_ADDR);
-	cmrd |= (1 << 4);
-	ecram_write(ecram, LOQ_CMDR_ADDR, cmrd);
+	ecram_transaction_commit_set_bits(tx, LOQ_CMDR_ADDR, 1 << 4);
 
-	return 0;
+	err = ecram_transaction_apply(tx);
+	ecram_transaction_free(tx);
+	return err;
 }
 
-
 #define EC4_FANCURVE_SIZE 10
 #define EC4_FAN1_BASE 0xC50A
 #define EC4_FAN2_BASE 0xC531
@@ -4167,6 +5524,11 @@ static int ec_read_fancurve_legion2024(struct ecram *ecram,
 				       struct fancurve *fancurve)
 {
 	int i;
+	int err;
+
+	err = ecram_hold(ecram);
+	if (err)
+		return err;
 
 	fancurve->fan_speed_unit = FAN_SPEED_UNIT_RPM_HUNDRED;
 	fancurve->size = EC4_FANCURVE_SIZE;
@@ -4189,6 +5551,7 @@ static int ec_read_fancurve_legion2024(struct ecram *ecram,
 		p->accel = 0;
 		p->decel = 0;
 	}
+	ecram_release(ecram);
 	return 0;
 }
 
@@ -4196,26 +5559,35 @@ static int ec_write_fancurve_legion2024(struct ecram *ecram,
 					const struct model_config *model,
 					const struct fancurve *fancurve)
 {
+	struct ecram_transaction *tx;
 	int i;
+	int err;
+
+	tx = ecram_transaction_begin(ecram);
+	if (!tx)
+		return -ENOMEM;
 
 	for (i = 0; i < EC4_FANCURVE_SIZE; i++) {
 		const struct fancurve_point *p = &fancurve->points[i];
 		u8 off = EC4_POINT_STRIDE * i;
 
 		// fan1 curve: cpu_max, gpu_max, speed1
-		ecram_write(ecram, EC4_FAN1_BASE + off,
-			    p->cpu_max_temp_celsius);
-		ecram_write(ecram, EC4_FAN1_BASE + off + 1,
-			    p->gpu_max_temp_celsius);
-		ecram_write(ecram, EC4_FAN1_BASE + off + 2, p->speed1);
+		ecram_transaction_write(tx, EC4_FAN1_BASE + off,
+					p->cpu_max_temp_celsius);
+		ecram_transaction_write(tx, EC4_FAN1_BASE + off + 1,
+					p->gpu_max_temp_celsius);
+		ecram_transaction_write(tx, EC4_FAN1_BASE + off + 2, p->speed1);
 		// fan2 curve: same temperature thresholds, speed2
-		ecram_write(ecram, EC4_FAN2_BASE + off,
-			    p->cpu_max_temp_celsius);
-		ecram_write(ecram, EC4_FAN2_BASE + off + 1,
-			    p->gpu_max_temp_celsius);
-		ecram_write(ecram, EC4_FAN2_BASE + off + 2, p->speed2);
+		ecram_transaction_write(tx, EC4_FAN2_BASE + off,
+					p->cpu_max_temp_celsius);
+		ecram_transaction_write(tx, EC4_FAN2_BASE + off + 1,
+					p->gpu_max_temp_celsius);
+		ecram_transaction_write(tx, EC4_FAN2_BASE + off + 2, p->speed2);
 	}
-	return 0;
+
+	err = ecram_transaction_apply(tx);
+	ecram_transaction_free(tx);
+	return err;
 }
 
 
@@ -4293,6 +5665,8 @@ static int write_fancurve(struct legion_private *priv,
 		return -EINVAL;
 	}
 
+	trace_legion_fancurve_write(priv->conf->access_method_fancurve,
+				    fancurve->size, err);
 	if (!err) {
 		priv->fancurve = *fancurve;
 		priv->fancurve_valid = true;
@@ -5061,6 +6435,28 @@ static int debugfs_fancurve_show(struct seq_file *s, void *unused)
 
 DEFINE_SHOW_ATTRIBUTE(debugfs_fancurve);
 
+static int debugfs_ec_lock_stats_show(struct seq_file *s, void *unused)
+{
+	struct legion_private *priv = s->private;
+	struct ecram_portio *ec_portio = &priv->ecram.portio;
+
+	mutex_lock(&ec_portio->io_port_mutex);
+	seq_printf(s, "acpi_global_lock: %s\n",
+		   ec_portio->global_lock_available ? "used" : "not used");
+	seq_printf(s, "locks: %llu\n", ec_portio->lock_count);
+	seq_printf(s, "contended: %llu\n", ec_portio->lock_contended);
+	seq_printf(s, "wait_ns_total: %llu\n", ec_portio->lock_wait_ns_total);
+	seq_printf(s, "wait_ns_max: %llu\n", ec_portio->lock_wait_ns_max);
+	seq_printf(s, "global_lock_wait_ns_total: %llu\n",
+		   ec_portio->global_lock_wait_ns_total);
+	seq_printf(s, "global_lock_failures: %llu\n",
+		   ec_portio->global_lock_failures);
+	mutex_unlock(&ec_portio->io_port_mutex);
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(debugfs_ec_lock_stats);
+
 static void legion_debugfs_init(struct legion_private *priv)
 {
 	struct dentry *dir;
@@ -5079,6 +6475,8 @@ static void legion_debugfs_init(struct legion_private *priv)
 			    &debugfs_ecmemory_fops);
 	debugfs_create_file("ecmemoryram", 0444, dir, priv,
 			    &debugfs_ecmemoryram_fops);
+	debugfs_create_file("ec_lock_stats", 0444, dir, priv,
+			    &debugfs_ec_lock_stats_fops);
 
 	priv->debugfs_dir = dir;
 }
@@ -5093,2309 +6491,3758 @@ static void legion_debugfs_exit(struct legion_private *priv)
 }
 
 /* =============================  */
-/* sysfs interface                */
+/* Capabilities                   */
 /* ============================   */
+// Determined once when loading the driver and used for the visibility of
+// attributes. Exported in the attribute capabilities so that user space
+// does not have to probe every file.
+
+enum legion_capability {
+	LEGION_CAP_WMI_GAMEZONE = 0,
+	LEGION_CAP_WMI_CPU_METHOD,
+	LEGION_CAP_WMI_GPU_METHOD,
+	LEGION_CAP_WMI_FAN_METHOD,
+	LEGION_CAP_WMI_KBBACKLIGHT,
+	LEGION_CAP_WMI_OTHER_METHOD,
+	LEGION_CAP_ACPI_RAPIDCHARGE,
+	LEGION_CAP_POWERMODE,
+	LEGION_CAP_CUSTOM_POWERMODE,
+	LEGION_CAP_EXTREME_POWERMODE,
+	LEGION_CAP_FANCURVE,
+	LEGION_CAP_MINIFANCURVE,
+	LEGION_CAP_FANFULLSPEED,
+	LEGION_CAP_FANCURVE_DEFAULTS,
+	LEGION_CAP_KEYBOARD_BACKLIGHT,
+	LEGION_CAP_YLOGO_LIGHT,
+	LEGION_CAP_IOPORT_LIGHT,
+	LEGION_CAP_OC_CONTROLS,
+	LEGION_CAP_MAX
+};
 
-static int show_simple_wmi_attribute(struct device *dev,
-				     struct device_attribute *attr, char *buf,
-				     const char *guid, u8 instance,
-				     u32 method_id, bool invert,
-				     unsigned long scale)
-{
-	unsigned long state = 0;
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
+static const char *const legion_capability_names[LEGION_CAP_MAX] = {
+	[LEGION_CAP_WMI_GAMEZONE] = "wmi_gamezone",
+	[LEGION_CAP_WMI_CPU_METHOD] = "wmi_cpu_method",
+	[LEGION_CAP_WMI_GPU_METHOD] = "wmi_gpu_method",
+	[LEGION_CAP_WMI_FAN_METHOD] = "wmi_fan_method",
+	[LEGION_CAP_WMI_KBBACKLIGHT] = "wmi_kbbacklight",
+	[LEGION_CAP_WMI_OTHER_METHOD] = "wmi_other_method",
+	[LEGION_CAP_ACPI_RAPIDCHARGE] = "acpi_rapidcharge",
+	[LEGION_CAP_POWERMODE] = "powermode",
+	[LEGION_CAP_CUSTOM_POWERMODE] = "custom_powermode",
+	[LEGION_CAP_EXTREME_POWERMODE] = "extreme_powermode",
+	[LEGION_CAP_FANCURVE] = "fancurve",
+	[LEGION_CAP_MINIFANCURVE] = "minifancurve",
+	[LEGION_CAP_FANFULLSPEED] = "fanfullspeed",
+	[LEGION_CAP_FANCURVE_DEFAULTS] = "fancurve_defaults",
+	[LEGION_CAP_KEYBOARD_BACKLIGHT] = "keyboard_backlight",
+	[LEGION_CAP_YLOGO_LIGHT] = "ylogo_light",
+	[LEGION_CAP_IOPORT_LIGHT] = "ioport_light",
+	[LEGION_CAP_OC_CONTROLS] = "oc_controls",
+};
 
-	mutex_lock(&priv->fancurve_mutex);
-	err = get_simple_wmi_attribute(priv, guid, instance, method_id, invert,
-				       scale, &state);
-	mutex_unlock(&priv->fancurve_mutex);
+struct legion_other_method_feature_desc {
+	const char *name;
+	enum OtherMethodFeature feature_id;
+};
 
-	if (err)
-		return err;
+// features of WMI Other Method that are checked by reading them
+static const struct legion_other_method_feature_desc
+	legion_other_method_features[] = {
+	{ "cpu_shortterm_powerlimit",
+	  OtherMethodFeature_CPU_SHORT_TERM_POWER_LIMIT },
+	{ "cpu_longterm_powerlimit",
+	  OtherMethodFeature_CPU_LONG_TERM_POWER_LIMIT },
+	{ "cpu_peak_powerlimit", OtherMethodFeature_CPU_PEAK_POWER_LIMIT },
+	{ "cpu_temperature_limit", OtherMethodFeature_CPU_TEMPERATURE_LIMIT },
+	{ "cpu_apu_sppt_powerlimit", OtherMethodFeature_APU_PPT_POWER_LIMIT },
+	{ "cpu_cross_loading_powerlimit",
+	  OtherMethodFeature_CPU_CROSS_LOAD_POWER_LIMIT },
+	{ "cpu_l1_tau", OtherMethodFeature_CPU_L1_TAU },
+	{ "gpu_ppab_powerlimit", OtherMethodFeature_GPU_POWER_BOOST },
+	{ "gpu_ctgp_powerlimit", OtherMethodFeature_GPU_cTGP },
+	{ "gpu_temperature_limit", OtherMethodFeature_GPU_TEMPERATURE_LIMIT },
+	{ "gpu_power_target_offset",
+	  OtherMethodFeature_GPU_POWER_TARGET_ON_AC_OFFSET_FROM_BASELINE },
+	{ "fan_fullspeed", OtherMethodFeature_FAN_FULLSPEED },
+	{ "fan1_speed", OtherMethodFeature_FAN_SPEED_1 },
+	{ "fan2_speed", OtherMethodFeature_FAN_SPEED_2 },
+	{ "cpu_temperature", OtherMethodFeature_TEMP_CPU },
+	{ "gpu_temperature", OtherMethodFeature_TEMP_GPU },
+};
 
-	return sysfs_emit(buf, "%lu\n", state);
+static const char *access_method_name(enum access_method method)
+{
+	switch (method) {
+	case ACCESS_METHOD_NO_ACCESS:
+		return "none";
+	case ACCESS_METHOD_EC:
+		return "ec";
+	case ACCESS_METHOD_ACPI:
+		return "acpi";
+	case ACCESS_METHOD_WMI:
+		return "wmi";
+	case ACCESS_METHOD_WMI2:
+		return "wmi2";
+	case ACCESS_METHOD_WMI3:
+		return "wmi3";
+	case ACCESS_METHOD_EC2:
+		return "ec2";
+	case ACCESS_METHOD_EC3:
+		return "ec3";
+	case ACCESS_METHOD_EC4:
+		return "ec4";
+	default:
+		return "unknown";
+	}
 }
 
-static int show_simple_wmi_attribute_from_buffer(struct device *dev,
-						 struct device_attribute *attr,
-						 char *buf, const char *guid,
-						 u8 instance, u32 method_id,
-						 size_t ressize, size_t i,
-						 int scale)
+static bool legion_rapidcharge_is_supported(struct legion_private *priv)
 {
-	int err;
-	unsigned long value;
-	struct legion_private *priv = dev_get_drvdata(dev);
+	return acpi_method_exists(
+		priv->adev, get_model_acpi_path(priv->conf,
+						 ACPI_PATH_READ_RAPIDCHARGE)) &&
+	       acpi_method_exists(
+		priv->adev, get_model_acpi_path(priv->conf,
+						 ACPI_PATH_WRITE_RAPIDCHARGE));
+}
 
-	if (i >= ressize) {
-		pr_info("Index not within buffer size\n");
-		return -EINVAL;
-	}
+static bool legion_has_capability(struct legion_private *priv,
+				  enum legion_capability cap)
+{
+	return test_bit(cap, &priv->caps.flags);
+}
+
+// Fast part of determining capabilities without firmware calls
+static void legion_capabilities_init(struct legion_private *priv)
+{
+	const struct model_config *conf = priv->conf;
+	struct legion_capabilities *caps = &priv->caps;
+
+	caps->probed = false;
+	caps->flags = 0;
+	caps->other_method = 0;
+	caps->fan_count = conf->has_four_fans ? 4 : 2;
+	caps->fancurve_size = 0;
+
+	if (legion_wmi_has_guid(LEGION_WMI_GAMEZONE_GUID))
+		set_bit(LEGION_CAP_WMI_GAMEZONE, &caps->flags);
+	if (legion_wmi_has_guid(WMI_GUID_LENOVO_CPU_METHOD))
+		set_bit(LEGION_CAP_WMI_CPU_METHOD, &caps->flags);
+	if (legion_wmi_has_guid(WMI_GUID_LENOVO_GPU_METHOD))
+		set_bit(LEGION_CAP_WMI_GPU_METHOD, &caps->flags);
+	if (legion_wmi_has_guid(WMI_GUID_LENOVO_FAN_METHOD))
+		set_bit(LEGION_CAP_WMI_FAN_METHOD, &caps->flags);
+	if (legion_wmi_has_guid(LEGION_WMI_KBBACKLIGHT_GUID))
+		set_bit(LEGION_CAP_WMI_KBBACKLIGHT, &caps->flags);
+	if (legion_wmi_has_guid(LEGION_WMI_LENOVO_OTHER_METHOD_GUID))
+		set_bit(LEGION_CAP_WMI_OTHER_METHOD, &caps->flags);
+	if (legion_rapidcharge_is_supported(priv))
+		set_bit(LEGION_CAP_ACPI_RAPIDCHARGE, &caps->flags);
+	if (conf->access_method_powermode != ACCESS_METHOD_NO_ACCESS)
+		set_bit(LEGION_CAP_POWERMODE, &caps->flags);
+	if (conf->has_custom_powermode)
+		set_bit(LEGION_CAP_CUSTOM_POWERMODE, &caps->flags);
+	if (conf->has_extreme_powermode)
+		set_bit(LEGION_CAP_EXTREME_POWERMODE, &caps->flags);
+	if (conf->has_minifancurve)
+		set_bit(LEGION_CAP_MINIFANCURVE, &caps->flags);
+	if (conf->access_method_fanfullspeed != ACCESS_METHOD_NO_ACCESS)
+		set_bit(LEGION_CAP_FANFULLSPEED, &caps->flags);
+	if (conf->has_fancurve_defaults)
+		set_bit(LEGION_CAP_FANCURVE_DEFAULTS, &caps->flags);
+	if (conf->access_method_keyboard != ACCESS_METHOD_NO_ACCESS)
+		set_bit(LEGION_CAP_KEYBOARD_BACKLIGHT, &caps->flags);
+	if (conf->ec_ylogo_register || !conf->skip_ylogo_light)
+		set_bit(LEGION_CAP_YLOGO_LIGHT, &caps->flags);
+	if (!conf->skip_ioport_light)
+		set_bit(LEGION_CAP_IOPORT_LIGHT, &caps->flags);
+	if (!conf->skip_oc_controls)
+		set_bit(LEGION_CAP_OC_CONTROLS, &caps->flags);
+
+	pr_info("Capabilities: 0x%lx; fans: %u\n", caps->flags,
+		caps->fan_count);
+}
+
+// Slow part of determining capabilities that needs firmware calls.
+// Called from the deferred probe in steps, so attributes can be shown as
+// soon as the capability they need is confirmed.
+static void legion_capabilities_probe_fancurve(struct legion_private *priv)
+{
+	struct legion_capabilities *caps = &priv->caps;
+	struct fancurve fancurve;
 
 	mutex_lock(&priv->fancurve_mutex);
-	err = wmi_exec_noarg_int_or_buffer(guid, instance, method_id, ressize,
-					     i, &value);
+	if (priv->conf->access_method_fancurve != ACCESS_METHOD_NO_ACCESS &&
+	    !read_fancurve(priv, &fancurve)) {
+		set_bit(LEGION_CAP_FANCURVE, &caps->flags);
+		caps->fancurve_size = fancurve.size;
+	}
 	mutex_unlock(&priv->fancurve_mutex);
-	if (err)
-		return err;
-
-	return sysfs_emit(buf, "%lu\n", scale * value);
 }
 
-static int store_simple_wmi_attribute(struct device *dev,
-				      struct device_attribute *attr,
-				      const char *buf, size_t count,
-				      const char *guid, u8 instance,
-				      u32 method_id, bool invert, int scale)
+// Last step, afterwards all capabilities are probed
+static void
+legion_capabilities_probe_other_method(struct legion_private *priv)
 {
-	int state;
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
+	struct legion_capabilities *caps = &priv->caps;
+	int value;
+	int i;
 
-	err = kstrtouint(buf, 0, &state);
-	if (err)
-		return err;
-	err = set_simple_wmi_attribute(priv, guid, instance, method_id, invert,
-				       scale, state);
-	if (err)
-		return err;
-	return count;
+	mutex_lock(&priv->fancurve_mutex);
+	if (legion_has_capability(priv, LEGION_CAP_WMI_OTHER_METHOD)) {
+		for (i = 0; i < ARRAY_SIZE(legion_other_method_features); ++i) {
+			if (!wmi_other_method_get_value(
+				    legion_other_method_features[i].feature_id,
+				    &value))
+				set_bit(i, &caps->other_method);
+		}
+	}
+	caps->probed = true;
+	mutex_unlock(&priv->fancurve_mutex);
+
+	pr_info("Capabilities: 0x%lx; Other Method features: 0x%lx; fan curve size: %zu\n",
+		caps->flags, caps->other_method, caps->fancurve_size);
 }
 
-static ssize_t lockfancontroller_show(struct device *dev,
-				      struct device_attribute *attr, char *buf)
+static bool legion_other_method_is_supported(struct legion_private *priv,
+					     enum OtherMethodFeature feature_id)
 {
-	struct legion_private *priv = dev_get_drvdata(dev);
-	bool is_lockfancontroller;
-	int err;
+	int i;
 
-	mutex_lock(&priv->fancurve_mutex);
-	err = ec_read_lockfancontroller(&priv->ecram, priv->conf,
-					&is_lockfancontroller);
-	mutex_unlock(&priv->fancurve_mutex);
-	if (err)
-		return -EINVAL;
+	for (i = 0; i < ARRAY_SIZE(legion_other_method_features); ++i) {
+		if (legion_other_method_features[i].feature_id == feature_id)
+			return test_bit(i, &priv->caps.other_method);
+	}
+	return false;
+}
 
-	return sysfs_emit(buf, "%d\n", is_lockfancontroller);
+static bool powerlimit_is_supported(struct legion_private *priv,
+				    enum legion_powerlimit_id id)
+{
+	if (priv->conf->skip_oc_controls)
+		return false;
+	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
+		return legion_other_method_is_supported(
+			priv, legion_powerlimits[id].feature_id);
+	return legion_wmi_has_guid(legion_powerlimits[id].guid);
 }
 
-static ssize_t lockfancontroller_store(struct device *dev,
-				       struct device_attribute *attr,
-				       const char *buf, size_t count)
+static ssize_t capabilities_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
 {
 	struct legion_private *priv = dev_get_drvdata(dev);
-	bool is_lockfancontroller;
-	int err;
+	const struct model_config *conf = priv->conf;
+	const struct legion_capabilities *caps = &priv->caps;
+	ssize_t len = 0;
+	unsigned long i;
+	bool first;
+
+	len += sysfs_emit_at(buf, len, "bitmap=0x%lx\n", caps->flags);
+
+	len += sysfs_emit_at(buf, len, "flags=");
+	first = true;
+	for_each_set_bit(i, &caps->flags, LEGION_CAP_MAX) {
+		len += sysfs_emit_at(buf, len, "%s%s", first ? "" : ",",
+				     legion_capability_names[i]);
+		first = false;
+	}
+	len += sysfs_emit_at(buf, len, "\n");
+
+	len += sysfs_emit_at(buf, len, "other_method=");
+	first = true;
+	for_each_set_bit(i, &caps->other_method,
+			 ARRAY_SIZE(legion_other_method_features)) {
+		len += sysfs_emit_at(buf, len, "%s%s", first ? "" : ",",
+				     legion_other_method_features[i].name);
+		first = false;
+	}
+	len += sysfs_emit_at(buf, len, "\n");
+
+	len += sysfs_emit_at(buf, len, "access_powermode=%s\n",
+			     access_method_name(conf->access_method_powermode));
+	len += sysfs_emit_at(buf, len, "access_keyboard=%s\n",
+			     access_method_name(conf->access_method_keyboard));
+	len += sysfs_emit_at(
+		buf, len, "access_temperature=%s\n",
+		access_method_name(conf->access_method_temperature));
+	len += sysfs_emit_at(buf, len, "access_fanspeed=%s\n",
+			     access_method_name(conf->access_method_fanspeed));
+	len += sysfs_emit_at(buf, len, "access_fancurve=%s\n",
+			     access_method_name(conf->access_method_fancurve));
+	len += sysfs_emit_at(
+		buf, len, "access_fanfullspeed=%s\n",
+		access_method_name(conf->access_method_fanfullspeed));
+	len += sysfs_emit_at(
+		buf, len, "access_powerlimits=%s\n",
+		access_method_name(conf->access_method_powerlimits));
+	len += sysfs_emit_at(buf, len, "fan_count=%u\n", caps->fan_count);
+	len += sysfs_emit_at(buf, len, "fancurve_size=%zu\n",
+			     caps->fancurve_size);
+	len += sysfs_emit_at(buf, len, "probed=%d\n", caps->probed);
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(capabilities);
 
-	err = kstrtobool(buf, &is_lockfancontroller);
-	if (err)
-		return err;
+/* =============================  */
+/* Throttling statistics          */
+/* ============================   */
+// Periodically combine power mode, fan curve level, fan speeds and
+// temperatures vs. their limits and count per power mode how often and
+// how long fans were saturated or lagging behind their target speed,
+// temperatures at their limit or fan full speed was engaged. Enabled with throttle_sample_ms.
+
+static const char *const legion_throttle_state_names[] = {
+	[LEGION_THROTTLE_FAN_SATURATED] = "fan_saturated",
+	[LEGION_THROTTLE_CPU_TEMP_LIMIT] = "cpu_temp_limit",
+	[LEGION_THROTTLE_GPU_TEMP_LIMIT] = "gpu_temp_limit",
+	[LEGION_THROTTLE_FULLSPEED] = "fullspeed",
+	[LEGION_THROTTLE_FAN_LAGGING] = "fan_lagging",
+};
 
-	mutex_lock(&priv->fancurve_mutex);
-	err = ec_write_lockfancontroller(&priv->ecram, priv->conf,
-					 is_lockfancontroller);
-	mutex_unlock(&priv->fancurve_mutex);
-	if (err)
-		return -EINVAL;
+static const char *const legion_throttle_profile_names[] = {
+	[LEGION_THROTTLE_PROFILE_QUIET] = "quiet",
+	[LEGION_THROTTLE_PROFILE_BALANCED] = "balanced",
+	[LEGION_THROTTLE_PROFILE_PERFORMANCE] = "performance",
+	[LEGION_THROTTLE_PROFILE_EXTREME] = "extreme",
+	[LEGION_THROTTLE_PROFILE_CUSTOM] = "custom",
+	[LEGION_THROTTLE_PROFILE_UNKNOWN] = "unknown",
+};
 
-	return count;
+static enum legion_throttle_profile legion_throttle_profile(int powermode)
+{
+	switch (powermode) {
+	case LEGION_WMI_POWERMODE_LOW_POWER:
+		return LEGION_THROTTLE_PROFILE_QUIET;
+	case LEGION_WMI_POWERMODE_BALANCED:
+		return LEGION_THROTTLE_PROFILE_BALANCED;
+	case LEGION_WMI_POWERMODE_PERFORMANCE:
+		return LEGION_THROTTLE_PROFILE_PERFORMANCE;
+	case LEGION_WMI_POWERMODE_MAX_POWER:
+		return LEGION_THROTTLE_PROFILE_EXTREME;
+	case LEGION_WMI_POWERMODE_CUSTOM:
+		return LEGION_THROTTLE_PROFILE_CUSTOM;
+	default:
+		return LEGION_THROTTLE_PROFILE_UNKNOWN;
+	}
 }
 
-static DEVICE_ATTR_RW(lockfancontroller);
-
-static ssize_t rapidcharge_show(struct device *dev,
-				struct device_attribute *attr, char *buf)
+static bool legion_throttle_fan_lagging(const struct sensor_record *record,
+					enum SENSOR_ATTR rpm_id,
+					enum SENSOR_ATTR target_id)
 {
-	bool state = false;
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
-
-	mutex_lock(&priv->fancurve_mutex);
-	err = acpi_read_rapidcharge(priv->adev, &state);
-	mutex_unlock(&priv->fancurve_mutex);
-	if (err)
-		return err;
+	int target;
 
-	return sysfs_emit(buf, "%d\n", state);
+	if (!test_bit(rpm_id, &record->valid) ||
+	    !test_bit(target_id, &record->valid))
+		return false;
+	target = record->values[target_id];
+	// more than 10 % below target
+	return target > 0 && record->values[rpm_id] * 10 < target * 9;
 }
 
-static ssize_t rapidcharge_store(struct device *dev,
-				 struct device_attribute *attr, const char *buf,
-				 size_t count)
+// Returns the temperature limit or 0 if it is unknown
+static int legion_throttle_read_temp_limit(struct legion_private *priv,
+					   bool gpu,
+					   enum OtherMethodFeature feature_id)
 {
-	struct legion_private *priv = dev_get_drvdata(dev);
-	int state;
-	int err;
+	unsigned long limit_gpu;
+	int limit;
 
-	err = kstrtouint(buf, 0, &state);
-	if (err)
-		return err;
+	if (legion_other_method_is_supported(priv, feature_id)) {
+		if (wmi_other_method_get_value(feature_id, &limit))
+			return 0;
+		return limit;
+	}
+	if (gpu && legion_has_capability(priv, LEGION_CAP_WMI_GPU_METHOD)) {
+		if (wmi_exec_noarg_int(WMI_GUID_LENOVO_GPU_METHOD, 0,
+				       WMI_METHOD_ID_GPU_GET_TEMPERATURE_LIMIT,
+				       &limit_gpu))
+			return 0;
+		return limit_gpu;
+	}
+	return 0;
+}
 
-	mutex_lock(&priv->fancurve_mutex);
-	err = acpi_write_rapidcharge(priv->adev, state);
-	mutex_unlock(&priv->fancurve_mutex);
-	if (err)
-		return err;
+// Get the temperature limits of CPU and GPU, only reading them via WMI
+// if the power mode changed since the last call
+static void legion_throttle_temp_limits(struct legion_private *priv,
+					int powermode, int limits[2])
+{
+	struct legion_throttle_stats *stats = &priv->throttle;
 
-	return count;
+	mutex_lock(&stats->mutex);
+	if (!stats->temp_limits_valid ||
+	    stats->temp_limits_powermode != powermode) {
+		stats->temp_limits[0] = legion_throttle_read_temp_limit(
+			priv, false, OtherMethodFeature_CPU_TEMPERATURE_LIMIT);
+		stats->temp_limits[1] = legion_throttle_read_temp_limit(
+			priv, true, OtherMethodFeature_GPU_TEMPERATURE_LIMIT);
+		stats->temp_limits_powermode = powermode;
+		stats->temp_limits_valid = true;
+	}
+	limits[0] = stats->temp_limits[0];
+	limits[1] = stats->temp_limits[1];
+	mutex_unlock(&stats->mutex);
 }
 
-static DEVICE_ATTR_RW(rapidcharge);
-
-static ssize_t issupportgpuoc_show(struct device *dev,
-				   struct device_attribute *attr, char *buf)
+// Read the temperature limits again with the next sample
+static void legion_throttle_invalidate_temp_limits(struct legion_private *priv)
 {
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_ISSUPPORTGPUOC, false,
-					 1);
+	mutex_lock(&priv->throttle.mutex);
+	priv->throttle.temp_limits_valid = false;
+	mutex_unlock(&priv->throttle.mutex);
 }
 
-static DEVICE_ATTR_RO(issupportgpuoc);
-
-static ssize_t aslcodeversion_show(struct device *dev,
-				   struct device_attribute *attr, char *buf)
+static bool legion_throttle_temp_limit(const struct sensor_record *record,
+				       enum SENSOR_ATTR temp_id, int limit)
 {
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_GETVERSION, false, 1);
+	return test_bit(temp_id, &record->valid) && limit > 0 &&
+	       record->values[temp_id] >= limit;
 }
 
-static DEVICE_ATTR_RO(aslcodeversion);
+/* =============================  */
+/* Fan health statistics          */
+/* ============================   */
+// Collected by the throttling sampler. Dust reduces the airflow, so over
+// months fans reach their target later or not at all and the same fan
+// speed cools less. Kept per fan: actual vs. target speed and the time to
+// reach a new target per fan curve level, and the temperature reached per
+// fan speed bucket (CPU for fan 1, GPU for fan 2).
+
+static const enum SENSOR_ATTR legion_fan_health_rpm_ids[] = {
+	SENSOR_FAN1_RPM_ID, SENSOR_FAN2_RPM_ID
+};
+static const enum SENSOR_ATTR legion_fan_health_target_ids[] = {
+	SENSOR_FAN1_TARGET_RPM_ID, SENSOR_FAN2_TARGET_RPM_ID
+};
+static const enum SENSOR_ATTR legion_fan_health_temp_ids[] = {
+	SENSOR_CPU_TEMP_ID, SENSOR_GPU_TEMP_ID
+};
 
-static ssize_t issupportcpuoc_show(struct device *dev,
-				   struct device_attribute *attr, char *buf)
+// Fan curve level the fan runs at or -1 if unknown. Uses the current
+// point from EC if known, otherwise the point with the target speed.
+// Call with fancurve_mutex held.
+static int legion_fan_health_level(struct legion_private *priv,
+				   const struct sensor_record *record, int fan,
+				   int ec_point)
 {
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_ISSUPPORTCPUOC, false,
-					 1);
-}
+	enum SENSOR_ATTR target_id = legion_fan_health_target_ids[fan];
+	const struct fancurve *fancurve = &priv->fancurve;
+	int target;
+	int i;
 
-static DEVICE_ATTR_RO(issupportcpuoc);
+	if (ec_point >= 0 && ec_point < MAXFANCURVESIZE)
+		return ec_point;
+	if (!test_bit(target_id, &record->valid) || !priv->fancurve_valid ||
+	    fancurve->fan_speed_unit != FAN_SPEED_UNIT_RPM_HUNDRED)
+		return -1;
 
-static ssize_t winkey_show(struct device *dev, struct device_attribute *attr,
-			   char *buf)
-{
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_GETWINKEYSTATUS, true,
-					 1);
+	target = record->values[target_id];
+	for (i = 0; i < fancurve->size; ++i) {
+		int speed = fan == 0 ? fancurve->points[i].speed1 :
+				       fancurve->points[i].speed2;
+
+		if (speed * 100 == target)
+			return i;
+	}
+	return -1;
 }
 
-static ssize_t winkey_store(struct device *dev, struct device_attribute *attr,
-			    const char *buf, size_t count)
+static void legion_fan_health_sample(struct legion_fan_health *health,
+				     const struct sensor_record *record,
+				     const int *levels, ktime_t now)
 {
-	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  LEGION_WMI_GAMEZONE_GUID, 0,
-					  WMI_METHOD_ID_SETWINKEYSTATUS, true,
-					  1);
-}
+	int fan;
 
-static DEVICE_ATTR_RW(winkey);
+	mutex_lock(&health->mutex);
+	for (fan = 0; fan < LEGION_FAN_HEALTH_FANS; ++fan) {
+		enum SENSOR_ATTR rpm_id = legion_fan_health_rpm_ids[fan];
+		enum SENSOR_ATTR target_id = legion_fan_health_target_ids[fan];
+		enum SENSOR_ATTR temp_id = legion_fan_health_temp_ids[fan];
+		struct legion_fan_level_stats *level;
+		int rpm;
+		int target;
 
-// on newer models the touchpad feature in ideapad does not work anymore, so
-// we need this
-static ssize_t touchpad_show(struct device *dev, struct device_attribute *attr,
-			     char *buf)
-{
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_GETTPSTATUS, true, 1);
-}
+		if (!test_bit(rpm_id, &record->valid) ||
+		    !test_bit(target_id, &record->valid))
+			continue;
+		rpm = record->values[rpm_id];
+		target = record->values[target_id];
 
-static ssize_t touchpad_store(struct device *dev, struct device_attribute *attr,
-			      const char *buf, size_t count)
-{
-	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  LEGION_WMI_GAMEZONE_GUID, 0,
-					  WMI_METHOD_ID_SETTPSTATUS, true, 1);
-}
+		if (test_bit(temp_id, &record->valid)) {
+			struct legion_fan_rpm_stats *bucket = &health->rpm[fan][min(
+				rpm / LEGION_FAN_HEALTH_RPM_STEP,
+				LEGION_FAN_HEALTH_RPM_BUCKETS - 1)];
 
-static DEVICE_ATTR_RW(touchpad);
+			bucket->samples++;
+			bucket->temp_sum += record->values[temp_id];
+		}
 
-static ssize_t gsync_show(struct device *dev, struct device_attribute *attr,
-			  char *buf)
+		if (target <= 0) {
+			health->settling[fan] = false;
+			health->last_target[fan] = target;
+			continue;
+		}
+
+		if (target != health->last_target[fan]) {
+			health->settling[fan] = levels[fan] >= 0;
+			health->settle_level[fan] = levels[fan];
+			health->settle_start[fan] = now;
+			health->last_target[fan] = target;
+		}
+		if (health->settling[fan]) {
+			s64 elapsed = ktime_ms_delta(now,
+						     health->settle_start[fan]);
+
+			level = &health->levels[fan][health->settle_level[fan]];
+			if (abs(rpm - target) * 100 <=
+			    target * LEGION_FAN_HEALTH_SETTLED_PERCENT) {
+				level->settle_count++;
+				level->settle_ms += elapsed;
+				health->settling[fan] = false;
+			} else if (elapsed > LEGION_FAN_HEALTH_SETTLE_TIMEOUT_MS) {
+				level->settle_timeouts++;
+				health->settling[fan] = false;
+			}
+		}
+
+		if (levels[fan] < 0)
+			continue;
+		level = &health->levels[fan][levels[fan]];
+		level->samples++;
+		level->rpm_sum += rpm;
+		level->target_sum += target;
+	}
+	mutex_unlock(&health->mutex);
+}
+
+static void legion_fan_health_reset(struct legion_fan_health *health)
 {
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_GETGSYNCSTATUS, true, 1);
+	mutex_lock(&health->mutex);
+	memset(health->levels, 0, sizeof(health->levels));
+	memset(health->rpm, 0, sizeof(health->rpm));
+	memset(health->settling, 0, sizeof(health->settling));
+	memset(health->last_target, 0, sizeof(health->last_target));
+	mutex_unlock(&health->mutex);
 }
 
-static ssize_t gsync_store(struct device *dev, struct device_attribute *attr,
-			   const char *buf, size_t count)
+// Fans stop while suspended, so a target speed that was not reached
+// before suspend must not be counted as settled or timed out after
+// resume. The first sample after resume starts a new measurement.
+static void legion_fan_health_resume(struct legion_fan_health *health)
 {
-	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  LEGION_WMI_GAMEZONE_GUID, 0,
-					  WMI_METHOD_ID_SETGSYNCSTATUS, true,
-					  1);
+	mutex_lock(&health->mutex);
+	memset(health->settling, 0, sizeof(health->settling));
+	memset(health->last_target, 0, sizeof(health->last_target));
+	mutex_unlock(&health->mutex);
 }
 
-static DEVICE_ATTR_RW(gsync);
+// Export and import format, one line per entry:
+// legion_fan_health 1
+// level <i> fan<n>=<samples>,<rpm_sum>,<target_sum>,<settle_count>,<settle_ms>,<settle_timeouts> ...
+// rpm <lower bound> fan<n>=<samples>,<temp_sum> ...
+// Ratios and averages are left to userspace, so saved statistics can be
+// written back and added up, e.g. across reboots.
+#define LEGION_FAN_HEALTH_HEADER "legion_fan_health 1"
 
-static ssize_t powerchargemode_show(struct device *dev,
-				    struct device_attribute *attr, char *buf)
+static ssize_t fan_health_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
 {
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_GETPOWERCHARGEMODE,
-					 false, 1);
+	struct legion_private *priv = dev_get_drvdata(dev);
+	struct legion_fan_health *health = &priv->fan_health;
+	int len = 0;
+	int fan;
+	int i;
+
+	mutex_lock(&health->mutex);
+	len += sysfs_emit_at(buf, len, LEGION_FAN_HEALTH_HEADER "\n");
+	for (i = 0; i < MAXFANCURVESIZE; ++i) {
+		len += sysfs_emit_at(buf, len, "level %d", i);
+		for (fan = 0; fan < LEGION_FAN_HEALTH_FANS; ++fan) {
+			const struct legion_fan_level_stats *level =
+				&health->levels[fan][i];
+
+			len += sysfs_emit_at(buf, len,
+					     " fan%d=%llu,%llu,%llu,%llu,%llu,%llu",
+					     fan + 1, level->samples,
+					     level->rpm_sum, level->target_sum,
+					     level->settle_count,
+					     level->settle_ms,
+					     level->settle_timeouts);
+		}
+		len += sysfs_emit_at(buf, len, "\n");
+	}
+	for (i = 0; i < LEGION_FAN_HEALTH_RPM_BUCKETS; ++i) {
+		len += sysfs_emit_at(buf, len, "rpm %d",
+				     i * LEGION_FAN_HEALTH_RPM_STEP);
+		for (fan = 0; fan < LEGION_FAN_HEALTH_FANS; ++fan)
+			len += sysfs_emit_at(buf, len, " fan%d=%llu,%llu",
+					     fan + 1,
+					     health->rpm[fan][i].samples,
+					     health->rpm[fan][i].temp_sum);
+		len += sysfs_emit_at(buf, len, "\n");
+	}
+	mutex_unlock(&health->mutex);
+	return len;
 }
-static DEVICE_ATTR_RO(powerchargemode);
 
-static ssize_t overdrive_show(struct device *dev, struct device_attribute *attr,
-			      char *buf)
+static int legion_fan_health_import_line(struct legion_fan_health *health,
+					 const char *line)
 {
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_GETODSTATUS, false, 1);
+	struct legion_fan_level_stats level[LEGION_FAN_HEALTH_FANS];
+	struct legion_fan_rpm_stats rpm[LEGION_FAN_HEALTH_FANS];
+	int fan;
+	int i;
+
+	if (sscanf(line,
+		   "level %d fan1=%llu,%llu,%llu,%llu,%llu,%llu fan2=%llu,%llu,%llu,%llu,%llu,%llu",
+		   &i, &level[0].samples, &level[0].rpm_sum,
+		   &level[0].target_sum, &level[0].settle_count,
+		   &level[0].settle_ms, &level[0].settle_timeouts,
+		   &level[1].samples, &level[1].rpm_sum, &level[1].target_sum,
+		   &level[1].settle_count, &level[1].settle_ms,
+		   &level[1].settle_timeouts) == 13) {
+		if (i < 0 || i >= MAXFANCURVESIZE)
+			return -EINVAL;
+		for (fan = 0; fan < LEGION_FAN_HEALTH_FANS; ++fan) {
+			struct legion_fan_level_stats *dst =
+				&health->levels[fan][i];
+
+			dst->samples += level[fan].samples;
+			dst->rpm_sum += level[fan].rpm_sum;
+			dst->target_sum += level[fan].target_sum;
+			dst->settle_count += level[fan].settle_count;
+			dst->settle_ms += level[fan].settle_ms;
+			dst->settle_timeouts += level[fan].settle_timeouts;
+		}
+		return 0;
+	}
+	if (sscanf(line, "rpm %d fan1=%llu,%llu fan2=%llu,%llu", &i,
+		   &rpm[0].samples, &rpm[0].temp_sum, &rpm[1].samples,
+		   &rpm[1].temp_sum) == 5) {
+		if (i < 0 || i % LEGION_FAN_HEALTH_RPM_STEP ||
+		    i / LEGION_FAN_HEALTH_RPM_STEP >=
+			    LEGION_FAN_HEALTH_RPM_BUCKETS)
+			return -EINVAL;
+		i /= LEGION_FAN_HEALTH_RPM_STEP;
+		for (fan = 0; fan < LEGION_FAN_HEALTH_FANS; ++fan) {
+			health->rpm[fan][i].samples += rpm[fan].samples;
+			health->rpm[fan][i].temp_sum += rpm[fan].temp_sum;
+		}
+		return 0;
+	}
+	return -EINVAL;
 }
 
-static ssize_t overdrive_store(struct device *dev,
-			       struct device_attribute *attr, const char *buf,
-			       size_t count)
+// Writing 0 resets the statistics; writing the output of a previous read
+// adds the saved statistics to the current ones.
+static ssize_t fan_health_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t count)
 {
-	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  LEGION_WMI_GAMEZONE_GUID, 0,
-					  WMI_METHOD_ID_SETODSTATUS, false, 1);
-}
+	struct legion_private *priv = dev_get_drvdata(dev);
+	struct legion_fan_health *health = &priv->fan_health;
+	char *copy;
+	char *pos;
+	char *line;
+	int err = 0;
 
-static DEVICE_ATTR_RW(overdrive);
+	if (sysfs_streq(buf, "0")) {
+		legion_fan_health_reset(health);
+		return count;
+	}
 
-static ssize_t thermalmode_show(struct device *dev,
-				struct device_attribute *attr, char *buf)
-{
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_GETTHERMALMODE, false,
-					 1);
-}
-static DEVICE_ATTR_RO(thermalmode);
+	copy = kstrndup(buf, count, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+	pos = copy;
+	line = strsep(&pos, "\n");
+	if (!line || strcmp(strim(line), LEGION_FAN_HEALTH_HEADER)) {
+		kfree(copy);
+		return -EINVAL;
+	}
 
-// TOOD: probably remove again because provided by other means; only useful for overclocking
-static ssize_t cpumaxfrequency_show(struct device *dev,
-				    struct device_attribute *attr, char *buf)
-{
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_GETCPUMAXFREQUENCY,
-					 false, 1);
+	mutex_lock(&health->mutex);
+	while (!err && (line = strsep(&pos, "\n"))) {
+		line = strim(line);
+		if (*line)
+			err = legion_fan_health_import_line(health, line);
+	}
+	mutex_unlock(&health->mutex);
+	kfree(copy);
+	return err ? err : count;
 }
-static DEVICE_ATTR_RO(cpumaxfrequency);
 
-static ssize_t isacfitforoc_show(struct device *dev,
-				 struct device_attribute *attr, char *buf)
+static DEVICE_ATTR_RW(fan_health);
+
+static void legion_throttle_sample(struct legion_private *priv)
 {
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_ISACFITFOROC, false, 1);
+	struct legion_throttle_stats *stats = &priv->throttle;
+	struct legion_throttle_counters *counters;
+	struct sensor_record record;
+	unsigned long states = 0;
+	unsigned long thermalmode = 0;
+	bool thermalmode_valid = false;
+	bool fullspeed;
+	int powermode;
+	int levels[LEGION_FAN_HEALTH_FANS];
+	int temp_limits[2];
+	int point = -1;
+	ktime_t now;
+	u64 delta_ms;
+	int i;
+
+	mutex_lock(&priv->fancurve_mutex);
+	if (read_powermode(priv, &powermode))
+		powermode = -1;
+	read_sensor_record(priv, &record);
+
+	if (legion_has_capability(priv, LEGION_CAP_FANFULLSPEED) &&
+	    !read_fanfullspeed(priv, &fullspeed) && fullspeed)
+		set_bit(LEGION_THROTTLE_FULLSPEED, &states);
+
+	// current fan curve point is only known with direct EC access
+	if (priv->conf->access_method_fancurve == ACCESS_METHOD_EC &&
+	    priv->fancurve_valid && priv->fancurve.size > 0) {
+		point = ecram_read(&priv->ecram,
+				   priv->conf->registers->EXT_FAN_CUR_POINT);
+		if (point + 1 >= priv->fancurve.size)
+			set_bit(LEGION_THROTTLE_FAN_SATURATED, &states);
+	}
+	for (i = 0; i < LEGION_FAN_HEALTH_FANS; ++i)
+		levels[i] = legion_fan_health_level(priv, &record, i, point);
+	if (legion_throttle_fan_lagging(&record, SENSOR_FAN1_RPM_ID,
+					SENSOR_FAN1_TARGET_RPM_ID) ||
+	    legion_throttle_fan_lagging(&record, SENSOR_FAN2_RPM_ID,
+					SENSOR_FAN2_TARGET_RPM_ID))
+		set_bit(LEGION_THROTTLE_FAN_LAGGING, &states);
+	mutex_unlock(&priv->fancurve_mutex);
+
+	// the remaining WMI reads do not need fancurve_mutex, so they
+	// do not block writers of the fan curve
+	legion_throttle_temp_limits(priv, powermode, temp_limits);
+	if (legion_throttle_temp_limit(&record, SENSOR_CPU_TEMP_ID,
+				       temp_limits[0]))
+		set_bit(LEGION_THROTTLE_CPU_TEMP_LIMIT, &states);
+	if (legion_throttle_temp_limit(&record, SENSOR_GPU_TEMP_ID,
+				       temp_limits[1]))
+		set_bit(LEGION_THROTTLE_GPU_TEMP_LIMIT, &states);
+
+	if (legion_has_capability(priv, LEGION_CAP_WMI_GAMEZONE))
+		thermalmode_valid = !wmi_exec_noarg_int(
+			LEGION_WMI_GAMEZONE_GUID, 0,
+			WMI_METHOD_ID_GETTHERMALMODE, &thermalmode);
+
+	mutex_lock(&stats->mutex);
+	now = ktime_get();
+	// count time since last sample for the current state, but not
+	// more than two periods, e.g. after suspend
+	delta_ms = stats->last_valid ?
+			   ktime_ms_delta(now, stats->last_sample) :
+			   throttle_sample_ms;
+	delta_ms = min_t(u64, delta_ms, 2 * (u64)throttle_sample_ms);
+
+	counters = &stats->counters[legion_throttle_profile(powermode)];
+	counters->samples++;
+	counters->time_ms += delta_ms;
+	for (i = 0; i < LEGION_THROTTLE_STATE_MAX; ++i) {
+		if (!test_bit(i, &states))
+			continue;
+		counters->state_ms[i] += delta_ms;
+		if (!stats->last_valid || !test_bit(i, &stats->last_states))
+			counters->entered[i]++;
+	}
+	if (thermalmode_valid) {
+		if (stats->last_valid && thermalmode != stats->last_thermalmode)
+			counters->thermalmode_changes++;
+		stats->last_thermalmode = thermalmode;
+	}
+	stats->last_states = states;
+	stats->last_sample = now;
+	stats->last_valid = true;
+	mutex_unlock(&stats->mutex);
+
+	legion_fan_health_sample(&priv->fan_health, &record, levels, now);
 }
-static DEVICE_ATTR_RO(isacfitforoc);
 
-static ssize_t igpumode_show(struct device *dev, struct device_attribute *attr,
-			     char *buf)
+static void legion_throttle_work(struct work_struct *work)
 {
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_GETIGPUMODESTATUS, false,
-					 1);
+	struct legion_private *priv = container_of(
+		to_delayed_work(work), struct legion_private, throttle_work);
+
+	legion_throttle_sample(priv);
+	schedule_delayed_work(&priv->throttle_work,
+			      msecs_to_jiffies(throttle_sample_ms));
 }
 
-static ssize_t igpumode_store(struct device *dev, struct device_attribute *attr,
-			      const char *buf, size_t count)
+static void legion_throttle_reset(struct legion_throttle_stats *stats)
 {
-	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  LEGION_WMI_GAMEZONE_GUID, 0,
-					  WMI_METHOD_ID_SETIGPUMODESTATUS,
-					  false, 1);
+	mutex_lock(&stats->mutex);
+	memset(stats->counters, 0, sizeof(stats->counters));
+	stats->reset_time = ktime_get();
+	stats->last_valid = false;
+	mutex_unlock(&stats->mutex);
 }
 
-static DEVICE_ATTR_RW(igpumode);
-
-static ssize_t notify_dgpu_store(struct device *dev,
-				 struct device_attribute *attr, const char *buf,
-				 size_t count)
+static void legion_throttle_init(struct legion_private *priv)
 {
-	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  LEGION_WMI_GAMEZONE_GUID, 0,
-					  WMI_METHOD_ID_NOTIFYDGPUSTATUS, false,
-					  1);
+	mutex_init(&priv->throttle.mutex);
+	legion_throttle_reset(&priv->throttle);
+	mutex_init(&priv->fan_health.mutex);
+	legion_fan_health_reset(&priv->fan_health);
+	INIT_DELAYED_WORK(&priv->throttle_work, legion_throttle_work);
 }
 
-static DEVICE_ATTR_WO(notify_dgpu);
-
-static ssize_t issupportigpumode_show(struct device *dev,
-				      struct device_attribute *attr, char *buf)
+static void legion_throttle_start(struct legion_private *priv)
 {
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_ISSUPPORTIGPUMODE, false,
-					 1);
+	if (throttle_sample_ms == 0)
+		return;
+	pr_info("Sampling throttling state every %u ms\n", throttle_sample_ms);
+	priv->throttle_started = true;
+	schedule_delayed_work(&priv->throttle_work, 0);
 }
 
-static DEVICE_ATTR_RO(issupportigpumode);
-
-static ssize_t issupportgsync_show(struct device *dev,
-				   struct device_attribute *attr, char *buf)
+static void legion_throttle_stop(struct legion_private *priv)
 {
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 LEGION_WMI_GAMEZONE_GUID, 0,
-					 WMI_METHOD_ID_ISSUPPORTGSYNC, false, 1);
+	cancel_delayed_work_sync(&priv->throttle_work);
 }
 
-static DEVICE_ATTR_RO(issupportgsync);
-
-static ssize_t cpu_oc_show(struct device *dev, struct device_attribute *attr,
-			   char *buf)
+// Do not access EC and WMI while the platform is suspended
+static void legion_throttle_suspend(struct legion_private *priv)
 {
-	return show_simple_wmi_attribute_from_buffer(
-		dev, attr, buf, WMI_GUID_LENOVO_CPU_METHOD, 0,
-		WMI_METHOD_ID_CPU_GET_OC_STATUS, 16, 0, 1);
+	cancel_delayed_work_sync(&priv->throttle_work);
 }
 
-static ssize_t cpu_oc_store(struct device *dev, struct device_attribute *attr,
-			    const char *buf, size_t count)
+static void legion_throttle_resume(struct legion_private *priv)
 {
-	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  WMI_GUID_LENOVO_CPU_METHOD, 0,
-					  WMI_METHOD_ID_CPU_SET_OC_STATUS,
-					  false, 1);
+	if (!priv->throttle_started)
+		return;
+	// power mode and limits might have been changed by the firmware
+	legion_throttle_invalidate_temp_limits(priv);
+	legion_fan_health_resume(&priv->fan_health);
+	schedule_delayed_work(&priv->throttle_work,
+			      msecs_to_jiffies(throttle_sample_ms));
 }
 
-static DEVICE_ATTR_RW(cpu_oc);
-
-static ssize_t wmi_common_method_other_show(struct legion_private *priv, char *buf,
-				      int feature_id)
+// One line per power mode:
+// <mode> samples=<n> time_ms=<ms> <state>=<times entered>,<ms in state> ...
+// thermalmode_changes=<n>
+static ssize_t throttle_stats_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
 {
-	int err, out;
+	struct legion_private *priv = dev_get_drvdata(dev);
+	struct legion_throttle_stats *stats = &priv->throttle;
+	const struct legion_throttle_counters *counters;
+	int len = 0;
+	int profile;
+	int i;
 
-	mutex_lock(&priv->fancurve_mutex);
-	err = wmi_other_method_get_value(feature_id, &out);
-	mutex_unlock(&priv->fancurve_mutex);
+	mutex_lock(&stats->mutex);
+	len += sysfs_emit_at(buf, len, "since_ms=%lld\n",
+			     ktime_ms_delta(ktime_get(), stats->reset_time));
+	for (profile = 0; profile < LEGION_THROTTLE_PROFILE_MAX; ++profile) {
+		counters = &stats->counters[profile];
+		len += sysfs_emit_at(buf, len, "%s samples=%llu time_ms=%llu",
+				     legion_throttle_profile_names[profile],
+				     counters->samples, counters->time_ms);
+		for (i = 0; i < LEGION_THROTTLE_STATE_MAX; ++i)
+			len += sysfs_emit_at(buf, len, " %s=%llu,%llu",
+					     legion_throttle_state_names[i],
+					     counters->entered[i],
+					     counters->state_ms[i]);
+		len += sysfs_emit_at(buf, len, " thermalmode_changes=%llu\n",
+				     counters->thermalmode_changes);
+	}
+	mutex_unlock(&stats->mutex);
+	return len;
+}
+
+// Writing 0 resets the statistics
+static ssize_t throttle_stats_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct legion_private *priv = dev_get_drvdata(dev);
+	int value;
+	int err;
 
+	err = kstrtoint(buf, 0, &value);
 	if (err)
+		return err;
+	if (value != 0)
 		return -EINVAL;
 
-	return sysfs_emit(buf, "%d\n", out);
+	legion_throttle_reset(&priv->throttle);
+	return count;
 }
 
-static ssize_t wmi_common_method_other_store(struct legion_private *priv,
-					     const char *buf, size_t count,
-					     int feature_id)
-{
-	// TODO:  use DEV, TYP, FEA, plus Powermode as key to lookup
-	// on capability data CD0, CD1 for :
-	//  - if feature is enabled for laptop model
-	//  - if value (DAT1) is valid (on/off, exact value, step, range)
-	int err, value, output;
+static DEVICE_ATTR_RW(throttle_stats);
 
-	err = kstrtoint(buf, 0, &value);
-	if (err)
-		return err;
+/* =============================  */
+/* Generic netlink protocol       */
+/* ============================   */
+// Generic netlink family "legion" to read the whole state with one request
+// and to write several values at once. Keep in sync with user space.
+
+#define LEGION_NL_FAMILY_NAME LEGION_DRVR_SHORTNAME
+#define LEGION_NL_VERSION 1
+#define LEGION_NL_MCGRP_EVENTS "events"
+
+enum legion_nl_cmd {
+	LEGION_NL_CMD_UNSPEC = 0,
+	// reply contains all attributes that can be read
+	LEGION_NL_CMD_GET_STATE,
+	// accepts LEGION_NL_ATTR_POWERMODE, LEGION_NL_ATTR_FANFULLSPEED,
+	// and LEGION_NL_ATTR_POWERLIMITS
+	LEGION_NL_CMD_SET_STATE,
+	// sent to multicast group "events" with LEGION_NL_ATTR_EVENT
+	LEGION_NL_CMD_EVENT,
+	__LEGION_NL_CMD_MAX
+};
 
-	mutex_lock(&priv->fancurve_mutex);
-	err = wmi_other_method_set_value(feature_id, value, &output);
-	mutex_unlock(&priv->fancurve_mutex);
+enum legion_nl_attr {
+	LEGION_NL_ATTR_UNSPEC = 0,
+	LEGION_NL_ATTR_CPU_TEMP, // s32, celsius
+	LEGION_NL_ATTR_GPU_TEMP, // s32, celsius
+	LEGION_NL_ATTR_IC_TEMP, // s32, celsius
+	LEGION_NL_ATTR_FAN1_RPM, // s32
+	LEGION_NL_ATTR_FAN2_RPM, // s32
+	LEGION_NL_ATTR_FAN3_RPM, // s32
+	LEGION_NL_ATTR_FAN4_RPM, // s32
+	LEGION_NL_ATTR_FAN1_TARGET_RPM, // s32
+	LEGION_NL_ATTR_FAN2_TARGET_RPM, // s32
+	LEGION_NL_ATTR_POWERMODE, // u32, same values as powermode attribute
+	LEGION_NL_ATTR_FANFULLSPEED, // u8
+	// nested: LEGION_NL_ATTR_FANCURVE_POINT for each point
+	LEGION_NL_ATTR_FANCURVE,
+	// nested: attribute type is enum legion_powerlimit_id + 1, s32 watt
+	LEGION_NL_ATTR_POWERLIMITS,
+	LEGION_NL_ATTR_EVENT, // u32, enum legion_nl_event
+	LEGION_NL_ATTR_TIMESTAMP, // u64, ns CLOCK_MONOTONIC of sensor values
+	LEGION_NL_ATTR_PAD,
+	__LEGION_NL_ATTR_MAX
+};
 
-	if (err)
-		return -EINVAL;
+#define LEGION_NL_ATTR_MAX (__LEGION_NL_ATTR_MAX - 1)
 
-	return count;
-}
+// nested in LEGION_NL_ATTR_FANCURVE
+enum legion_nl_fancurve_attr {
+	LEGION_NL_FANCURVE_UNSPEC = 0,
+	LEGION_NL_FANCURVE_POINT, // nested: enum legion_nl_point_attr
+	__LEGION_NL_FANCURVE_MAX
+};
 
-static ssize_t cpu_shortterm_powerlimit_show(struct device *dev,
-					     struct device_attribute *attr,
-					     char *buf)
-{
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
+// nested in LEGION_NL_FANCURVE_POINT; all u8 as in struct fancurve_point
+enum legion_nl_point_attr {
+	LEGION_NL_POINT_UNSPEC = 0,
+	LEGION_NL_POINT_SPEED1,
+	LEGION_NL_POINT_SPEED2,
+	LEGION_NL_POINT_ACCEL,
+	LEGION_NL_POINT_DECEL,
+	LEGION_NL_POINT_CPU_MAX_TEMP,
+	LEGION_NL_POINT_CPU_MIN_TEMP,
+	LEGION_NL_POINT_GPU_MAX_TEMP,
+	LEGION_NL_POINT_GPU_MIN_TEMP,
+	LEGION_NL_POINT_IC_MAX_TEMP,
+	LEGION_NL_POINT_IC_MIN_TEMP,
+	__LEGION_NL_POINT_MAX
+};
 
-	switch (priv->conf->access_method_powerlimits) {
-	case ACCESS_METHOD_WMI3:
-		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_CPU_SHORT_TERM_POWER_LIMIT);
-	default:
-		err = show_simple_wmi_attribute_from_buffer(
-				dev, attr, buf, WMI_GUID_LENOVO_CPU_METHOD, 0,
-				WMI_METHOD_ID_CPU_GET_SHORTTERM_POWERLIMIT, 16, 0, 1);
-	}
-	return err;
-}
+enum legion_nl_event {
+	LEGION_NL_EVENT_POWERMODE = 1,
+	LEGION_NL_EVENT_POWERLIMITS,
+};
 
-static ssize_t cpu_shortterm_powerlimit_store(struct device *dev,
-					      struct device_attribute *attr,
-					      const char *buf, size_t count)
+static void legion_nl_event(enum legion_nl_event event);
+
+/* =============================  */
+/* sysfs interface                */
+/* ============================   */
+
+static int show_simple_wmi_attribute(struct device *dev,
+				     struct device_attribute *attr, char *buf,
+				     const char *guid, u8 instance,
+				     u32 method_id, bool invert,
+				     unsigned long scale)
 {
+	unsigned long state = 0;
+	int err;
 	struct legion_private *priv = dev_get_drvdata(dev);
 
-	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
-		return wmi_common_method_other_store(priv, buf, count,
-						     OtherMethodFeature_CPU_SHORT_TERM_POWER_LIMIT);
+	mutex_lock(&priv->fancurve_mutex);
+	err = get_simple_wmi_attribute(priv, guid, instance, method_id, invert,
+				       scale, &state);
+	mutex_unlock(&priv->fancurve_mutex);
 
-	return store_simple_wmi_attribute(
-		dev, attr, buf, count, WMI_GUID_LENOVO_CPU_METHOD, 0,
-		WMI_METHOD_ID_CPU_SET_SHORTTERM_POWERLIMIT, false, 1);
-}
+	if (err)
+		return err;
 
-static DEVICE_ATTR_RW(cpu_shortterm_powerlimit);
+	return sysfs_emit(buf, "%lu\n", state);
+}
 
-static ssize_t cpu_longterm_powerlimit_show(struct device *dev,
-					    struct device_attribute *attr,
-					    char *buf)
+static int show_simple_wmi_attribute_from_buffer(struct device *dev,
+						 struct device_attribute *attr,
+						 char *buf, const char *guid,
+						 u8 instance, u32 method_id,
+						 size_t ressize, size_t i,
+						 int scale)
 {
 	int err;
+	unsigned long value;
 	struct legion_private *priv = dev_get_drvdata(dev);
 
-	switch (priv->conf->access_method_powerlimits) {
-	case ACCESS_METHOD_WMI3:
-		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_CPU_LONG_TERM_POWER_LIMIT);
-	default:
-	  err = show_simple_wmi_attribute_from_buffer(
-				dev, attr, buf, WMI_GUID_LENOVO_CPU_METHOD, 0,
-				WMI_METHOD_ID_CPU_GET_LONGTERM_POWERLIMIT, 16, 0, 1);
+	if (i >= ressize) {
+		pr_info("Index not within buffer size\n");
+		return -EINVAL;
 	}
-	return err;
-}
-
-static ssize_t cpu_longterm_powerlimit_store(struct device *dev,
-					     struct device_attribute *attr,
-					     const char *buf, size_t count)
-{
-	struct legion_private *priv = dev_get_drvdata(dev);
 
-	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
-		return wmi_common_method_other_store(priv, buf, count,
-						     OtherMethodFeature_CPU_LONG_TERM_POWER_LIMIT);
+	mutex_lock(&priv->fancurve_mutex);
+	err = wmi_exec_noarg_int_or_buffer(guid, instance, method_id, ressize,
+					     i, &value);
+	mutex_unlock(&priv->fancurve_mutex);
+	if (err)
+		return err;
 
-	return store_simple_wmi_attribute(
-		dev, attr, buf, count, WMI_GUID_LENOVO_CPU_METHOD, 0,
-		WMI_METHOD_ID_CPU_SET_LONGTERM_POWERLIMIT, false, 1);
+	return sysfs_emit(buf, "%lu\n", scale * value);
 }
 
-static DEVICE_ATTR_RW(cpu_longterm_powerlimit);
-
-static ssize_t cpu_default_powerlimit_show(struct device *dev,
-					   struct device_attribute *attr,
-					   char *buf)
+static int store_simple_wmi_attribute(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count,
+				      const char *guid, u8 instance,
+				      u32 method_id, bool invert, int scale)
 {
-	return show_simple_wmi_attribute(
-		dev, attr, buf, WMI_GUID_LENOVO_CPU_METHOD, 0,
-		WMI_METHOD_ID_CPU_GET_DEFAULT_POWERLIMIT, false, 1);
-}
+	int state;
+	int err;
+	struct legion_private *priv = dev_get_drvdata(dev);
 
-static DEVICE_ATTR_RO(cpu_default_powerlimit);
+	err = kstrtouint(buf, 0, &state);
+	if (err)
+		return err;
+	err = set_simple_wmi_attribute(priv, guid, instance, method_id, invert,
+				       scale, state);
+	if (err)
+		return err;
+	return count;
+}
 
-static ssize_t cpu_peak_powerlimit_show(struct device *dev,
-					struct device_attribute *attr,
-					char *buf)
+static ssize_t lockfancontroller_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
 {
 	struct legion_private *priv = dev_get_drvdata(dev);
+	bool is_lockfancontroller;
+	int err;
 
-	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
-		return wmi_common_method_other_show(priv, buf,
-						    OtherMethodFeature_CPU_PEAK_POWER_LIMIT);
+	mutex_lock(&priv->fancurve_mutex);
+	err = ec_read_lockfancontroller(&priv->ecram, priv->conf,
+					&is_lockfancontroller);
+	mutex_unlock(&priv->fancurve_mutex);
+	if (err)
+		return -EINVAL;
 
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 WMI_GUID_LENOVO_GPU_METHOD, 0,
-					 WMI_METHOD_ID_CPU_GET_PEAK_POWERLIMIT,
-					 false, 1);
+	return sysfs_emit(buf, "%d\n", is_lockfancontroller);
 }
 
-static ssize_t cpu_peak_powerlimit_store(struct device *dev,
-					 struct device_attribute *attr,
-					 const char *buf, size_t count)
+static ssize_t lockfancontroller_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
 {
 	struct legion_private *priv = dev_get_drvdata(dev);
+	bool is_lockfancontroller;
+	int err;
 
-	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
-		return wmi_common_method_other_store(priv, buf, count,
-						     OtherMethodFeature_CPU_PEAK_POWER_LIMIT);
+	err = kstrtobool(buf, &is_lockfancontroller);
+	if (err)
+		return err;
 
-	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  WMI_GUID_LENOVO_GPU_METHOD, 0,
-					  WMI_METHOD_ID_CPU_SET_PEAK_POWERLIMIT,
-					  false, 1);
+	mutex_lock(&priv->fancurve_mutex);
+	err = ec_write_lockfancontroller(&priv->ecram, priv->conf,
+					 is_lockfancontroller);
+	mutex_unlock(&priv->fancurve_mutex);
+	if (err)
+		return -EINVAL;
+
+	return count;
 }
 
-static DEVICE_ATTR_RW(cpu_peak_powerlimit);
+static DEVICE_ATTR_RW(lockfancontroller);
 
-static ssize_t cpu_apu_sppt_powerlimit_show(struct device *dev,
-					    struct device_attribute *attr,
-					    char *buf)
+static ssize_t rapidcharge_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
 {
+	bool state = false;
+	int err;
 	struct legion_private *priv = dev_get_drvdata(dev);
 
-	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
-		return wmi_common_method_other_show(priv, buf,
-						    OtherMethodFeature_APU_PPT_POWER_LIMIT);
+	mutex_lock(&priv->fancurve_mutex);
+	err = acpi_read_rapidcharge(priv->adev, &state);
+	mutex_unlock(&priv->fancurve_mutex);
+	if (err)
+		return err;
 
-	return show_simple_wmi_attribute(
-		dev, attr, buf, WMI_GUID_LENOVO_GPU_METHOD, 0,
-		WMI_METHOD_ID_CPU_GET_APU_SPPT_POWERLIMIT, false, 1);
+	return sysfs_emit(buf, "%d\n", state);
 }
 
-static ssize_t cpu_apu_sppt_powerlimit_store(struct device *dev,
-					     struct device_attribute *attr,
-					     const char *buf, size_t count)
+static ssize_t rapidcharge_store(struct device *dev,
+				 struct device_attribute *attr, const char *buf,
+				 size_t count)
 {
 	struct legion_private *priv = dev_get_drvdata(dev);
+	int state;
+	int err;
 
-	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
-		return wmi_common_method_other_store(priv, buf, count,
-						     OtherMethodFeature_APU_PPT_POWER_LIMIT);
+	err = kstrtouint(buf, 0, &state);
+	if (err)
+		return err;
 
-	return store_simple_wmi_attribute(
-		dev, attr, buf, count, WMI_GUID_LENOVO_GPU_METHOD, 0,
-		WMI_METHOD_ID_CPU_SET_APU_SPPT_POWERLIMIT, false, 1);
+	mutex_lock(&priv->fancurve_mutex);
+	err = acpi_write_rapidcharge(priv->adev, state);
+	mutex_unlock(&priv->fancurve_mutex);
+	if (err)
+		return err;
+
+	return count;
 }
 
-static DEVICE_ATTR_RW(cpu_apu_sppt_powerlimit);
+static DEVICE_ATTR_RW(rapidcharge);
 
-static ssize_t cpu_cross_loading_powerlimit_show(struct device *dev,
-						 struct device_attribute *attr,
-						 char *buf)
+static ssize_t issupportgpuoc_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
 {
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
-
-	switch (priv->conf->access_method_powerlimits) {
-	case ACCESS_METHOD_WMI3:
-		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_CPU_CROSS_LOAD_POWER_LIMIT);
-	default:
-		err = show_simple_wmi_attribute(
-				dev, attr, buf, WMI_GUID_LENOVO_GPU_METHOD, 0,
-				WMI_METHOD_ID_CPU_GET_CROSS_LOADING_POWERLIMIT, false, 1);
-	}
-	return err;
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_ISSUPPORTGPUOC, false,
+					 1);
 }
 
-static ssize_t cpu_cross_loading_powerlimit_store(struct device *dev,
-						  struct device_attribute *attr,
-						  const char *buf, size_t count)
+static DEVICE_ATTR_RO(issupportgpuoc);
+
+static ssize_t aslcodeversion_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
 {
-	struct legion_private *priv = dev_get_drvdata(dev);
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_GETVERSION, false, 1);
+}
 
-	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
-		return wmi_common_method_other_store(priv, buf, count,
-						     OtherMethodFeature_CPU_CROSS_LOAD_POWER_LIMIT);
+static DEVICE_ATTR_RO(aslcodeversion);
 
-	return store_simple_wmi_attribute(
-		dev, attr, buf, count, WMI_GUID_LENOVO_GPU_METHOD, 0,
-		WMI_METHOD_ID_CPU_SET_CROSS_LOADING_POWERLIMIT, false, 1);
+static ssize_t issupportcpuoc_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_ISSUPPORTCPUOC, false,
+					 1);
 }
 
-static DEVICE_ATTR_RW(cpu_cross_loading_powerlimit);
+static DEVICE_ATTR_RO(issupportcpuoc);
 
-static ssize_t gpu_oc_show(struct device *dev, struct device_attribute *attr,
+static ssize_t winkey_show(struct device *dev, struct device_attribute *attr,
 			   char *buf)
 {
-	int err;
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_GETWINKEYSTATUS, true,
+					 1);
+}
 
-	err = show_simple_wmi_attribute(dev, attr, buf,
-					WMI_GUID_LENOVO_GPU_METHOD, 0,
-					WMI_METHOD_ID_GPU_GET_OC_STATUS, false,
-					1);
-	return err;
-}
-
-static ssize_t gpu_oc_store(struct device *dev, struct device_attribute *attr,
+static ssize_t winkey_store(struct device *dev, struct device_attribute *attr,
 			    const char *buf, size_t count)
 {
 	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  WMI_GUID_LENOVO_GPU_METHOD, 0,
-					  WMI_METHOD_ID_GPU_SET_OC_STATUS,
-					  false, 1);
+					  LEGION_WMI_GAMEZONE_GUID, 0,
+					  WMI_METHOD_ID_SETWINKEYSTATUS, true,
+					  1);
 }
 
-static DEVICE_ATTR_RW(gpu_oc);
+static DEVICE_ATTR_RW(winkey);
 
-static ssize_t gpu_ppab_powerlimit_show(struct device *dev,
-					struct device_attribute *attr,
-					char *buf)
+// on newer models the touchpad feature in ideapad does not work anymore, so
+// we need this
+static ssize_t touchpad_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
 {
-	struct legion_private *priv = dev_get_drvdata(dev);
-
-	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
-		return wmi_common_method_other_show(priv, buf,
-						    OtherMethodFeature_GPU_POWER_BOOST);
-
-	return show_simple_wmi_attribute_from_buffer(
-		dev, attr, buf, WMI_GUID_LENOVO_GPU_METHOD, 0,
-		WMI_METHOD_ID_GPU_GET_PPAB_POWERLIMIT, 16, 0, 1);
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_GETTPSTATUS, true, 1);
 }
 
-static ssize_t gpu_ppab_powerlimit_store(struct device *dev,
-					 struct device_attribute *attr,
-					 const char *buf, size_t count)
+static ssize_t touchpad_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
 {
-	struct legion_private *priv = dev_get_drvdata(dev);
-
-	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
-		return wmi_common_method_other_store(priv, buf, count,
-						     OtherMethodFeature_GPU_POWER_BOOST);
-
 	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  WMI_GUID_LENOVO_GPU_METHOD, 0,
-					  WMI_METHOD_ID_GPU_SET_PPAB_POWERLIMIT,
-					  false, 1);
+					  LEGION_WMI_GAMEZONE_GUID, 0,
+					  WMI_METHOD_ID_SETTPSTATUS, true, 1);
 }
 
-static DEVICE_ATTR_RW(gpu_ppab_powerlimit);
+static DEVICE_ATTR_RW(touchpad);
 
-static ssize_t gpu_ctgp_powerlimit_show(struct device *dev,
-					struct device_attribute *attr,
-					char *buf)
+static ssize_t gsync_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
 {
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
-
-	switch (priv->conf->access_method_powerlimits) {
-	case ACCESS_METHOD_WMI3:
-		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_GPU_cTGP);
-	default:
-		err = show_simple_wmi_attribute_from_buffer(
-				dev, attr, buf, WMI_GUID_LENOVO_GPU_METHOD, 0,
-				WMI_METHOD_ID_GPU_GET_CTGP_POWERLIMIT, 16, 0, 1);
-	}
-	return err;
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_GETGSYNCSTATUS, true, 1);
 }
 
-static ssize_t gpu_ctgp_powerlimit_store(struct device *dev,
-					 struct device_attribute *attr,
-					 const char *buf, size_t count)
+static ssize_t gsync_store(struct device *dev, struct device_attribute *attr,
+			   const char *buf, size_t count)
 {
-	struct legion_private *priv = dev_get_drvdata(dev);
-
-	if (priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3)
-		return wmi_common_method_other_store(priv, buf, count,
-						     OtherMethodFeature_GPU_cTGP);
-
 	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  WMI_GUID_LENOVO_GPU_METHOD, 0,
-					  WMI_METHOD_ID_GPU_SET_CTGP_POWERLIMIT,
-					  false, 1);
+					  LEGION_WMI_GAMEZONE_GUID, 0,
+					  WMI_METHOD_ID_SETGSYNCSTATUS, true,
+					  1);
 }
 
-static DEVICE_ATTR_RW(gpu_ctgp_powerlimit);
+static DEVICE_ATTR_RW(gsync);
 
-static ssize_t gpu_ctgp2_powerlimit_show(struct device *dev,
-					 struct device_attribute *attr,
-					 char *buf)
+static ssize_t powerchargemode_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
 {
-	return show_simple_wmi_attribute_from_buffer(
-		dev, attr, buf, WMI_GUID_LENOVO_GPU_METHOD, 0,
-		WMI_METHOD_ID_GPU_GET_CTGP_POWERLIMIT, 16, 0x0C, 1);
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_GETPOWERCHARGEMODE,
+					 false, 1);
 }
+static DEVICE_ATTR_RO(powerchargemode);
 
-static DEVICE_ATTR_RO(gpu_ctgp2_powerlimit);
-
-// TOOD: probably remove again because provided by other means; only useful for overclocking
-static ssize_t
-gpu_default_ppab_ctrgp_powerlimit_show(struct device *dev,
-				       struct device_attribute *attr, char *buf)
+static ssize_t overdrive_show(struct device *dev, struct device_attribute *attr,
+			      char *buf)
 {
-	return show_simple_wmi_attribute(
-		dev, attr, buf, WMI_GUID_LENOVO_GPU_METHOD, 0,
-		WMI_METHOD_ID_GPU_GET_DEFAULT_PPAB_CTGP_POWERLIMIT, false, 1);
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_GETODSTATUS, false, 1);
 }
-static DEVICE_ATTR_RO(gpu_default_ppab_ctrgp_powerlimit);
 
-static ssize_t gpu_temperature_limit_show(struct device *dev,
-					  struct device_attribute *attr,
-					  char *buf)
+static ssize_t overdrive_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
 {
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
-
-	switch (priv->conf->access_method_powerlimits) {
-	case ACCESS_METHOD_WMI3:
-		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_GPU_TEMPERATURE_LIMIT);
-	default:
-		err = show_simple_wmi_attribute(
-				dev, attr, buf, WMI_GUID_LENOVO_GPU_METHOD, 0,
-				WMI_METHOD_ID_GPU_GET_TEMPERATURE_LIMIT, false, 1);
-	}
-	return err;
+	return store_simple_wmi_attribute(dev, attr, buf, count,
+					  LEGION_WMI_GAMEZONE_GUID, 0,
+					  WMI_METHOD_ID_SETODSTATUS, false, 1);
 }
 
-static ssize_t gpu_temperature_limit_store(struct device *dev,
-					   struct device_attribute *attr,
-					   const char *buf, size_t count)
+static DEVICE_ATTR_RW(overdrive);
+
+static ssize_t thermalmode_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
 {
-	return store_simple_wmi_attribute(
-		dev, attr, buf, count, WMI_GUID_LENOVO_GPU_METHOD, 0,
-		WMI_METHOD_ID_GPU_SET_TEMPERATURE_LIMIT, false, 1);
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_GETTHERMALMODE, false,
+					 1);
 }
+static DEVICE_ATTR_RO(thermalmode);
 
-static ssize_t cpu_temperature_limit_show(struct device *dev,
-					  struct device_attribute *attr,
-					  char *buf)
+// TOOD: probably remove again because provided by other means; only useful for overclocking
+static ssize_t cpumaxfrequency_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
 {
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
-
-	switch (priv->conf->access_method_powerlimits) {
-	case ACCESS_METHOD_WMI3:
-		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_CPU_TEMPERATURE_LIMIT);
-	default:
-		return -EINVAL;
-	}
-	return err;
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_GETCPUMAXFREQUENCY,
+					 false, 1);
 }
+static DEVICE_ATTR_RO(cpumaxfrequency);
 
-static ssize_t cpu_temperature_limit_store(struct device *dev,
-					   struct device_attribute *attr,
-					   const char *buf, size_t count)
+static ssize_t isacfitforoc_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
 {
-	// TODO:
-	return -EINVAL;
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_ISACFITFOROC, false, 1);
 }
+static DEVICE_ATTR_RO(isacfitforoc);
 
-static ssize_t cpu_l1_tau_show(struct device *dev,
-					  struct device_attribute *attr,
-					  char *buf)
+static ssize_t igpumode_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
 {
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
-
-	switch (priv->conf->access_method_powerlimits) {
-	case ACCESS_METHOD_WMI3:
-		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_CPU_L1_TAU);
-	default:
-		return -EINVAL;
-	}
-	return err;
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_GETIGPUMODESTATUS, false,
+					 1);
 }
 
-static ssize_t cpu_l1_tau_store(struct device *dev,
-					   struct device_attribute *attr,
-					   const char *buf, size_t count)
+static ssize_t igpumode_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
 {
-	// TODO:
-	return -EINVAL;
+	return store_simple_wmi_attribute(dev, attr, buf, count,
+					  LEGION_WMI_GAMEZONE_GUID, 0,
+					  WMI_METHOD_ID_SETIGPUMODESTATUS,
+					  false, 1);
 }
 
-static ssize_t gpu_power_target_offset_show(struct device *dev,
-					  struct device_attribute *attr,
-					  char *buf)
-{
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
+static DEVICE_ATTR_RW(igpumode);
 
-	switch (priv->conf->access_method_powerlimits) {
-	case ACCESS_METHOD_WMI3:
-		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_GPU_POWER_TARGET_ON_AC_OFFSET_FROM_BASELINE);
-	default:
-		return -EINVAL;
-	}
-	return err;
+static ssize_t notify_dgpu_store(struct device *dev,
+				 struct device_attribute *attr, const char *buf,
+				 size_t count)
+{
+	return store_simple_wmi_attribute(dev, attr, buf, count,
+					  LEGION_WMI_GAMEZONE_GUID, 0,
+					  WMI_METHOD_ID_NOTIFYDGPUSTATUS, false,
+					  1);
 }
 
-static ssize_t gpu_power_target_offset_store(struct device *dev,
-					   struct device_attribute *attr,
-					   const char *buf, size_t count)
+static DEVICE_ATTR_WO(notify_dgpu);
+
+static ssize_t issupportigpumode_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
 {
-	// TODO:
-	return -EINVAL;
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_ISSUPPORTIGPUMODE, false,
+					 1);
 }
 
-static DEVICE_ATTR_RW(gpu_temperature_limit);
-static DEVICE_ATTR_RW(cpu_temperature_limit);
-static DEVICE_ATTR_RW(cpu_l1_tau);
-static DEVICE_ATTR_RW(gpu_power_target_offset);
+static DEVICE_ATTR_RO(issupportigpumode);
 
-// TOOD: probably remove again because provided by other means; only useful for overclocking
-static ssize_t gpu_boost_clock_show(struct device *dev,
-				    struct device_attribute *attr, char *buf)
+static ssize_t issupportgsync_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
 {
 	return show_simple_wmi_attribute(dev, attr, buf,
-					 WMI_GUID_LENOVO_GPU_METHOD, 0,
-					 WMI_METHOD_ID_GPU_GET_BOOST_CLOCK,
-					 false, 1);
+					 LEGION_WMI_GAMEZONE_GUID, 0,
+					 WMI_METHOD_ID_ISSUPPORTGSYNC, false, 1);
 }
-static DEVICE_ATTR_RO(gpu_boost_clock);
 
-static ssize_t fan_fullspeed_show(struct device *dev,
-				  struct device_attribute *attr, char *buf)
-{
-	bool state = false;
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
+static DEVICE_ATTR_RO(issupportgsync);
+
+static ssize_t cpu_oc_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	return show_simple_wmi_attribute_from_buffer(
+		dev, attr, buf, WMI_GUID_LENOVO_CPU_METHOD, 0,
+		WMI_METHOD_ID_CPU_GET_OC_STATUS, 16, 0, 1);
+}
+
+static ssize_t cpu_oc_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	return store_simple_wmi_attribute(dev, attr, buf, count,
+					  WMI_GUID_LENOVO_CPU_METHOD, 0,
+					  WMI_METHOD_ID_CPU_SET_OC_STATUS,
+					  false, 1);
+}
+
+static DEVICE_ATTR_RW(cpu_oc);
+
+static ssize_t wmi_common_method_other_show(struct legion_private *priv, char *buf,
+				      int feature_id)
+{
+	int err, out;
 
 	mutex_lock(&priv->fancurve_mutex);
-	err = read_fanfullspeed(priv, &state);
+	err = wmi_other_method_get_value(feature_id, &out);
 	mutex_unlock(&priv->fancurve_mutex);
+
 	if (err)
 		return -EINVAL;
 
-	return sysfs_emit(buf, "%d\n", state);
+	return sysfs_emit(buf, "%d\n", out);
 }
 
-static ssize_t fan_fullspeed_store(struct device *dev,
-				   struct device_attribute *attr,
-				   const char *buf, size_t count)
+static ssize_t wmi_common_method_other_store(struct legion_private *priv,
+					     const char *buf, size_t count,
+					     int feature_id)
 {
-	struct legion_private *priv = dev_get_drvdata(dev);
-	int state;
-	int err;
+	// TODO:  use DEV, TYP, FEA, plus Powermode as key to lookup
+	// on capability data CD0, CD1 for :
+	//  - if feature is enabled for laptop model
+	//  - if value (DAT1) is valid (on/off, exact value, step, range)
+	int err, value, output;
 
-	err = kstrtouint(buf, 0, &state);
+	err = kstrtoint(buf, 0, &value);
 	if (err)
 		return err;
 
 	mutex_lock(&priv->fancurve_mutex);
-	err = fan_control_write_allowed(priv);
-	if (!err)
-		err = write_fanfullspeed(priv, state);
+	err = wmi_other_method_set_value(feature_id, value, &output);
 	mutex_unlock(&priv->fancurve_mutex);
+
 	if (err)
-		return err;
+		return -EINVAL;
 
 	return count;
 }
 
-static DEVICE_ATTR_RW(fan_fullspeed);
-
-static ssize_t fan_maxspeed_show(struct device *dev,
-				 struct device_attribute *attr, char *buf)
-{
-	return show_simple_wmi_attribute(dev, attr, buf,
-					 WMI_GUID_LENOVO_FAN_METHOD, 0,
-					 WMI_METHOD_ID_FAN_GET_MAXSPEED, false,
-					 1);
-}
-
-static ssize_t fan_maxspeed_store(struct device *dev,
-				  struct device_attribute *attr,
-				  const char *buf, size_t count)
-{
-	return store_simple_wmi_attribute(dev, attr, buf, count,
-					  WMI_GUID_LENOVO_FAN_METHOD, 0,
-					  WMI_METHOD_ID_FAN_SET_MAXSPEED, false,
-					  1);
-}
-
-static DEVICE_ATTR_RW(fan_maxspeed);
-
-static ssize_t powermode_show(struct device *dev, struct device_attribute *attr,
-			      char *buf)
+static ssize_t powerlimit_show(struct device *dev, char *buf,
+			       enum legion_powerlimit_id id)
 {
 	struct legion_private *priv = dev_get_drvdata(dev);
-	int power_mode;
+	int value;
+	int err;
 
 	mutex_lock(&priv->fancurve_mutex);
-	read_powermode(priv, &power_mode);
+	err = get_powerlimit(priv, id, &value);
 	mutex_unlock(&priv->fancurve_mutex);
-	return sysfs_emit(buf, "%d\n", power_mode);
-}
+	if (err)
+		return err;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-static void legion_platform_profile_notify(struct device *dev);
-#else
-static void legion_platform_profile_notify(void);
-#endif
+	return sysfs_emit(buf, "%d\n", value);
+}
 
-static ssize_t powermode_store(struct device *dev,
-			       struct device_attribute *attr, const char *buf,
-			       size_t count)
+static ssize_t powerlimit_store(struct device *dev, const char *buf,
+				size_t count, enum legion_powerlimit_id id)
 {
 	struct legion_private *priv = dev_get_drvdata(dev);
-	int powermode;
+	unsigned int value;
 	int err;
 
-	err = kstrtouint(buf, 0, &powermode);
+	err = kstrtouint(buf, 0, &value);
 	if (err)
 		return err;
+	if (value > INT_MAX)
+		return -EINVAL;
 
 	mutex_lock(&priv->fancurve_mutex);
-	err = write_powermode(priv, powermode);
+	err = set_powerlimit(priv, id, value);
 	mutex_unlock(&priv->fancurve_mutex);
 	if (err)
-		return -EINVAL;
-
-	// TODO: better?
-	// we have to wait a bit before change is done in hardware and
-	// readback done after notifying returns correct value, otherwise
-	// the notified reader will read old value
-	msleep(500);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	legion_platform_profile_notify(priv->ppdev);
-#else
-	legion_platform_profile_notify();
-#endif
+		return err;
 
 	return count;
 }
 
-static DEVICE_ATTR_RW(powermode);
-
-static struct attribute *legion_sysfs_attributes[] = {
-	&dev_attr_powermode.attr,
-	&dev_attr_lockfancontroller.attr,
-	&dev_attr_rapidcharge.attr,
-	&dev_attr_winkey.attr,
-	&dev_attr_touchpad.attr,
-	&dev_attr_gsync.attr,
-	&dev_attr_powerchargemode.attr,
-	&dev_attr_overdrive.attr,
-	&dev_attr_cpumaxfrequency.attr,
-	&dev_attr_isacfitforoc.attr,
-	&dev_attr_cpu_oc.attr,
-	&dev_attr_cpu_shortterm_powerlimit.attr,
-	&dev_attr_cpu_longterm_powerlimit.attr,
-	&dev_attr_cpu_apu_sppt_powerlimit.attr,
-	&dev_attr_cpu_default_powerlimit.attr,
-	&dev_attr_cpu_peak_powerlimit.attr,
-	&dev_attr_cpu_cross_loading_powerlimit.attr,
-	&dev_attr_gpu_oc.attr,
-	&dev_attr_gpu_ppab_powerlimit.attr,
-	&dev_attr_gpu_ctgp_powerlimit.attr,
-	&dev_attr_gpu_ctgp2_powerlimit.attr,
-	&dev_attr_gpu_default_ppab_ctrgp_powerlimit.attr,
-	&dev_attr_gpu_temperature_limit.attr,
-	&dev_attr_cpu_temperature_limit.attr,
-	&dev_attr_cpu_l1_tau.attr,
-	&dev_attr_gpu_power_target_offset.attr,
-	&dev_attr_gpu_boost_clock.attr,
-	&dev_attr_fan_fullspeed.attr,
-	&dev_attr_fan_maxspeed.attr,
-	&dev_attr_thermalmode.attr,
-	&dev_attr_issupportcpuoc.attr,
-	&dev_attr_issupportgpuoc.attr,
-	&dev_attr_aslcodeversion.attr,
-	&dev_attr_igpumode.attr,
-	&dev_attr_notify_dgpu.attr,
-	&dev_attr_issupportigpumode.attr,
-	&dev_attr_issupportgsync.attr,
-	NULL
-};
-
-static bool legion_rapidcharge_is_supported(struct legion_private *priv)
+static ssize_t cpu_shortterm_powerlimit_show(struct device *dev,
+					     struct device_attribute *attr,
+					     char *buf)
 {
-	return acpi_method_exists(
-		priv->adev, get_model_acpi_path(priv->conf,
-						 ACPI_PATH_READ_RAPIDCHARGE)) &&
-	       acpi_method_exists(
-		priv->adev, get_model_acpi_path(priv->conf,
-						 ACPI_PATH_WRITE_RAPIDCHARGE));
+	return powerlimit_show(dev, buf, LEGION_POWERLIMIT_CPU_SHORTTERM);
 }
 
-static bool legion_attribute_uses_cpu_wmi(const struct attribute *attr)
+static ssize_t cpu_shortterm_powerlimit_store(struct device *dev,
+					      struct device_attribute *attr,
+					      const char *buf, size_t count)
 {
-	return attr == &dev_attr_cpu_oc.attr ||
-	       attr == &dev_attr_cpu_shortterm_powerlimit.attr ||
-	       attr == &dev_attr_cpu_longterm_powerlimit.attr ||
-	       attr == &dev_attr_cpu_default_powerlimit.attr;
+	return powerlimit_store(dev, buf, count, LEGION_POWERLIMIT_CPU_SHORTTERM);
 }
 
-static bool legion_attribute_uses_gpu_wmi(const struct attribute *attr)
+static DEVICE_ATTR_RW(cpu_shortterm_powerlimit);
+
+static ssize_t cpu_longterm_powerlimit_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf)
 {
-	return attr == &dev_attr_cpu_apu_sppt_powerlimit.attr ||
-	       attr == &dev_attr_cpu_peak_powerlimit.attr ||
-	       attr == &dev_attr_cpu_cross_loading_powerlimit.attr ||
-	       attr == &dev_attr_gpu_oc.attr ||
-	       attr == &dev_attr_gpu_ppab_powerlimit.attr ||
-	       attr == &dev_attr_gpu_ctgp_powerlimit.attr ||
-	       attr == &dev_attr_gpu_ctgp2_powerlimit.attr ||
-	       attr == &dev_attr_gpu_default_ppab_ctrgp_powerlimit.attr ||
-	       attr == &dev_attr_gpu_temperature_limit.attr ||
-	       attr == &dev_attr_gpu_boost_clock.attr;
+	return powerlimit_show(dev, buf, LEGION_POWERLIMIT_CPU_LONGTERM);
 }
 
-static umode_t legion_sysfs_is_visible(struct kobject *kobj,
-				       struct attribute *attr, int idx)
+static ssize_t cpu_longterm_powerlimit_store(struct device *dev,
+					     struct device_attribute *attr,
+					     const char *buf, size_t count)
 {
-	struct device *dev = kobj_to_dev(kobj);
-	struct legion_private *priv = dev_get_drvdata(dev);
-
-	if (!priv)
-		return attr->mode;
-
-	if (attr == &dev_attr_rapidcharge.attr)
-		return legion_rapidcharge_is_supported(priv) ? attr->mode : 0;
-	if (legion_attribute_uses_cpu_wmi(attr) &&
-	    !wmi_has_guid(WMI_GUID_LENOVO_CPU_METHOD))
-		return 0;
-	if (legion_attribute_uses_gpu_wmi(attr) &&
-	    !wmi_has_guid(WMI_GUID_LENOVO_GPU_METHOD))
-		return 0;
-
-	if (attr == &dev_attr_fan_fullspeed.attr &&
-	    priv->conf->access_method_fanfullspeed == ACCESS_METHOD_NO_ACCESS)
-		return 0;
+	return powerlimit_store(dev, buf, count, LEGION_POWERLIMIT_CPU_LONGTERM);
+}
 
-	if (priv->conf->skip_oc_controls &&
-	    (attr == &dev_attr_cpu_oc.attr ||
-	     attr == &dev_attr_gpu_oc.attr ||
-	     attr == &dev_attr_cpu_shortterm_powerlimit.attr ||
-	     attr == &dev_attr_cpu_longterm_powerlimit.attr ||
-	     attr == &dev_attr_cpu_peak_powerlimit.attr ||
-	     attr == &dev_attr_cpu_default_powerlimit.attr ||
-	     attr == &dev_attr_cpu_apu_sppt_powerlimit.attr ||
-	     attr == &dev_attr_cpu_cross_loading_powerlimit.attr ||
-	     attr == &dev_attr_gpu_ppab_powerlimit.attr ||
-	     attr == &dev_attr_gpu_ctgp_powerlimit.attr ||
-	     attr == &dev_attr_gpu_ctgp2_powerlimit.attr ||
-	     attr == &dev_attr_gpu_default_ppab_ctrgp_powerlimit.attr ||
-	     attr == &dev_attr_gpu_temperature_limit.attr ||
-	     attr == &dev_attr_gpu_boost_clock.attr))
-		return 0;
+static DEVICE_ATTR_RW(cpu_longterm_powerlimit);
 
-	return attr->mode;
+static ssize_t cpu_default_powerlimit_show(struct device *dev,
+					   struct device_attribute *attr,
+					   char *buf)
+{
+	return show_simple_wmi_attribute(
+		dev, attr, buf, WMI_GUID_LENOVO_CPU_METHOD, 0,
+		WMI_METHOD_ID_CPU_GET_DEFAULT_POWERLIMIT, false, 1);
 }
 
-static const struct attribute_group legion_attribute_group = {
-	.attrs = legion_sysfs_attributes,
-	.is_visible = legion_sysfs_is_visible
-};
+static DEVICE_ATTR_RO(cpu_default_powerlimit);
 
-static int legion_sysfs_init(struct legion_private *priv)
+static ssize_t cpu_peak_powerlimit_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
 {
-	return device_add_group(&priv->platform_device->dev,
-				&legion_attribute_group);
+	return powerlimit_show(dev, buf, LEGION_POWERLIMIT_CPU_PEAK);
 }
 
-static void legion_sysfs_exit(struct legion_private *priv)
+static ssize_t cpu_peak_powerlimit_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
 {
-	pr_info("Unloading legion sysfs\n");
-	device_remove_group(&priv->platform_device->dev,
-			    &legion_attribute_group);
-	pr_info("Unloading legion sysfs done\n");
+	return powerlimit_store(dev, buf, count, LEGION_POWERLIMIT_CPU_PEAK);
 }
 
-/* =============================  */
-/* WMI + ACPI                     */
-/* ============================   */
-// heavily based on ideapad_laptop.c
+static DEVICE_ATTR_RW(cpu_peak_powerlimit);
 
-// TODO: proper names if meaning of all events is clear
-enum LEGION_WMI_EVENT {
-	LEGION_WMI_EVENT_GAMEZONE = 1,
-	LEGION_EVENT_A,
-	LEGION_EVENT_B,
-	LEGION_EVENT_C,
-	LEGION_EVENT_D,
-	LEGION_EVENT_E,
-	LEGION_EVENT_F,
-	LEGION_EVENT_G
-};
+static ssize_t cpu_apu_sppt_powerlimit_show(struct device *dev,
+					    struct device_attribute *attr,
+					    char *buf)
+{
+	return powerlimit_show(dev, buf, LEGION_POWERLIMIT_CPU_APU_SPPT);
+}
 
-struct legion_wmi_private {
-	enum LEGION_WMI_EVENT event;
-};
+static ssize_t cpu_apu_sppt_powerlimit_store(struct device *dev,
+					     struct device_attribute *attr,
+					     const char *buf, size_t count)
+{
+	return powerlimit_store(dev, buf, count, LEGION_POWERLIMIT_CPU_APU_SPPT);
+}
 
-//static void legion_wmi_notify2(u32 value, void *context)
-//    {
-//	pr_info("WMI notify\n" );
-//    }
+static DEVICE_ATTR_RW(cpu_apu_sppt_powerlimit);
 
-static void legion_wmi_notify(struct wmi_device *wdev, union acpi_object *data)
+static ssize_t cpu_cross_loading_powerlimit_show(struct device *dev,
+						 struct device_attribute *attr,
+						 char *buf)
 {
-	struct legion_wmi_private *wpriv;
-	struct legion_private *priv;
+	return powerlimit_show(dev, buf, LEGION_POWERLIMIT_CPU_CROSS_LOADING);
+}
 
-	mutex_lock(&legion_shared_mutex);
-	priv = legion_shared;
-	if ((!priv) && (priv->loaded)) {
-		pr_info("Received WMI event while not initialized!\n");
-		goto unlock;
-	}
+static ssize_t cpu_cross_loading_powerlimit_store(struct device *dev,
+						  struct device_attribute *attr,
+						  const char *buf, size_t count)
+{
+	return powerlimit_store(dev, buf, count, LEGION_POWERLIMIT_CPU_CROSS_LOADING);
+}
 
-	wpriv = dev_get_drvdata(&wdev->dev);
-	switch (wpriv->event) {
-	case LEGION_EVENT_A:
-		pr_info("Fan event: legion type: %d;  acpi type: %d (%d=integer)",
-			wpriv->event, data->type, ACPI_TYPE_INTEGER);
-		// TODO: here it is too early (first unlock mutext, then wait a bit)
-		//legion_platform_profile_notify();
-		break;
-	default:
-		pr_info("Event: legion type: %d;  acpi type: %d (%d=integer)",
-			wpriv->event, data->type, ACPI_TYPE_INTEGER);
-		break;
-	}
+static DEVICE_ATTR_RW(cpu_cross_loading_powerlimit);
 
-unlock:
-	mutex_unlock(&legion_shared_mutex);
-	// todo; fix that!
-	// problem: we get an event just before the powermode change (from the key?),
-	// so if we notify too early, it will read the old power mode/platform profile
-	msleep(500);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	legion_platform_profile_notify(priv->ppdev);
-#else
-	legion_platform_profile_notify();
-#endif
+static ssize_t gpu_oc_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
+{
+	int err;
+
+	err = show_simple_wmi_attribute(dev, attr, buf,
+					WMI_GUID_LENOVO_GPU_METHOD, 0,
+					WMI_METHOD_ID_GPU_GET_OC_STATUS, false,
+					1);
+	return err;
 }
 
-static int legion_wmi_probe(struct wmi_device *wdev, const void *context)
+static ssize_t gpu_oc_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
 {
-	struct legion_wmi_private *wpriv;
+	return store_simple_wmi_attribute(dev, attr, buf, count,
+					  WMI_GUID_LENOVO_GPU_METHOD, 0,
+					  WMI_METHOD_ID_GPU_SET_OC_STATUS,
+					  false, 1);
+}
 
-	wpriv = devm_kzalloc(&wdev->dev, sizeof(*wpriv), GFP_KERNEL);
-	if (!wpriv)
-		return -ENOMEM;
+static DEVICE_ATTR_RW(gpu_oc);
 
-	*wpriv = *(const struct legion_wmi_private *)context;
+static ssize_t gpu_ppab_powerlimit_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	return powerlimit_show(dev, buf, LEGION_POWERLIMIT_GPU_PPAB);
+}
 
-	dev_set_drvdata(&wdev->dev, wpriv);
-	dev_info(&wdev->dev, "Register after probing for WMI.\n");
-	return 0;
+static ssize_t gpu_ppab_powerlimit_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	return powerlimit_store(dev, buf, count, LEGION_POWERLIMIT_GPU_PPAB);
 }
 
-static const struct legion_wmi_private legion_wmi_context_gamezone = {
-	.event = LEGION_WMI_EVENT_GAMEZONE
-};
-static const struct legion_wmi_private legion_wmi_context_a = {
-	.event = LEGION_EVENT_A
-};
-static const struct legion_wmi_private legion_wmi_context_b = {
-	.event = LEGION_EVENT_B
-};
-static const struct legion_wmi_private legion_wmi_context_c = {
-	.event = LEGION_EVENT_C
-};
-static const struct legion_wmi_private legion_wmi_context_d = {
-	.event = LEGION_EVENT_D
-};
-static const struct legion_wmi_private legion_wmi_context_e = {
-	.event = LEGION_EVENT_E
-};
-static const struct legion_wmi_private legion_wmi_context_f = {
-	.event = LEGION_EVENT_F
-};
+static DEVICE_ATTR_RW(gpu_ppab_powerlimit);
 
-#define LEGION_WMI_GUID_FAN_EVENT "D320289E-8FEA-41E0-86F9-611D83151B5F"
-#define LEGION_WMI_GUID_FAN2_EVENT "bc72a435-e8c1-4275-b3e2-d8b8074aba59"
-#define LEGION_WMI_GUID_GAMEZONE_KEY_EVENT \
-	"10afc6d9-ea8b-4590-a2e7-1cd3c84bb4b1"
-#define LEGION_WMI_GUID_GAMEZONE_GPU_EVENT \
-	"bfd42481-aee3-4502-a107-afb68425c5f8"
-#define LEGION_WMI_GUID_GAMEZONE_OC_EVENT "d062906b-12d4-4510-999d-4831ee80e985"
-#define LEGION_WMI_GUID_GAMEZONE_TEMP_EVENT \
-	"bfd42481-aee3-4501-a107-afb68425c5f8"
-//#define LEGION_WMI_GUID_GAMEZONE_DATA_EVENT  "887b54e3-dddc-4b2c-8b88-68a26a8835d0"
+static ssize_t gpu_ctgp_powerlimit_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	return powerlimit_show(dev, buf, LEGION_POWERLIMIT_GPU_CTGP);
+}
 
-static const struct wmi_device_id legion_wmi_ids[] = {
-	{ LEGION_WMI_GAMEZONE_GUID, &legion_wmi_context_gamezone },
-	{ LEGION_WMI_GUID_FAN_EVENT, &legion_wmi_context_a },
-	{ LEGION_WMI_GUID_FAN2_EVENT, &legion_wmi_context_b },
-	{ LEGION_WMI_GUID_GAMEZONE_KEY_EVENT, &legion_wmi_context_c },
-	{ LEGION_WMI_GUID_GAMEZONE_GPU_EVENT, &legion_wmi_context_d },
-	{ LEGION_WMI_GUID_GAMEZONE_OC_EVENT, &legion_wmi_context_e },
-	{ LEGION_WMI_GUID_GAMEZONE_TEMP_EVENT, &legion_wmi_context_f },
-	{ "8FC0DE0C-B4E4-43FD-B0F3-8871711C1294",
-	  &legion_wmi_context_gamezone }, /* Legion 5 */
-	{},
-};
-MODULE_DEVICE_TABLE(wmi, legion_wmi_ids);
+static ssize_t gpu_ctgp_powerlimit_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	return powerlimit_store(dev, buf, count, LEGION_POWERLIMIT_GPU_CTGP);
+}
 
-static struct wmi_driver legion_wmi_driver = {
-	.driver = {
-		.name = "legion_wmi",
-	},
-	.id_table = legion_wmi_ids,
-	.probe = legion_wmi_probe,
-	.notify = legion_wmi_notify,
-};
+static DEVICE_ATTR_RW(gpu_ctgp_powerlimit);
 
-//acpi_status status = wmi_install_notify_handler(LEGION_WMI_GAMEZONE_GUID,
-//				legion_wmi_notify2, NULL);
-//if (ACPI_FAILURE(status)) {
-//    return -ENODEV;
-//}
-//return 0;
+static ssize_t gpu_ctgp2_powerlimit_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	return show_simple_wmi_attribute_from_buffer(
+		dev, attr, buf, WMI_GUID_LENOVO_GPU_METHOD, 0,
+		WMI_METHOD_ID_GPU_GET_CTGP_POWERLIMIT, 16, 0x0C, 1);
+}
 
-static int legion_wmi_init(void)
+static DEVICE_ATTR_RO(gpu_ctgp2_powerlimit);
+
+// TOOD: probably remove again because provided by other means; only useful for overclocking
+static ssize_t
+gpu_default_ppab_ctrgp_powerlimit_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
 {
-	return wmi_driver_register(&legion_wmi_driver);
+	return show_simple_wmi_attribute(
+		dev, attr, buf, WMI_GUID_LENOVO_GPU_METHOD, 0,
+		WMI_METHOD_ID_GPU_GET_DEFAULT_PPAB_CTGP_POWERLIMIT, false, 1);
 }
+static DEVICE_ATTR_RO(gpu_default_ppab_ctrgp_powerlimit);
 
-static void legion_wmi_exit(void)
+// All power limits at once as lines of name=value, e.g.
+// "cpu_longterm=55 cpu_shortterm=80". Writing applies all given values
+// in one transaction; see write_powerlimits for the order. Results
+// of the last write per power limit are in powerlimits_status.
+static ssize_t powerlimits_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
 {
-	// TODO: remove this
-	pr_info("Unloading legion WMI\n");
+	struct legion_private *priv = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	int value;
+	int err;
+	int id;
 
-	//wmi_remove_notify_handler(LEGION_WMI_GAMEZONE_GUID);
-	wmi_driver_unregister(&legion_wmi_driver);
-	pr_info("Unloading legion WMI done\n");
-}
+	mutex_lock(&priv->fancurve_mutex);
+	for (id = 0; id < LEGION_POWERLIMIT_MAX; ++id) {
+		if (!powerlimit_is_supported(priv, id))
+			continue;
+		err = get_powerlimit(priv, id, &value);
+		if (err)
+			continue;
+		len += sysfs_emit_at(buf, len, "%s=%d\n",
+				     legion_powerlimits[id].name, value);
+	}
+	mutex_unlock(&priv->fancurve_mutex);
 
-/* =============================  */
-/* Platform profile               */
-/* ============================   */
+	return len;
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-static void legion_platform_profile_notify(struct device *dev)
-#else
-static void legion_platform_profile_notify(void)
-#endif
+static int powerlimits_parse(struct legion_private *priv, char *str,
+			     unsigned long *mask, int *values)
 {
-	if (!enable_platformprofile) {
-		pr_info("Skipping platform_profile_notify because enable_platformprofile is false\n");
-		return;
-	}
+	char *token;
+	char *key;
+	int value;
+	int id;
+	int err;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	platform_profile_notify(dev);
-#else
-	platform_profile_notify();
-#endif
+	while ((token = strsep(&str, " \t\n,")) != NULL) {
+		if (!*token)
+			continue;
+		key = strsep(&token, "=");
+		if (!token)
+			return -EINVAL;
+		err = kstrtoint(token, 0, &value);
+		if (err)
+			return err;
+		for (id = 0; id < LEGION_POWERLIMIT_MAX; ++id) {
+			if (!strcmp(key, legion_powerlimits[id].name))
+				break;
+		}
+		if (id == LEGION_POWERLIMIT_MAX)
+			return -EINVAL;
+		if (!powerlimit_is_supported(priv, id))
+			return -EOPNOTSUPP;
+		// check all values before anything is written
+		err = check_powerlimit(id, value);
+		if (err)
+			return err;
+		values[id] = value;
+		set_bit(id, mask);
+	}
+	return 0;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-static int legion_platform_profile_get(struct device *dev,
-				       enum platform_profile_option *profile)
-#else
-static int legion_platform_profile_get(struct platform_profile_handler *pprof,
-				       enum platform_profile_option *profile)
-#endif
+static ssize_t powerlimits_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
 {
-	int powermode;
-	struct legion_private *priv;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	priv = dev_get_drvdata(dev);
-#else
-	priv = container_of(pprof, struct legion_private,
-			    platform_profile_handler);
-#endif
-	read_powermode(priv, &powermode);
+	struct legion_private *priv = dev_get_drvdata(dev);
+	int values[LEGION_POWERLIMIT_MAX];
+	unsigned long mask = 0;
+	char *str;
+	int err;
 
-	switch (powermode) {
-	case LEGION_WMI_POWERMODE_BALANCED:
-		*profile = PLATFORM_PROFILE_BALANCED;
-		break;
-	case LEGION_WMI_POWERMODE_PERFORMANCE:
-		*profile = PLATFORM_PROFILE_PERFORMANCE;
-		break;
-	case LEGION_WMI_POWERMODE_LOW_POWER:
-		*profile = PLATFORM_PROFILE_LOW_POWER;
-		break;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	case LEGION_WMI_POWERMODE_CUSTOM:
-		*profile = PLATFORM_PROFILE_CUSTOM;
-		break;
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
-	case LEGION_WMI_POWERMODE_MAX_POWER:
-		*profile = PLATFORM_PROFILE_MAX_POWER;
-		break;
-#endif
-	default:
+	str = kstrndup(buf, count, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+	err = powerlimits_parse(priv, str, &mask, values);
+	kfree(str);
+	if (err)
+		return err;
+	if (!mask)
 		return -EINVAL;
-	}
-	return 0;
+
+	mutex_lock(&priv->fancurve_mutex);
+	// written values replace values that are still pending
+	priv->powerlimit_pending &= ~mask;
+	err = write_powerlimits(priv, mask, values,
+				priv->powerlimits_results);
+	priv->powerlimits_written = mask;
+	mutex_unlock(&priv->fancurve_mutex);
+	legion_nl_event(LEGION_NL_EVENT_POWERLIMITS);
+	if (err)
+		return err;
+
+	return count;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-static int legion_platform_profile_set(struct device *dev,
-				       enum platform_profile_option profile)
-#else
-static int legion_platform_profile_set(struct platform_profile_handler *pprof,
-				       enum platform_profile_option profile)
-#endif
+static DEVICE_ATTR_RW(powerlimits);
+
+static ssize_t powerlimits_status_show(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
 {
-	int powermode;
-	struct legion_private *priv;
+	struct legion_private *priv = dev_get_drvdata(dev);
+	ssize_t len = 0;
+	unsigned long id;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	priv = dev_get_drvdata(dev);
-#else
-	priv = container_of(pprof, struct legion_private,
-			    platform_profile_handler);
-#endif
-	switch (profile) {
-	case PLATFORM_PROFILE_BALANCED:
-		powermode = LEGION_WMI_POWERMODE_BALANCED;
-		break;
-	case PLATFORM_PROFILE_PERFORMANCE:
-		powermode = LEGION_WMI_POWERMODE_PERFORMANCE;
-		break;
-	case PLATFORM_PROFILE_LOW_POWER:
-		powermode = LEGION_WMI_POWERMODE_LOW_POWER;
-		break;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	case PLATFORM_PROFILE_CUSTOM:
-		powermode = LEGION_WMI_POWERMODE_CUSTOM;
-		break;
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
-	case PLATFORM_PROFILE_MAX_POWER:
-		powermode = LEGION_WMI_POWERMODE_MAX_POWER;
-		break;
-#endif
-	default:
-		return -EOPNOTSUPP;
+	mutex_lock(&priv->fancurve_mutex);
+	for_each_set_bit(id, &priv->powerlimits_written,
+			 LEGION_POWERLIMIT_MAX) {
+		len += sysfs_emit_at(buf, len, "%s=%d\n",
+				     legion_powerlimits[id].name,
+				     priv->powerlimits_results[id]);
 	}
+	mutex_unlock(&priv->fancurve_mutex);
 
-	return write_powermode(priv, powermode);
+	return len;
 }
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-static bool conf_has_custom_powermode;
-static bool conf_has_extreme_powermode;
-static enum access_method conf_access_method_powermode;
+static DEVICE_ATTR_RO(powerlimits_status);
 
-static int legion_platform_profile_probe(void *drvdata, unsigned long *choices)
+static ssize_t gpu_temperature_limit_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
 {
-	set_bit(PLATFORM_PROFILE_LOW_POWER, choices);
-	set_bit(PLATFORM_PROFILE_BALANCED, choices);
-	set_bit(PLATFORM_PROFILE_PERFORMANCE, choices);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	if (conf_has_custom_powermode && conf_access_method_powermode == ACCESS_METHOD_WMI)
-		set_bit(PLATFORM_PROFILE_CUSTOM, choices);
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
-	if (conf_has_extreme_powermode && conf_access_method_powermode == ACCESS_METHOD_WMI)
-		set_bit(PLATFORM_PROFILE_MAX_POWER, choices);
-#endif
-	return 0;
+	int err;
+	struct legion_private *priv = dev_get_drvdata(dev);
+
+	switch (priv->conf->access_method_powerlimits) {
+	case ACCESS_METHOD_WMI3:
+		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_GPU_TEMPERATURE_LIMIT);
+	default:
+		err = show_simple_wmi_attribute(
+				dev, attr, buf, WMI_GUID_LENOVO_GPU_METHOD, 0,
+				WMI_METHOD_ID_GPU_GET_TEMPERATURE_LIMIT, false, 1);
+	}
+	return err;
 }
 
-static const struct platform_profile_ops legion_platform_profile_ops = {
-	.probe = legion_platform_profile_probe,
-	.profile_get = legion_platform_profile_get,
-	.profile_set = legion_platform_profile_set,
-};
-#endif
+static ssize_t gpu_temperature_limit_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count)
+{
+	struct legion_private *priv = dev_get_drvdata(dev);
+	ssize_t res;
 
-static int legion_platform_profile_init(struct legion_private *priv)
+	res = store_simple_wmi_attribute(
+		dev, attr, buf, count, WMI_GUID_LENOVO_GPU_METHOD, 0,
+		WMI_METHOD_ID_GPU_SET_TEMPERATURE_LIMIT, false, 1);
+	legion_throttle_invalidate_temp_limits(priv);
+	return res;
+}
+
+static ssize_t cpu_temperature_limit_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	struct device *dev = &priv->platform_device->dev;
-#else
 	int err;
-#endif
+	struct legion_private *priv = dev_get_drvdata(dev);
 
-	if (!enable_platformprofile) {
-		pr_info("Skipping creating platform profile support because enable_platformprofile is false\n");
-		return 0;
+	switch (priv->conf->access_method_powerlimits) {
+	case ACCESS_METHOD_WMI3:
+		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_CPU_TEMPERATURE_LIMIT);
+	default:
+		return -EINVAL;
 	}
+	return err;
+}
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	conf_has_custom_powermode = priv->conf->has_custom_powermode;
-	conf_has_extreme_powermode = priv->conf->has_extreme_powermode;
-	conf_access_method_powermode = priv->conf->access_method_powermode;
-#else
-	priv->platform_profile_handler.profile_get =
-		legion_platform_profile_get;
-	priv->platform_profile_handler.profile_set =
-		legion_platform_profile_set;
+static ssize_t cpu_temperature_limit_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count)
+{
+	// TODO:
+	return -EINVAL;
+}
 
-	set_bit(PLATFORM_PROFILE_LOW_POWER, priv->platform_profile_handler.choices);
-	set_bit(PLATFORM_PROFILE_BALANCED,
-		priv->platform_profile_handler.choices);
-	set_bit(PLATFORM_PROFILE_PERFORMANCE,
-		priv->platform_profile_handler.choices);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	if (priv->conf->has_custom_powermode &&
-	    priv->conf->access_method_powermode == ACCESS_METHOD_WMI) {
-		set_bit(PLATFORM_PROFILE_CUSTOM,
-			priv->platform_profile_handler.choices);
-	}
-#endif
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
-	if (priv->conf->has_extreme_powermode &&
-	    priv->conf->access_method_powermode == ACCESS_METHOD_WMI) {
-		set_bit(PLATFORM_PROFILE_MAX_POWER,
-			priv->platform_profile_handler.choices);
-	}
-#endif
-#endif
+static ssize_t cpu_l1_tau_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	int err;
+	struct legion_private *priv = dev_get_drvdata(dev);
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
-	priv->ppdev = devm_platform_profile_register(dev, "lenovo-legion", priv, &legion_platform_profile_ops);
-	if (IS_ERR(priv->ppdev))
-		return PTR_ERR(priv->ppdev);
-#else
-	err = platform_profile_register(&priv->platform_profile_handler);
-	if (err)
-		return err;
-#endif
+	switch (priv->conf->access_method_powerlimits) {
+	case ACCESS_METHOD_WMI3:
+		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_CPU_L1_TAU);
+	default:
+		return -EINVAL;
+	}
+	return err;
+}
 
-	return 0;
+static ssize_t cpu_l1_tau_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count)
+{
+	// TODO:
+	return -EINVAL;
 }
 
-static void legion_platform_profile_exit(struct legion_private *priv)
+static ssize_t gpu_power_target_offset_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
 {
-	if (!enable_platformprofile) {
-		pr_info("Skipping unloading platform profile support because enable_platformprofile is false\n");
-		return;
+	int err;
+	struct legion_private *priv = dev_get_drvdata(dev);
+
+	switch (priv->conf->access_method_powerlimits) {
+	case ACCESS_METHOD_WMI3:
+		return wmi_common_method_other_show(priv, buf, OtherMethodFeature_GPU_POWER_TARGET_ON_AC_OFFSET_FROM_BASELINE);
+	default:
+		return -EINVAL;
 	}
-	pr_info("Unloading legion platform profile\n");
-#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
-	platform_profile_remove();
-#endif
-	pr_info("Unloading legion platform profile done\n");
+	return err;
 }
 
-/* =============================  */
-/* hwom interface              */
-/* ============================   */
-
-// hw-mon interface
+static ssize_t gpu_power_target_offset_store(struct device *dev,
+					   struct device_attribute *attr,
+					   const char *buf, size_t count)
+{
+	// TODO:
+	return -EINVAL;
+}
 
-// todo: register_group or register_info?
+static DEVICE_ATTR_RW(gpu_temperature_limit);
+static DEVICE_ATTR_RW(cpu_temperature_limit);
+static DEVICE_ATTR_RW(cpu_l1_tau);
+static DEVICE_ATTR_RW(gpu_power_target_offset);
 
-// TODO: use one common function (like here) or one function per attribute?
-static ssize_t sensor_label_show(struct device *dev,
-				 struct device_attribute *attr, char *buf)
+// TOOD: probably remove again because provided by other means; only useful for overclocking
+static ssize_t gpu_boost_clock_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
 {
-	int sensor_id = (to_sensor_dev_attr(attr))->index;
-	const char *label;
-
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 WMI_GUID_LENOVO_GPU_METHOD, 0,
+					 WMI_METHOD_ID_GPU_GET_BOOST_CLOCK,
+					 false, 1);
+}
+static DEVICE_ATTR_RO(gpu_boost_clock);
+
+static ssize_t fan_fullspeed_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	bool state = false;
+	int err;
+	struct legion_private *priv = dev_get_drvdata(dev);
+
+	mutex_lock(&priv->fancurve_mutex);
+	err = read_fanfullspeed(priv, &state);
+	mutex_unlock(&priv->fancurve_mutex);
+	if (err)
+		return -EINVAL;
+
+	return sysfs_emit(buf, "%d\n", state);
+}
+
+static ssize_t fan_fullspeed_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct legion_private *priv = dev_get_drvdata(dev);
+	int state;
+	int err;
+
+	err = kstrtouint(buf, 0, &state);
+	if (err)
+		return err;
+
+	mutex_lock(&priv->fancurve_mutex);
+	err = fan_control_write_allowed(priv);
+	if (!err)
+		err = write_fanfullspeed(priv, state);
+	mutex_unlock(&priv->fancurve_mutex);
+	if (err)
+		return err;
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(fan_fullspeed);
+
+static ssize_t fan_maxspeed_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	return show_simple_wmi_attribute(dev, attr, buf,
+					 WMI_GUID_LENOVO_FAN_METHOD, 0,
+					 WMI_METHOD_ID_FAN_GET_MAXSPEED, false,
+					 1);
+}
+
+static ssize_t fan_maxspeed_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	return store_simple_wmi_attribute(dev, attr, buf, count,
+					  WMI_GUID_LENOVO_FAN_METHOD, 0,
+					  WMI_METHOD_ID_FAN_SET_MAXSPEED, false,
+					  1);
+}
+
+static DEVICE_ATTR_RW(fan_maxspeed);
+
+static ssize_t powermode_show(struct device *dev, struct device_attribute *attr,
+			      char *buf)
+{
+	struct legion_private *priv = dev_get_drvdata(dev);
+	int power_mode;
+
+	mutex_lock(&priv->fancurve_mutex);
+	read_powermode(priv, &power_mode);
+	mutex_unlock(&priv->fancurve_mutex);
+	return sysfs_emit(buf, "%d\n", power_mode);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+static void legion_platform_profile_notify(struct device *dev);
+#else
+static void legion_platform_profile_notify(void);
+#endif
+
+static ssize_t powermode_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	struct legion_private *priv = dev_get_drvdata(dev);
+	int powermode;
+	int err;
+
+	err = kstrtouint(buf, 0, &powermode);
+	if (err)
+		return err;
+
+	mutex_lock(&priv->fancurve_mutex);
+	err = write_powermode(priv, powermode);
+	mutex_unlock(&priv->fancurve_mutex);
+	if (err)
+		return -EINVAL;
+
+	// TODO: better?
+	// we have to wait a bit before change is done in hardware and
+	// readback done after notifying returns correct value, otherwise
+	// the notified reader will read old value
+	msleep(500);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	legion_platform_profile_notify(priv->ppdev);
+#else
+	legion_platform_profile_notify();
+#endif
+	legion_nl_event(LEGION_NL_EVENT_POWERMODE);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(powermode);
+
+// All sensors with one read in a single line with fixed order:
+// timestamp (ns, CLOCK_MONOTONIC), temp1, temp2, temp3 (millidegree
+// celsius), fan1, fan2, fan1_target, fan2_target, fan3, fan4 (rpm).
+// Values that cannot be read are "-".
+static ssize_t sensors_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct legion_private *priv = dev_get_drvdata(dev);
+	struct sensor_record record;
+	ssize_t len;
+	int id;
+	int value;
+
+	mutex_lock(&priv->fancurve_mutex);
+	read_sensor_record(priv, &record);
+	mutex_unlock(&priv->fancurve_mutex);
+
+	len = sysfs_emit(buf, "%llu", record.timestamp_ns);
+	for (id = SENSOR_CPU_TEMP_ID; id <= SENSOR_FAN4_RPM_ID; ++id) {
+		if (!test_bit(id, &record.valid)) {
+			len += sysfs_emit_at(buf, len, " -");
+			continue;
+		}
+		value = record.values[id];
+		if (id <= SENSOR_IC_TEMP_ID)
+			value *= 1000;
+		len += sysfs_emit_at(buf, len, " %d", value);
+	}
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+static DEVICE_ATTR_RO(sensors);
+
+static struct attribute *legion_sysfs_attributes[] = {
+	&dev_attr_capabilities.attr,
+	&dev_attr_throttle_stats.attr,
+	&dev_attr_fan_health.attr,
+	&dev_attr_sensors.attr,
+	&dev_attr_powermode.attr,
+	&dev_attr_lockfancontroller.attr,
+	&dev_attr_rapidcharge.attr,
+	&dev_attr_winkey.attr,
+	&dev_attr_touchpad.attr,
+	&dev_attr_gsync.attr,
+	&dev_attr_powerchargemode.attr,
+	&dev_attr_overdrive.attr,
+	&dev_attr_cpumaxfrequency.attr,
+	&dev_attr_isacfitforoc.attr,
+	&dev_attr_cpu_oc.attr,
+	&dev_attr_cpu_shortterm_powerlimit.attr,
+	&dev_attr_cpu_longterm_powerlimit.attr,
+	&dev_attr_cpu_apu_sppt_powerlimit.attr,
+	&dev_attr_cpu_default_powerlimit.attr,
+	&dev_attr_cpu_peak_powerlimit.attr,
+	&dev_attr_cpu_cross_loading_powerlimit.attr,
+	&dev_attr_gpu_oc.attr,
+	&dev_attr_gpu_ppab_powerlimit.attr,
+	&dev_attr_gpu_ctgp_powerlimit.attr,
+	&dev_attr_gpu_ctgp2_powerlimit.attr,
+	&dev_attr_gpu_default_ppab_ctrgp_powerlimit.attr,
+	&dev_attr_powerlimits.attr,
+	&dev_attr_powerlimits_status.attr,
+	&dev_attr_gpu_temperature_limit.attr,
+	&dev_attr_cpu_temperature_limit.attr,
+	&dev_attr_cpu_l1_tau.attr,
+	&dev_attr_gpu_power_target_offset.attr,
+	&dev_attr_gpu_boost_clock.attr,
+	&dev_attr_fan_fullspeed.attr,
+	&dev_attr_fan_maxspeed.attr,
+	&dev_attr_thermalmode.attr,
+	&dev_attr_issupportcpuoc.attr,
+	&dev_attr_issupportgpuoc.attr,
+	&dev_attr_aslcodeversion.attr,
+	&dev_attr_igpumode.attr,
+	&dev_attr_notify_dgpu.attr,
+	&dev_attr_issupportigpumode.attr,
+	&dev_attr_issupportgsync.attr,
+	NULL
+};
+
+static bool legion_attribute_uses_cpu_wmi(const struct attribute *attr)
+{
+	return attr == &dev_attr_cpu_oc.attr ||
+	       attr == &dev_attr_cpu_shortterm_powerlimit.attr ||
+	       attr == &dev_attr_cpu_longterm_powerlimit.attr ||
+	       attr == &dev_attr_cpu_default_powerlimit.attr;
+}
+
+static bool legion_attribute_uses_gpu_wmi(const struct attribute *attr)
+{
+	return attr == &dev_attr_cpu_apu_sppt_powerlimit.attr ||
+	       attr == &dev_attr_cpu_peak_powerlimit.attr ||
+	       attr == &dev_attr_cpu_cross_loading_powerlimit.attr ||
+	       attr == &dev_attr_gpu_oc.attr ||
+	       attr == &dev_attr_gpu_ppab_powerlimit.attr ||
+	       attr == &dev_attr_gpu_ctgp_powerlimit.attr ||
+	       attr == &dev_attr_gpu_ctgp2_powerlimit.attr ||
+	       attr == &dev_attr_gpu_default_ppab_ctrgp_powerlimit.attr ||
+	       attr == &dev_attr_gpu_temperature_limit.attr ||
+	       attr == &dev_attr_gpu_boost_clock.attr;
+}
+
+static umode_t legion_sysfs_is_visible(struct kobject *kobj,
+				       struct attribute *attr, int idx)
+{
+	struct device *dev = kobj_to_dev(kobj);
+	struct legion_private *priv = dev_get_drvdata(dev);
+
+	if (!priv)
+		return attr->mode;
+
+	if (attr == &dev_attr_rapidcharge.attr)
+		return legion_has_capability(priv, LEGION_CAP_ACPI_RAPIDCHARGE) ?
+			       attr->mode :
+			       0;
+	if (legion_attribute_uses_cpu_wmi(attr) &&
+	    !legion_has_capability(priv, LEGION_CAP_WMI_CPU_METHOD))
+		return 0;
+	if (legion_attribute_uses_gpu_wmi(attr) &&
+	    !legion_has_capability(priv, LEGION_CAP_WMI_GPU_METHOD))
+		return 0;
+
+	if (attr == &dev_attr_powerlimits.attr ||
+	    attr == &dev_attr_powerlimits_status.attr) {
+		int id;
+
+		for (id = 0; id < LEGION_POWERLIMIT_MAX; ++id) {
+			if (powerlimit_is_supported(priv, id))
+				return attr->mode;
+		}
+		return 0;
+	}
+
+	if (attr == &dev_attr_fan_fullspeed.attr &&
+	    !legion_has_capability(priv, LEGION_CAP_FANFULLSPEED))
+		return 0;
+
+	if ((attr == &dev_attr_throttle_stats.attr ||
+	     attr == &dev_attr_fan_health.attr) &&
+	    throttle_sample_ms == 0)
+		return 0;
+
+	if (priv->conf->skip_oc_controls &&
+	    (attr == &dev_attr_cpu_oc.attr ||
+	     attr == &dev_attr_gpu_oc.attr ||
+	     attr == &dev_attr_cpu_shortterm_powerlimit.attr ||
+	     attr == &dev_attr_cpu_longterm_powerlimit.attr ||
+	     attr == &dev_attr_cpu_peak_powerlimit.attr ||
+	     attr == &dev_attr_cpu_default_powerlimit.attr ||
+	     attr == &dev_attr_cpu_apu_sppt_powerlimit.attr ||
+	     attr == &dev_attr_cpu_cross_loading_powerlimit.attr ||
+	     attr == &dev_attr_gpu_ppab_powerlimit.attr ||
+	     attr == &dev_attr_gpu_ctgp_powerlimit.attr ||
+	     attr == &dev_attr_gpu_ctgp2_powerlimit.attr ||
+	     attr == &dev_attr_gpu_default_ppab_ctrgp_powerlimit.attr ||
+	     attr == &dev_attr_gpu_temperature_limit.attr ||
+	     attr == &dev_attr_gpu_boost_clock.attr))
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group legion_attribute_group = {
+	.attrs = legion_sysfs_attributes,
+	.is_visible = legion_sysfs_is_visible
+};
+
+static int legion_sysfs_init(struct legion_private *priv)
+{
+	return device_add_group(&priv->platform_device->dev,
+				&legion_attribute_group);
+}
+
+// Show or hide attributes again after capabilities changed
+static void legion_sysfs_update(struct legion_private *priv)
+{
+	int err;
+
+	err = sysfs_update_group(&priv->platform_device->dev.kobj,
+				 &legion_attribute_group);
+	if (err)
+		pr_info("Failed to update sysfs interface: %d\n", err);
+}
+
+static void legion_sysfs_exit(struct legion_private *priv)
+{
+	pr_info("Unloading legion sysfs\n");
+	device_remove_group(&priv->platform_device->dev,
+			    &legion_attribute_group);
+	pr_info("Unloading legion sysfs done\n");
+}
+
+/* =============================  */
+/* WMI + ACPI                     */
+/* ============================   */
+// heavily based on ideapad_laptop.c
+
+// TODO: proper names if meaning of all events is clear
+enum LEGION_WMI_EVENT {
+	LEGION_WMI_EVENT_GAMEZONE = 1,
+	LEGION_EVENT_A,
+	LEGION_EVENT_B,
+	LEGION_EVENT_C,
+	LEGION_EVENT_D,
+	LEGION_EVENT_E,
+	LEGION_EVENT_F,
+	LEGION_EVENT_G,
+	LEGION_WMI_EVENT_LIGHT
+};
+
+struct legion_wmi_private {
+	enum LEGION_WMI_EVENT event;
+};
+
+// delay between a WMI event and notifying userspace of the power mode
+#define LEGION_WMI_NOTIFY_DELAY_MS 500
+// delay between a WMI event and reading the light states; gives the
+// firmware time to apply the change
+#define LEGION_LIGHT_REFRESH_DELAY_MS 100
+
+//static void legion_wmi_notify2(u32 value, void *context)
+//    {
+//	pr_info("WMI notify\n" );
+//    }
+
+static void legion_wmi_notify_work(struct work_struct *work)
+{
+	struct legion_private *priv = container_of(
+		to_delayed_work(work), struct legion_private, notify_work);
+
+	if (trace_legion_profile_notify_enabled()) {
+		int powermode = -1;
+
+		read_powermode(priv, &powermode);
+		trace_legion_profile_notify(powermode);
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	legion_platform_profile_notify(priv->ppdev);
+#else
+	legion_platform_profile_notify();
+#endif
+	legion_nl_event(LEGION_NL_EVENT_POWERMODE);
+}
+
+static void legion_wmi_notify(struct wmi_device *wdev, union acpi_object *data)
+{
+	struct legion_wmi_private *wpriv;
+	struct legion_private *priv;
+
+	rcu_read_lock();
+	priv = rcu_dereference(legion_shared);
+	if (!priv) {
+		pr_info("Received WMI event while not initialized!\n");
+		goto unlock;
+	}
+
+	wpriv = dev_get_drvdata(&wdev->dev);
+	switch (wpriv->event) {
+	case LEGION_EVENT_A:
+		pr_info("Fan event: legion type: %d;  acpi type: %d (%d=integer)",
+			wpriv->event, data->type, ACPI_TYPE_INTEGER);
+		break;
+	default:
+		pr_info("Event: legion type: %d;  acpi type: %d (%d=integer)",
+			wpriv->event, data->type, ACPI_TYPE_INTEGER);
+		break;
+	}
+
+	// lights changed by hotkeys (e.g. Fn+Space) are reported by one of
+	// these depending on model
+	if (wpriv->event == LEGION_WMI_EVENT_LIGHT ||
+	    wpriv->event == LEGION_EVENT_C)
+		schedule_delayed_work(
+			&priv->light_work,
+			msecs_to_jiffies(LEGION_LIGHT_REFRESH_DELAY_MS));
+
+	trace_legion_wmi_event(wpriv->event, LEGION_WMI_NOTIFY_DELAY_MS);
+	// todo; fix that!
+	// problem: we get an event just before the powermode change (from the key?),
+	// so if we notify too early, it will read the old power mode/platform profile
+	schedule_delayed_work(&priv->notify_work,
+			      msecs_to_jiffies(LEGION_WMI_NOTIFY_DELAY_MS));
+
+unlock:
+	rcu_read_unlock();
+}
+
+static int legion_wmi_probe(struct wmi_device *wdev, const void *context)
+{
+	struct legion_wmi_private *wpriv;
+
+	wpriv = devm_kzalloc(&wdev->dev, sizeof(*wpriv), GFP_KERNEL);
+	if (!wpriv)
+		return -ENOMEM;
+
+	*wpriv = *(const struct legion_wmi_private *)context;
+
+	dev_set_drvdata(&wdev->dev, wpriv);
+	dev_info(&wdev->dev, "Register after probing for WMI.\n");
+	return 0;
+}
+
+static const struct legion_wmi_private legion_wmi_context_gamezone = {
+	.event = LEGION_WMI_EVENT_GAMEZONE
+};
+static const struct legion_wmi_private legion_wmi_context_a = {
+	.event = LEGION_EVENT_A
+};
+static const struct legion_wmi_private legion_wmi_context_b = {
+	.event = LEGION_EVENT_B
+};
+static const struct legion_wmi_private legion_wmi_context_c = {
+	.event = LEGION_EVENT_C
+};
+static const struct legion_wmi_private legion_wmi_context_d = {
+	.event = LEGION_EVENT_D
+};
+static const struct legion_wmi_private legion_wmi_context_e = {
+	.event = LEGION_EVENT_E
+};
+static const struct legion_wmi_private legion_wmi_context_f = {
+	.event = LEGION_EVENT_F
+};
+static const struct legion_wmi_private legion_wmi_context_light = {
+	.event = LEGION_WMI_EVENT_LIGHT
+};
+
+#define LEGION_WMI_GUID_FAN_EVENT "D320289E-8FEA-41E0-86F9-611D83151B5F"
+#define LEGION_WMI_GUID_FAN2_EVENT "bc72a435-e8c1-4275-b3e2-d8b8074aba59"
+#define LEGION_WMI_GUID_GAMEZONE_KEY_EVENT \
+	"10afc6d9-ea8b-4590-a2e7-1cd3c84bb4b1"
+#define LEGION_WMI_GUID_GAMEZONE_GPU_EVENT \
+	"bfd42481-aee3-4502-a107-afb68425c5f8"
+#define LEGION_WMI_GUID_GAMEZONE_OC_EVENT "d062906b-12d4-4510-999d-4831ee80e985"
+#define LEGION_WMI_GUID_GAMEZONE_TEMP_EVENT \
+	"bfd42481-aee3-4501-a107-afb68425c5f8"
+//#define LEGION_WMI_GUID_GAMEZONE_DATA_EVENT  "887b54e3-dddc-4b2c-8b88-68a26a8835d0"
+
+static const struct wmi_device_id legion_wmi_ids[] = {
+	{ LEGION_WMI_GAMEZONE_GUID, &legion_wmi_context_gamezone },
+	{ LEGION_WMI_GUID_FAN_EVENT, &legion_wmi_context_a },
+	{ LEGION_WMI_GUID_FAN2_EVENT, &legion_wmi_context_b },
+	{ LEGION_WMI_GUID_GAMEZONE_KEY_EVENT, &legion_wmi_context_c },
+	{ LEGION_WMI_GUID_GAMEZONE_GPU_EVENT, &legion_wmi_context_d },
+	{ LEGION_WMI_GUID_GAMEZONE_OC_EVENT, &legion_wmi_context_e },
+	{ LEGION_WMI_GUID_GAMEZONE_TEMP_EVENT, &legion_wmi_context_f },
+	{ "8FC0DE0C-B4E4-43FD-B0F3-8871711C1294",
+	  &legion_wmi_context_light }, /* Legion 5, lighting event */
+	{},
+};
+MODULE_DEVICE_TABLE(wmi, legion_wmi_ids);
+
+static struct wmi_driver legion_wmi_driver = {
+	.driver = {
+		.name = "legion_wmi",
+	},
+	.id_table = legion_wmi_ids,
+	.probe = legion_wmi_probe,
+	.notify = legion_wmi_notify,
+};
+
+//acpi_status status = wmi_install_notify_handler(LEGION_WMI_GAMEZONE_GUID,
+//				legion_wmi_notify2, NULL);
+//if (ACPI_FAILURE(status)) {
+//    return -ENODEV;
+//}
+//return 0;
+
+static bool legion_wmi_registered;
+
+// Called from the deferred probe after the lights are set up, since WMI
+// events refresh them
+static int legion_wmi_init(void)
+{
+	int err;
+
+	err = wmi_driver_register(&legion_wmi_driver);
+	if (!err)
+		legion_wmi_registered = true;
+	return err;
+}
+
+static void legion_wmi_exit(void)
+{
+	if (!legion_wmi_registered)
+		return;
+	legion_wmi_registered = false;
+	// TODO: remove this
+	pr_info("Unloading legion WMI\n");
+
+	//wmi_remove_notify_handler(LEGION_WMI_GAMEZONE_GUID);
+	wmi_driver_unregister(&legion_wmi_driver);
+	pr_info("Unloading legion WMI done\n");
+}
+
+/* =============================  */
+/* Platform profile               */
+/* ============================   */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+static void legion_platform_profile_notify(struct device *dev)
+#else
+static void legion_platform_profile_notify(void)
+#endif
+{
+	if (!enable_platformprofile) {
+		pr_info("Skipping platform_profile_notify because enable_platformprofile is false\n");
+		return;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	platform_profile_notify(dev);
+#else
+	platform_profile_notify();
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+static int legion_platform_profile_get(struct device *dev,
+				       enum platform_profile_option *profile)
+#else
+static int legion_platform_profile_get(struct platform_profile_handler *pprof,
+				       enum platform_profile_option *profile)
+#endif
+{
+	int powermode;
+	struct legion_private *priv;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	priv = dev_get_drvdata(dev);
+#else
+	priv = container_of(pprof, struct legion_private,
+			    platform_profile_handler);
+#endif
+	read_powermode(priv, &powermode);
+
+	switch (powermode) {
+	case LEGION_WMI_POWERMODE_BALANCED:
+		*profile = PLATFORM_PROFILE_BALANCED;
+		break;
+	case LEGION_WMI_POWERMODE_PERFORMANCE:
+		*profile = PLATFORM_PROFILE_PERFORMANCE;
+		break;
+	case LEGION_WMI_POWERMODE_LOW_POWER:
+		*profile = PLATFORM_PROFILE_LOW_POWER;
+		break;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	case LEGION_WMI_POWERMODE_CUSTOM:
+		*profile = PLATFORM_PROFILE_CUSTOM;
+		break;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
+	case LEGION_WMI_POWERMODE_MAX_POWER:
+		*profile = PLATFORM_PROFILE_MAX_POWER;
+		break;
+#endif
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+static int legion_platform_profile_set(struct device *dev,
+				       enum platform_profile_option profile)
+#else
+static int legion_platform_profile_set(struct platform_profile_handler *pprof,
+				       enum platform_profile_option profile)
+#endif
+{
+	int powermode;
+	struct legion_private *priv;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	priv = dev_get_drvdata(dev);
+#else
+	priv = container_of(pprof, struct legion_private,
+			    platform_profile_handler);
+#endif
+	switch (profile) {
+	case PLATFORM_PROFILE_BALANCED:
+		powermode = LEGION_WMI_POWERMODE_BALANCED;
+		break;
+	case PLATFORM_PROFILE_PERFORMANCE:
+		powermode = LEGION_WMI_POWERMODE_PERFORMANCE;
+		break;
+	case PLATFORM_PROFILE_LOW_POWER:
+		powermode = LEGION_WMI_POWERMODE_LOW_POWER;
+		break;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	case PLATFORM_PROFILE_CUSTOM:
+		powermode = LEGION_WMI_POWERMODE_CUSTOM;
+		break;
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
+	case PLATFORM_PROFILE_MAX_POWER:
+		powermode = LEGION_WMI_POWERMODE_MAX_POWER;
+		break;
+#endif
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return write_powermode(priv, powermode);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+static bool conf_has_custom_powermode;
+static bool conf_has_extreme_powermode;
+static enum access_method conf_access_method_powermode;
+
+static int legion_platform_profile_probe(void *drvdata, unsigned long *choices)
+{
+	set_bit(PLATFORM_PROFILE_LOW_POWER, choices);
+	set_bit(PLATFORM_PROFILE_BALANCED, choices);
+	set_bit(PLATFORM_PROFILE_PERFORMANCE, choices);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	if (conf_has_custom_powermode && conf_access_method_powermode == ACCESS_METHOD_WMI)
+		set_bit(PLATFORM_PROFILE_CUSTOM, choices);
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
+	if (conf_has_extreme_powermode && conf_access_method_powermode == ACCESS_METHOD_WMI)
+		set_bit(PLATFORM_PROFILE_MAX_POWER, choices);
+#endif
+	return 0;
+}
+
+static const struct platform_profile_ops legion_platform_profile_ops = {
+	.probe = legion_platform_profile_probe,
+	.profile_get = legion_platform_profile_get,
+	.profile_set = legion_platform_profile_set,
+};
+#endif
+
+static int legion_platform_profile_init(struct legion_private *priv)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	struct device *dev = &priv->platform_device->dev;
+#else
+	int err;
+#endif
+
+	if (!enable_platformprofile) {
+		pr_info("Skipping creating platform profile support because enable_platformprofile is false\n");
+		return 0;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	conf_has_custom_powermode = priv->conf->has_custom_powermode;
+	conf_has_extreme_powermode = priv->conf->has_extreme_powermode;
+	conf_access_method_powermode = priv->conf->access_method_powermode;
+#else
+	priv->platform_profile_handler.profile_get =
+		legion_platform_profile_get;
+	priv->platform_profile_handler.profile_set =
+		legion_platform_profile_set;
+
+	set_bit(PLATFORM_PROFILE_LOW_POWER, priv->platform_profile_handler.choices);
+	set_bit(PLATFORM_PROFILE_BALANCED,
+		priv->platform_profile_handler.choices);
+	set_bit(PLATFORM_PROFILE_PERFORMANCE,
+		priv->platform_profile_handler.choices);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	if (priv->conf->has_custom_powermode &&
+	    priv->conf->access_method_powermode == ACCESS_METHOD_WMI) {
+		set_bit(PLATFORM_PROFILE_CUSTOM,
+			priv->platform_profile_handler.choices);
+	}
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 19, 0)
+	if (priv->conf->has_extreme_powermode &&
+	    priv->conf->access_method_powermode == ACCESS_METHOD_WMI) {
+		set_bit(PLATFORM_PROFILE_MAX_POWER,
+			priv->platform_profile_handler.choices);
+	}
+#endif
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	priv->ppdev = devm_platform_profile_register(dev, "lenovo-legion", priv, &legion_platform_profile_ops);
+	if (IS_ERR(priv->ppdev))
+		return PTR_ERR(priv->ppdev);
+#else
+	err = platform_profile_register(&priv->platform_profile_handler);
+	if (err)
+		return err;
+#endif
+
+	return 0;
+}
+
+static void legion_platform_profile_exit(struct legion_private *priv)
+{
+	if (!enable_platformprofile) {
+		pr_info("Skipping unloading platform profile support because enable_platformprofile is false\n");
+		return;
+	}
+	pr_info("Unloading legion platform profile\n");
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+	platform_profile_remove();
+#endif
+	pr_info("Unloading legion platform profile done\n");
+}
+
+/* =============================  */
+/* hwom interface              */
+/* ============================   */
+
+// hw-mon interface
+
+// todo: register_group or register_info?
+
+// TODO: use one common function (like here) or one function per attribute?
+static ssize_t sensor_label_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	int sensor_id = (to_sensor_dev_attr(attr))->index;
+	const char *label;
+
+	switch (sensor_id) {
+	case SENSOR_CPU_TEMP_ID:
+		label = "CPU Temperature\n";
+		break;
+	case SENSOR_GPU_TEMP_ID:
+		label = "GPU Temperature\n";
+		break;
+	case SENSOR_IC_TEMP_ID:
+		label = "IC Temperature\n";
+		break;
+	case SENSOR_FAN1_RPM_ID:
+		label = "Fan 1\n";
+		break;
+	case SENSOR_FAN2_RPM_ID:
+		label = "Fan 2\n";
+		break;
+	case SENSOR_FAN3_RPM_ID:
+		label = "Fan 3\n";
+		break;
+	case SENSOR_FAN4_RPM_ID:
+		label = "Fan 4\n";
+		break;
+	case SENSOR_FAN1_TARGET_RPM_ID:
+		label = "Fan 1 Target\n";
+		break;
+	case SENSOR_FAN2_TARGET_RPM_ID:
+		label = "Fan 2 Target\n";
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return sprintf(buf, label);
+}
+
+// TODO: use one common function (like here) or one function per attribute?
+static ssize_t sensor_show(struct device *dev, struct device_attribute *devattr,
+			   char *buf)
+{
+	struct legion_private *priv = dev_get_drvdata(dev);
+	int sensor_id = (to_sensor_dev_attr(devattr))->index;
+	struct sensor_values values;
+	int outval;
+	int err = -EIO;
+
 	switch (sensor_id) {
 	case SENSOR_CPU_TEMP_ID:
-		label = "CPU Temperature\n";
+		err = read_temperature(priv, 0, &outval);
+		outval *= 1000;
 		break;
 	case SENSOR_GPU_TEMP_ID:
-		label = "GPU Temperature\n";
+		err = read_gpu_temperature(priv, &outval);
+		outval *= 1000;
 		break;
 	case SENSOR_IC_TEMP_ID:
-		label = "IC Temperature\n";
+		ec_read_sensor_values(&priv->ecram, priv->conf, &values);
+		outval = 1000 * values.ic_temp_celsius;
+		err = 0;
 		break;
 	case SENSOR_FAN1_RPM_ID:
-		label = "Fan 1\n";
+		err = read_fanspeed(priv, 0, &outval);
 		break;
 	case SENSOR_FAN2_RPM_ID:
-		label = "Fan 2\n";
+		err = read_fanspeed(priv, 1, &outval);
 		break;
 	case SENSOR_FAN3_RPM_ID:
-		label = "Fan 3\n";
+		err = read_fanspeed(priv, 2, &outval);
 		break;
 	case SENSOR_FAN4_RPM_ID:
-		label = "Fan 4\n";
+		err = read_fanspeed(priv, 3, &outval);
 		break;
 	case SENSOR_FAN1_TARGET_RPM_ID:
-		label = "Fan 1 Target\n";
+		ec_read_sensor_values(&priv->ecram, priv->conf, &values);
+		outval = values.fan1_target_rpm;
+		err = 0;
 		break;
 	case SENSOR_FAN2_TARGET_RPM_ID:
-		label = "Fan 2 Target\n";
+		ec_read_sensor_values(&priv->ecram, priv->conf, &values);
+		outval = values.fan2_target_rpm;
+		err = 0;
+		break;
+	default:
+		pr_info("Error reading sensor value with id %d\n", sensor_id);
+		return -EOPNOTSUPP;
+	}
+	if (err)
+		return err;
+
+	return sprintf(buf, "%d\n", outval);
+}
+
+static SENSOR_DEVICE_ATTR_RO(temp1_input, sensor, SENSOR_CPU_TEMP_ID);
+static SENSOR_DEVICE_ATTR_RO(temp1_label, sensor_label, SENSOR_CPU_TEMP_ID);
+static SENSOR_DEVICE_ATTR_RO(temp2_input, sensor, SENSOR_GPU_TEMP_ID);
+static SENSOR_DEVICE_ATTR_RO(temp2_label, sensor_label, SENSOR_GPU_TEMP_ID);
+static SENSOR_DEVICE_ATTR_RO(temp3_input, sensor, SENSOR_IC_TEMP_ID);
+static SENSOR_DEVICE_ATTR_RO(temp3_label, sensor_label, SENSOR_IC_TEMP_ID);
+static SENSOR_DEVICE_ATTR_RO(fan1_input, sensor, SENSOR_FAN1_RPM_ID);
+static SENSOR_DEVICE_ATTR_RO(fan1_label, sensor_label, SENSOR_FAN1_RPM_ID);
+static SENSOR_DEVICE_ATTR_RO(fan2_input, sensor, SENSOR_FAN2_RPM_ID);
+static SENSOR_DEVICE_ATTR_RO(fan2_label, sensor_label, SENSOR_FAN2_RPM_ID);
+static SENSOR_DEVICE_ATTR_RO(fan3_input, sensor, SENSOR_FAN3_RPM_ID);
+static SENSOR_DEVICE_ATTR_RO(fan3_label, sensor_label, SENSOR_FAN3_RPM_ID);
+static SENSOR_DEVICE_ATTR_RO(fan4_input, sensor, SENSOR_FAN4_RPM_ID);
+static SENSOR_DEVICE_ATTR_RO(fan4_label, sensor_label, SENSOR_FAN4_RPM_ID);
+static SENSOR_DEVICE_ATTR_RO(fan1_target, sensor, SENSOR_FAN1_TARGET_RPM_ID);
+static SENSOR_DEVICE_ATTR_RO(fan2_target, sensor, SENSOR_FAN2_TARGET_RPM_ID);
+
+static struct attribute *sensor_hwmon_attributes[] = {
+	&sensor_dev_attr_temp1_input.dev_attr.attr,
+	&sensor_dev_attr_temp1_label.dev_attr.attr,
+	&sensor_dev_attr_temp2_input.dev_attr.attr,
+	&sensor_dev_attr_temp2_label.dev_attr.attr,
+	&sensor_dev_attr_temp3_input.dev_attr.attr,
+	&sensor_dev_attr_temp3_label.dev_attr.attr,
+	&sensor_dev_attr_fan1_input.dev_attr.attr,
+	&sensor_dev_attr_fan1_label.dev_attr.attr,
+	&sensor_dev_attr_fan2_input.dev_attr.attr,
+	&sensor_dev_attr_fan2_label.dev_attr.attr,
+	&sensor_dev_attr_fan3_input.dev_attr.attr,
+	&sensor_dev_attr_fan3_label.dev_attr.attr,
+	&sensor_dev_attr_fan4_input.dev_attr.attr,
+	&sensor_dev_attr_fan4_label.dev_attr.attr,
+	&sensor_dev_attr_fan1_target.dev_attr.attr,
+	&sensor_dev_attr_fan2_target.dev_attr.attr,
+	NULL
+};
+
+static ssize_t fan_max_show(struct device *dev,
+			    struct device_attribute *devattr, char *buf)
+{
+	return sprintf(buf, "%d\n", MAX_RPM);
+}
+
+static ssize_t autopoint_show(struct device *dev,
+			      struct device_attribute *devattr, char *buf)
+{
+	struct fancurve fancurve;
+	int err;
+	int value;
+	struct legion_private *priv = dev_get_drvdata(dev);
+	int fancurve_attr_id = to_sensor_dev_attr_2(devattr)->nr;
+	int point_id = to_sensor_dev_attr_2(devattr)->index;
+	bool ok = true;
+
+	mutex_lock(&priv->fancurve_mutex);
+	err = read_fancurve(priv, &fancurve);
+	mutex_unlock(&priv->fancurve_mutex);
+
+	if (err) {
+		pr_info("Failed to read fancurve\n");
+		return -EOPNOTSUPP;
+	}
+	if (!(point_id >= 0 && point_id < MAXFANCURVESIZE)) {
+		pr_info("Failed to read fancurve due to wrong point id: %d\n",
+			point_id);
+		return -EOPNOTSUPP;
+	}
+
+	switch (fancurve_attr_id) {
+	case FANCURVE_ATTR_PWM1:
+		ok = fancurve_get_speed_pwm(&fancurve, point_id, 0, &value);
+		break;
+	case FANCURVE_ATTR_PWM2:
+		ok = fancurve_get_speed_pwm(&fancurve, point_id, 1, &value);
+		break;
+	case FANCURVE_ATTR_CPU_TEMP:
+		value = fancurve.points[point_id].cpu_max_temp_celsius;
+		break;
+	case FANCURVE_ATTR_CPU_HYST:
+		value = fancurve.points[point_id].cpu_min_temp_celsius;
+		break;
+	case FANCURVE_ATTR_GPU_TEMP:
+		value = fancurve.points[point_id].gpu_max_temp_celsius;
+		break;
+	case FANCURVE_ATTR_GPU_HYST:
+		value = fancurve.points[point_id].gpu_min_temp_celsius;
+		break;
+	case FANCURVE_ATTR_IC_TEMP:
+		value = fancurve.points[point_id].ic_max_temp_celsius;
+		break;
+	case FANCURVE_ATTR_IC_HYST:
+		value = fancurve.points[point_id].ic_min_temp_celsius;
+		break;
+	case FANCURVE_ATTR_ACCEL:
+		value = fancurve.points[point_id].accel;
+		break;
+	case FANCURVE_ATTR_DECEL:
+		value = fancurve.points[point_id].decel;
+		break;
+	case FANCURVE_SIZE:
+		value = fancurve.size;
 		break;
 	default:
+		pr_info("Failed to read fancurve due to wrong attribute id: %d\n",
+			fancurve_attr_id);
+		return -EOPNOTSUPP;
+	}
+	if (!ok)
+		value = 0;
+	return sprintf(buf, "%d\n", value);
+}
+
+static ssize_t autopoint_store(struct device *dev,
+			       struct device_attribute *devattr,
+			       const char *buf, size_t count)
+{
+	struct fancurve fancurve;
+	int err;
+	int value;
+	bool valid;
+	struct legion_private *priv = dev_get_drvdata(dev);
+	int fancurve_attr_id = to_sensor_dev_attr_2(devattr)->nr;
+	int point_id = to_sensor_dev_attr_2(devattr)->index;
+	bool write_fancurve_size = false;
+
+	if (priv->conf->wmi_fancurve_speed_only &&
+	    fancurve_attr_id != FANCURVE_ATTR_PWM1)
 		return -EOPNOTSUPP;
+
+	if (!(point_id >= 0 && point_id < MAXFANCURVESIZE)) {
+		pr_info("Failed to read fancurve due to wrong point id: %d\n",
+			point_id);
+		err = -EOPNOTSUPP;
+		goto error;
+	}
+
+	err = kstrtoint(buf, 0, &value);
+	if (err) {
+		pr_info("Parsing hwmon store failed: error: %d; point_id: %d; fancurve_attr_id: %d\\n",
+			err, point_id, fancurve_attr_id);
+		goto error;
+	}
+
+	mutex_lock(&priv->fancurve_mutex);
+	err = fan_control_write_allowed(priv);
+	if (err)
+		goto error_mutex;
+	err = read_fancurve(priv, &fancurve);
+
+	if (err) {
+		pr_info("Failed to read fancurve\n");
+		err = -EOPNOTSUPP;
+		goto error_mutex;
+	}
+
+	switch (fancurve_attr_id) {
+	case FANCURVE_ATTR_PWM1:
+		valid = fancurve_set_speed_pwm(&fancurve, point_id, 0, value);
+		break;
+	case FANCURVE_ATTR_PWM2:
+		valid = fancurve_set_speed_pwm(&fancurve, point_id, 1, value);
+		break;
+	case FANCURVE_ATTR_CPU_TEMP:
+		valid = fancurve_set_cpu_temp_max(&fancurve, point_id, value);
+		break;
+	case FANCURVE_ATTR_CPU_HYST:
+		valid = fancurve_set_cpu_temp_min(&fancurve, point_id, value);
+		break;
+	case FANCURVE_ATTR_GPU_TEMP:
+		valid = fancurve_set_gpu_temp_max(&fancurve, point_id, value);
+		break;
+	case FANCURVE_ATTR_GPU_HYST:
+		valid = fancurve_set_gpu_temp_min(&fancurve, point_id, value);
+		break;
+	case FANCURVE_ATTR_IC_TEMP:
+		valid = fancurve_set_ic_temp_max(&fancurve, point_id, value);
+		break;
+	case FANCURVE_ATTR_IC_HYST:
+		valid = fancurve_set_ic_temp_min(&fancurve, point_id, value);
+		break;
+	case FANCURVE_ATTR_ACCEL:
+		valid = fancurve_set_accel(&fancurve, point_id, value);
+		break;
+	case FANCURVE_ATTR_DECEL:
+		valid = fancurve_set_decel(&fancurve, point_id, value);
+		break;
+	case FANCURVE_SIZE:
+		valid = fancurve_set_size(&fancurve, value, true);
+		write_fancurve_size = true;
+		break;
+	default:
+		pr_info("Failed to write fancurve due to wrong attribute id: %d\n",
+			fancurve_attr_id);
+		err = -EOPNOTSUPP;
+		goto error_mutex;
+	}
+
+	if (!valid) {
+		pr_info("Ignoring invalid fancurve value %d for attribute %d at point %d\n",
+			value, fancurve_attr_id, point_id);
+		err = -EOPNOTSUPP;
+		goto error_mutex;
+	}
+
+	err = write_fancurve(priv, &fancurve, write_fancurve_size);
+	if (err) {
+		pr_info("Failed to write fancurve for accessing hwmon at point_id: %d\n",
+			point_id);
+		goto error_mutex;
 	}
 
-	return sprintf(buf, label);
+	mutex_unlock(&priv->fancurve_mutex);
+	return count;
+
+error_mutex:
+	mutex_unlock(&priv->fancurve_mutex);
+error:
+	return err;
 }
 
-// TODO: use one common function (like here) or one function per attribute?
-static ssize_t sensor_show(struct device *dev, struct device_attribute *devattr,
-			   char *buf)
+static ssize_t fancurve_defaults_powermode_store(struct device *dev,
+				  struct device_attribute *devattr,
+				  const char *buf, size_t count)
 {
+	int value;
+	int err;
 	struct legion_private *priv = dev_get_drvdata(dev);
-	int sensor_id = (to_sensor_dev_attr(devattr))->index;
-	struct sensor_values values;
-	int outval;
-	int err = -EIO;
 
-	switch (sensor_id) {
-	case SENSOR_CPU_TEMP_ID:
-		err = read_temperature(priv, 0, &outval);
-		outval *= 1000;
-		break;
-	case SENSOR_GPU_TEMP_ID:
-		err = read_temperature(priv, 1, &outval);
-		outval *= 1000;
-		break;
-	case SENSOR_IC_TEMP_ID:
-		ec_read_sensor_values(&priv->ecram, priv->conf, &values);
-		outval = 1000 * values.ic_temp_celsius;
-		err = 0;
-		break;
-	case SENSOR_FAN1_RPM_ID:
-		err = read_fanspeed(priv, 0, &outval);
-		break;
-	case SENSOR_FAN2_RPM_ID:
-		err = read_fanspeed(priv, 1, &outval);
-		break;
-	case SENSOR_FAN3_RPM_ID:
-		err = read_fanspeed(priv, 2, &outval);
-		break;
-	case SENSOR_FAN4_RPM_ID:
-		err = read_fanspeed(priv, 3, &outval);
-		break;
-	case SENSOR_FAN1_TARGET_RPM_ID:
-		ec_read_sensor_values(&priv->ecram, priv->conf, &values);
-		outval = values.fan1_target_rpm;
-		err = 0;
-		break;
-	case SENSOR_FAN2_TARGET_RPM_ID:
-		ec_read_sensor_values(&priv->ecram, priv->conf, &values);
-		outval = values.fan2_target_rpm;
-		err = 0;
-		break;
-	default:
-		pr_info("Error reading sensor value with id %d\n", sensor_id);
-		return -EOPNOTSUPP;
+	err = kstrtoint(buf, 0, &value);
+	if (err) {
+		err = -1;
+		pr_info("Parsing fancurve_defaults_powermode store failed: error:%d\n", err);
+		goto error;
+	}
+
+	if (!(value == LEGION_WMI_POWERMODE_LOW_POWER ||
+	      value == LEGION_WMI_POWERMODE_PERFORMANCE ||
+	      value == LEGION_WMI_POWERMODE_BALANCED ||
+	      value == LEGION_WMI_POWERMODE_CUSTOM ||
+	      value == LEGION_WMI_POWERMODE_MAX_POWER)) {
+		err = -1;
+		pr_info("Parsing fancurve_defaults_powermode store failed invalid powermode id %d: error:%d\n", value, err);
+		goto error;
+	}
+
+	mutex_lock(&priv->fancurve_mutex);
+	err = wmi_write_fancurve_defaults(priv, value);
+	if (err) {
+		err = -1;
+		pr_info("Failed to write auto points defaults\n");
+		goto error_unlock;
+	}
+	fancurve_defaults_powermode = value;
+	mutex_unlock(&priv->fancurve_mutex);
+	return count;
+
+error_unlock:
+	mutex_unlock(&priv->fancurve_mutex);
+error:
+	return err;
+}
+
+static ssize_t fancurve_defaults_powermode_show(struct device *dev,
+				 struct device_attribute *devattr, char *buf)
+{
+	struct legion_private *priv = dev_get_drvdata(dev);
+	int power_mode;
+
+	mutex_lock(&priv->fancurve_mutex);
+	read_powermode(priv, &power_mode);
+	mutex_unlock(&priv->fancurve_mutex);
+	// set to 0 if not in CUSTOM mode (pressed Fn-Q)
+	if (power_mode != LEGION_WMI_POWERMODE_CUSTOM)
+		fancurve_defaults_powermode = 0;
+	return sprintf(buf, "%d\n", fancurve_defaults_powermode);
+}
+
+// pwm1
+static SENSOR_DEVICE_ATTR_RO(fan1_max, fan_max, 0);
+// pwm2
+static SENSOR_DEVICE_ATTR_RO(fan2_max, fan_max, 0);
+//size
+static SENSOR_DEVICE_ATTR_2_RW(auto_points_size, autopoint, FANCURVE_SIZE, 0);
+static SENSOR_DEVICE_ATTR_2_RW(fancurve_defaults_powermode, fancurve_defaults_powermode, 0, 0);
+
+static ssize_t minifancurve_show(struct device *dev,
+				 struct device_attribute *devattr, char *buf)
+{
+	bool value;
+	int err;
+	struct legion_private *priv = dev_get_drvdata(dev);
+
+	mutex_lock(&priv->fancurve_mutex);
+	err = ec_read_minifancurve(&priv->ecram, priv->conf, &value);
+	if (err) {
+		err = -1;
+		pr_info("Failed to read minifancurve\n");
+		goto error_unlock;
+	}
+	mutex_unlock(&priv->fancurve_mutex);
+	return sprintf(buf, "%d\n", value);
+
+error_unlock:
+	mutex_unlock(&priv->fancurve_mutex);
+	return -1;
+}
+
+static ssize_t minifancurve_store(struct device *dev,
+				  struct device_attribute *devattr,
+				  const char *buf, size_t count)
+{
+	int value;
+	int err;
+	struct legion_private *priv = dev_get_drvdata(dev);
+
+	err = kstrtoint(buf, 0, &value);
+	if (err) {
+		err = -1;
+		pr_info("Parsing hwmon store failed: error:%d\n", err);
+		goto error;
+	}
+
+	mutex_lock(&priv->fancurve_mutex);
+	err = ec_write_minifancurve(&priv->ecram, priv->conf, value);
+	if (err) {
+		err = -1;
+		pr_info("Failed to write minifancurve\n");
+		goto error_unlock;
+	}
+	mutex_unlock(&priv->fancurve_mutex);
+	return count;
+
+error_unlock:
+	mutex_unlock(&priv->fancurve_mutex);
+error:
+	return err;
+}
+
+static SENSOR_DEVICE_ATTR_RW(minifancurve, minifancurve, 0);
+
+static struct attribute *fancurve_hwmon_attributes[] = {
+	&sensor_dev_attr_fan1_max.dev_attr.attr,
+	&sensor_dev_attr_fan2_max.dev_attr.attr,
+	//
+	&sensor_dev_attr_auto_points_size.dev_attr.attr,
+	&sensor_dev_attr_minifancurve.dev_attr.attr,
+	&sensor_dev_attr_fancurve_defaults_powermode.dev_attr.attr,
+	NULL
+};
+
+static bool legion_wmi_fancurve_speed_attribute(const struct attribute *attr)
+{
+	return attr == &sensor_dev_attr_fan1_max.dev_attr.attr;
+}
+
+static umode_t legion_hwmon_sensor_is_visible(struct kobject *kobj,
+					      struct attribute *attr,
+					      int idx)
+{
+	bool supported = true;
+	struct device *dev = kobj_to_dev(kobj);
+	struct legion_private *priv = dev_get_drvdata(dev);
+
+	if (attr == &sensor_dev_attr_temp3_input.dev_attr.attr ||
+	    attr == &sensor_dev_attr_temp3_label.dev_attr.attr)
+		supported = supported && !priv->conf->skip_ic_temp;
+
+	if (attr == &sensor_dev_attr_fan3_input.dev_attr.attr ||
+	    attr == &sensor_dev_attr_fan3_label.dev_attr.attr ||
+	    attr == &sensor_dev_attr_fan4_input.dev_attr.attr ||
+	    attr == &sensor_dev_attr_fan4_label.dev_attr.attr)
+		supported = supported && priv->conf->has_four_fans;
+
+	return supported ? attr->mode : 0;
+}
+
+static umode_t legion_hwmon_fancurve_is_visible(struct kobject *kobj,
+						struct attribute *attr,
+						int idx)
+{
+	bool supported = true;
+	struct device *dev = kobj_to_dev(kobj);
+	struct legion_private *priv = dev_get_drvdata(dev);
+
+	if (priv->conf->wmi_fancurve_speed_only &&
+	    !legion_wmi_fancurve_speed_attribute(attr))
+		return 0;
+	if (attr == &sensor_dev_attr_minifancurve.dev_attr.attr)
+		supported = priv->conf->has_minifancurve;
+	if (attr == &sensor_dev_attr_fancurve_defaults_powermode.dev_attr.attr)
+		supported = priv->conf->has_fancurve_defaults;
+
+	supported = supported && (priv->conf->access_method_fancurve !=
+				  ACCESS_METHOD_NO_ACCESS);
+
+	return supported ? attr->mode : 0;
+}
+
+static const struct attribute_group legion_hwmon_sensor_group = {
+	.attrs = sensor_hwmon_attributes,
+	.is_visible = legion_hwmon_sensor_is_visible
+};
+
+static const struct attribute_group legion_hwmon_fancurve_group = {
+	.attrs = fancurve_hwmon_attributes,
+	.is_visible = legion_hwmon_fancurve_is_visible,
+};
+
+// Fan curve points (pwmX_auto_pointY_*) are not defined statically but
+// generated for the values and number of points the model supports.
+struct legion_autopoint_desc {
+	const char *name_fmt;
+	enum FANCURVE_ATTR attr_id;
+};
+
+static const struct legion_autopoint_desc legion_autopoint_descs[] = {
+	{ "pwm1_auto_point%d_pwm", FANCURVE_ATTR_PWM1 },
+	{ "pwm2_auto_point%d_pwm", FANCURVE_ATTR_PWM2 },
+	{ "pwm1_auto_point%d_temp", FANCURVE_ATTR_CPU_TEMP },
+	{ "pwm1_auto_point%d_temp_hyst", FANCURVE_ATTR_CPU_HYST },
+	{ "pwm2_auto_point%d_temp", FANCURVE_ATTR_GPU_TEMP },
+	{ "pwm2_auto_point%d_temp_hyst", FANCURVE_ATTR_GPU_HYST },
+	{ "pwm3_auto_point%d_temp", FANCURVE_ATTR_IC_TEMP },
+	{ "pwm3_auto_point%d_temp_hyst", FANCURVE_ATTR_IC_HYST },
+	{ "pwm1_auto_point%d_accel", FANCURVE_ATTR_ACCEL },
+	{ "pwm1_auto_point%d_decel", FANCURVE_ATTR_DECEL },
+};
+
+#define LEGION_AUTOPOINT_NAME_LEN 32
+
+struct legion_autopoint_attr {
+	struct sensor_device_attribute_2 sensor_attr;
+	char name[LEGION_AUTOPOINT_NAME_LEN];
+};
+
+static bool legion_autopoint_is_supported(struct legion_private *priv,
+					  enum FANCURVE_ATTR attr_id)
+{
+	if (priv->conf->wmi_fancurve_speed_only)
+		return attr_id == FANCURVE_ATTR_PWM1;
+	if (attr_id == FANCURVE_ATTR_PWM2)
+		return priv->caps.fan_count >= 2;
+	return true;
+}
+
+// Number of fan curve points that get attributes. The size of the fan
+// curve can only be changed with direct EC access; otherwise it is fixed.
+static size_t legion_autopoint_count(struct legion_private *priv)
+{
+	if (priv->conf->access_method_fancurve == ACCESS_METHOD_EC)
+		return MAXFANCURVESIZE;
+	return min_t(size_t, priv->caps.fancurve_size, MAXFANCURVESIZE);
+}
+
+// Builds hwmon_autopoint_group. Called after the fan curve size is known
+// and before the hwmon device is registered, so the attributes exist when
+// its uevent is sent.
+static int legion_hwmon_autopoints_init(struct legion_private *priv)
+{
+	struct device *dev = &priv->platform_device->dev;
+	struct legion_autopoint_attr *points;
+	struct attribute **attrs;
+	size_t point_count = legion_autopoint_count(priv);
+	size_t max_count = 0;
+	size_t count = 0;
+	size_t i;
+	size_t j;
+
+	if (!legion_has_capability(priv, LEGION_CAP_FANCURVE) ||
+	    point_count == 0)
+		return -ENODEV;
+
+	// only allocate what is used
+	for (i = 0; i < ARRAY_SIZE(legion_autopoint_descs); ++i) {
+		if (legion_autopoint_is_supported(
+			    priv, legion_autopoint_descs[i].attr_id))
+			max_count += point_count;
 	}
-	if (err)
-		return err;
 
-	return sprintf(buf, "%d\n", outval);
-}
+	points = devm_kcalloc(dev, max_count, sizeof(*points), GFP_KERNEL);
+	attrs = devm_kcalloc(dev, max_count + 1, sizeof(*attrs), GFP_KERNEL);
+	if (!points || !attrs)
+		return -ENOMEM;
 
-static SENSOR_DEVICE_ATTR_RO(temp1_input, sensor, SENSOR_CPU_TEMP_ID);
-static SENSOR_DEVICE_ATTR_RO(temp1_label, sensor_label, SENSOR_CPU_TEMP_ID);
-static SENSOR_DEVICE_ATTR_RO(temp2_input, sensor, SENSOR_GPU_TEMP_ID);
-static SENSOR_DEVICE_ATTR_RO(temp2_label, sensor_label, SENSOR_GPU_TEMP_ID);
-static SENSOR_DEVICE_ATTR_RO(temp3_input, sensor, SENSOR_IC_TEMP_ID);
-static SENSOR_DEVICE_ATTR_RO(temp3_label, sensor_label, SENSOR_IC_TEMP_ID);
-static SENSOR_DEVICE_ATTR_RO(fan1_input, sensor, SENSOR_FAN1_RPM_ID);
-static SENSOR_DEVICE_ATTR_RO(fan1_label, sensor_label, SENSOR_FAN1_RPM_ID);
-static SENSOR_DEVICE_ATTR_RO(fan2_input, sensor, SENSOR_FAN2_RPM_ID);
-static SENSOR_DEVICE_ATTR_RO(fan2_label, sensor_label, SENSOR_FAN2_RPM_ID);
-static SENSOR_DEVICE_ATTR_RO(fan3_input, sensor, SENSOR_FAN3_RPM_ID);
-static SENSOR_DEVICE_ATTR_RO(fan3_label, sensor_label, SENSOR_FAN3_RPM_ID);
-static SENSOR_DEVICE_ATTR_RO(fan4_input, sensor, SENSOR_FAN4_RPM_ID);
-static SENSOR_DEVICE_ATTR_RO(fan4_label, sensor_label, SENSOR_FAN4_RPM_ID);
-static SENSOR_DEVICE_ATTR_RO(fan1_target, sensor, SENSOR_FAN1_TARGET_RPM_ID);
-static SENSOR_DEVICE_ATTR_RO(fan2_target, sensor, SENSOR_FAN2_TARGET_RPM_ID);
+	for (i = 0; i < ARRAY_SIZE(legion_autopoint_descs); ++i) {
+		const struct legion_autopoint_desc *desc =
+			&legion_autopoint_descs[i];
+
+		if (!legion_autopoint_is_supported(priv, desc->attr_id))
+			continue;
+
+		for (j = 0; j < point_count; ++j) {
+			struct legion_autopoint_attr *point = &points[count];
+			struct device_attribute *dev_attr =
+				&point->sensor_attr.dev_attr;
+
+			snprintf(point->name, sizeof(point->name),
+				 desc->name_fmt, (int)j + 1);
+			sysfs_attr_init(&dev_attr->attr);
+			dev_attr->attr.name = point->name;
+			dev_attr->attr.mode = 0644;
+			dev_attr->show = autopoint_show;
+			dev_attr->store = autopoint_store;
+			point->sensor_attr.nr = desc->attr_id;
+			point->sensor_attr.index = j;
+			attrs[count++] = &dev_attr->attr;
+		}
+	}
+	attrs[count] = NULL;
 
-static struct attribute *sensor_hwmon_attributes[] = {
-	&sensor_dev_attr_temp1_input.dev_attr.attr,
-	&sensor_dev_attr_temp1_label.dev_attr.attr,
-	&sensor_dev_attr_temp2_input.dev_attr.attr,
-	&sensor_dev_attr_temp2_label.dev_attr.attr,
-	&sensor_dev_attr_temp3_input.dev_attr.attr,
-	&sensor_dev_attr_temp3_label.dev_attr.attr,
-	&sensor_dev_attr_fan1_input.dev_attr.attr,
-	&sensor_dev_attr_fan1_label.dev_attr.attr,
-	&sensor_dev_attr_fan2_input.dev_attr.attr,
-	&sensor_dev_attr_fan2_label.dev_attr.attr,
-	&sensor_dev_attr_fan3_input.dev_attr.attr,
-	&sensor_dev_attr_fan3_label.dev_attr.attr,
-	&sensor_dev_attr_fan4_input.dev_attr.attr,
-	&sensor_dev_attr_fan4_label.dev_attr.attr,
-	&sensor_dev_attr_fan1_target.dev_attr.attr,
-	&sensor_dev_attr_fan2_target.dev_attr.attr,
-	NULL
-};
+	priv->hwmon_autopoint_group.attrs = attrs;
 
-static ssize_t fan_max_show(struct device *dev,
-			    struct device_attribute *devattr, char *buf)
-{
-	return sprintf(buf, "%d\n", MAX_RPM);
+	pr_info("Created %zu fan curve attributes for %zu points using %zu bytes\n",
+		count, point_count,
+		max_count * sizeof(*points) + (max_count + 1) * sizeof(*attrs));
+	return 0;
 }
 
-static ssize_t autopoint_show(struct device *dev,
-			      struct device_attribute *devattr, char *buf)
+// Called from the deferred probe, since the fan curve attributes depend on
+// the probed capabilities.
+static ssize_t legion_hwmon_init(struct legion_private *priv)
 {
-	struct fancurve fancurve;
+	struct device *hwmon_dev;
+	size_t nr_groups = 0;
+	ktime_t start;
 	int err;
-	int value;
-	struct legion_private *priv = dev_get_drvdata(dev);
-	int fancurve_attr_id = to_sensor_dev_attr_2(devattr)->nr;
-	int point_id = to_sensor_dev_attr_2(devattr)->index;
-	bool ok = true;
 
-	mutex_lock(&priv->fancurve_mutex);
-	err = read_fancurve(priv, &fancurve);
-	mutex_unlock(&priv->fancurve_mutex);
+	//TODO: use hwmon_device_register_with_groups or
+	// hwmon_device_register_with_info (latter means all hwmon functions have to be
+	// changed)
+	// some laptop driver do it in one way, some in the other
+	// TODO: Use devm_hwmon_device_register_with_groups ?
+	// some laptop drivers use this, some
+	priv->hwmon_groups[nr_groups++] = &legion_hwmon_sensor_group;
+	priv->hwmon_groups[nr_groups++] = &legion_hwmon_fancurve_group;
+	err = legion_hwmon_autopoints_init(priv);
+	if (!err)
+		priv->hwmon_groups[nr_groups++] = &priv->hwmon_autopoint_group;
+	else if (err != -ENODEV)
+		pr_info("Failed to create fan curve attributes: %d\n", err);
+	priv->hwmon_groups[nr_groups] = NULL;
 
-	if (err) {
-		pr_info("Failed to read fancurve\n");
-		return -EOPNOTSUPP;
-	}
-	if (!(point_id >= 0 && point_id < MAXFANCURVESIZE)) {
-		pr_info("Failed to read fancurve due to wrong point id: %d\n",
-			point_id);
-		return -EOPNOTSUPP;
+	start = ktime_get();
+	hwmon_dev = hwmon_device_register_with_groups(
+		&priv->platform_device->dev, "legion_hwmon", priv,
+		priv->hwmon_groups);
+	if (IS_ERR_OR_NULL(hwmon_dev)) {
+		pr_err("hwmon_device_register failed!\n");
+		return PTR_ERR(hwmon_dev);
 	}
+	pr_info("Registered hwmon in %lld us\n",
+		ktime_us_delta(ktime_get(), start));
+	dev_set_drvdata(hwmon_dev, priv);
+	priv->hwmon_dev = hwmon_dev;
+	return 0;
+}
 
-	switch (fancurve_attr_id) {
-	case FANCURVE_ATTR_PWM1:
-		ok = fancurve_get_speed_pwm(&fancurve, point_id, 0, &value);
-		break;
-	case FANCURVE_ATTR_PWM2:
-		ok = fancurve_get_speed_pwm(&fancurve, point_id, 1, &value);
-		break;
-	case FANCURVE_ATTR_CPU_TEMP:
-		value = fancurve.points[point_id].cpu_max_temp_celsius;
-		break;
-	case FANCURVE_ATTR_CPU_HYST:
-		value = fancurve.points[point_id].cpu_min_temp_celsius;
-		break;
-	case FANCURVE_ATTR_GPU_TEMP:
-		value = fancurve.points[point_id].gpu_max_temp_celsius;
-		break;
-	case FANCURVE_ATTR_GPU_HYST:
-		value = fancurve.points[point_id].gpu_min_temp_celsius;
-		break;
-	case FANCURVE_ATTR_IC_TEMP:
-		value = fancurve.points[point_id].ic_max_temp_celsius;
-		break;
-	case FANCURVE_ATTR_IC_HYST:
-		value = fancurve.points[point_id].ic_min_temp_celsius;
-		break;
-	case FANCURVE_ATTR_ACCEL:
-		value = fancurve.points[point_id].accel;
-		break;
-	case FANCURVE_ATTR_DECEL:
-		value = fancurve.points[point_id].decel;
-		break;
-	case FANCURVE_SIZE:
-		value = fancurve.size;
-		break;
-	default:
-		pr_info("Failed to read fancurve due to wrong attribute id: %d\n",
-			fancurve_attr_id);
-		return -EOPNOTSUPP;
+static void legion_hwmon_exit(struct legion_private *priv)
+{
+	pr_info("Unloading legion hwon\n");
+	if (priv->hwmon_dev) {
+		hwmon_device_unregister(priv->hwmon_dev);
+		priv->hwmon_dev = NULL;
 	}
-	if (!ok)
-		value = 0;
-	return sprintf(buf, "%d\n", value);
+	pr_info("Unloading legion hwon done\n");
 }
 
-static ssize_t autopoint_store(struct device *dev,
-			       struct device_attribute *devattr,
-			       const char *buf, size_t count)
+/* =============================  */
+/* Thermal cooling device         */
+/* ============================   */
+// Cooling device so that thermal governors (or thermald) can raise the fans
+// before the embedded controller reacts with its own fan curve.
+// State 0 keeps the fan curve as it is. State i with 1 <= i < size of the
+// fan curve raises the speeds of all points below point i to the speeds
+// of point i, so the fans run at least at level i. If fan full speed is
+// supported, the highest state additionally turns it on.
+// Note: the fan curve that is active when leaving state 0 is restored when
+// going back to state 0, i.e. changes to the fan curve from user space in
+// between are overwritten.
+
+static unsigned long legion_cooling_curve_states(struct legion_private *priv)
+{
+	return priv->cooling_curve_size > 1 ? priv->cooling_curve_size - 1 : 0;
+}
+
+static unsigned long legion_cooling_max_state(struct legion_private *priv)
+{
+	unsigned long max_state = legion_cooling_curve_states(priv);
+
+	if (priv->conf->access_method_fanfullspeed != ACCESS_METHOD_NO_ACCESS)
+		max_state += 1;
+	return max_state;
+}
+
+// Only call with fancurve_mutex held
+static int legion_cooling_write_floor(struct legion_private *priv,
+				      size_t floor_i)
 {
 	struct fancurve fancurve;
+	size_t i;
 	int err;
-	int value;
-	bool valid;
-	struct legion_private *priv = dev_get_drvdata(dev);
-	int fancurve_attr_id = to_sensor_dev_attr_2(devattr)->nr;
-	int point_id = to_sensor_dev_attr_2(devattr)->index;
-	bool write_fancurve_size = false;
 
-	if (priv->conf->wmi_fancurve_speed_only &&
-	    fancurve_attr_id != FANCURVE_ATTR_PWM1)
-		return -EOPNOTSUPP;
+	if (floor_i == 0) {
+		// restore fan curve from before
+		if (!priv->cooling_base_valid)
+			return 0;
+		err = write_fancurve(priv, &priv->cooling_base, false);
+		if (!err)
+			priv->cooling_base_valid = false;
+		return err;
+	}
 
-	if (!(point_id >= 0 && point_id < MAXFANCURVESIZE)) {
-		pr_info("Failed to read fancurve due to wrong point id: %d\n",
-			point_id);
-		err = -EOPNOTSUPP;
-		goto error;
+	if (!priv->cooling_base_valid) {
+		err = read_fancurve(priv, &priv->cooling_base);
+		if (err)
+			return err;
+		priv->cooling_base_valid = true;
 	}
 
-	err = kstrtoint(buf, 0, &value);
-	if (err) {
-		pr_info("Parsing hwmon store failed: error: %d; point_id: %d; fancurve_attr_id: %d\\n",
-			err, point_id, fancurve_attr_id);
-		goto error;
+	fancurve = priv->cooling_base;
+	if (fancurve.size == 0)
+		return -EINVAL;
+	floor_i = min(floor_i, fancurve.size - 1);
+	for (i = 0; i < floor_i; ++i) {
+		fancurve.points[i].speed1 = max(fancurve.points[i].speed1,
+						fancurve.points[floor_i].speed1);
+		fancurve.points[i].speed2 = max(fancurve.points[i].speed2,
+						fancurve.points[floor_i].speed2);
 	}
+	return write_fancurve(priv, &fancurve, false);
+}
+
+// Only call with fancurve_mutex held
+static int legion_cooling_set_state(struct legion_private *priv,
+				    unsigned long state)
+{
+	unsigned long curve_states = legion_cooling_curve_states(priv);
+	bool fullspeed_old = priv->cooling_state > curve_states;
+	bool fullspeed_new = state > curve_states;
+	size_t floor_old = min(priv->cooling_state, curve_states);
+	size_t floor_new = min(state, curve_states);
+	int err;
+
+	if (state > legion_cooling_max_state(priv))
+		return -EINVAL;
+	if (state == priv->cooling_state)
+		return 0;
 
-	mutex_lock(&priv->fancurve_mutex);
 	err = fan_control_write_allowed(priv);
 	if (err)
-		goto error_mutex;
-	err = read_fancurve(priv, &fancurve);
+		return err;
 
-	if (err) {
-		pr_info("Failed to read fancurve\n");
-		err = -EOPNOTSUPP;
-		goto error_mutex;
+	if (fullspeed_old && !fullspeed_new) {
+		err = write_fanfullspeed(priv, false);
+		if (err)
+			return err;
 	}
 
-	switch (fancurve_attr_id) {
-	case FANCURVE_ATTR_PWM1:
-		valid = fancurve_set_speed_pwm(&fancurve, point_id, 0, value);
-		break;
-	case FANCURVE_ATTR_PWM2:
-		valid = fancurve_set_speed_pwm(&fancurve, point_id, 1, value);
-		break;
-	case FANCURVE_ATTR_CPU_TEMP:
-		valid = fancurve_set_cpu_temp_max(&fancurve, point_id, value);
-		break;
-	case FANCURVE_ATTR_CPU_HYST:
-		valid = fancurve_set_cpu_temp_min(&fancurve, point_id, value);
-		break;
-	case FANCURVE_ATTR_GPU_TEMP:
-		valid = fancurve_set_gpu_temp_max(&fancurve, point_id, value);
-		break;
-	case FANCURVE_ATTR_GPU_HYST:
-		valid = fancurve_set_gpu_temp_min(&fancurve, point_id, value);
-		break;
-	case FANCURVE_ATTR_IC_TEMP:
-		valid = fancurve_set_ic_temp_max(&fancurve, point_id, value);
-		break;
-	case FANCURVE_ATTR_IC_HYST:
-		valid = fancurve_set_ic_temp_min(&fancurve, point_id, value);
-		break;
-	case FANCURVE_ATTR_ACCEL:
-		valid = fancurve_set_accel(&fancurve, point_id, value);
-		break;
-	case FANCURVE_ATTR_DECEL:
-		valid = fancurve_set_decel(&fancurve, point_id, value);
-		break;
-	case FANCURVE_SIZE:
-		valid = fancurve_set_size(&fancurve, value, true);
-		write_fancurve_size = true;
-		break;
-	default:
-		pr_info("Failed to write fancurve due to wrong attribute id: %d\n",
-			fancurve_attr_id);
-		err = -EOPNOTSUPP;
-		goto error_mutex;
+	if (floor_old != floor_new) {
+		err = legion_cooling_write_floor(priv, floor_new);
+		if (err)
+			return err;
 	}
 
-	if (!valid) {
-		pr_info("Ignoring invalid fancurve value %d for attribute %d at point %d\n",
-			value, fancurve_attr_id, point_id);
-		err = -EOPNOTSUPP;
-		goto error_mutex;
+	if (fullspeed_new && !fullspeed_old) {
+		err = write_fanfullspeed(priv, true);
+		if (err)
+			return err;
 	}
 
-	err = write_fancurve(priv, &fancurve, write_fancurve_size);
-	if (err) {
-		pr_info("Failed to write fancurve for accessing hwmon at point_id: %d\n",
-			point_id);
-		err = -EOPNOTSUPP;
-		goto error_mutex;
-	}
+	priv->cooling_state = state;
+	return 0;
+}
+
+static int legion_cooling_get_max_state(struct thermal_cooling_device *cdev,
+					unsigned long *state)
+{
+	struct legion_private *priv = cdev->devdata;
+
+	*state = legion_cooling_max_state(priv);
+	return 0;
+}
+
+static int legion_cooling_get_cur_state(struct thermal_cooling_device *cdev,
+					unsigned long *state)
+{
+	struct legion_private *priv = cdev->devdata;
+
+	*state = priv->cooling_state;
+	return 0;
+}
 
-	mutex_unlock(&priv->fancurve_mutex);
-	return count;
+static int legion_cooling_set_cur_state(struct thermal_cooling_device *cdev,
+					unsigned long state)
+{
+	struct legion_private *priv = cdev->devdata;
+	int err;
 
-error_mutex:
+	mutex_lock(&priv->fancurve_mutex);
+	err = legion_cooling_set_state(priv, state);
 	mutex_unlock(&priv->fancurve_mutex);
-error:
+	if (err)
+		pr_info("Could not set cooling state %lu: %d\n", state, err);
 	return err;
 }
 
-static ssize_t fancurve_defaults_powermode_store(struct device *dev,
-				  struct device_attribute *devattr,
-				  const char *buf, size_t count)
+static const struct thermal_cooling_device_ops legion_cooling_ops = {
+	.get_max_state = legion_cooling_get_max_state,
+	.get_cur_state = legion_cooling_get_cur_state,
+	.set_cur_state = legion_cooling_set_cur_state,
+};
+
+static int legion_cooling_init(struct legion_private *priv)
 {
-	int value;
-	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
+	struct thermal_cooling_device *cdev;
 
-	err = kstrtoint(buf, 0, &value);
-	if (err) {
-		err = -1;
-		pr_info("Parsing fancurve_defaults_powermode store failed: error:%d\n", err);
-		goto error;
-	}
+	priv->cooling_state = 0;
+	priv->cooling_base_valid = false;
+	priv->cooling_curve_size = priv->caps.fancurve_size;
 
-	if (!(value == LEGION_WMI_POWERMODE_LOW_POWER ||
-	      value == LEGION_WMI_POWERMODE_PERFORMANCE ||
-	      value == LEGION_WMI_POWERMODE_BALANCED ||
-	      value == LEGION_WMI_POWERMODE_CUSTOM ||
-	      value == LEGION_WMI_POWERMODE_MAX_POWER)) {
-		err = -1;
-		pr_info("Parsing fancurve_defaults_powermode store failed invalid powermode id %d: error:%d\n", value, err);
-		goto error;
+	if (legion_cooling_max_state(priv) == 0) {
+		pr_info("No fan control for cooling device\n");
+		return -ENODEV;
 	}
 
+	cdev = thermal_cooling_device_register("legion_fan", priv,
+					       &legion_cooling_ops);
+	if (IS_ERR(cdev))
+		return PTR_ERR(cdev);
+	priv->cooling_dev = cdev;
+	pr_info("Cooling device with %lu states registered\n",
+		legion_cooling_max_state(priv) + 1);
+	return 0;
+}
+
+/**
+ * Deinit cooling device and give back fan control to the embedded
+ * controller.
+ *
+ * Can also be called if init was not successful.
+ */
+static void legion_cooling_exit(struct legion_private *priv)
+{
+	if (!priv->cooling_dev)
+		return;
+
+	thermal_cooling_device_unregister(priv->cooling_dev);
+	priv->cooling_dev = NULL;
+
 	mutex_lock(&priv->fancurve_mutex);
-	err = wmi_write_fancurve_defaults(priv, value);
-	if (err) {
-		err = -1;
-		pr_info("Failed to write auto points defaults\n");
-		goto error_unlock;
-	}
-	fancurve_defaults_powermode = value;
+	legion_cooling_set_state(priv, 0);
 	mutex_unlock(&priv->fancurve_mutex);
-	return count;
+}
 
-error_unlock:
-	mutex_unlock(&priv->fancurve_mutex);
-error:
-	return err;
+/* =============================  */
+/* Powercap                       */
+/* ============================   */
+// Power limits of CPU and GPU as powercap control type "legion" with the
+// zones "cpu" and "gpu". Each power limit supported by the firmware is a
+// constraint of its zone.
+
+#if IS_ENABLED(CONFIG_POWERCAP)
+
+#define LEGION_UW_PER_W 1000000ULL
+
+enum legion_powercap_zone_id {
+	LEGION_POWERCAP_ZONE_CPU = 0,
+	LEGION_POWERCAP_ZONE_GPU,
+	LEGION_POWERCAP_ZONE_MAX
+};
+
+static const char *const legion_powercap_zone_names[LEGION_POWERCAP_ZONE_MAX] = {
+	[LEGION_POWERCAP_ZONE_CPU] = "cpu",
+	[LEGION_POWERCAP_ZONE_GPU] = "gpu",
+};
+
+static const char *const legion_powercap_constraint_names[LEGION_POWERLIMIT_MAX] = {
+	[LEGION_POWERLIMIT_CPU_SHORTTERM] = "short_term",
+	[LEGION_POWERLIMIT_CPU_LONGTERM] = "long_term",
+	[LEGION_POWERLIMIT_CPU_PEAK] = "peak_power",
+	[LEGION_POWERLIMIT_CPU_APU_SPPT] = "apu_sppt",
+	[LEGION_POWERLIMIT_CPU_CROSS_LOADING] = "cross_loading",
+	[LEGION_POWERLIMIT_GPU_CTGP] = "ctgp",
+	[LEGION_POWERLIMIT_GPU_PPAB] = "ppab",
+};
+
+// Allocated on its own and freed by the powercap core with .release when
+// the last reference to the zone device is dropped, which can be after
+// powercap_unregister_zone.
+struct legion_powercap_zone {
+	struct powercap_zone zone;
+	bool registered;
+	struct legion_private *priv;
+	enum legion_powerlimit_id constraints[LEGION_POWERLIMIT_MAX];
+	int nr_constraints;
+};
+
+struct legion_powercap {
+	struct powercap_control_type *control_type;
+	struct legion_powercap_zone *zones[LEGION_POWERCAP_ZONE_MAX];
+};
+
+static enum legion_powercap_zone_id
+legion_powercap_zone_of(enum legion_powerlimit_id id)
+{
+	switch (id) {
+	case LEGION_POWERLIMIT_GPU_CTGP:
+	case LEGION_POWERLIMIT_GPU_PPAB:
+		return LEGION_POWERCAP_ZONE_GPU;
+	default:
+		return LEGION_POWERCAP_ZONE_CPU;
+	}
 }
 
-static ssize_t fancurve_defaults_powermode_show(struct device *dev,
-				 struct device_attribute *devattr, char *buf)
+static struct legion_powercap_zone *
+to_legion_powercap_zone(struct powercap_zone *zone)
 {
-	struct legion_private *priv = dev_get_drvdata(dev);
-	int power_mode;
+	return container_of(zone, struct legion_powercap_zone, zone);
+}
 
-	mutex_lock(&priv->fancurve_mutex);
-	read_powermode(priv, &power_mode);
-	mutex_unlock(&priv->fancurve_mutex);
-	// set to 0 if not in CUSTOM mode (pressed Fn-Q)
-	if (power_mode != LEGION_WMI_POWERMODE_CUSTOM)
-		fancurve_defaults_powermode = 0;
-	return sprintf(buf, "%d\n", fancurve_defaults_powermode);
+static const struct legion_powerlimit_desc *
+legion_powercap_constraint(struct powercap_zone *zone, int cid)
+{
+	struct legion_powercap_zone *pz = to_legion_powercap_zone(zone);
+
+	if (cid < 0 || cid >= pz->nr_constraints)
+		return NULL;
+	return &legion_powerlimits[pz->constraints[cid]];
 }
 
-// pwm1
-static SENSOR_DEVICE_ATTR_RO(fan1_max, fan_max, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point1_pwm, autopoint,
-			       FANCURVE_ATTR_PWM1, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point2_pwm, autopoint,
-			       FANCURVE_ATTR_PWM1, 1);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point3_pwm, autopoint,
-			       FANCURVE_ATTR_PWM1, 2);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point4_pwm, autopoint,
-			       FANCURVE_ATTR_PWM1, 3);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point5_pwm, autopoint,
-			       FANCURVE_ATTR_PWM1, 4);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point6_pwm, autopoint,
-			       FANCURVE_ATTR_PWM1, 5);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point7_pwm, autopoint,
-			       FANCURVE_ATTR_PWM1, 6);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point8_pwm, autopoint,
-			       FANCURVE_ATTR_PWM1, 7);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point9_pwm, autopoint,
-			       FANCURVE_ATTR_PWM1, 8);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point10_pwm, autopoint,
-			       FANCURVE_ATTR_PWM1, 9);
-// pwm2
-static SENSOR_DEVICE_ATTR_RO(fan2_max, fan_max, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point1_pwm, autopoint,
-			       FANCURVE_ATTR_PWM2, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point2_pwm, autopoint,
-			       FANCURVE_ATTR_PWM2, 1);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point3_pwm, autopoint,
-			       FANCURVE_ATTR_PWM2, 2);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point4_pwm, autopoint,
-			       FANCURVE_ATTR_PWM2, 3);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point5_pwm, autopoint,
-			       FANCURVE_ATTR_PWM2, 4);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point6_pwm, autopoint,
-			       FANCURVE_ATTR_PWM2, 5);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point7_pwm, autopoint,
-			       FANCURVE_ATTR_PWM2, 6);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point8_pwm, autopoint,
-			       FANCURVE_ATTR_PWM2, 7);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point9_pwm, autopoint,
-			       FANCURVE_ATTR_PWM2, 8);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point10_pwm, autopoint,
-			       FANCURVE_ATTR_PWM2, 9);
-// CPU temp
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point1_temp, autopoint,
-			       FANCURVE_ATTR_CPU_TEMP, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point2_temp, autopoint,
-			       FANCURVE_ATTR_CPU_TEMP, 1);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point3_temp, autopoint,
-			       FANCURVE_ATTR_CPU_TEMP, 2);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point4_temp, autopoint,
-			       FANCURVE_ATTR_CPU_TEMP, 3);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point5_temp, autopoint,
-			       FANCURVE_ATTR_CPU_TEMP, 4);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point6_temp, autopoint,
-			       FANCURVE_ATTR_CPU_TEMP, 5);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point7_temp, autopoint,
-			       FANCURVE_ATTR_CPU_TEMP, 6);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point8_temp, autopoint,
-			       FANCURVE_ATTR_CPU_TEMP, 7);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point9_temp, autopoint,
-			       FANCURVE_ATTR_CPU_TEMP, 8);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point10_temp, autopoint,
-			       FANCURVE_ATTR_CPU_TEMP, 9);
-// CPU temp hyst
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point1_temp_hyst, autopoint,
-			       FANCURVE_ATTR_CPU_HYST, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point2_temp_hyst, autopoint,
-			       FANCURVE_ATTR_CPU_HYST, 1);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point3_temp_hyst, autopoint,
-			       FANCURVE_ATTR_CPU_HYST, 2);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point4_temp_hyst, autopoint,
-			       FANCURVE_ATTR_CPU_HYST, 3);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point5_temp_hyst, autopoint,
-			       FANCURVE_ATTR_CPU_HYST, 4);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point6_temp_hyst, autopoint,
-			       FANCURVE_ATTR_CPU_HYST, 5);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point7_temp_hyst, autopoint,
-			       FANCURVE_ATTR_CPU_HYST, 6);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point8_temp_hyst, autopoint,
-			       FANCURVE_ATTR_CPU_HYST, 7);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point9_temp_hyst, autopoint,
-			       FANCURVE_ATTR_CPU_HYST, 8);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point10_temp_hyst, autopoint,
-			       FANCURVE_ATTR_CPU_HYST, 9);
-// GPU temp
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point1_temp, autopoint,
-			       FANCURVE_ATTR_GPU_TEMP, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point2_temp, autopoint,
-			       FANCURVE_ATTR_GPU_TEMP, 1);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point3_temp, autopoint,
-			       FANCURVE_ATTR_GPU_TEMP, 2);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point4_temp, autopoint,
-			       FANCURVE_ATTR_GPU_TEMP, 3);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point5_temp, autopoint,
-			       FANCURVE_ATTR_GPU_TEMP, 4);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point6_temp, autopoint,
-			       FANCURVE_ATTR_GPU_TEMP, 5);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point7_temp, autopoint,
-			       FANCURVE_ATTR_GPU_TEMP, 6);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point8_temp, autopoint,
-			       FANCURVE_ATTR_GPU_TEMP, 7);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point9_temp, autopoint,
-			       FANCURVE_ATTR_GPU_TEMP, 8);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point10_temp, autopoint,
-			       FANCURVE_ATTR_GPU_TEMP, 9);
-// GPU temp hyst
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point1_temp_hyst, autopoint,
-			       FANCURVE_ATTR_GPU_HYST, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point2_temp_hyst, autopoint,
-			       FANCURVE_ATTR_GPU_HYST, 1);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point3_temp_hyst, autopoint,
-			       FANCURVE_ATTR_GPU_HYST, 2);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point4_temp_hyst, autopoint,
-			       FANCURVE_ATTR_GPU_HYST, 3);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point5_temp_hyst, autopoint,
-			       FANCURVE_ATTR_GPU_HYST, 4);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point6_temp_hyst, autopoint,
-			       FANCURVE_ATTR_GPU_HYST, 5);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point7_temp_hyst, autopoint,
-			       FANCURVE_ATTR_GPU_HYST, 6);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point8_temp_hyst, autopoint,
-			       FANCURVE_ATTR_GPU_HYST, 7);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point9_temp_hyst, autopoint,
-			       FANCURVE_ATTR_GPU_HYST, 8);
-static SENSOR_DEVICE_ATTR_2_RW(pwm2_auto_point10_temp_hyst, autopoint,
-			       FANCURVE_ATTR_GPU_HYST, 9);
-// IC temp
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point1_temp, autopoint,
-			       FANCURVE_ATTR_IC_TEMP, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point2_temp, autopoint,
-			       FANCURVE_ATTR_IC_TEMP, 1);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point3_temp, autopoint,
-			       FANCURVE_ATTR_IC_TEMP, 2);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point4_temp, autopoint,
-			       FANCURVE_ATTR_IC_TEMP, 3);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point5_temp, autopoint,
-			       FANCURVE_ATTR_IC_TEMP, 4);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point6_temp, autopoint,
-			       FANCURVE_ATTR_IC_TEMP, 5);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point7_temp, autopoint,
-			       FANCURVE_ATTR_IC_TEMP, 6);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point8_temp, autopoint,
-			       FANCURVE_ATTR_IC_TEMP, 7);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point9_temp, autopoint,
-			       FANCURVE_ATTR_IC_TEMP, 8);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point10_temp, autopoint,
-			       FANCURVE_ATTR_IC_TEMP, 9);
-// IC temp hyst
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point1_temp_hyst, autopoint,
-			       FANCURVE_ATTR_IC_HYST, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point2_temp_hyst, autopoint,
-			       FANCURVE_ATTR_IC_HYST, 1);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point3_temp_hyst, autopoint,
-			       FANCURVE_ATTR_IC_HYST, 2);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point4_temp_hyst, autopoint,
-			       FANCURVE_ATTR_IC_HYST, 3);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point5_temp_hyst, autopoint,
-			       FANCURVE_ATTR_IC_HYST, 4);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point6_temp_hyst, autopoint,
-			       FANCURVE_ATTR_IC_HYST, 5);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point7_temp_hyst, autopoint,
-			       FANCURVE_ATTR_IC_HYST, 6);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point8_temp_hyst, autopoint,
-			       FANCURVE_ATTR_IC_HYST, 7);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point9_temp_hyst, autopoint,
-			       FANCURVE_ATTR_IC_HYST, 8);
-static SENSOR_DEVICE_ATTR_2_RW(pwm3_auto_point10_temp_hyst, autopoint,
-			       FANCURVE_ATTR_IC_HYST, 9);
-// accel
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point1_accel, autopoint,
-			       FANCURVE_ATTR_ACCEL, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point2_accel, autopoint,
-			       FANCURVE_ATTR_ACCEL, 1);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point3_accel, autopoint,
-			       FANCURVE_ATTR_ACCEL, 2);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point4_accel, autopoint,
-			       FANCURVE_ATTR_ACCEL, 3);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point5_accel, autopoint,
-			       FANCURVE_ATTR_ACCEL, 4);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point6_accel, autopoint,
-			       FANCURVE_ATTR_ACCEL, 5);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point7_accel, autopoint,
-			       FANCURVE_ATTR_ACCEL, 6);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point8_accel, autopoint,
-			       FANCURVE_ATTR_ACCEL, 7);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point9_accel, autopoint,
-			       FANCURVE_ATTR_ACCEL, 8);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point10_accel, autopoint,
-			       FANCURVE_ATTR_ACCEL, 9);
-// decel
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point1_decel, autopoint,
-			       FANCURVE_ATTR_DECEL, 0);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point2_decel, autopoint,
-			       FANCURVE_ATTR_DECEL, 1);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point3_decel, autopoint,
-			       FANCURVE_ATTR_DECEL, 2);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point4_decel, autopoint,
-			       FANCURVE_ATTR_DECEL, 3);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point5_decel, autopoint,
-			       FANCURVE_ATTR_DECEL, 4);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point6_decel, autopoint,
-			       FANCURVE_ATTR_DECEL, 5);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point7_decel, autopoint,
-			       FANCURVE_ATTR_DECEL, 6);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point8_decel, autopoint,
-			       FANCURVE_ATTR_DECEL, 7);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point9_decel, autopoint,
-			       FANCURVE_ATTR_DECEL, 8);
-static SENSOR_DEVICE_ATTR_2_RW(pwm1_auto_point10_decel, autopoint,
-			       FANCURVE_ATTR_DECEL, 9);
-//size
-static SENSOR_DEVICE_ATTR_2_RW(auto_points_size, autopoint, FANCURVE_SIZE, 0);
-static SENSOR_DEVICE_ATTR_2_RW(fancurve_defaults_powermode, fancurve_defaults_powermode, 0, 0);
+static int legion_powercap_get_max_power_range_uw(struct powercap_zone *zone,
+						  u64 *max_power_uw)
+{
+	struct legion_powercap_zone *pz = to_legion_powercap_zone(zone);
+	unsigned int max_watts = 0;
+	int i;
 
-static ssize_t minifancurve_show(struct device *dev,
-				 struct device_attribute *devattr, char *buf)
+	for (i = 0; i < pz->nr_constraints; ++i)
+		max_watts = max(max_watts,
+				legion_powerlimits[pz->constraints[i]].max_watts);
+	*max_power_uw = max_watts * LEGION_UW_PER_W;
+	return 0;
+}
+
+static int legion_powercap_get_power_uw(struct powercap_zone *zone,
+					u64 *power_uw)
 {
-	bool value;
+	// firmware does not provide a power meter
+	return -ENODATA;
+}
+
+static int legion_powercap_release(struct powercap_zone *zone)
+{
+	kfree(to_legion_powercap_zone(zone));
+	return 0;
+}
+
+static const struct powercap_zone_ops legion_powercap_zone_ops = {
+	.get_max_power_range_uw = legion_powercap_get_max_power_range_uw,
+	.get_power_uw = legion_powercap_get_power_uw,
+	.release = legion_powercap_release,
+};
+
+static int legion_powercap_set_power_limit_uw(struct powercap_zone *zone,
+					      int cid, u64 power_limit)
+{
+	struct legion_powercap_zone *pz = to_legion_powercap_zone(zone);
+	const struct legion_powerlimit_desc *desc =
+		legion_powercap_constraint(zone, cid);
+	u64 watts = div_u64(power_limit, LEGION_UW_PER_W);
 	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
 
-	mutex_lock(&priv->fancurve_mutex);
-	err = ec_read_minifancurve(&priv->ecram, priv->conf, &value);
-	if (err) {
-		err = -1;
-		pr_info("Failed to read minifancurve\n");
-		goto error_unlock;
-	}
-	mutex_unlock(&priv->fancurve_mutex);
-	return sprintf(buf, "%d\n", value);
+	if (!desc)
+		return -EINVAL;
+	if (watts > INT_MAX || check_powerlimit(pz->constraints[cid], watts))
+		return -EINVAL;
 
-error_unlock:
-	mutex_unlock(&priv->fancurve_mutex);
-	return -1;
+	mutex_lock(&pz->priv->fancurve_mutex);
+	err = set_powerlimit(pz->priv, pz->constraints[cid], (int)watts);
+	mutex_unlock(&pz->priv->fancurve_mutex);
+	return err;
 }
 
-static ssize_t minifancurve_store(struct device *dev,
-				  struct device_attribute *devattr,
-				  const char *buf, size_t count)
+static int legion_powercap_get_power_limit_uw(struct powercap_zone *zone,
+					      int cid, u64 *data)
 {
+	struct legion_powercap_zone *pz = to_legion_powercap_zone(zone);
 	int value;
 	int err;
-	struct legion_private *priv = dev_get_drvdata(dev);
 
-	err = kstrtoint(buf, 0, &value);
-	if (err) {
-		err = -1;
-		pr_info("Parsing hwmon store failed: error:%d\n", err);
-		goto error;
-	}
+	if (!legion_powercap_constraint(zone, cid))
+		return -EINVAL;
 
-	mutex_lock(&priv->fancurve_mutex);
-	err = ec_write_minifancurve(&priv->ecram, priv->conf, value);
-	if (err) {
-		err = -1;
-		pr_info("Failed to write minifancurve\n");
-		goto error_unlock;
+	mutex_lock(&pz->priv->fancurve_mutex);
+	err = get_powerlimit(pz->priv, pz->constraints[cid], &value);
+	mutex_unlock(&pz->priv->fancurve_mutex);
+	if (err)
+		return err;
+
+	*data = max(value, 0) * LEGION_UW_PER_W;
+	return 0;
+}
+
+static int legion_powercap_set_time_window_us(struct powercap_zone *zone,
+					      int cid, u64 window)
+{
+	// firmware has no method to set tau
+	return -EOPNOTSUPP;
+}
+
+static int legion_powercap_get_time_window_us(struct powercap_zone *zone,
+					      int cid, u64 *window)
+{
+	struct legion_powercap_zone *pz = to_legion_powercap_zone(zone);
+	int tau = 0;
+	int err = 0;
+
+	if (!legion_powercap_constraint(zone, cid))
+		return -EINVAL;
+
+	// only the long term limit has a time window (tau in seconds)
+	if (pz->constraints[cid] == LEGION_POWERLIMIT_CPU_LONGTERM &&
+	    pz->priv->conf->access_method_powerlimits == ACCESS_METHOD_WMI3) {
+		mutex_lock(&pz->priv->fancurve_mutex);
+		err = wmi_other_method_get_value(OtherMethodFeature_CPU_L1_TAU,
+						 &tau);
+		mutex_unlock(&pz->priv->fancurve_mutex);
 	}
-	mutex_unlock(&priv->fancurve_mutex);
-	return count;
+	if (err)
+		return err;
 
-error_unlock:
-	mutex_unlock(&priv->fancurve_mutex);
-error:
-	return err;
+	*window = (u64)max(tau, 0) * USEC_PER_SEC;
+	return 0;
 }
 
-static SENSOR_DEVICE_ATTR_RW(minifancurve, minifancurve, 0);
+static int legion_powercap_get_max_power_uw(struct powercap_zone *zone,
+					    int cid, u64 *data)
+{
+	const struct legion_powerlimit_desc *desc =
+		legion_powercap_constraint(zone, cid);
 
-static struct attribute *fancurve_hwmon_attributes[] = {
-	&sensor_dev_attr_fan1_max.dev_attr.attr,
-	&sensor_dev_attr_fan2_max.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point1_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point2_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point3_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point4_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point5_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point6_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point7_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point8_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point9_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point10_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point1_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point2_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point3_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point4_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point5_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point6_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point7_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point8_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point9_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point10_pwm.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point1_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point2_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point3_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point4_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point5_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point6_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point7_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point8_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point9_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point10_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point1_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point2_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point3_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point4_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point5_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point6_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point7_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point8_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point9_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point10_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point1_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point2_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point3_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point4_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point5_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point6_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point7_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point8_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point9_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point10_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point1_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point2_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point3_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point4_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point5_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point6_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point7_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point8_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point9_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm2_auto_point10_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point1_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point2_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point3_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point4_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point5_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point6_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point7_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point8_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point9_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point10_temp.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point1_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point2_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point3_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point4_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point5_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point6_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point7_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point8_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point9_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm3_auto_point10_temp_hyst.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point1_accel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point2_accel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point3_accel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point4_accel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point5_accel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point6_accel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point7_accel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point8_accel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point9_accel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point10_accel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point1_decel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point2_decel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point3_decel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point4_decel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point5_decel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point6_decel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point7_decel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point8_decel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point9_decel.dev_attr.attr,
-	&sensor_dev_attr_pwm1_auto_point10_decel.dev_attr.attr,
-	//
-	&sensor_dev_attr_auto_points_size.dev_attr.attr,
-	&sensor_dev_attr_minifancurve.dev_attr.attr,
-	&sensor_dev_attr_fancurve_defaults_powermode.dev_attr.attr,
-	NULL
-};
+	if (!desc)
+		return -EINVAL;
+	*data = desc->max_watts * LEGION_UW_PER_W;
+	return 0;
+}
 
-static bool legion_wmi_fancurve_speed_attribute(const struct attribute *attr)
+static int legion_powercap_get_min_power_uw(struct powercap_zone *zone,
+					    int cid, u64 *data)
 {
-	return attr == &sensor_dev_attr_fan1_max.dev_attr.attr ||
-	       attr == &sensor_dev_attr_pwm1_auto_point1_pwm.dev_attr.attr ||
-	       attr == &sensor_dev_attr_pwm1_auto_point2_pwm.dev_attr.attr ||
-	       attr == &sensor_dev_attr_pwm1_auto_point3_pwm.dev_attr.attr ||
-	       attr == &sensor_dev_attr_pwm1_auto_point4_pwm.dev_attr.attr ||
-	       attr == &sensor_dev_attr_pwm1_auto_point5_pwm.dev_attr.attr ||
-	       attr == &sensor_dev_attr_pwm1_auto_point6_pwm.dev_attr.attr ||
-	       attr == &sensor_dev_attr_pwm1_auto_point7_pwm.dev_attr.attr ||
-	       attr == &sensor_dev_attr_pwm1_auto_point8_pwm.dev_attr.attr ||
-	       attr == &sensor_dev_attr_pwm1_auto_point9_pwm.dev_attr.attr ||
-	       attr == &sensor_dev_attr_pwm1_auto_point10_pwm.dev_attr.attr;
+	const struct legion_powerlimit_desc *desc =
+		legion_powercap_constraint(zone, cid);
+
+	if (!desc)
+		return -EINVAL;
+	*data = desc->min_watts * LEGION_UW_PER_W;
+	return 0;
 }
 
-static umode_t legion_hwmon_sensor_is_visible(struct kobject *kobj,
-					      struct attribute *attr,
-					      int idx)
+static const char *legion_powercap_get_name(struct powercap_zone *zone,
+					    int cid)
 {
-	bool supported = true;
-	struct device *dev = kobj_to_dev(kobj);
-	struct legion_private *priv = dev_get_drvdata(dev);
+	struct legion_powercap_zone *pz = to_legion_powercap_zone(zone);
 
-	if (attr == &sensor_dev_attr_temp3_input.dev_attr.attr ||
-	    attr == &sensor_dev_attr_temp3_label.dev_attr.attr)
-		supported = supported && !priv->conf->skip_ic_temp;
+	if (!legion_powercap_constraint(zone, cid))
+		return NULL;
+	return legion_powercap_constraint_names[pz->constraints[cid]];
+}
 
-	if (attr == &sensor_dev_attr_fan3_input.dev_attr.attr ||
-	    attr == &sensor_dev_attr_fan3_label.dev_attr.attr ||
-	    attr == &sensor_dev_attr_fan4_input.dev_attr.attr ||
-	    attr == &sensor_dev_attr_fan4_label.dev_attr.attr)
-		supported = supported && priv->conf->has_four_fans;
+static const struct powercap_zone_constraint_ops legion_powercap_constraint_ops = {
+	.set_power_limit_uw = legion_powercap_set_power_limit_uw,
+	.get_power_limit_uw = legion_powercap_get_power_limit_uw,
+	.set_time_window_us = legion_powercap_set_time_window_us,
+	.get_time_window_us = legion_powercap_get_time_window_us,
+	.get_max_power_uw = legion_powercap_get_max_power_uw,
+	.get_min_power_uw = legion_powercap_get_min_power_uw,
+	.get_name = legion_powercap_get_name,
+};
 
-	return supported ? attr->mode : 0;
+static void legion_powercap_unregister(struct legion_powercap *pc)
+{
+	int i;
+
+	for (i = 0; i < LEGION_POWERCAP_ZONE_MAX; ++i) {
+		struct legion_powercap_zone *pz = pc->zones[i];
+
+		pc->zones[i] = NULL;
+		if (!pz)
+			continue;
+		// release frees registered zones
+		if (pz->registered)
+			powercap_unregister_zone(pc->control_type, &pz->zone);
+		else
+			kfree(pz);
+	}
+	if (!IS_ERR_OR_NULL(pc->control_type))
+		powercap_unregister_control_type(pc->control_type);
 }
 
-static umode_t legion_hwmon_fancurve_is_visible(struct kobject *kobj,
-						struct attribute *attr,
-						int idx)
+static int legion_powercap_init(struct legion_private *priv)
 {
-	bool supported = true;
-	struct device *dev = kobj_to_dev(kobj);
-	struct legion_private *priv = dev_get_drvdata(dev);
+	struct legion_powercap *pc;
+	struct legion_powercap_zone *pz;
+	struct powercap_zone *zone;
+	int nr_constraints = 0;
+	int i;
+	int err;
 
-	if (priv->conf->wmi_fancurve_speed_only &&
-	    !legion_wmi_fancurve_speed_attribute(attr))
-		return 0;
-	if (attr == &sensor_dev_attr_minifancurve.dev_attr.attr)
-		supported = priv->conf->has_minifancurve;
-	if (attr == &sensor_dev_attr_fancurve_defaults_powermode.dev_attr.attr)
-		supported = priv->conf->has_fancurve_defaults;
+	pc = kzalloc(sizeof(*pc), GFP_KERNEL);
+	if (!pc)
+		return -ENOMEM;
+	for (i = 0; i < LEGION_POWERCAP_ZONE_MAX; ++i) {
+		pc->zones[i] = kzalloc(sizeof(*pc->zones[i]), GFP_KERNEL);
+		if (!pc->zones[i]) {
+			err = -ENOMEM;
+			goto err_free;
+		}
+	}
 
-	supported = supported && (priv->conf->access_method_fancurve !=
-				  ACCESS_METHOD_NO_ACCESS);
+	// long term limit is first constraint like for intel-rapl
+	for (i = 0; i < ARRAY_SIZE(legion_powerlimit_order); ++i) {
+		enum legion_powerlimit_id id = legion_powerlimit_order[i];
+
+		if (!powerlimit_is_supported(priv, id))
+			continue;
+		pz = pc->zones[legion_powercap_zone_of(id)];
+		pz->constraints[pz->nr_constraints++] = id;
+		nr_constraints++;
+	}
+	if (nr_constraints == 0) {
+		pr_info("No power limits for powercap\n");
+		err = -ENODEV;
+		goto err_free;
+	}
+
+	pc->control_type =
+		powercap_register_control_type(NULL, LEGION_DRVR_SHORTNAME, NULL);
+	if (IS_ERR(pc->control_type)) {
+		err = PTR_ERR(pc->control_type);
+		goto err_free;
+	}
+
+	for (i = 0; i < LEGION_POWERCAP_ZONE_MAX; ++i) {
+		pz = pc->zones[i];
+		if (pz->nr_constraints == 0)
+			continue;
+		pz->priv = priv;
+		zone = powercap_register_zone(&pz->zone, pc->control_type,
+					      legion_powercap_zone_names[i],
+					      NULL, &legion_powercap_zone_ops,
+					      pz->nr_constraints,
+					      &legion_powercap_constraint_ops);
+		if (IS_ERR(zone)) {
+			err = PTR_ERR(zone);
+			// the core might already have released pz, so leave it
+			pc->zones[i] = NULL;
+			goto err_free;
+		}
+		pz->registered = true;
+	}
 
-	return supported ? attr->mode : 0;
+	priv->powercap = pc;
+	return 0;
+
+err_free:
+	legion_powercap_unregister(pc);
+	kfree(pc);
+	return err;
 }
 
-static const struct attribute_group legion_hwmon_sensor_group = {
-	.attrs = sensor_hwmon_attributes,
-	.is_visible = legion_hwmon_sensor_is_visible
-};
+/**
+ * Deinit powercap.
+ *
+ * Can also be called if init was not successful.
+ */
+static void legion_powercap_exit(struct legion_private *priv)
+{
+	struct legion_powercap *pc = priv->powercap;
 
-static const struct attribute_group legion_hwmon_fancurve_group = {
-	.attrs = fancurve_hwmon_attributes,
-	.is_visible = legion_hwmon_fancurve_is_visible,
-};
+	if (!pc)
+		return;
 
-static const struct attribute_group *legion_hwmon_groups[] = {
-	&legion_hwmon_sensor_group, &legion_hwmon_fancurve_group, NULL
-};
+	priv->powercap = NULL;
+	legion_powercap_unregister(pc);
+	kfree(pc);
+}
 
-static ssize_t legion_hwmon_init(struct legion_private *priv)
+#else
+
+static int legion_powercap_init(struct legion_private *priv)
 {
-	//TODO: use hwmon_device_register_with_groups or
-	// hwmon_device_register_with_info (latter means all hwmon functions have to be
-	// changed)
-	// some laptop driver do it in one way, some in the other
-	// TODO: Use devm_hwmon_device_register_with_groups ?
-	// some laptop drivers use this, some
-	struct device *hwmon_dev = hwmon_device_register_with_groups(
-		&priv->platform_device->dev, "legion_hwmon", priv,
-		legion_hwmon_groups);
-	if (IS_ERR_OR_NULL(hwmon_dev)) {
-		pr_err("hwmon_device_register failed!\n");
-		return PTR_ERR(hwmon_dev);
-	}
-	dev_set_drvdata(hwmon_dev, priv);
-	priv->hwmon_dev = hwmon_dev;
-	return 0;
+	return -ENODEV;
 }
 
-static void legion_hwmon_exit(struct legion_private *priv)
+static void legion_powercap_exit(struct legion_private *priv)
 {
-	pr_info("Unloading legion hwon\n");
-	if (priv->hwmon_dev) {
-		hwmon_device_unregister(priv->hwmon_dev);
-		priv->hwmon_dev = NULL;
-	}
-	pr_info("Unloading legion hwon done\n");
 }
 
+#endif
+
 /* ACPI*/
 
 static int acpi_init(struct legion_private *priv, struct acpi_device *adev)
@@ -7441,13 +10288,13 @@ err_acpi_init:
 /* ============================   */
 // In style of ideapad-driver and with code modified from ideapad-driver.
 
+// Cached brightness of all lights; avoids a WMI/EC call per query.
 static enum led_brightness
-legion_kbd_bl_led_cdev_brightness_get(struct led_classdev *led_cdev)
+legion_light_cdev_brightness_get(struct led_classdev *led_cdev)
 {
-	struct legion_private *priv =
-		container_of(led_cdev, struct legion_private, kbd_bl.led);
+	struct light *light_ins = container_of(led_cdev, struct light, led);
 
-	return legion_kbd_bl_brightness_get(priv);
+	return READ_ONCE(light_ins->last_brightness);
 }
 
 static int legion_kbd_bl_led_cdev_brightness_set(struct led_classdev *led_cdev,
@@ -7455,8 +10302,14 @@ static int legion_kbd_bl_led_cdev_brightness_set(struct led_classdev *led_cdev,
 {
 	struct legion_private *priv =
 		container_of(led_cdev, struct legion_private, kbd_bl.led);
+	int err;
 
-	return legion_kbd_bl_brightness_set(priv, brightness);
+	mutex_lock(&priv->kbd_bl.mutex);
+	err = legion_kbd_bl_brightness_set(priv, brightness);
+	if (!err)
+		WRITE_ONCE(priv->kbd_bl.last_brightness, brightness);
+	mutex_unlock(&priv->kbd_bl.mutex);
+	return err;
 }
 
 static int legion_kbd_bl_init(struct legion_private *priv)
@@ -7479,12 +10332,16 @@ static int legion_kbd_bl_init(struct legion_private *priv)
 		return brightness;
 	}
 
+	priv->kbd_bl.priv = priv;
+	priv->kbd_bl.light_id = LIGHT_ID_KEYBOARD;
+	priv->kbd_bl.lower_limit = 1;
+	priv->kbd_bl.upper_limit = 3;
 	priv->kbd_bl.last_brightness = brightness;
 
 	// will be renamed to "platform::kbd_backlight_1" if it exists already
 	priv->kbd_bl.led.name = "platform::" LED_FUNCTION_KBD_BACKLIGHT;
 	priv->kbd_bl.led.max_brightness = 2;
-	priv->kbd_bl.led.brightness_get = legion_kbd_bl_led_cdev_brightness_get;
+	priv->kbd_bl.led.brightness_get = legion_light_cdev_brightness_get;
 	priv->kbd_bl.led.brightness_set_blocking =
 		legion_kbd_bl_led_cdev_brightness_set;
 	priv->kbd_bl.led.flags = LED_BRIGHT_HW_CHANGED;
@@ -7519,172 +10376,639 @@ static void legion_kbd_bl_exit(struct legion_private *priv)
 /* Additional light driver        */
 /* ============================   */
 
-static enum led_brightness
-legion_wmi_cdev_brightness_get(struct led_classdev *led_cdev)
+static int legion_wmi_cdev_brightness_set(struct led_classdev *led_cdev,
+					  enum led_brightness brightness)
+{
+	struct light *light_ins = container_of(led_cdev, struct light, led);
+	int err;
+
+	mutex_lock(&light_ins->mutex);
+	err = legion_wmi_light_set(light_ins->priv, light_ins->light_id,
+				   light_ins->lower_limit,
+				   light_ins->upper_limit, brightness);
+	if (!err)
+		WRITE_ONCE(light_ins->last_brightness, brightness);
+	mutex_unlock(&light_ins->mutex);
+	return err;
+}
+
+/* =============================  */
+/* Y-Logo light via EC register   */
+/* ============================   */
+// EC register value: 0 = bright, 1 = dim, 2 = off. The sysfs LED
+// brightness is mapped inversely so that 0 = off and 2 = bright.
+
+static int legion_ec_ylogo_get(struct legion_private *priv)
+{
+	u8 value = ecram_read(&priv->ecram, priv->conf->ec_ylogo_register);
+
+	if (value > 2)
+		return -ERANGE;
+	return 2 - value;
+}
+
+static int legion_ec_ylogo_set(struct legion_private *priv,
+			       unsigned int brightness)
+{
+	if (brightness > 2)
+		return -EINVAL;
+	ecram_write(&priv->ecram, priv->conf->ec_ylogo_register,
+		    2 - (u8)brightness);
+	return 0;
+}
+
+static int legion_ec_ylogo_cdev_brightness_set(struct led_classdev *led_cdev,
+					       enum led_brightness brightness)
 {
-	struct legion_private *priv =
-		container_of(led_cdev, struct legion_private, kbd_bl.led);
 	struct light *light_ins = container_of(led_cdev, struct light, led);
+	int err;
+
+	mutex_lock(&light_ins->mutex);
+	err = legion_ec_ylogo_set(light_ins->priv, brightness);
+	if (!err)
+		WRITE_ONCE(light_ins->last_brightness, brightness);
+	mutex_unlock(&light_ins->mutex);
+	return err;
+}
+
+static int legion_ec_ylogo_init(struct legion_private *priv)
+{
+	struct light *light_ins = &priv->ylogo_light;
+	int brightness, err;
+
+	if (WARN_ON(light_ins->initialized)) {
+		pr_info("Light already initialized for light: Y-Logo\n");
+		return -EEXIST;
+	}
+
+	brightness = legion_ec_ylogo_get(priv);
+	if (brightness < 0) {
+		pr_info("Error reading brightness for Y-Logo light\n");
+		return brightness;
+	}
+
+	light_ins->priv = priv;
+	light_ins->ec_access = true;
+	light_ins->last_brightness = brightness;
+	light_ins->led.name = "platform::ylogo";
+	light_ins->led.max_brightness = 2;
+	light_ins->led.brightness_get = legion_light_cdev_brightness_get;
+	light_ins->led.brightness_set_blocking =
+		legion_ec_ylogo_cdev_brightness_set;
+	light_ins->led.flags = LED_BRIGHT_HW_CHANGED;
+
+	err = led_classdev_register(&priv->platform_device->dev,
+				    &light_ins->led);
+	if (err)
+		return err;
+
+	light_ins->initialized = true;
+	return 0;
+}
+
+static int legion_light_init(struct legion_private *priv,
+			     struct light *light_ins, u8 light_id,
+			     u8 lower_limit, u8 upper_limit, const char *name)
+{
+	int brightness, err;
+
+	if (WARN_ON(light_ins->initialized)) {
+		pr_info("Light already initialized for light: %u\n",
+			light_ins->light_id);
+		return -EEXIST;
+	}
+
+	light_ins->light_id = light_id;
+	light_ins->lower_limit = lower_limit;
+	light_ins->upper_limit = upper_limit;
+
+	brightness = legion_wmi_light_get(priv, light_ins->light_id,
+					  light_ins->lower_limit,
+					  light_ins->upper_limit);
+	if (brightness == -ENODEV)
+		return brightness;
+	if (brightness < 0) {
+		pr_info("Error reading brightness for light: %u\n",
+			light_ins->light_id);
+		return brightness;
+	}
+
+	light_ins->priv = priv;
+	light_ins->last_brightness = brightness;
+	light_ins->led.name = name;
+	light_ins->led.max_brightness =
+		light_ins->upper_limit - light_ins->lower_limit;
+	light_ins->led.brightness_get = legion_light_cdev_brightness_get;
+	light_ins->led.brightness_set_blocking = legion_wmi_cdev_brightness_set;
+	light_ins->led.flags = LED_BRIGHT_HW_CHANGED;
+
+	err = led_classdev_register(&priv->platform_device->dev,
+				    &light_ins->led);
+	if (err)
+		return err;
+
+	light_ins->initialized = true;
+
+	return 0;
+}
+
+/**
+ * Deinit light.
+ *
+ * Can also be called if init was not successful.
+ *
+ */
+static void legion_light_exit(struct legion_private *priv,
+			      struct light *light_ins)
+{
+	if (!light_ins->initialized)
+		return;
+
+	light_ins->initialized = false;
+
+	led_classdev_unregister(&light_ins->led);
+}
+
+// Read the light state from hardware and notify userspace if it was
+// changed by the firmware, e.g. with Fn+Space.
+static void legion_light_refresh(struct light *light_ins)
+{
+	int brightness;
+	bool changed;
+
+	if (!light_ins->initialized)
+		return;
+
+	// a write in between could otherwise be reverted in the cache by
+	// the brightness read before it
+	mutex_lock(&light_ins->mutex);
+	if (light_ins->ec_access)
+		brightness = legion_ec_ylogo_get(light_ins->priv);
+	else
+		brightness = legion_wmi_light_get(light_ins->priv,
+						  light_ins->light_id,
+						  light_ins->lower_limit,
+						  light_ins->upper_limit);
+	changed = brightness >= 0 &&
+		  brightness != READ_ONCE(light_ins->last_brightness);
+	if (changed)
+		WRITE_ONCE(light_ins->last_brightness, brightness);
+	mutex_unlock(&light_ins->mutex);
+
+	if (changed)
+		led_classdev_notify_brightness_hw_changed(&light_ins->led,
+							  brightness);
+}
+
+static void legion_light_refresh_work(struct work_struct *work)
+{
+	struct legion_private *priv = container_of(
+		to_delayed_work(work), struct legion_private, light_work);
+
+	legion_light_refresh(&priv->kbd_bl);
+	legion_light_refresh(&priv->ylogo_light);
+	legion_light_refresh(&priv->iport_light);
+}
+
+/* =============================  */
+/* Generic netlink                */
+/* ============================   */
+
+static bool legion_nl_registered;
+static struct genl_family legion_nl_family;
+
+static const struct nla_policy legion_nl_policy[LEGION_NL_ATTR_MAX + 1] = {
+	[LEGION_NL_ATTR_POWERMODE] = { .type = NLA_U32 },
+	[LEGION_NL_ATTR_FANFULLSPEED] = { .type = NLA_U8 },
+	[LEGION_NL_ATTR_POWERLIMITS] = { .type = NLA_NESTED },
+};
+
+static struct legion_private *legion_nl_get_priv(void)
+{
+	struct legion_private *priv;
+
+	// Using priv after rcu_read_unlock is fine: legion_remove unregisters
+	// the family, which waits for running handlers, before
+	// legion_shared_exit cancels the work they scheduled and priv is freed.
+	rcu_read_lock();
+	priv = rcu_dereference(legion_shared);
+	rcu_read_unlock();
+	return priv;
+}
+
+static int legion_nl_put_fancurve(struct sk_buff *msg,
+				  const struct fancurve *fancurve)
+{
+	const struct fancurve_point *p;
+	struct nlattr *nest_curve;
+	struct nlattr *nest_point;
+	size_t i;
+
+	nest_curve = nla_nest_start(msg, LEGION_NL_ATTR_FANCURVE);
+	if (!nest_curve)
+		return -EMSGSIZE;
+
+	for (i = 0; i < fancurve->size; ++i) {
+		p = &fancurve->points[i];
+		nest_point = nla_nest_start(msg, LEGION_NL_FANCURVE_POINT);
+		if (!nest_point ||
+		    nla_put_u8(msg, LEGION_NL_POINT_SPEED1, p->speed1) ||
+		    nla_put_u8(msg, LEGION_NL_POINT_SPEED2, p->speed2) ||
+		    nla_put_u8(msg, LEGION_NL_POINT_ACCEL, p->accel) ||
+		    nla_put_u8(msg, LEGION_NL_POINT_DECEL, p->decel) ||
+		    nla_put_u8(msg, LEGION_NL_POINT_CPU_MAX_TEMP,
+			       p->cpu_max_temp_celsius) ||
+		    nla_put_u8(msg, LEGION_NL_POINT_CPU_MIN_TEMP,
+			       p->cpu_min_temp_celsius) ||
+		    nla_put_u8(msg, LEGION_NL_POINT_GPU_MAX_TEMP,
+			       p->gpu_max_temp_celsius) ||
+		    nla_put_u8(msg, LEGION_NL_POINT_GPU_MIN_TEMP,
+			       p->gpu_min_temp_celsius) ||
+		    nla_put_u8(msg, LEGION_NL_POINT_IC_MAX_TEMP,
+			       p->ic_max_temp_celsius) ||
+		    nla_put_u8(msg, LEGION_NL_POINT_IC_MIN_TEMP,
+			       p->ic_min_temp_celsius)) {
+			nla_nest_cancel(msg, nest_curve);
+			return -EMSGSIZE;
+		}
+		nla_nest_end(msg, nest_point);
+	}
+
+	nla_nest_end(msg, nest_curve);
+	return 0;
+}
+
+static const int legion_nl_sensor_attrs[SENSOR_FAN4_RPM_ID + 1] = {
+	[SENSOR_CPU_TEMP_ID] = LEGION_NL_ATTR_CPU_TEMP,
+	[SENSOR_GPU_TEMP_ID] = LEGION_NL_ATTR_GPU_TEMP,
+	[SENSOR_IC_TEMP_ID] = LEGION_NL_ATTR_IC_TEMP,
+	[SENSOR_FAN1_RPM_ID] = LEGION_NL_ATTR_FAN1_RPM,
+	[SENSOR_FAN2_RPM_ID] = LEGION_NL_ATTR_FAN2_RPM,
+	[SENSOR_FAN1_TARGET_RPM_ID] = LEGION_NL_ATTR_FAN1_TARGET_RPM,
+	[SENSOR_FAN2_TARGET_RPM_ID] = LEGION_NL_ATTR_FAN2_TARGET_RPM,
+	[SENSOR_FAN3_RPM_ID] = LEGION_NL_ATTR_FAN3_RPM,
+	[SENSOR_FAN4_RPM_ID] = LEGION_NL_ATTR_FAN4_RPM,
+};
+
+// Values that cannot be read are left out of the reply.
+// Only call with fancurve_mutex held
+static int legion_nl_put_state(struct legion_private *priv,
+			       struct sk_buff *msg)
+{
+	struct sensor_record record;
+	struct fancurve fancurve;
+	struct nlattr *nest;
+	bool fullspeed;
+	int value;
+	int id;
+
+	read_sensor_record(priv, &record);
+	if (nla_put_u64_64bit(msg, LEGION_NL_ATTR_TIMESTAMP,
+			      record.timestamp_ns, LEGION_NL_ATTR_PAD))
+		return -EMSGSIZE;
+	for (id = SENSOR_CPU_TEMP_ID; id <= SENSOR_FAN4_RPM_ID; ++id) {
+		if (test_bit(id, &record.valid) &&
+		    nla_put_s32(msg, legion_nl_sensor_attrs[id],
+				record.values[id]))
+			return -EMSGSIZE;
+	}
+
+	if (!read_powermode(priv, &value) &&
+	    nla_put_u32(msg, LEGION_NL_ATTR_POWERMODE, value))
+		return -EMSGSIZE;
+
+	if (legion_has_capability(priv, LEGION_CAP_FANFULLSPEED) &&
+	    !read_fanfullspeed(priv, &fullspeed) &&
+	    nla_put_u8(msg, LEGION_NL_ATTR_FANFULLSPEED, fullspeed))
+		return -EMSGSIZE;
+
+	if (legion_has_capability(priv, LEGION_CAP_FANCURVE) &&
+	    !read_fancurve(priv, &fancurve) &&
+	    legion_nl_put_fancurve(msg, &fancurve))
+		return -EMSGSIZE;
+
+	nest = nla_nest_start(msg, LEGION_NL_ATTR_POWERLIMITS);
+	if (!nest)
+		return -EMSGSIZE;
+	for (id = 0; id < LEGION_POWERLIMIT_MAX; ++id) {
+		if (!powerlimit_is_supported(priv, id) ||
+		    get_powerlimit(priv, id, &value))
+			continue;
+		if (nla_put_s32(msg, id + 1, value)) {
+			nla_nest_cancel(msg, nest);
+			return -EMSGSIZE;
+		}
+	}
+	nla_nest_end(msg, nest);
+
+	return 0;
+}
+
+static int legion_nl_get_state(struct sk_buff *skb, struct genl_info *info)
+{
+	struct legion_private *priv = legion_nl_get_priv();
+	struct sk_buff *msg;
+	void *hdr;
+	int err;
+
+	if (!priv)
+		return -ENODEV;
+
+	msg = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+
+	hdr = genlmsg_put_reply(msg, info, &legion_nl_family, 0,
+				LEGION_NL_CMD_GET_STATE);
+	if (!hdr) {
+		err = -EMSGSIZE;
+		goto err_free;
+	}
+
+	mutex_lock(&priv->fancurve_mutex);
+	err = legion_nl_put_state(priv, msg);
+	mutex_unlock(&priv->fancurve_mutex);
+	if (err)
+		goto err_free;
+
+	genlmsg_end(msg, hdr);
+	return genlmsg_reply(msg, info);
+
+err_free:
+	nlmsg_free(msg);
+	return err;
+}
+
+static int legion_nl_parse_powerlimits(struct legion_private *priv,
+				       const struct nlattr *nest,
+				       struct netlink_ext_ack *extack,
+				       unsigned long *mask, int *values)
+{
+	const struct nlattr *nla;
+	int rem;
+	int id;
+
+	nla_for_each_nested(nla, nest, rem) {
+		id = nla_type(nla) - 1;
+		if (id < 0 || id >= LEGION_POWERLIMIT_MAX ||
+		    nla_len(nla) != sizeof(s32)) {
+			NL_SET_ERR_MSG_ATTR(extack, nla, "invalid power limit");
+			return -EINVAL;
+		}
+		if (!powerlimit_is_supported(priv, id)) {
+			NL_SET_ERR_MSG_ATTR(extack, nla,
+					    "power limit not supported");
+			return -EOPNOTSUPP;
+		}
+		values[id] = nla_get_s32(nla);
+		if (check_powerlimit(id, values[id])) {
+			NL_SET_ERR_MSG_ATTR(extack, nla,
+					    "power limit out of range");
+			return -EINVAL;
+		}
+		set_bit(id, mask);
+	}
+	return 0;
+}
+
+static int legion_nl_set_state(struct sk_buff *skb, struct genl_info *info)
+{
+	struct legion_private *priv = legion_nl_get_priv();
+	int values[LEGION_POWERLIMIT_MAX];
+	unsigned long mask = 0;
+	bool powermode_written = false;
+	bool powerlimits_written = false;
+	int err = 0;
+
+	if (!priv)
+		return -ENODEV;
+
+	if (info->attrs[LEGION_NL_ATTR_POWERLIMITS]) {
+		err = legion_nl_parse_powerlimits(
+			priv, info->attrs[LEGION_NL_ATTR_POWERLIMITS],
+			info->extack, &mask, values);
+		if (err)
+			return err;
+	}
+
+	mutex_lock(&priv->fancurve_mutex);
+	if (info->attrs[LEGION_NL_ATTR_POWERMODE]) {
+		err = write_powermode(
+			priv, nla_get_u32(info->attrs[LEGION_NL_ATTR_POWERMODE]));
+		if (err) {
+			NL_SET_ERR_MSG(info->extack, "writing power mode failed");
+			goto unlock;
+		}
+		powermode_written = true;
+	}
+	if (info->attrs[LEGION_NL_ATTR_FANFULLSPEED]) {
+		err = fan_control_write_allowed(priv);
+		if (!err)
+			err = write_fanfullspeed(
+				priv,
+				nla_get_u8(info->attrs[LEGION_NL_ATTR_FANFULLSPEED]));
+		if (err) {
+			NL_SET_ERR_MSG(info->extack,
+				       "writing fan full speed failed");
+			goto unlock;
+		}
+	}
+	if (mask) {
+		priv->powerlimit_pending &= ~mask;
+		err = write_powerlimits(priv, mask, values,
+					priv->powerlimits_results);
+		priv->powerlimits_written = mask;
+		powerlimits_written = true;
+		if (err)
+			NL_SET_ERR_MSG(info->extack,
+				       "writing power limits failed; see powerlimits_status");
+	}
+unlock:
+	mutex_unlock(&priv->fancurve_mutex);
 
-	return legion_wmi_light_get(priv, light_ins->light_id,
-				    light_ins->lower_limit,
-				    light_ins->upper_limit);
+	if (powerlimits_written)
+		legion_nl_event(LEGION_NL_EVENT_POWERLIMITS);
+	// like after a WMI event, the firmware needs some time until the new
+	// power mode is read back; legion_wmi_notify_work notifies
+	if (powermode_written)
+		schedule_delayed_work(
+			&priv->notify_work,
+			msecs_to_jiffies(LEGION_WMI_NOTIFY_DELAY_MS));
+	return err;
 }
 
-static int legion_wmi_cdev_brightness_set(struct led_classdev *led_cdev,
-					  enum led_brightness brightness)
-{
-	struct legion_private *priv =
-		container_of(led_cdev, struct legion_private, kbd_bl.led);
-	struct light *light_ins = container_of(led_cdev, struct light, led);
+static const struct genl_ops legion_nl_ops[] = {
+	{
+		.cmd = LEGION_NL_CMD_GET_STATE,
+		.doit = legion_nl_get_state,
+	},
+	{
+		.cmd = LEGION_NL_CMD_SET_STATE,
+		.doit = legion_nl_set_state,
+		.flags = GENL_ADMIN_PERM,
+	},
+};
 
-	return legion_wmi_light_set(priv, light_ins->light_id,
-				    light_ins->lower_limit,
-				    light_ins->upper_limit, brightness);
-}
+static const struct genl_multicast_group legion_nl_mcgrps[] = {
+	{ .name = LEGION_NL_MCGRP_EVENTS },
+};
 
-/* =============================  */
-/* Y-Logo light via EC register   */
-/* ============================   */
-// EC register value: 0 = bright, 1 = dim, 2 = off. The sysfs LED
-// brightness is mapped inversely so that 0 = off and 2 = bright.
+static struct genl_family legion_nl_family = {
+	.name = LEGION_NL_FAMILY_NAME,
+	.version = LEGION_NL_VERSION,
+	.maxattr = LEGION_NL_ATTR_MAX,
+	.policy = legion_nl_policy,
+	.module = THIS_MODULE,
+	.ops = legion_nl_ops,
+	.n_ops = ARRAY_SIZE(legion_nl_ops),
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+	.resv_start_op = __LEGION_NL_CMD_MAX,
+#endif
+	.mcgrps = legion_nl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(legion_nl_mcgrps),
+};
 
-static int legion_ec_ylogo_get(struct legion_private *priv)
+static void legion_nl_event(enum legion_nl_event event)
 {
-	u8 value = ecram_read(&priv->ecram, priv->conf->ec_ylogo_register);
+	struct sk_buff *msg;
+	void *hdr;
 
-	if (value > 2)
-		return -ERANGE;
-	return 2 - value;
+	if (!legion_nl_registered)
+		return;
+
+	msg = genlmsg_new(nla_total_size(sizeof(u32)), GFP_KERNEL);
+	if (!msg)
+		return;
+
+	hdr = genlmsg_put(msg, 0, 0, &legion_nl_family, 0,
+			  LEGION_NL_CMD_EVENT);
+	if (!hdr || nla_put_u32(msg, LEGION_NL_ATTR_EVENT, event)) {
+		nlmsg_free(msg);
+		return;
+	}
+	genlmsg_end(msg, hdr);
+	// fails if nobody listens, which is fine
+	genlmsg_multicast(&legion_nl_family, msg, 0, 0, GFP_KERNEL);
 }
 
-static int legion_ec_ylogo_set(struct legion_private *priv,
-			       unsigned int brightness)
+static int legion_nl_init(void)
 {
-	if (brightness > 2)
-		return -EINVAL;
-	ecram_write(&priv->ecram, priv->conf->ec_ylogo_register,
-		    2 - (u8)brightness);
+	int err;
+
+	err = genl_register_family(&legion_nl_family);
+	if (err)
+		return err;
+	legion_nl_registered = true;
 	return 0;
 }
 
-static enum led_brightness
-legion_ec_ylogo_cdev_brightness_get(struct led_classdev *led_cdev)
+static void legion_nl_exit(void)
 {
-	struct light *light_ins = container_of(led_cdev, struct light, led);
-	struct legion_private *priv =
-		container_of(light_ins, struct legion_private, ylogo_light);
-
-	return legion_ec_ylogo_get(priv);
+	if (!legion_nl_registered)
+		return;
+	legion_nl_registered = false;
+	genl_unregister_family(&legion_nl_family);
 }
 
-static int legion_ec_ylogo_cdev_brightness_set(struct led_classdev *led_cdev,
-					       enum led_brightness brightness)
+/* =============================  */
+/* Platform driver                */
+/* ============================   */
+
+// Everything that needs slow firmware calls and is not needed by the
+// basic interfaces. Runs after legion_add returned; attributes that depend
+// on the results become visible when it is done.
+static void legion_deferred_probe(struct work_struct *work)
 {
-	struct light *light_ins = container_of(led_cdev, struct light, led);
 	struct legion_private *priv =
-		container_of(light_ins, struct legion_private, ylogo_light);
+		container_of(work, struct legion_private, probe_work);
+	struct device *dev = &priv->platform_device->dev;
+	ktime_t start = ktime_get();
+	int err;
 
-	return legion_ec_ylogo_set(priv, brightness);
-}
+	legion_capabilities_probe_fancurve(priv);
+	legion_sysfs_update(priv);
+	legion_capabilities_probe_other_method(priv);
+	legion_sysfs_update(priv);
 
-static int legion_ec_ylogo_init(struct legion_private *priv)
-{
-	struct light *light_ins = &priv->ylogo_light;
-	int brightness, err;
+	pr_info("Creating hwmon interface\n");
+	err = legion_hwmon_init(priv);
+	if (err) {
+		dev_info(dev,
+			 "Failed to create hwmon interface. Skipping ...\n");
+	}
 
-	if (WARN_ON(light_ins->initialized)) {
-		pr_info("Light already initialized for light: Y-Logo\n");
-		return -EEXIST;
+	pr_info("Init keyboard backlight LED driver\n");
+	err = legion_kbd_bl_init(priv);
+	if (err) {
+		dev_info(
+			dev,
+			"Failed to init keyboard backlight LED driver. Skipping ...\n");
 	}
 
-	brightness = legion_ec_ylogo_get(priv);
-	if (brightness < 0) {
-		pr_info("Error reading brightness for Y-Logo light\n");
-		return brightness;
+	if (priv->conf->ec_ylogo_register) {
+		pr_info("Init Y-Logo LED driver\n");
+		err = legion_ec_ylogo_init(priv);
+		if (err) {
+			dev_info(dev,
+				 "Failed to init Y-Logo LED driver. Skipping ...\n");
+		}
+	} else if (!priv->conf->skip_ylogo_light) {
+		pr_info("Init Y-Logo LED driver\n");
+		err = legion_light_init(priv, &priv->ylogo_light,
+					LIGHT_ID_YLOGO, 0, 1,
+					"platform::ylogo");
+		if (err) {
+			dev_info(dev,
+				 "Failed to init Y-Logo LED driver. Skipping ...\n");
+		}
 	}
 
-	light_ins->led.name = "platform::ylogo";
-	light_ins->led.max_brightness = 2;
-	light_ins->led.brightness_get = legion_ec_ylogo_cdev_brightness_get;
-	light_ins->led.brightness_set_blocking =
-		legion_ec_ylogo_cdev_brightness_set;
-	light_ins->led.flags = LED_BRIGHT_HW_CHANGED;
+	if (!priv->conf->skip_ioport_light) {
+		pr_info("Init IO-Port LED driver\n");
+		err = legion_light_init(priv, &priv->iport_light, LIGHT_ID_IOPORT,
+					0, 2, "platform::ioport");
+		if (err && err != -ENODEV) {
+			dev_info(dev,
+				 "Failed to init IO-Port LED driver. Skipping ...\n");
+		}
+	}
 
-	err = led_classdev_register(&priv->platform_device->dev,
-				    &light_ins->led);
+	pr_info("Init WMI driver support\n");
+	err = legion_wmi_init();
 	if (err)
-		return err;
-
-	light_ins->initialized = true;
-	return 0;
-}
-
-static int legion_light_init(struct legion_private *priv,
-			     struct light *light_ins, u8 light_id,
-			     u8 lower_limit, u8 upper_limit, const char *name)
-{
-	int brightness, err;
+		dev_info(dev, "Failed to init WMI driver: %d\n", err);
 
-	if (WARN_ON(light_ins->initialized)) {
-		pr_info("Light already initialized for light: %u\n",
-			light_ins->light_id);
-		return -EEXIST;
+	pr_info("Init thermal cooling device\n");
+	err = legion_cooling_init(priv);
+	if (err) {
+		dev_info(dev,
+			 "Failed to init cooling device. Skipping ...\n");
 	}
 
-	light_ins->light_id = light_id;
-	light_ins->lower_limit = lower_limit;
-	light_ins->upper_limit = upper_limit;
-
-	brightness = legion_wmi_light_get(priv, light_ins->light_id,
-					  light_ins->lower_limit,
-					  light_ins->upper_limit);
-	if (brightness == -ENODEV)
-		return brightness;
-	if (brightness < 0) {
-		pr_info("Error reading brightness for light: %u\n",
-			light_ins->light_id);
-		return brightness;
+	pr_info("Init powercap\n");
+	err = legion_powercap_init(priv);
+	if (err) {
+		dev_info(dev,
+			 "Failed to init powercap. Skipping ...\n");
 	}
 
-	light_ins->led.name = name;
-	light_ins->led.max_brightness =
-		light_ins->upper_limit - light_ins->lower_limit;
-	light_ins->led.brightness_get = legion_wmi_cdev_brightness_get;
-	light_ins->led.brightness_set_blocking = legion_wmi_cdev_brightness_set;
-	light_ins->led.flags = LED_BRIGHT_HW_CHANGED;
-
-	err = led_classdev_register(&priv->platform_device->dev,
-				    &light_ins->led);
-	if (err)
-		return err;
-
-	light_ins->initialized = true;
+	legion_throttle_start(priv);
 
-	return 0;
+	dev_info(dev, "Deferred probing done in %lld us\n",
+		 ktime_us_delta(ktime_get(), start));
 }
 
-/**
- * Deinit light.
- *
- * Can also be called if init was not successful.
- *
- */
-static void legion_light_exit(struct legion_private *priv,
-			      struct light *light_ins)
+static const struct dmi_system_id *legion_sim_find_model(const char *ident)
 {
-	if (!light_ins->initialized)
-		return;
-
-	light_ins->initialized = false;
+	const struct dmi_system_id *dmi_sys;
 
-	led_classdev_unregister(&light_ins->led);
+	for (dmi_sys = optimistic_allowlist; dmi_sys->driver_data; ++dmi_sys) {
+		if (!strcmp(dmi_sys->ident, ident))
+			return dmi_sys;
+	}
+	return NULL;
 }
 
-/* =============================  */
-/* Platform driver                */
-/* ============================   */
-
 static int legion_add(struct platform_device *pdev)
 {
 	struct legion_private *priv;
@@ -7697,6 +11021,7 @@ static int legion_add(struct platform_device *pdev)
 	bool is_allowed = false;
 	bool do_load_by_list = false;
 	bool do_load = false;
+	ktime_t probe_start = ktime_get();
 	//struct legion_private *priv = dev_get_drvdata(&pdev->dev);
 	dev_info(&pdev->dev, "legion_laptop platform driver probing\n");
 
@@ -7707,8 +11032,11 @@ static int legion_add(struct platform_device *pdev)
 		dmi_get_system_info(DMI_PRODUCT_NAME),
 		dmi_get_system_info(DMI_BIOS_VERSION));
 
-	// TODO: allocate?
-	priv = &_priv;
+	priv = devm_kzalloc(&pdev->dev, sizeof(*priv), GFP_KERNEL);
+	if (!priv) {
+		err = -ENOMEM;
+		goto err_legion_shared_init;
+	}
 	priv->platform_device = pdev;
 	err = legion_shared_init(priv);
 	if (err) {
@@ -7723,9 +11051,21 @@ static int legion_add(struct platform_device *pdev)
 		dmi_get_system_info(DMI_PRODUCT_NAME),
 		dmi_get_system_info(DMI_BIOS_VERSION));
 
-	dmi_sys = dmi_first_match(optimistic_allowlist);
-	is_allowed = dmi_sys != NULL;
-	is_denied = dmi_check_system(denylist);
+	if (legion_sim_active()) {
+		dmi_sys = legion_sim_find_model(simulate);
+		if (!dmi_sys) {
+			dev_info(&pdev->dev, "Unknown model to simulate: %s\n",
+				 simulate);
+			err = -ENODEV;
+			goto err_model_mismtach;
+		}
+		is_allowed = true;
+		is_denied = false;
+	} else {
+		dmi_sys = dmi_first_match(optimistic_allowlist);
+		is_allowed = dmi_sys != NULL;
+		is_denied = dmi_check_system(denylist);
+	}
 	do_load_by_list = is_allowed && !is_denied;
 	do_load = do_load_by_list || force;
 
@@ -7759,6 +11099,8 @@ static int legion_add(struct platform_device *pdev)
 
 	priv->conf = dmi_sys->driver_data;
 	_model = priv->conf;
+	if (legion_sim_active())
+		legion_sim_ec_setup(priv->conf);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(7, 0, 0)
 	err = acpi_init(priv, ACPI_COMPANION(&pdev->dev));
 	if (err) {
@@ -7770,9 +11112,12 @@ static int legion_add(struct platform_device *pdev)
 #endif
 	// TODO: remove; only used for reverse engineering
 	pr_info("Creating RAM access to embedded controller\n");
-	err = ecram_memoryio_init(&priv->ec_memoryio,
-				  priv->conf->ramio_physical_start, 0,
-				  priv->conf->ramio_size);
+	if (legion_sim_active())
+		err = 0;
+	else
+		err = ecram_memoryio_init(&priv->ec_memoryio,
+					  priv->conf->ramio_physical_start, 0,
+					  priv->conf->ramio_size);
 	if (err) {
 		dev_info(
 			&pdev->dev,
@@ -7806,6 +11151,8 @@ static int legion_add(struct platform_device *pdev)
 			 "Skipped checking embedded controller id\n");
 	}
 
+	legion_capabilities_init(priv);
+
 	dev_info(&pdev->dev, "Creating debugfs interface\n");
 	legion_debugfs_init(priv);
 
@@ -7817,14 +11164,6 @@ static int legion_add(struct platform_device *pdev)
 		goto err_sysfs_init;
 	}
 
-	pr_info("Creating hwmon interface");
-	err = legion_hwmon_init(priv);
-	if (err) {
-		dev_info(&pdev->dev, "Failed to create hwmon interface: %d\n",
-			 err);
-		goto err_hwmon_init;
-	}
-
 	pr_info("Creating platform profile support\n");
 	err = legion_platform_profile_init(priv);
 	if (err) {
@@ -7833,62 +11172,31 @@ static int legion_add(struct platform_device *pdev)
 		goto err_platform_profile;
 	}
 
-	pr_info("Init WMI driver support\n");
-	err = legion_wmi_init();
-	if (err) {
-		dev_info(&pdev->dev, "Failed to init WMI driver: %d\n", err);
-		goto err_wmi;
-	}
-
-	pr_info("Init keyboard backlight LED driver\n");
-	err = legion_kbd_bl_init(priv);
+	pr_info("Init generic netlink\n");
+	err = legion_nl_init();
 	if (err) {
-		dev_info(
-			&pdev->dev,
-			"Failed to init keyboard backlight LED driver. Skipping ...\n");
-	}
-
-	if (priv->conf->ec_ylogo_register) {
-		pr_info("Init Y-Logo LED driver\n");
-		err = legion_ec_ylogo_init(priv);
-		if (err) {
-			dev_info(&pdev->dev,
-				 "Failed to init Y-Logo LED driver. Skipping ...\n");
-		}
-	} else if (!priv->conf->skip_ylogo_light) {
-		pr_info("Init Y-Logo LED driver\n");
-		err = legion_light_init(priv, &priv->ylogo_light,
-					LIGHT_ID_YLOGO, 0, 1,
-					"platform::ylogo");
-		if (err) {
-			dev_info(&pdev->dev,
-				 "Failed to init Y-Logo LED driver. Skipping ...\n");
-		}
+		dev_info(&pdev->dev,
+			 "Failed to init generic netlink. Skipping ...\n");
 	}
 
-	if (!priv->conf->skip_ioport_light) {
-		pr_info("Init IO-Port LED driver\n");
-		err = legion_light_init(priv, &priv->iport_light, LIGHT_ID_IOPORT,
-					0, 2, "platform::ioport");
-		if (err && err != -ENODEV) {
-			dev_info(&pdev->dev,
-				 "Failed to init IO-Port LED driver. Skipping ...\n");
-		}
-	}
+	// slow probing of capabilities, lights, ... is done later
+	INIT_WORK(&priv->probe_work, legion_deferred_probe);
+	schedule_work(&priv->probe_work);
 
-	dev_info(&pdev->dev, "legion_laptop loaded for this device\n");
+	dev_info(&pdev->dev, "legion_laptop loaded for this device in %lld us\n",
+		 ktime_us_delta(ktime_get(), probe_start));
 	return 0;
 
 	// TODO: remove eventually
+	legion_nl_exit();
+	legion_powercap_exit(priv);
+	legion_cooling_exit(priv);
 	legion_light_exit(priv, &priv->iport_light);
 	legion_light_exit(priv, &priv->ylogo_light);
 	legion_kbd_bl_exit(priv);
 	legion_wmi_exit();
-err_wmi:
 	legion_platform_profile_exit(priv);
 err_platform_profile:
-	legion_hwmon_exit(priv);
-err_hwmon_init:
 	legion_sysfs_exit(priv);
 err_sysfs_init:
 	legion_debugfs_exit(priv);
@@ -7900,6 +11208,7 @@ err_ecram_memoryio_init:
 #if LINUX_VERSION_CODE < KERNEL_VERSION(7, 0, 0)
 err_acpi_init:
 #endif
+	cancel_delayed_work_sync(&priv->powerlimit_work);
 	legion_shared_exit(priv);
 err_legion_shared_init:
 err_model_mismtach:
@@ -7911,10 +11220,16 @@ static void legion_remove(struct platform_device *pdev)
 {
 	struct legion_private *priv = dev_get_drvdata(&pdev->dev);
 
-	mutex_lock(&legion_shared_mutex);
-	priv->loaded = false;
-	mutex_unlock(&legion_shared_mutex);
+	// before legion_shared_exit, so no handler schedules notify_work again
+	// after it was cancelled
+	legion_nl_exit();
+	// first unpublish, so WMI events do not use priv anymore
+	legion_shared_exit(priv);
 
+	cancel_work_sync(&priv->probe_work);
+	legion_throttle_stop(priv);
+	legion_powercap_exit(priv);
+	legion_cooling_exit(priv);
 	legion_light_exit(priv, &priv->iport_light);
 	legion_light_exit(priv, &priv->ylogo_light);
 	legion_kbd_bl_exit(priv);
@@ -7923,6 +11238,9 @@ static void legion_remove(struct platform_device *pdev)
 	legion_wmi_exit();
 	legion_platform_profile_exit(priv);
 
+	// write power limits that are still pending before power mode is reset
+	powerlimit_writeback_stop(priv);
+
 	// toggle power mode to load default setting from embedded controller
 	// again
 	toggle_powermode(priv);
@@ -7932,29 +11250,31 @@ static void legion_remove(struct platform_device *pdev)
 	legion_debugfs_exit(priv);
 	ecram_exit(&priv->ecram);
 	ecram_memoryio_exit(&priv->ec_memoryio);
-	legion_shared_exit(priv);
 
 	pr_info("Legion platform unloaded\n");
 }
 
-static int legion_resume(struct platform_device *pdev)
+#ifdef CONFIG_PM_SLEEP
+static int legion_pm_suspend(struct device *dev)
 {
-	//struct legion_private *priv = dev_get_drvdata(&pdev->dev);
-	dev_info(&pdev->dev, "Resumed in legion-laptop\n");
+	struct legion_private *priv = dev_get_drvdata(dev);
 
+	legion_throttle_suspend(priv);
+	powerlimit_writeback_sync(priv);
 	return 0;
 }
 
-#ifdef CONFIG_PM_SLEEP
 static int legion_pm_resume(struct device *dev)
 {
-	//struct legion_private *priv = dev_get_drvdata(dev);
+	struct legion_private *priv = dev_get_drvdata(dev);
+
+	legion_throttle_resume(priv);
 	dev_info(dev, "Resumed PM in legion-laptop\n");
 
 	return 0;
 }
 #endif
-static SIMPLE_DEV_PM_OPS(legion_pm, NULL, legion_pm_resume);
+static SIMPLE_DEV_PM_OPS(legion_pm, legion_pm_suspend, legion_pm_resume);
 
 // same as ideapad
 static const struct acpi_device_id legion_device_ids[] = {
@@ -7973,36 +11293,53 @@ static struct platform_driver legion_driver = {
 #else
 	.remove_new = legion_remove,
 #endif
-	.resume = legion_resume,
 	.driver = {
 		.name   = "legion",
-#if LINUX_VERSION_CODE < KERNEL_VERSION(7, 0, 0) //leave as virtual driver
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
+		// also for the virtual device, so pending power limits are
+		// written before suspend
 		.pm     = &legion_pm,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(7, 0, 0) //leave as virtual driver
 		.acpi_match_table = ACPI_PTR(legion_device_ids),
 #endif
 	},
 };
 
-static int __init legion_init(void)
+static struct platform_device *legion_pdev;
+
+// Since 7.0 and when simulating there is no ACPI device to bind to
+static bool legion_use_virtual_device(void)
 {
-	int err;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(7, 0, 0)
-	static struct platform_device *legion_pdev;
+	return true;
+#else
+	return legion_sim_active();
 #endif
+}
+
+static int __init legion_init(void)
+{
+	int err;
 	pr_info("Loading legion_laptop\n");
+	err = legion_sim_init();
+	if (err)
+		return err;
 	err = platform_driver_register(&legion_driver);
 	if (err) {
 		pr_info("legion_laptop: platform_driver_register failed\n");
+		legion_sim_exit();
 		return err;
 	}
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(7, 0, 0)
-	legion_pdev = platform_device_register_simple("legion", -1, NULL, 0);
-	if (IS_ERR(legion_pdev)) {
-		pr_err("Failed to allocate virtual legion device\n");
-		platform_driver_unregister(&legion_driver);
-		return PTR_ERR(legion_pdev);
+	if (legion_use_virtual_device()) {
+		legion_pdev =
+			platform_device_register_simple("legion", -1, NULL, 0);
+		if (IS_ERR(legion_pdev)) {
+			pr_err("Failed to allocate virtual legion device\n");
+			platform_driver_unregister(&legion_driver);
+			legion_sim_exit();
+			return PTR_ERR(legion_pdev);
+		}
 	}
-#endif
 	return 0;
 }
 
@@ -8011,10 +11348,14 @@ module_init(legion_init);
 static void __exit legion_exit(void)
 {
 	platform_driver_unregister(&legion_driver);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(7, 0, 0)
-	platform_device_unregister(_priv.platform_device);
-#endif
+	if (legion_pdev)
+		platform_device_unregister(legion_pdev);
+	legion_sim_exit();
 	pr_info("legion_laptop exit\n");
 }
 
 module_exit(legion_exit);
+
+#if IS_ENABLED(CONFIG_LEGION_LAPTOP_KUNIT_TEST)
+#include "legion-laptop-test.c"
+#endif
@@ -1,9 +1,14 @@
 #!/usr/bin/env python3
 # PYTHON_ARGCOMPLETE_OK
 # pylint: disable=wrong-import-order
+import time
+# taken before the slow imports; CLOCK_MONOTONIC like legiond and the kernel trace
+CLI_START_TIME = time.monotonic()
 import argcomplete
 import argparse
 import logging
+import re
+import subprocess
 import sys
 import os
 # Make it possible to run without installationimport
@@ -359,6 +364,138 @@ def set_feature(legion: LegionModelFacade, name, values, **_) -> int:
         print(feat)
     return -2
 
+TRACE_ENV = "LEGION_CLI_TRACE"
+TRACEFS_DIRS = ["/sys/kernel/tracing", "/sys/kernel/debug/tracing"]
+# (stage, description); first record of a stage in a switch is used,
+# except for stages in TRACE_LAST_STAGES
+TRACE_STAGES = [
+    ("legion_wmi_event", "kernel: WMI event"),
+    ("legion_profile_notify", "kernel: platform_profile notified"),
+    ("legiond-powerstate", "legiond: power state change seen"),
+    ("legiond-timer", "legiond: delay timer fired"),
+    ("legiond-fancurve-start", "legiond: fan curve apply started"),
+    ("cli-start", "legion_cli: python started"),
+    ("cli-ready", "legion_cli: model initialized"),
+    ("legion_fancurve_write", "kernel: fan curve written"),
+    ("cli-done", "legion_cli: done"),
+    ("legiond-fancurve-done", "legiond: fan curve applied"),
+]
+TRACE_LAST_STAGES = {"legion_fancurve_write"}
+TRACE_START_STAGES = {"legion_wmi_event", "legiond-powerstate"}
+TRACE_END_STAGE = "legiond-fancurve-done"
+
+
+def trace_stage(stage: str, detail: str = "", timestamp: float = None):
+    """Log a record for trace-profile-switch if started by legiond"""
+    if os.environ.get(TRACE_ENV):
+        if timestamp is None:
+            timestamp = time.monotonic()
+        print(f"trace: {timestamp:.6f} {stage} {detail}", file=sys.stderr)
+
+
+def find_tracefs():
+    for tracefs in TRACEFS_DIRS:
+        if os.path.exists(os.path.join(tracefs, "events", "legion_laptop")):
+            return tracefs
+    return None
+
+
+def read_kernel_trace_records():
+    tracefs = find_tracefs()
+    if tracefs is None:
+        print("Kernel tracepoints not found; kernel stages are missing.")
+        return []
+    with open(os.path.join(tracefs, "trace_clock"), encoding="utf-8") as f:
+        if "[mono]" not in f.read():
+            print("Kernel trace clock is not mono; kernel stages are missing.")
+            print("Run with --enable-kernel-trace once before switching.")
+            return []
+    records = []
+    pattern = re.compile(r"\s(\d+\.\d+): (legion_\w+): (.*)$")
+    with open(os.path.join(tracefs, "trace"), encoding="utf-8") as f:
+        for line in f:
+            match = pattern.search(line)
+            if match:
+                records.append((float(match.group(1)), match.group(2), match.group(3)))
+    return records
+
+
+def read_legiond_trace_records(logfile=None):
+    if logfile is not None:
+        with open(logfile, encoding="utf-8") as f:
+            lines = f.readlines()
+    else:
+        try:
+            lines = subprocess.run(
+                ["journalctl", "-u", "legiond.service", "-o", "cat", "--no-pager", "-n", "20000"],
+                capture_output=True, text=True, check=False).stdout.splitlines()
+        except FileNotFoundError:
+            print("journalctl not found; use --log with the output of legiond.")
+            return []
+    records = []
+    for line in lines:
+        fields = line.split(maxsplit=3)
+        if len(fields) >= 3 and fields[0] == "trace:":
+            try:
+                records.append((float(fields[1]), fields[2],
+                                fields[3].strip() if len(fields) > 3 else ""))
+            except ValueError:
+                continue
+    return records
+
+
+def split_profile_switches(records):
+    """Group records sorted by time into switches; a switch starts with a WMI
+    event or a power state change seen by legiond and ends when legiond applied the fan curve"""
+    switches = []
+    current = None
+    for timestamp, stage, detail in sorted(records):
+        if current is None:
+            if stage not in TRACE_START_STAGES:
+                continue
+            current = {}
+        if stage in TRACE_LAST_STAGES or stage not in current:
+            current[stage] = (timestamp, detail)
+        if stage == TRACE_END_STAGE:
+            switches.append(current)
+            current = None
+    return switches
+
+
+def trace_profile_switch(_, count=5, logfile=None, enable_kernel_trace=False, **__) -> int:
+    if enable_kernel_trace:
+        tracefs = find_tracefs()
+        if tracefs is None:
+            print("Kernel tracepoints of legion_laptop not found.")
+            return 1
+        with open(os.path.join(tracefs, "trace_clock"), "w", encoding="utf-8") as f:
+            f.write("mono")
+        with open(os.path.join(tracefs, "events", "legion_laptop", "enable"), "w",
+                  encoding="utf-8") as f:
+            f.write("1")
+        print("Kernel tracing enabled. Switch the power mode and run again without option.")
+        return 0
+
+    records = read_kernel_trace_records() + read_legiond_trace_records(logfile)
+    switches = split_profile_switches(records)
+    if not switches:
+        print("No complete profile switch found.")
+        return 1
+    for i, switch in enumerate(switches[-count:]):
+        start = min(timestamp for timestamp, _ in switch.values())
+        previous = start
+        print(f"Profile switch {i + 1} (at {start:.6f} s):")
+        for stage, description in TRACE_STAGES:
+            if stage not in switch:
+                print(f"  {description:<36} {'-':>10}")
+                continue
+            timestamp, detail = switch[stage]
+            print(f"  {description:<36} {1000 * (timestamp - start):>8.1f} ms "
+                  f"(+{1000 * (timestamp - previous):.1f} ms) {detail}")
+            previous = timestamp
+    return 0
+
+
 def create_argparser()->argparse.ArgumentParser:
     parser = argparse.ArgumentParser(description='Legion CLI')
     parser.add_argument(
@@ -441,6 +578,19 @@ def create_argparser()->argparse.ArgumentParser:
     status_parser = bootlogo_sub.add_parser('status', help='View status')
     status_parser.set_defaults(func=boot_logo_status)
 
+    trace_parser = subcommands.add_parser(
+        'trace-profile-switch',
+        help='Print the time spent in each stage of the last power mode switches')
+    trace_parser.add_argument(
+        '--count', type=int, help='Number of switches to show', default=5)
+    trace_parser.add_argument(
+        '--log', dest='logfile', type=str,
+        help='File with the output of legiond instead of the journal')
+    trace_parser.add_argument(
+        '--enable-kernel-trace', action='store_true',
+        help='Enable the kernel tracepoints with a CLOCK_MONOTONIC trace clock')
+    trace_parser.set_defaults(func=trace_profile_switch)
+
     return parser, subcommands
 
 def boot_logo_enable(legion: LegionModelFacade, image_path: str, **kwargs) -> int:  # pylint: disable=unused-argument
@@ -490,8 +640,13 @@ def main():
 
     if args.subcommand is None:
         parser.print_help()
+    elif args.subcommand == 'trace-profile-switch':
+        # only reads logs; works without the kernel module
+        args.func(None, **vars(args))
     else:
+        trace_stage("cli-start", timestamp=CLI_START_TIME)
         legion = LegionModelFacade(expect_hwmon=not args.donotexpecthwmon)
+        trace_stage("cli-ready")
         for cmd in cmd_group:
             cmd.set_model(legion)
         # set global options
@@ -499,6 +654,7 @@ def main():
             legion.set_preset_folder(args.preset_dir)
 
         args.func(legion, **vars(args))
+        trace_stage("cli-done", args.subcommand)
 
 
 if __name__ == '__main__':